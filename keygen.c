@@ -2,68 +2,216 @@
 ** Program name: keygen.c
 ** Author:       Louis Adams
 ** Email:        adamslou@oregonstate.edu
-** Due date:     2020-06-05     		             	
+** Due date:     2020-06-05
 ** Description:  This program creates a random key to be output to stdout. The
-**               key should include only capital letters A-Z as well as space 
+**               key should include only capital letters A-Z as well as space
 **               characters. The key will be of a length specified by arg[1].
 **               When output to stdout a newline character will follow the key.
 **               The key is meant to used with a plaintext file to create a
 **               ciphertext for the otp (One Time Pad) program.
-*******************************************************************************/ 
+**
+**               The random characters come from the ChaCha20 stream cipher with
+**               a 256 bit key read from getrandom(), so no two runs share a key.
+**               Random bytes of 243 or more are thrown away and the rest are
+**               taken mod 27, which gives every character exactly the same odds.
+**               The key is made in blocks, each with its own ChaCha20 nonce, by
+**               one thread per CPU, and the blocks are written out in order as
+**               soon as they're ready, so memory use doesn't grow with the key.
+**               The generator itself is in otp_random.c.
+**
+**               keygen --binary length makes a key for binary text instead: the
+**               ChaCha20 bytes as they are, any of the 256, with no newline
+**               after them, for otp --binary to XOR with.
+*******************************************************************************/
 #define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <time.h>
+#include <sys/random.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <getopt.h>
 #include <errno.h>
-#include <limits.h>
+#include "otp_random.h"
+
+#define BLOCK_SIZE (1 << 20)            // the number of key characters made at a time
+#define MAX_THREADS 64                  // the most threads used to make the key
+
+// a block of the key being made by one thread and written out by main()
+struct keyBlock {
+    char data[BLOCK_SIZE];              // the characters of the block
+    size_t size;                        // how many characters the block holds
+    bool full;                          // true once the block is ready to be written
+    pthread_mutex_t lock;               // held while full is checked or changed
+    pthread_cond_t changed;             // signaled when full changes
+};
+
+// a thread making every numThreads'th block of the key, starting with its own number
+struct keyThread {
+    pthread_t thread;
+    unsigned int number;                // the thread's number, 0 to numThreads - 1
+    struct keyBlock block;              // the block the thread is working on
+};
+
+// function prototypes:
+void* makeBlocks(void* arg);
+bool writeAll(int fd, const char* buffer, size_t length);
+
+// global variables
+uint32_t chachaKey[CHACHA_KEY_WORDS];   // the ChaCha20 key, the same for every block
+long long keyLen;                       // the length of the key
+long long numBlocks;                    // the number of blocks in the key
+unsigned int numThreads;                // the number of threads making blocks
+bool binaryKey = false;                 // true if the user passed --binary
 
 int main(int argc, char *argv[]){
     char* endPtr;                           // points to the end of the number entered by the user
+    struct keyThread* threads;              // the threads making the key
+    struct keyBlock* block;                 // the next block to be written out
+    long cpus;                              // the number of CPUs online
+    ssize_t i;
+    int option;                             // the option returned by getopt_long()
+    struct option longOptions[] = {
+        {"binary", no_argument, NULL, 'b'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while((option = getopt_long(argc, argv, "b", longOptions, NULL)) != -1){
+        if(option == 'b'){
+            binaryKey = true;
+            continue;
+        }
+        fprintf(stderr, "keygen USAGE: %s [--binary] length\n", argv[0]); exit(1);
+    }
+    if(optind + 1 != argc){
+        fprintf(stderr, "keygen USAGE: %s [--binary] length\n", argv[0]); exit(1);
+    }
+
+    // convert the length to an integer
+    // adapted from: https://stackoverflow.com/questions/9748393/how-can-i-get-argv-as-int/38669018
     errno = 0;
-    int keyLen;                             // the length of the key
-    char* key;                              // points to the generated key
-    int randNum;                            // a random number from 64-90 representing A-Z or a space
+    keyLen = strtoll(argv[optind], &endPtr, 10);  // convert argument to type long long in base 10
 
-    // seed the random number generator
-    srand(time(0));
+    if(errno != 0 || *endPtr != '\0' || keyLen < 1){
+        fprintf(stderr, "You must use a positive integer with keygen.\n"); exit(1);
+    }
 
+    // seed the random number generator, getrandom() only blocks until the kernel's pool is ready
+    do{
+        i = getrandom(chachaKey, sizeof(chachaKey), 0);
+    }while(i < 0 && errno == EINTR);
+    if(i != sizeof(chachaKey)){
+        perror("keygen ERROR getting random bytes"); exit(1);
+    }
 
-    // convert argv[1] to an integer
-    // adapted from: https://stackoverflow.com/questions/9748393/how-can-i-get-argv-as-int/38669018 
-    long keyLenLong = strtol(argv[1], &endPtr, 10);  // convert argument to type long in base 10
+    // use a thread for each CPU, but no more threads than there are blocks
+    numBlocks = (keyLen + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    numThreads = cpus < 1 ? 1 : cpus > MAX_THREADS ? MAX_THREADS : cpus;
+    if(numThreads > numBlocks) numThreads = numBlocks;
 
-    if(errno != 0 || *endPtr != '\0' || keyLenLong > INT_MAX || keyLenLong < 1){
-        perror("You must use a positive integer with keygen.\n");
+    // allocate memory on the heap for the threads and their blocks
+    threads = malloc(numThreads * sizeof(struct keyThread));
+    if(threads == NULL){
+        perror("keygen ERROR with malloc"); exit(1);
     }
-    else{
-        keyLen = keyLenLong;
+    for(unsigned int t = 0; t < numThreads; t++){
+        threads[t].number = t;
+        threads[t].block.full = false;
+        pthread_mutex_init(&threads[t].block.lock, NULL);
+        pthread_cond_init(&threads[t].block.changed, NULL);
+        if(pthread_create(&threads[t].thread, NULL, makeBlocks, &threads[t]) != 0){
+            fprintf(stderr, "keygen ERROR creating thread\n"); exit(1);
+        }
     }
 
-    // allocate memory on the heap for the key
-    key = malloc((keyLen + 1) * sizeof(char));  // add 1 to keyLen for the null terminator
+    // write the blocks out in order, each one is handed back to its thread once it's written
+    for(long long b = 0; b < numBlocks; b++){
+        block = &threads[b % numThreads].block;
 
-    // add random characters to the key
-    for(int i = 0; i < keyLen; i++){
-        randNum = rand() % 27 + 64;
-        if(randNum != 64){  // if the random number equals 65-90, then add the corresponding ASCII character (A-Z)
-            key[i] = randNum;
-        }
-        else{
-            key[i] = ' ';   // if the random number equals 64, then add a space to the key
+        pthread_mutex_lock(&block->lock);
+        while(!block->full) pthread_cond_wait(&block->changed, &block->lock);
+        pthread_mutex_unlock(&block->lock);
+
+        if(!writeAll(STDOUT_FILENO, block->data, block->size)){
+            perror("keygen ERROR writing key"); exit(1);
         }
+
+        pthread_mutex_lock(&block->lock);
+        block->full = false;
+        pthread_cond_signal(&block->changed);
+        pthread_mutex_unlock(&block->lock);
     }
 
-    // add a null terminator to the key string
-    key[keyLen] = '\0';
+    // a text key is followed by a newline character, a binary one is only its bytes
+    if(!binaryKey && !writeAll(STDOUT_FILENO, "\n", sizeof(char))){
+        perror("keygen ERROR writing key"); exit(1);
+    }
 
-    // print the key followed by a newline character
-    printf("%s\n", key);
+    for(unsigned int t = 0; t < numThreads; t++){
+        pthread_join(threads[t].thread, NULL);
+        pthread_mutex_destroy(&threads[t].block.lock);
+        pthread_cond_destroy(&threads[t].block.changed);
+    }
 
     // free the memory on the heap
-    free(key);
+    free(threads);
 
     return 0;
 }
+
+/*******************************************************************************
+ *                                  makeBlocks                                 *
+ * This function is run by each thread. It makes every numThreads'th block of  *
+ * the key, waiting for main() to write out the last one before reusing its    *
+ * buffer.                                                                     *
+ ******************************************************************************/
+void* makeBlocks(void* arg){
+    struct keyThread* self = arg;
+    struct keyBlock* block = &self->block;
+
+    for(long long b = self->number; b < numBlocks; b += numThreads){
+        pthread_mutex_lock(&block->lock);
+        while(block->full) pthread_cond_wait(&block->changed, &block->lock);
+        pthread_mutex_unlock(&block->lock);
+
+        // the last block is usually shorter than the rest
+        block->size = (b == numBlocks - 1) ? keyLen - b * (long long)BLOCK_SIZE : BLOCK_SIZE;
+        if(binaryKey){
+            makeBinaryKeyBlock(chachaKey, b, block->data, block->size);
+        }
+        else{
+            makeKeyBlock(chachaKey, b, block->data, block->size);
+        }
+
+        pthread_mutex_lock(&block->lock);
+        block->full = true;
+        pthread_cond_signal(&block->changed);
+        pthread_mutex_unlock(&block->lock);
+    }
+    return NULL;
+}
+
+
+
+/*******************************************************************************
+ *                                  writeAll                                   *
+ * This function makes sure all of the data in a buffer is written, calling    *
+ * write() again after a partial write or an interruption.                     *
+ ******************************************************************************/
+bool writeAll(int fd, const char* buffer, size_t length){
+    while(length > 0){
+        ssize_t i = write(fd, buffer, length);
+        if(i < 0 && errno == EINTR) continue;
+        if(i < 1){
+            return false;
+        }
+        buffer += i;
+        length -= i;
+    }
+    return true;
+}
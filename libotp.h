@@ -0,0 +1,29 @@
+/*******************************************************************************
+** Program name: libotp.h
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  The one header a program linked with libotp (libotp.a or
+**               libotp.so) needs to include. It brings in:
+**                  otp_cipher.h    encrypting and decrypting caller buffers,
+**                                  in place if the output is the input
+**                  otp_pad.h       slicing one large pad between many messages
+**                  otp_random.h    making key characters
+**                  otp_protocol.h  the requests otp and otp_d send each other
+**                  otp_client.h    a connection to otp_d with post and get calls
+**                  otp_async.h     many posts and gets in flight from one thread
+**                  otp_server.h    running otp_d's server
+**               keygen, otp and otp_d are each a command line over these.
+*******************************************************************************/
+#ifndef LIBOTP_H
+#define LIBOTP_H
+
+#include "otp_cipher.h"
+#include "otp_pad.h"
+#include "otp_random.h"
+#include "otp_protocol.h"
+#include "otp_client.h"
+#include "otp_async.h"
+#include "otp_server.h"
+
+#endif
@@ -18,6 +18,78 @@
 **               will not be deciphered correctly but will still be deleted. It's
 **               only for one-time use! Once otp has converted the ciphertext to
 **               plaintext using the key, the plaintext will be output to the console.
+**
+**               With --stream, the plaintext, key and ciphertext are handled a
+**               chunk at a time instead of being read into memory whole, so files
+**               of any size can be posted and retrieved:
+**                              otp --stream get username key port#
+**                              otp --stream post username plaintextfile key port#
+**
+**               With --binary, the plaintext can be any bytes at all, newlines
+**               and nulls included, and is XORed with a key made by
+**               keygen --binary instead. The whole plaintext file is posted
+**               and a get prints exactly what was posted, with no newline added.
+**               It works with --stream too:
+**                              otp --binary [--stream] get username key port#
+**                              otp --binary [--stream] post username plaintextfile key port#
+**
+**               With --packed, a post's ciphertext is packed 8 characters to
+**               5 bytes before it's sent (see otp_cipher.h), so it takes 3/8
+**               less room on the wire and in otp_d. Gets unpack a packed
+**               ciphertext whether or not --packed was passed, since a packed
+**               one says so in its first byte, --stream gets included. It works
+**               with --pad and --batch but not with --binary or --stream:
+**                              otp --packed [--pad] post username plaintextfile key port#
+**
+**               With --pad, the key is one large pad shared by many messages. It
+**               is memory-mapped rather than read, each post uses the next unused
+**               slice of it (see otp_pad.c), and the ciphertext starts with a
+**               header giving the slice's offset so the get can find it again:
+**                              otp --pad get username pad port#
+**                              otp --pad post username plaintextfile pad port#
+**
+**               With --batch, otp reads a manifest file of posts and gets, one per
+**               line in the same form as the arguments above but without the
+**               port, and pipelines them all over a single connection:
+**                              otp --batch manifest port#
+**               The requests are sent as fast as they can be made while a second
+**               thread reads the answers to the gets, and the plaintexts are
+**               printed in the order the gets appear in the manifest.
+**               Each post's answer is read in its turn too, so a post otp_d
+**               couldn't store is reported.
+**
+**               otp drain takes all of a user's ciphertexts in one request,
+**               oldest first, and decrypts and prints each one as it arrives.
+**               Without --pad each ciphertext has its own key, given in the
+**               order the ciphertexts were posted, and no more are taken than
+**               there are keys. With --pad each one is decrypted with its own
+**               slice of the pad. --max-count and --max-bytes limit how much is
+**               taken, and whatever is left stays for the next drain or get:
+**                              otp [--max-count N] [--max-bytes N] drain username key [key ...] port#
+**                              otp --pad [--max-count N] [--max-bytes N] drain username pad port#
+**
+**               otp stats prints a snapshot of otp_d's counters: requests, bytes,
+**               connections, what's queued in the store, and latency percentiles
+**               for each phase of a request over the last minute:
+**                              otp stats port#
+**
+**               A plaintext or ciphertext of 8 MB or more is encrypted or
+**               decrypted by several threads at once, each taking its own slice
+**               of it, one thread for each CPU by default (see otp_cipher.c).
+**               Anything smaller is done on one thread, since starting the
+**               others would take longer than it saves. --threads N sets how
+**               many can be used, and --threads 1 uses just one:
+**                              otp --threads N get|post ...
+**
+**               If otp_d is too busy to take the connection, otp says how long
+**               otp_d asked it to wait and exits with status 3 so a script can
+**               back off and try again. Every post asks otp_d to answer once it
+**               has stored the ciphertext (and synced it, if otp_d was started
+**               with --durability), so a post is never mistaken for one that
+**               was stored.
+**
+**               Everything but the command line is in libotp: the cipher, the
+**               pad and the client calls otp makes to otp_d (see otp_client.h).
 *******************************************************************************/ 
 #define _GNU_SOURCE
 #include <stdlib.h>
@@ -28,25 +100,74 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <sys/socket.h>
-#include <netinet/in.h>
-#include <netdb.h>
 #include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+#include "otp_cipher.h"
+#include "otp_pad.h"
+#include "otp_protocol.h"
+#include "otp_client.h"
+
+// a post or 'get' sent in batch mode whose answer hasn't been read yet
+struct pendingRequest {
+    char mode;                      // MODE_POST or MODE_GET
+    char* user;                     // the username the request was for
+    char* keyName;                  // the name of the key file ('get' only)
+    char* key;                      // the key to decrypt the answer with ('get' only)
+    size_t keySize;                 // the size of the key
+    struct pendingRequest* next;    // the next request sent after this one
+};
+
+// the requests sent in batch mode, in the order they were sent
+struct pendingQueue {
+    struct pendingRequest* head;    // the oldest request, the next answer is for this one
+    struct pendingRequest* tail;    // the newest request
+    bool done;                      // true once every request has been sent
+    struct otpConnection conn;      // the connection to otp_d
+    int failures;                   // the number of requests whose answers were failures
+    pthread_mutex_t lock;           // held while the queue is used
+    pthread_cond_t changed;         // signaled when a request is added or done is set
+};
 
 // function prototypes:
-bool sendAll(int socket, void* buffer, size_t length);
-bool recvAll(int socket, void* buffer, size_t length);
+void connectToServer(struct otpConnection* conn, int portNumber);
+void checkStatus(struct otpConnection* conn, enum otpStatus status, const char* msg);
+bool readLineChunk(FILE* file, char* buffer, size_t bufferSize, size_t* chunkSize);
+bool readChunk(FILE* file, char* buffer, size_t bufferSize, size_t* chunkSize, bool binary);
+void sendPost(struct otpConnection* conn, const char* user, const char* ciphertext, size_t ciphertextSize);
+bool unpackCiphertext(char** ciphertext, size_t* ciphertextSize);
+void finishPost(struct otpConnection* conn);
+void reportBusy(uint64_t retryAfter);
+void streamPost(const char* user, const char* plaintextName, const char* keyName, int portNumber, bool binary);
+void streamGet(const char* user, const char* keyName, int portNumber, bool binary);
+void binaryPost(const char* user, const char* plaintextName, const char* keyName, int portNumber);
+void binaryGet(const char* user, const char* keyName, int portNumber);
+char* readBinaryFile(const char* filename, size_t* fileSize);
+void padPost(const char* user, const char* plaintextName, const char* padName, int portNumber, bool packed);
+void padGet(const char* user, const char* padName, int portNumber);
+char* readLineFile(const char* filename, size_t* lineSize);
+int runBatch(const char* manifestName, int portNumber, bool packed);
+bool batchPost(struct pendingQueue* queue, const char* user, const char* plaintextName, const char* keyName);
+bool batchGet(struct pendingQueue* queue, const char* user, const char* keyName);
+void queueRequest(struct pendingQueue* queue, struct pendingRequest* request);
+void* receiveAnswers(void* arg);
+void showStats(int portNumber);
+int runDrain(const char* user, char** keyNames, int numKeys, const char* padName, uint64_t maxCount,
+             uint64_t maxBytes, int portNumber);
+bool decryptDrained(const char* user, char* ciphertext, size_t ciphertextSize, const char* keyName,
+                    const struct pad* pad);
+bool parseLimit(const char* text, uint64_t* limit);
 
 void error(const char *msg) { perror(msg); exit(1); } // error function used for reporting issues
 
 int main(int argc, char *argv[]){
-    int socketFD, portNumber;
-    struct sockaddr_in serverAddress;
-    struct hostent* serverHostInfo;
+    struct otpConnection conn;      // the connection to otp_d
+    int portNumber;
     char* plaintext = NULL;         // a buffer for the plaintext to be read from a file
     char* key = NULL;               // a buffer for the key to be read from a file
     char* ciphertext = NULL;        // a buffer for the ciphertext to be sent to otp_d
-    char userFileResult;            // will contain 's' if the user has a ciphertext file, otherwise 'f'
-    size_t userSize = strlen(argv[2]);  // size of the username
+    enum otpStatus status;          // OTP_EMPTY if the user has no ciphertext file
     size_t plaintextBuffSize;       // size of the plaintext buffer used with getline()
     size_t keyBuffSize;             // size of the key buffer used with getline()
     size_t ciphertextSize;          // size of the ciphertext
@@ -57,6 +178,107 @@ int main(int argc, char *argv[]){
     FILE* plaintextFile;            // declare FILE pointer to the plaintext file
     FILE* keyFile;                  // declare FILE pointer to the key file
     bool postMode;                  // true if user entered "post"
+    enum cipherResult cipherResult; // whether the plaintext and key were good
+    bool streamMode = false;        // true if user passed --stream
+    bool padMode = false;           // true if user passed --pad
+    bool batchMode = false;         // true if user passed --batch
+    bool binaryMode = false;        // true if user passed --binary
+    bool packedMode = false;        // true if user passed --packed
+    uint64_t maxCount = 0;          // the most ciphertexts a drain takes, 0 for no limit
+    uint64_t maxBytes = 0;          // the bytes after which a drain stops, 0 for no limit
+    uint64_t cipherThreads = 0;     // the most threads a long text is split among, 0 for one per CPU
+    char* programName = argv[0];    // the name otp was run as, for the usage message
+    int option;                     // the option returned by getopt_long()
+    struct option longOptions[] = {
+        {"stream", no_argument, NULL, 's'},
+        {"pad", no_argument, NULL, 'k'},
+        {"batch", no_argument, NULL, 'b'},
+        {"binary", no_argument, NULL, 'x'},
+        {"packed", no_argument, NULL, 'z'},
+        {"max-count", required_argument, NULL, 'c'},
+        {"max-bytes", required_argument, NULL, 'm'},
+        {"threads", required_argument, NULL, 't'},
+        {NULL, 0, NULL, 0}
+    };
+
+    // parse the command line options, then shift them off so that argv[1] is "get" or "post"
+    while((option = getopt_long(argc, argv, "+", longOptions, NULL)) != -1){
+        if(option == 's'){
+            streamMode = true;
+        }
+        else if(option == 'k'){
+            padMode = true;
+        }
+        else if(option == 'b'){
+            batchMode = true;
+        }
+        else if(option == 'x'){
+            binaryMode = true;
+        }
+        else if(option == 'z'){
+            packedMode = true;
+        }
+        else if(option == 'c' && parseLimit(optarg, &maxCount)){
+            continue;
+        }
+        else if(option == 'm' && parseLimit(optarg, &maxBytes)){
+            continue;
+        }
+        else if(option == 't' && parseLimit(optarg, &cipherThreads) && cipherThreads >= 1 &&
+                cipherThreads <= MAX_CIPHER_THREADS){
+            continue;
+        }
+        else{
+            fprintf(stderr,"otp USAGE: %s [--threads N] [--binary|--packed] [--stream|--pad] get|post user ...\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+    if(streamMode == true && padMode == true){
+        fprintf(stderr,"otp ERROR: --stream and --pad can't be used together\n"); exit(1);
+    }
+    if(binaryMode == true && (padMode == true || batchMode == true)){
+        fprintf(stderr,"otp ERROR: --binary can't be used with --pad or --batch\n"); exit(1);
+    }
+    if(packedMode == true && (binaryMode == true || streamMode == true)){
+        fprintf(stderr,"otp ERROR: --packed can't be used with --binary or --stream\n"); exit(1);
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+    argv[0] = programName;
+    setCipherThreads((unsigned int)cipherThreads);
+
+    // in batch mode every request comes from the manifest
+    if(batchMode == true){
+        if(argc < 3 || streamMode == true || padMode == true){
+            fprintf(stderr,"otp USAGE: %s --batch manifest port\n", argv[0]); exit(1);
+        }
+        return runBatch(argv[1], atoi(argv[2]), packedMode);
+    }
+
+    // stats mode only needs the port
+    if(argc == 3 && strcmp(argv[1], "stats") == 0){
+        if(streamMode == true || padMode == true || binaryMode == true){
+            fprintf(stderr,"otp USAGE: %s stats port\n", argv[0]); exit(1);
+        }
+        showStats(atoi(argv[2]));
+        return 0;
+    }
+
+    // drain mode takes a key for each ciphertext, or one pad for all of them
+    if(argc >= 2 && strcmp(argv[1], "drain") == 0){
+        if(streamMode == true || binaryMode == true || argc < 5 || (padMode == true && argc != 5)){
+            fprintf(stderr,"otp USAGE: %s [--pad] [--max-count N] [--max-bytes N] drain user key [key ...] port\n",
+                    argv[0]);
+            exit(1);
+        }
+        return runDrain(argv[2], argv + 3, argc - 4, padMode == true ? argv[3] : NULL, maxCount, maxBytes,
+                        atoi(argv[argc - 1]));
+    }
+
+    if(argc < 3){
+        fprintf(stderr,"otp USAGE: %s [--binary|--packed] [--stream|--pad] get|post user ...\n", argv[0]); exit(1);
+    }
 
     // determine if "get" or "post" was entered
     if(strcmp(argv[1], "post") == 0){
@@ -69,6 +291,57 @@ int main(int argc, char *argv[]){
         error("otp ERROR, user must enter \"get\" or \"post\" as argv[1]");
     }
 
+    // in stream mode the files are read as the chunks are sent or received
+    if(streamMode == true){
+        if(postMode == true && argc < 6){
+            fprintf(stderr,"otp USAGE: %s --stream post user plaintext key port\n", argv[0]); exit(1);
+        }
+        if(postMode == false && argc < 5){
+            fprintf(stderr,"otp USAGE: %s --stream get user key port\n", argv[0]); exit(1);
+        }
+        if(postMode == true){
+            streamPost(argv[2], argv[3], argv[4], atoi(argv[5]), binaryMode);
+        }
+        else{
+            streamGet(argv[2], argv[3], atoi(argv[4]), binaryMode);
+        }
+        return 0;
+    }
+
+    // in binary mode the files are read whole and XORed
+    if(binaryMode == true){
+        if(postMode == true && argc < 6){
+            fprintf(stderr,"otp USAGE: %s --binary post user plaintext key port\n", argv[0]); exit(1);
+        }
+        if(postMode == false && argc < 5){
+            fprintf(stderr,"otp USAGE: %s --binary get user key port\n", argv[0]); exit(1);
+        }
+        if(postMode == true){
+            binaryPost(argv[2], argv[3], argv[4], atoi(argv[5]));
+        }
+        else{
+            binaryGet(argv[2], argv[3], atoi(argv[4]));
+        }
+        return 0;
+    }
+
+    // in pad mode the key is a slice of a memory-mapped pad
+    if(padMode == true){
+        if(postMode == true && argc < 6){
+            fprintf(stderr,"otp USAGE: %s --pad post user plaintext pad port\n", argv[0]); exit(1);
+        }
+        if(postMode == false && argc < 5){
+            fprintf(stderr,"otp USAGE: %s --pad get user pad port\n", argv[0]); exit(1);
+        }
+        if(postMode == true){
+            padPost(argv[2], argv[3], argv[4], atoi(argv[5]), packedMode);
+        }
+        else{
+            padGet(argv[2], argv[3], atoi(argv[4]));
+        }
+        return 0;
+    }
+
     // if we are in post mode, we get the plaintext and key and create the ciphertext
     if(postMode == true){
         // check for the correct number of arguments
@@ -114,46 +387,25 @@ int main(int argc, char *argv[]){
         plaintextSize--;
         keySize--;
 
-        // check plaintext and key for bad characters
-        for(int i = 0; i < plaintextSize; i++){
-            if((plaintext[i] < 65 || plaintext[i] > 90) && plaintext[i] != 32){
-                fprintf(stderr, "otp ERROR: \"%s\" has bad characters\n", argv[3]);
-                exit(1);
-            }
-        }
-        for(int i = 0; i < keySize; i++){
-            if((key[i] < 65 || key[i] > 90) && key[i] != 32){
-                fprintf(stderr, "otp ERROR: \"%s\" has bad characters\n", argv[4]);
-                exit(1);
-            }
-        }
-
         // allocate memory on the heap for the ciphertext, add 1 to the size for the null terminator
         ciphertext = malloc((plaintextSize + 1) * sizeof(char));
         if(ciphertext == NULL) error("otp ERROR on malloc");
         ciphertext[plaintextSize] = '\0';
         ciphertextSize = plaintextSize;
 
-        // create ciphertext from the plaintext and the key
-        // we have 27 possible values with the space being value 0 and the uppercase letters A-Z being 1-26
-        // instead of using the values 0-26, we'll use ASCII values 65-90 representing letters A-Z and we'll 
-        // treat the space as if it comes before the letters (ASCII 64), so we're using the values 64-90
-        for(int i = 0; i < plaintextSize; i++){
-            if(key[i] == 32){       // if the key is a space, the ciphertext will equal the plaintext
-                ciphertext[i] = plaintext[i];
-            }
-            else if(plaintext[i] == 32){    // if the plaintext is a space, the ciphertext will equal the key
-                ciphertext[i] = key[i];
-            }
-            else{
-                ciphertext[i] = plaintext[i] + key[i] - 64;
-                if(ciphertext[i] > 90){
-                    ciphertext[i] = ciphertext[i] % 91 + 64;
-                }
-                if(ciphertext[i] == 64){    // if we get a value of 64, change it to 32 (a space)
-                    ciphertext[i] = 32;
-                }
-            }
+        // create ciphertext from the plaintext and the key, checking both for bad characters
+        // as we go, then check the rest of the key which is longer than the plaintext
+        cipherResult = encryptText(plaintext, key, ciphertext, plaintextSize);
+        if(cipherResult == CIPHER_OK && !validText(key + plaintextSize, keySize - plaintextSize)){
+            cipherResult = CIPHER_BAD_KEY;
+        }
+        if(cipherResult == CIPHER_BAD_TEXT){
+            fprintf(stderr, "otp ERROR: \"%s\" has bad characters\n", argv[3]);
+            exit(1);
+        }
+        if(cipherResult == CIPHER_BAD_KEY){
+            fprintf(stderr, "otp ERROR: \"%s\" has bad characters\n", argv[4]);
+            exit(1);
         }
     }
     // else we are in get mode
@@ -182,16 +434,12 @@ int main(int argc, char *argv[]){
         keySize--;
 
         // check key for bad characters
-        for(int i = 0; i < keySize; i++){
-            if((key[i] < 65 || key[i] > 90) && key[i] != 32){
-                fprintf(stderr, "otp ERROR: \"%s\" has bad characters\n", argv[3]);
-                exit(1);
-            }
+        if(!validText(key, keySize)){
+            fprintf(stderr, "otp ERROR: \"%s\" has bad characters\n", argv[3]);
+            exit(1);
         }
     }
 
-    // Set up the server address struct
-    memset((char*)&serverAddress, '\0', sizeof(serverAddress)); // Clear out the address struct
     // Get the port number, convert to an integer from a string
     if(postMode == true){
         portNumber = atoi(argv[5]);
@@ -199,186 +447,1036 @@ int main(int argc, char *argv[]){
     else{
         portNumber  = atoi(argv[4]);
     }
-    serverAddress.sin_family = AF_INET;         // Create a network-capable socket
-    serverAddress.sin_port = htons(portNumber); // Store the port number
-    serverHostInfo = gethostbyname("localhost");    // Convert the machine name into a special form of address
-    if(serverHostInfo == NULL) { fprintf(stderr, "otp ERROR: no such host\n"); exit(2); }
-    
-    // Copy in the address
-    memcpy((char*)&serverAddress.sin_addr.s_addr, (char*)serverHostInfo->h_addr, serverHostInfo->h_length);
-
-    // Set up the socket
-    socketFD = socket(AF_INET, SOCK_STREAM, 0); // Create the socket
-    if(socketFD < 0) error("otp ERROR opening socket");
-    
-    // Connect to server's address
-    if(connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0){
-        fprintf(stderr, "otp ERROR connecting to port %d\n", portNumber); 
-        exit(2);
-    }
+    connectToServer(&conn, portNumber);
+    if(packedMode == true) conn.flags = FLAG_PACKED;
 
     if(postMode == true){
-        // send the mode to otp_d, 'p' is for 'post'
-        if(!sendAll(socketFD, "p", sizeof(char))){
-            error("otp ERROR writing to socket");
+        // send the header, the username and the ciphertext to otp_d, 'p' is for 'post'
+        sendPost(&conn, argv[2], ciphertext, ciphertextSize);
+        finishPost(&conn);
+    }
+
+    // 'get' mode
+    if(postMode == false){
+        // send the header and the username to otp_d, 'g' is for 'get', and receive the
+        // ciphertext, or OTP_EMPTY if the user has no ciphertext file
+        status = otpGet(&conn, argv[2], &ciphertext, &ciphertextSize);
+        if(status == OTP_EMPTY){
+            fprintf(stderr, "otp ERROR: no ciphertext for user \"%s\"\n", argv[2]);
+            exit(1);    // exit if the given user has no ciphertext file
         }
+        checkStatus(&conn, status, "otp ERROR reading from socket");
 
-        // send size of the username to otp_d
-        if(!sendAll(socketFD, &userSize, sizeof(size_t))){
-            error("otp ERROR writing to socket");
+        if(keySize < ciphertextSize){
+            fprintf(stderr, "otp ERROR: \"%s\" not long enough for the ciphertext\n", argv[3]);
+            exit(1);    // exit if the key isn't long enough for the ciphertext
         }
 
-        // send the username to otp_d
-        if(!sendAll(socketFD, argv[2], userSize)){
-            error("otp ERROR writing to socket");
+        // turn the ciphertext into plaintext in place with the key, the key has already been checked
+        if(decryptText(ciphertext, key, ciphertext, ciphertextSize) != CIPHER_OK){
+            fprintf(stderr, "otp ERROR: the ciphertext for user \"%s\" has bad characters\n", argv[2]);
+            exit(1);
         }
 
-        // send size of the ciphertext to otp_d
-        if(!sendAll(socketFD, &ciphertextSize, sizeof(size_t))){
-            error("otp ERROR writing to socket");
+        // print the plaintext followed by a newline
+        printf("%s\n", ciphertext);
+        fflush(stdout);
+    }
+
+    // free memory allocated by getline() and malloc()
+    free(plaintext);
+    free(key);
+    free(ciphertext);
+
+    // close files
+    fclose(keyFile);
+    if(postMode == true){
+        fclose(plaintextFile);
+    }
+
+    // close socket
+    otpClose(&conn);
+
+    return 0;
+}
+
+/*******************************************************************************
+ *                                  connectToServer                            *
+ * This function connects to otp_d on the given port of this machine. otp      *
+ * exits if it can't connect.                                                  *
+ ******************************************************************************/
+void connectToServer(struct otpConnection* conn, int portNumber){
+    if(otpConnect(conn, NULL, portNumber) != OTP_OK){
+        if(errno == EHOSTUNREACH){ fprintf(stderr, "otp ERROR: no such host\n"); exit(2); }
+        fprintf(stderr, "otp ERROR connecting to port %d\n", portNumber);
+        exit(2);
+    }
+}
+
+/*******************************************************************************
+ *                                  checkStatus                                *
+ * This function ends otp if a call on the connection didn't work: with status *
+ * 3 if otp_d was too busy, otherwise with msg and the reason.                 *
+ ******************************************************************************/
+void checkStatus(struct otpConnection* conn, enum otpStatus status, const char* msg){
+    if(status == OTP_BUSY) reportBusy(conn->retryAfter);
+    if(status != OTP_OK) error(msg);
+}
+
+/*******************************************************************************
+ *                                  readLineChunk                              *
+ * This function reads up to bufferSize characters of the current line of a    *
+ * file. It returns true once the end of the line (or of the file) has been    *
+ * reached, in which case the newline is consumed but not stored.              *
+ ******************************************************************************/
+bool readLineChunk(FILE* file, char* buffer, size_t bufferSize, size_t* chunkSize){
+    int c;
+
+    *chunkSize = 0;
+    while(*chunkSize < bufferSize){
+        c = getc_unlocked(file);
+        if(c == EOF || c == '\n') return true;
+        buffer[(*chunkSize)++] = c;
+    }
+    return false;
+}
+
+/*******************************************************************************
+ *                                  readChunk                                  *
+ * This function reads the next chunk of a plaintext or key file for --stream. *
+ * Text files are read a line at a time with readLineChunk(), binary ones are  *
+ * read as they are, newlines and all. It returns true once the end of the     *
+ * text has been reached.                                                      *
+ ******************************************************************************/
+bool readChunk(FILE* file, char* buffer, size_t bufferSize, size_t* chunkSize, bool binary){
+    if(!binary) return readLineChunk(file, buffer, bufferSize, chunkSize);
+
+    *chunkSize = fread(buffer, sizeof(char), bufferSize, file);
+    if(ferror(file)) error("otp ERROR reading file");
+    return *chunkSize < bufferSize;
+}
+
+/*******************************************************************************
+ *                                  finishPost                                 *
+ * This function tells otp_d that a post is the last request on a connection, *
+ * waits for otp_d to say it's stored and then for otp_d to close the          *
+ * connection. otp exits if the post wasn't taken.                             *
+ ******************************************************************************/
+void finishPost(struct otpConnection* conn){
+    enum otpStatus status;
+
+    otpShutdown(conn);
+    status = otpRecvAck(conn);
+    if(status == OTP_OK) status = otpWaitForClose(conn);
+    if(status == OTP_BUSY) reportBusy(conn->retryAfter);
+    if(status != OTP_OK){
+        fprintf(stderr, "otp ERROR: otp_d didn't finish the post\n");
+        exit(1);
+    }
+}
+
+/*******************************************************************************
+ *                                  sendPost                                   *
+ * This function sends a whole ciphertext as a 'post', packing it first if the *
+ * connection's flags have FLAG_PACKED.                                        *
+ ******************************************************************************/
+void sendPost(struct otpConnection* conn, const char* user, const char* ciphertext, size_t ciphertextSize){
+    char* packed = NULL;                // the ciphertext packed, with FLAG_PACKED
+
+    if(conn->flags & FLAG_PACKED){
+        packed = malloc(packedSize(ciphertextSize));
+        if(packed == NULL) error("otp ERROR on malloc");
+        packText(ciphertext, ciphertextSize, packed);
+        ciphertext = packed;
+        ciphertextSize = packedSize(ciphertextSize);
+    }
+    checkStatus(conn, otpSendRequest(conn, MODE_POST, user, ciphertext, ciphertextSize),
+                "otp ERROR writing to socket");
+    free(packed);
+}
+
+/*******************************************************************************
+ *                                  unpackCiphertext                           *
+ * This function swaps a ciphertext received with otpRecvBody() for the        *
+ * characters packed in it, if it starts with PACKED_MARKER, in a new buffer   *
+ * with a null terminator. False is returned if the packing is bad.            *
+ ******************************************************************************/
+bool unpackCiphertext(char** ciphertext, size_t* ciphertextSize){
+    char* unpacked;                     // the characters packed in the ciphertext
+
+    if(*ciphertextSize == 0 || (*ciphertext)[0] != PACKED_MARKER) return true;
+
+    unpacked = malloc(unpackedSize(*ciphertextSize) + 1);
+    if(unpacked == NULL) error("otp ERROR on malloc");
+    if(!unpackText(*ciphertext, *ciphertextSize, unpacked, ciphertextSize)){
+        free(unpacked);
+        return false;
+    }
+    unpacked[*ciphertextSize] = '\0';
+    free(*ciphertext);
+    *ciphertext = unpacked;
+    return true;
+}
+
+/*******************************************************************************
+ *                                  reportBusy                                 *
+ * This function tells the user otp_d was too busy and how long it asked otp   *
+ * to wait, then exits with status 3.                                          *
+ ******************************************************************************/
+void reportBusy(uint64_t retryAfter){
+    fprintf(stderr, "otp ERROR: otp_d is busy, try again in %llu ms\n", (unsigned long long)retryAfter);
+    exit(3);
+}
+
+/*******************************************************************************
+ *                                  streamPost                                 *
+ * This function encrypts a plaintext file and posts it a chunk at a time,     *
+ * each chunk encrypted in place, or XORed with the key if it's binary. The    *
+ * empty chunk that tells otp_d the ciphertext is complete is only sent once   *
+ * all of the plaintext and key have been checked, so when otp exits with an   *
+ * error part way through, otp_d throws away what it received.                 *
+ ******************************************************************************/
+void streamPost(const char* user, const char* plaintextName, const char* keyName, int portNumber, bool binary){
+    FILE* plaintextFile;                // the plaintext file, read a chunk at a time
+    FILE* keyFile;                      // the key file, read a chunk at a time
+    char* chunk;                        // a chunk of the plaintext, encrypted in place and sent to otp_d
+    char* key;                          // the key for that chunk
+    size_t chunkSize;                   // the size of the plaintext chunk
+    size_t keySize;                     // how much of the key was read for the chunk
+    bool plaintextDone = false;         // true once the whole plaintext line has been read
+    bool keyDone = false;               // true once the whole key line has been read
+    enum cipherResult cipherResult;     // whether the plaintext and key were good
+    struct otpConnection conn;          // the connection to otp_d
+
+    plaintextFile = fopen(plaintextName, "r");
+    if(!plaintextFile) error("otp ERROR opening plaintext file\n");
+    keyFile = fopen(keyName, "r");
+    if(!keyFile) error("otp ERROR opening key file\n");
+
+    chunk = malloc(STREAM_CHUNK_SIZE);
+    key = malloc(STREAM_CHUNK_SIZE);
+    if(chunk == NULL || key == NULL) error("otp ERROR on malloc");
+
+    connectToServer(&conn, portNumber);
+    if(binary) conn.flags = FLAG_BINARY;
+    checkStatus(&conn, otpSendRequest(&conn, MODE_STREAM_POST, user, NULL, 0), "otp ERROR writing to socket");
+
+    while(!plaintextDone){
+        plaintextDone = readChunk(plaintextFile, chunk, STREAM_CHUNK_SIZE, &chunkSize, binary);
+        if(chunkSize == 0) break;
+
+        // the key has to keep up with the plaintext
+        keyDone = readChunk(keyFile, key, chunkSize, &keySize, binary);
+        if(keySize < chunkSize){
+            fprintf(stderr, "otp ERROR: \"%s\" not long enough for \"%s\"\n", keyName, plaintextName);
+            exit(1);
         }
 
-        // send the ciphertext to otp_d
-        if(!sendAll(socketFD, ciphertext, ciphertextSize)){
-            error("otp ERROR writing to socket");
+        // turn the chunk into ciphertext, checking the plaintext and key for bad characters
+        // unless they're binary, when any byte is good
+        if(binary){
+            xorText(chunk, key, chunk, chunkSize);
+            cipherResult = CIPHER_OK;
+        }
+        else{
+            cipherResult = encryptText(chunk, key, chunk, chunkSize);
         }
+        if(cipherResult == CIPHER_BAD_TEXT){
+            fprintf(stderr, "otp ERROR: \"%s\" has bad characters\n", plaintextName);
+            exit(1);
+        }
+        if(cipherResult == CIPHER_BAD_KEY){
+            fprintf(stderr, "otp ERROR: \"%s\" has bad characters\n", keyName);
+            exit(1);
+        }
+
+        // send the size of the chunk and the chunk to otp_d
+        checkStatus(&conn, otpSendChunk(&conn, chunk, chunkSize), "otp ERROR writing to socket");
     }
 
-    // 'get' mode
-    if(postMode == false){
-        // send the mode to otp_d, 'g' is for 'get'
-        if(!sendAll(socketFD, "g", sizeof(char))){
-            error("otp ERROR writing to socket");
+    // check the rest of the key, which is longer than the plaintext
+    while(!keyDone && !binary){
+        keyDone = readLineChunk(keyFile, key, STREAM_CHUNK_SIZE, &keySize);
+        if(!validText(key, keySize)){
+            fprintf(stderr, "otp ERROR: \"%s\" has bad characters\n", keyName);
+            exit(1);
         }
+    }
+
+    // send the empty chunk which ends the ciphertext
+    checkStatus(&conn, otpSendChunk(&conn, NULL, 0), "otp ERROR writing to socket");
+    finishPost(&conn);
+
+    free(chunk);
+    free(key);
+    fclose(plaintextFile);
+    fclose(keyFile);
+    otpClose(&conn);
+}
+
+/*******************************************************************************
+ *                                  streamGet                                  *
+ * This function gets the oldest ciphertext for a user a chunk at a time,      *
+ * decrypting each chunk with the next part of the key and printing it. The    *
+ * key is checked for bad characters before anything is asked of otp_d. A     *
+ * binary ciphertext is XORed with the key instead and printed as it is.      *
+ * A packed ciphertext is unpacked a whole group at a time, holding back the   *
+ * last group received, which could be the padded one, and any part of a       *
+ * group until the rest of it arrives.                                         *
+ ******************************************************************************/
+void streamGet(const char* user, const char* keyName, int portNumber, bool binary){
+    FILE* keyFile;                      // the key file, read a chunk at a time
+    char* key;                          // the key for a chunk
+    char* chunk;                        // a chunk of ciphertext from otp_d, decrypted in place
+    char* unpacked;                     // the characters unpacked from a packed chunk
+    char* text;                         // the characters to decrypt, the chunk or what was unpacked from it
+    size_t textBuffSize;                // room for a chunk and what's held back, unpacked
+    enum otpStatus status;              // OTP_EMPTY if the user has no ciphertext
+    size_t chunkSize;                   // the size of the chunk sent from otp_d
+    size_t textSize;                    // the number of characters to decrypt
+    size_t keySize;                     // how much of the key was read for the chunk
+    size_t held = 0;                    // the packed bytes held back at the start of chunk
+    size_t groupsSize;                  // the packed bytes unpacked this time
+    bool keyDone = false;               // true once the whole key line has been read
+    bool firstChunk = true;             // true until the first chunk has been received
+    bool packed = false;                // true if the ciphertext started with PACKED_MARKER
+    bool ended = false;                 // true once the empty chunk has been received
+    struct otpConnection conn;          // the connection to otp_d
+
+    keyFile = fopen(keyName, "r");
+    if(!keyFile) error("otp ERROR opening key file\n");
+
+    textBuffSize = (MAX_CHUNK_SIZE + 2 * PACKED_GROUP_SIZE) / PACKED_GROUP_SIZE * PACKED_GROUP_CHARS;
+    key = malloc(textBuffSize);
+    chunk = malloc(MAX_CHUNK_SIZE + 2 * PACKED_GROUP_SIZE);
+    unpacked = malloc(textBuffSize);
+    if(key == NULL || chunk == NULL || unpacked == NULL) error("otp ERROR on malloc");
 
-        // send size of the username to otp_d
-        if(!sendAll(socketFD, &userSize, sizeof(size_t))){
-            error("otp ERROR writing to socket");
+    // check key for bad characters, then go back to the start of it
+    while(!keyDone && !binary){
+        keyDone = readLineChunk(keyFile, key, MAX_CHUNK_SIZE, &keySize);
+        if(!validText(key, keySize)){
+            fprintf(stderr, "otp ERROR: \"%s\" has bad characters\n", keyName);
+            exit(1);
         }
+    }
+    rewind(keyFile);
+    keyDone = false;
+
+    connectToServer(&conn, portNumber);
+    checkStatus(&conn, otpSendRequest(&conn, MODE_STREAM_GET, user, NULL, 0), "otp ERROR writing to socket");
+
+    // find out whether there's a ciphertext for the user
+    status = otpRecvAnswer(&conn, &chunkSize);
+    if(status == OTP_EMPTY){
+        fprintf(stderr, "otp ERROR: no ciphertext for user \"%s\"\n", user);
+        exit(1);    // exit if the given user has no ciphertext file
+    }
+    checkStatus(&conn, status, "otp ERROR reading from socket");
+
+    while(!ended){
+        // receive the size of the next chunk, a chunk of size 0 ends the ciphertext
+        checkStatus(&conn, otpRecvChunkSize(&conn, &chunkSize), "otp ERROR reading from socket");
+        ended = chunkSize == 0;
+        if(ended && !packed) break;
+        checkStatus(&conn, otpRecvBody(&conn, chunk + held, chunkSize), "otp ERROR reading from socket");
 
-        // send the username to otp_d
-        if(!sendAll(socketFD, argv[2], userSize)){
-            error("otp ERROR writing to socket");
+        // a packed ciphertext's marker is dropped, then only whole groups not at the end are unpacked
+        if(firstChunk && !binary && chunk[0] == PACKED_MARKER){
+            packed = true;
+            memmove(chunk, chunk + 1, --chunkSize);
         }
+        firstChunk = false;
+        text = packed ? unpacked : chunk;
+        textSize = chunkSize;
+        if(packed){
+            held += chunkSize;
+            groupsSize = held / PACKED_GROUP_SIZE * PACKED_GROUP_SIZE;
+            if(!ended && groupsSize > 0) groupsSize -= PACKED_GROUP_SIZE;
+            if(!unpackGroups(chunk, groupsSize, text, &textSize) || (ended && held != groupsSize) ||
+               (!ended && textSize != groupsSize / PACKED_GROUP_SIZE * PACKED_GROUP_CHARS)){
+                fprintf(stderr, "otp ERROR: the ciphertext for user \"%s\" has bad characters\n", user);
+                exit(1);
+            }
+            held -= groupsSize;
+            memmove(chunk, chunk + groupsSize, held);
+        }
+        if(textSize == 0) continue;
 
-        // receive the success 's' or failure 'f' of finding a ciphertext file for the user
-        if(!recvAll(socketFD, &userFileResult, sizeof(char))){
-            error("otp ERROR reading from socket");
+        // the key has to keep up with the ciphertext
+        keySize = 0;
+        if(!keyDone) keyDone = readChunk(keyFile, key, textSize, &keySize, binary);
+        if(keySize < textSize){
+            fprintf(stderr, "otp ERROR: \"%s\" not long enough for the ciphertext\n", keyName);
+            exit(1);    // exit if the key isn't long enough for the ciphertext
         }
-        if(userFileResult == 'f'){
-            fprintf(stderr, "otp ERROR: no ciphertext for user \"%s\"\n", argv[2]);
-            exit(1);    // exit if the given user has no ciphertext file
+
+        // turn the text into plaintext in place with the key, the key has already been checked
+        if(binary){
+            xorText(text, key, text, textSize);
+        }
+        else if(decryptText(text, key, text, textSize) != CIPHER_OK){
+            fprintf(stderr, "otp ERROR: the ciphertext for user \"%s\" has bad characters\n", user);
+            exit(1);
         }
+        fwrite(text, sizeof(char), textSize, stdout);
+    }
+
+    // print a newline after the plaintext, unless it's binary and has to come out exactly as posted
+    if(!binary) printf("\n");
+    fflush(stdout);
+
+    free(key);
+    free(chunk);
+    free(unpacked);
+    fclose(keyFile);
+    otpClose(&conn);
+}
+
+/*******************************************************************************
+ *                                  binaryPost                                 *
+ * This function XORs a whole binary plaintext file with a binary key and      *
+ * posts it. Every byte of the file is part of the plaintext, so nothing is    *
+ * stripped from the end and nothing is checked.                               *
+ ******************************************************************************/
+void binaryPost(const char* user, const char* plaintextName, const char* keyName, int portNumber){
+    char* plaintext;                    // the plaintext, XORed in place and sent to otp_d
+    char* key;                          // the key
+    size_t plaintextSize;               // size of the plaintext
+    size_t keySize;                     // size of the key
+    struct otpConnection conn;          // the connection to otp_d
+
+    plaintext = readBinaryFile(plaintextName, &plaintextSize);
+    key = readBinaryFile(keyName, &keySize);
+    if(keySize < plaintextSize){
+        fprintf(stderr, "otp ERROR: \"%s\" not long enough for \"%s\"\n", keyName, plaintextName);
+        exit(1);
+    }
+    xorText(plaintext, key, plaintext, plaintextSize);
+
+    connectToServer(&conn, portNumber);
+    conn.flags = FLAG_BINARY;
+    checkStatus(&conn, otpSendRequest(&conn, MODE_POST, user, plaintext, plaintextSize),
+                "otp ERROR writing to socket");
+    finishPost(&conn);
+
+    free(plaintext);
+    free(key);
+    otpClose(&conn);
+}
+
+/*******************************************************************************
+ *                                  binaryGet                                  *
+ * This function gets the oldest ciphertext for a user, XORs it with a binary  *
+ * key and prints the bytes exactly as they were posted.                       *
+ ******************************************************************************/
+void binaryGet(const char* user, const char* keyName, int portNumber){
+    char* key;                          // the key
+    char* ciphertext;                   // the ciphertext from otp_d, XORed in place
+    size_t keySize;                     // size of the key
+    size_t ciphertextSize;              // size of the ciphertext
+    enum otpStatus status;              // OTP_EMPTY if the user has no ciphertext
+    struct otpConnection conn;          // the connection to otp_d
 
-        // receive ciphertext size from otp_d
-        if(!recvAll(socketFD, &ciphertextSize, sizeof(size_t))){
-            error("otp ERROR reading from socket");
+    key = readBinaryFile(keyName, &keySize);
+
+    connectToServer(&conn, portNumber);
+    status = otpGet(&conn, user, &ciphertext, &ciphertextSize);
+    if(status == OTP_EMPTY){
+        fprintf(stderr, "otp ERROR: no ciphertext for user \"%s\"\n", user);
+        exit(1);    // exit if the given user has no ciphertext file
+    }
+    checkStatus(&conn, status, "otp ERROR reading from socket");
+
+    if(keySize < ciphertextSize){
+        fprintf(stderr, "otp ERROR: \"%s\" not long enough for the ciphertext\n", keyName);
+        exit(1);    // exit if the key isn't long enough for the ciphertext
+    }
+    xorText(ciphertext, key, ciphertext, ciphertextSize);
+    fwrite(ciphertext, sizeof(char), ciphertextSize, stdout);
+    fflush(stdout);
+
+    free(key);
+    free(ciphertext);
+    otpClose(&conn);
+}
+
+/*******************************************************************************
+ *                                  readBinaryFile                             *
+ * This function reads a whole file into a new heap buffer, every byte of it.  *
+ * otp exits if the file can't be read.                                        *
+ ******************************************************************************/
+char* readBinaryFile(const char* filename, size_t* fileSize){
+    FILE* file;                         // the file being read
+    struct stat fileInfo;               // contains info about the file
+    char* buffer;                       // the contents of the file
+
+    file = fopen(filename, "r");
+    if(!file) error("otp ERROR opening file");
+    if(fstat(fileno(file), &fileInfo) != 0) error("otp ERROR reading file");
+
+    // malloc(0) may return NULL, so an empty file still gets a byte
+    buffer = malloc(fileInfo.st_size > 0 ? fileInfo.st_size : 1);
+    if(buffer == NULL) error("otp ERROR on malloc");
+    *fileSize = fread(buffer, sizeof(char), fileInfo.st_size, file);
+    if(ferror(file)) error("otp ERROR reading file");
+    fclose(file);
+    return buffer;
+}
+
+/*******************************************************************************
+ *                                  padPost                                    *
+ * This function encrypts a plaintext file with the next unused slice of a pad *
+ * and posts it. The ciphertext sent is the offset header followed by the      *
+ * encrypted plaintext, both packed if packed is true.                         *
+ ******************************************************************************/
+void padPost(const char* user, const char* plaintextName, const char* padName, int portNumber, bool packed){
+    FILE* plaintextFile;                // the plaintext file
+    char* plaintext = NULL;             // a buffer for the plaintext read from the file
+    char* ciphertext;                   // the header and ciphertext sent to otp_d
+    size_t plaintextBuffSize;           // size of the plaintext buffer used with getline()
+    ssize_t sPlaintextSize;             // size of the plaintext (signed), used with getline()
+    size_t plaintextSize;               // size of the plaintext without its newline
+    size_t ciphertextSize;              // size of the header and ciphertext
+    size_t offset;                      // where the plaintext's slice of the pad starts
+    struct pad pad;                     // the memory-mapped pad
+    enum cipherResult cipherResult;     // whether the plaintext and pad were good
+    struct otpConnection conn;          // the connection to otp_d
+
+    // get the text from the plaintext file, which should be 1 line
+    plaintextFile = fopen(plaintextName, "r");
+    if(!plaintextFile) error("otp ERROR opening plaintext file\n");
+    sPlaintextSize = getline(&plaintext, &plaintextBuffSize, plaintextFile);
+    if(sPlaintextSize < 0) error("otp ERROR getting plaintext with getline()\n");
+    plaintextSize = sPlaintextSize;
+    if(plaintextSize > 0 && plaintext[plaintextSize - 1] == '\n') plaintextSize--;
+
+    // take the next unused slice of the pad
+    if(!openPad(&pad, padName)) error("otp ERROR opening pad file\n");
+    if(!reservePad(&pad, plaintextSize, &offset)){
+        if(errno == ENOSPC){
+            fprintf(stderr, "otp ERROR: \"%s\" not long enough for \"%s\"\n", padName, plaintextName);
+            exit(1);
         }
+        error("otp ERROR updating pad ledger");
+    }
 
-        if(keySize < ciphertextSize){
-            fprintf(stderr, "otp ERROR: \"%s\" not long enough for the ciphertext\n", argv[3]);
-            exit(1);    // exit if the key isn't long enough for the ciphertext
+    // allocate memory on the heap for the header and ciphertext
+    ciphertextSize = PAD_HEADER_SIZE + plaintextSize;
+    ciphertext = malloc(ciphertextSize);
+    if(ciphertext == NULL) error("otp ERROR on malloc");
+    encodePadOffset(offset, ciphertext);
+
+    // create ciphertext from the plaintext and the slice, checking both for bad characters
+    cipherResult = encryptText(plaintext, pad.text + offset, ciphertext + PAD_HEADER_SIZE, plaintextSize);
+    if(cipherResult == CIPHER_BAD_TEXT){
+        fprintf(stderr, "otp ERROR: \"%s\" has bad characters\n", plaintextName);
+        exit(1);
+    }
+    if(cipherResult == CIPHER_BAD_KEY){
+        fprintf(stderr, "otp ERROR: \"%s\" has bad characters\n", padName);
+        exit(1);
+    }
+
+    // send the request, the size of the ciphertext and the ciphertext to otp_d
+    connectToServer(&conn, portNumber);
+    if(packed) conn.flags = FLAG_PACKED;
+    sendPost(&conn, user, ciphertext, ciphertextSize);
+    finishPost(&conn);
+
+    free(plaintext);
+    free(ciphertext);
+    fclose(plaintextFile);
+    closePad(&pad);
+    otpClose(&conn);
+}
+
+/*******************************************************************************
+ *                                  padGet                                     *
+ * This function gets the oldest ciphertext for a user and decrypts it with    *
+ * the slice of the pad named by its offset header.                            *
+ ******************************************************************************/
+void padGet(const char* user, const char* padName, int portNumber){
+    char* ciphertext;                   // the header and ciphertext received from otp_d
+    char* plaintext;                    // the ciphertext after the header, decrypted in place
+    enum otpStatus status;              // OTP_EMPTY if the user has no ciphertext
+    size_t ciphertextSize;              // size of the header and ciphertext
+    size_t plaintextSize;               // size of the ciphertext after the header
+    size_t offset;                      // where the ciphertext's slice of the pad starts
+    struct pad pad;                     // the memory-mapped pad
+    enum cipherResult cipherResult;     // whether the ciphertext and pad were good
+    struct otpConnection conn;          // the connection to otp_d
+
+    if(!openPad(&pad, padName)) error("otp ERROR opening pad file\n");
+
+    // receive the ciphertext from otp_d, or OTP_EMPTY if there isn't one for the user
+    connectToServer(&conn, portNumber);
+    status = otpGet(&conn, user, &ciphertext, &ciphertextSize);
+    if(status == OTP_EMPTY){
+        fprintf(stderr, "otp ERROR: no ciphertext for user \"%s\"\n", user);
+        exit(1);    // exit if the given user has no ciphertext file
+    }
+    checkStatus(&conn, status, "otp ERROR reading from socket");
+
+    // find the slice of the pad the ciphertext was made with
+    if(ciphertextSize < PAD_HEADER_SIZE || !decodePadOffset(ciphertext, &offset)){
+        fprintf(stderr, "otp ERROR: the ciphertext for user \"%s\" wasn't made with a pad\n", user);
+        exit(1);
+    }
+    plaintextSize = ciphertextSize - PAD_HEADER_SIZE;
+    plaintext = ciphertext + PAD_HEADER_SIZE;
+    if(offset > pad.size || plaintextSize > pad.size - offset){
+        fprintf(stderr, "otp ERROR: \"%s\" not long enough for the ciphertext\n", padName);
+        exit(1);
+    }
+
+    // create plaintext from the ciphertext and the slice
+    cipherResult = decryptText(plaintext, pad.text + offset, plaintext, plaintextSize);
+    if(cipherResult == CIPHER_BAD_TEXT){
+        fprintf(stderr, "otp ERROR: the ciphertext for user \"%s\" has bad characters\n", user);
+        exit(1);
+    }
+    if(cipherResult == CIPHER_BAD_KEY){
+        fprintf(stderr, "otp ERROR: \"%s\" has bad characters\n", padName);
+        exit(1);
+    }
+
+    // print the plaintext followed by a newline, otpGet() null terminated it
+    printf("%s\n", plaintext);
+    fflush(stdout);
+
+    free(ciphertext);
+    closePad(&pad);
+    otpClose(&conn);
+}
+
+/*******************************************************************************
+ *                                  readLineFile                               *
+ * This function reads the first line of a file into a new buffer, without its *
+ * newline. NULL is returned if the file can't be read.                        *
+ ******************************************************************************/
+char* readLineFile(const char* filename, size_t* lineSize){
+    FILE* file;
+    char* line = NULL;                  // the buffer allocated by getline()
+    size_t lineBuffSize;                // size of the buffer used with getline()
+    ssize_t sLineSize;                  // size of the line (signed), used with getline()
+
+    file = fopen(filename, "r");
+    if(!file) return NULL;
+    sLineSize = getline(&line, &lineBuffSize, file);
+    fclose(file);
+    if(sLineSize < 0){
+        free(line);
+        return NULL;
+    }
+
+    // strip off the newline character
+    if(sLineSize > 0 && line[sLineSize - 1] == '\n') line[--sLineSize] = '\0';
+    *lineSize = sLineSize;
+    return line;
+}
+
+/*******************************************************************************
+ *                                  runBatch                                   *
+ * This function sends every post and get in a manifest over one connection.   *
+ * Requests are sent without waiting for answers, which a second thread reads  *
+ * and prints in order. A request with a problem is reported and skipped. Once *
+ * everything is sent, the sending side of the connection is shut down and the *
+ * thread waits for otp_d to close its side, which it only does after handling *
+ * every request. Posts are packed if packed is true. The return value is the  *
+ * exit status for otp.                                                        *
+ ******************************************************************************/
+int runBatch(const char* manifestName, int portNumber, bool packed){
+    FILE* manifest;                     // the manifest of posts and gets
+    char* line = NULL;                  // a line of the manifest
+    size_t lineBuffSize;                // size of the line buffer used with getline()
+    int lineNumber = 0;                 // the number of the line, for error messages
+    char* fields[4];                    // the words on the line
+    int numFields;                      // how many words are on the line
+    int failures = 0;                   // the number of posts and gets that failed
+    pthread_t receiver;                 // the thread reading the answers to the 'get's
+    struct pendingQueue queue = {NULL, NULL, false, {-1, 0}, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+    manifest = fopen(manifestName, "r");
+    if(!manifest) error("otp ERROR opening manifest file\n");
+
+    // a failed write is reported instead of killing otp
+    signal(SIGPIPE, SIG_IGN);
+
+    connectToServer(&queue.conn, portNumber);
+    if(packed) queue.conn.flags = FLAG_PACKED;
+    if(pthread_create(&receiver, NULL, receiveAnswers, &queue) != 0){
+        fprintf(stderr, "otp ERROR creating thread\n"); exit(1);
+    }
+
+    while(getline(&line, &lineBuffSize, manifest) >= 0){
+        lineNumber++;
+
+        // split the line into words, skipping blank lines and comments
+        numFields = 0;
+        for(char* word = strtok(line, " \t\r\n"); word != NULL && numFields < 4; word = strtok(NULL, " \t\r\n")){
+            fields[numFields++] = word;
         }
+        if(numFields == 0 || fields[0][0] == '#') continue;
 
-        // allocate memory on the heap for ciphertext and plaintext, add 1 to the size for the null terminator
-        ciphertext = malloc((ciphertextSize + 1) * sizeof(char));
-        if(ciphertext == NULL) error("otp ERROR on malloc");
-        plaintext = malloc((ciphertextSize + 1) * sizeof(char));    // plaintext is the same size as ciphertext
-        if(plaintext == NULL) error("otp ERROR on malloc");
-
-        // get the ciphertext from otp
-        if(!recvAll(socketFD, ciphertext, ciphertextSize)){
-            error("otp ERROR reading from socket");
-        }
-        ciphertext[ciphertextSize] = '\0';
-
-        // create plaintext from the ciphertext and the key
-        // we have 27 possible values with the space being value 0 and the uppercase letters A-Z being 1-26
-        // instead of using the values 0-26, we'll use ASCII values 65-90 representing letters A-Z and we'll 
-        // treat the space as if it comes before the letters (ASCII 64), so we're using the values 64-90
-        for(int i = 0; i < ciphertextSize; i++){
-            if(key[i] == 32){       // if the key is a space, the plaintext will equal the ciphertext
-                plaintext[i] = ciphertext[i];
-            }
-            else if(ciphertext[i] == 32){   // if the ciphertext is a space, treat the space as ASCII value 64
-                plaintext[i] = 91 - (key[i] - 64);
-            }
-            else{
-                plaintext[i] = ciphertext[i] - key[i] + 64;
-                if(plaintext[i] < 64){
-                    plaintext[i] = plaintext[i] + 27;
-                }
-                if(plaintext[i] == 64){     // if we get a value of 64, change it to 32 (a space)
-                    plaintext[i] = 32;
-                }
-            }
+        if(numFields == 4 && strcmp(fields[0], "post") == 0){
+            if(!batchPost(&queue, fields[1], fields[2], fields[3])) failures++;
+        }
+        else if(numFields == 3 && strcmp(fields[0], "get") == 0){
+            if(!batchGet(&queue, fields[1], fields[2])) failures++;
         }
-        plaintext[ciphertextSize] = '\0';   // add a null terminator to the end of plaintext
+        else{
+            fprintf(stderr, "otp ERROR: line %d of \"%s\" isn't \"post user plaintext key\" or \"get user key\"\n",
+                    lineNumber, manifestName);
+            failures++;
+        }
+    }
+    free(line);
+    fclose(manifest);
 
-        // print the plaintext followed by a newline
-        printf("%s\n", plaintext);
-        fflush(stdout);
+    // tell otp_d there are no more requests and wait for the last answers
+    otpShutdown(&queue.conn);
+    pthread_mutex_lock(&queue.lock);
+    queue.done = true;
+    pthread_cond_signal(&queue.changed);
+    pthread_mutex_unlock(&queue.lock);
+    pthread_join(receiver, NULL);
+
+    otpClose(&queue.conn);
+    return (failures + queue.failures) == 0 ? 0 : 1;
+}
+
+/*******************************************************************************
+ *                                  batchPost                                  *
+ * This function encrypts a plaintext file and sends it as a 'post' in batch   *
+ * mode, queueing it for receiveAnswers() to read otp_d's answer to. False is  *
+ * returned if the files have a problem, in which case nothing is sent.        *
+ ******************************************************************************/
+bool batchPost(struct pendingQueue* queue, const char* user, const char* plaintextName, const char* keyName){
+    struct pendingRequest* post;        // the post being sent
+    char* plaintext;                    // the plaintext read from the file
+    char* key;                          // the key read from the file
+    char* ciphertext;                   // the ciphertext sent to otp_d
+    size_t plaintextSize;               // size of the plaintext
+    size_t keySize;                     // size of the key
+    enum cipherResult cipherResult;     // whether the plaintext and key were good
+
+    plaintext = readLineFile(plaintextName, &plaintextSize);
+    if(plaintext == NULL){
+        fprintf(stderr, "otp ERROR: can't read \"%s\"\n", plaintextName);
+        return false;
+    }
+    key = readLineFile(keyName, &keySize);
+    if(key == NULL){
+        fprintf(stderr, "otp ERROR: can't read \"%s\"\n", keyName);
+        free(plaintext);
+        return false;
+    }
+    ciphertext = malloc(plaintextSize + 1);
+    if(ciphertext == NULL) error("otp ERROR on malloc");
+
+    // create ciphertext from the plaintext and the key, checking both for bad characters
+    if(keySize < plaintextSize){
+        fprintf(stderr, "otp ERROR: \"%s\" not long enough for \"%s\"\n", keyName, plaintextName);
+        cipherResult = CIPHER_BAD_KEY;
+    }
+    else{
+        cipherResult = encryptText(plaintext, key, ciphertext, plaintextSize);
+        if(cipherResult == CIPHER_OK && !validText(key + plaintextSize, keySize - plaintextSize)){
+            cipherResult = CIPHER_BAD_KEY;
+        }
+        if(cipherResult != CIPHER_OK){
+            fprintf(stderr, "otp ERROR: \"%s\" has bad characters\n",
+                    cipherResult == CIPHER_BAD_TEXT ? plaintextName : keyName);
+        }
+    }
+
+    // send the request, the size of the ciphertext and the ciphertext to otp_d
+    if(cipherResult == CIPHER_OK){
+        post = calloc(1, sizeof(struct pendingRequest));
+        if(post == NULL || (post->user = strdup(user)) == NULL) error("otp ERROR on malloc");
+        post->mode = MODE_POST;
+        queueRequest(queue, post);
+        sendPost(&queue->conn, user, ciphertext, plaintextSize);
     }
 
-    // free memory allocated by getline() and malloc()
     free(plaintext);
     free(key);
     free(ciphertext);
+    return cipherResult == CIPHER_OK;
+}
 
-    // close files
-    fclose(keyFile);
-    if(postMode == true){
-        fclose(plaintextFile);
+/*******************************************************************************
+ *                                  batchGet                                   *
+ * This function sends a 'get' in batch mode, after adding it to the queue of  *
+ * 'get's for receiveAnswers() to read the answer to. False is returned if the *
+ * key has a problem, in which case nothing is sent.                           *
+ ******************************************************************************/
+bool batchGet(struct pendingQueue* queue, const char* user, const char* keyName){
+    struct pendingRequest* get;         // the 'get' being sent
+
+    get = malloc(sizeof(struct pendingRequest));
+    if(get == NULL) error("otp ERROR on malloc");
+    get->mode = MODE_GET;
+
+    // check key for bad characters before the ciphertext is used up
+    get->key = readLineFile(keyName, &get->keySize);
+    if(get->key == NULL){
+        fprintf(stderr, "otp ERROR: can't read \"%s\"\n", keyName);
+        free(get);
+        return false;
     }
+    if(!validText(get->key, get->keySize)){
+        fprintf(stderr, "otp ERROR: \"%s\" has bad characters\n", keyName);
+        free(get->key);
+        free(get);
+        return false;
+    }
+    get->user = strdup(user);
+    get->keyName = strdup(keyName);
+    if(get->user == NULL || get->keyName == NULL) error("otp ERROR on malloc");
 
-    // close socket
-    close(socketFD);
+    queueRequest(queue, get);
+    checkStatus(&queue->conn, otpSendRequest(&queue->conn, MODE_GET, user, NULL, 0), "otp ERROR writing to socket");
+    return true;
+}
 
-    return 0;
+/*******************************************************************************
+ *                                  queueRequest                               *
+ * This function adds a request to the back of the queue for receiveAnswers(). *
+ * Requests are queued before they're sent, so the answer never arrives first. *
+ ******************************************************************************/
+void queueRequest(struct pendingQueue* queue, struct pendingRequest* request){
+    request->next = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if(queue->tail == NULL) queue->head = request;
+    else queue->tail->next = request;
+    queue->tail = request;
+    pthread_cond_signal(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
 }
 
 /*******************************************************************************
- *                                  sendAll                                    *
- * This function makes sure all of the data in a buffer is sent. If the        *
- * connection is interrupted, send() will be called again until all the data is*
- * sent, in which case 'true' is returned.                                     *
- * Adapted from:                                                               *
- * https://stackoverflow.com/questions/13479760/c-socket-recv-and-send-all-data
+ *                                  receiveAnswers                             *
+ * This function is run by a thread in batch mode. It reads the answer to each *
+ * request in the order they were sent, reporting posts that weren't stored    *
+ * and printing the decrypted plaintext of each 'get'. Once every request has  *
+ * been sent and answered, it waits for otp_d to close the connection.         *
  ******************************************************************************/
-bool sendAll(int socket, void* buffer, size_t length){
-    char* ptr = (char*)buffer;  // initialize a pointer to the start of the buffer
-    
-    // once length is 0, all of the data from the buffer has been sent
-    while(length > 0){
-        ssize_t i = send(socket, ptr, length, 0);
-        if(i < 1){
-            return false;
+void* receiveAnswers(void* arg){
+    struct pendingQueue* queue = arg;
+    struct pendingRequest* get;         // the request the next answer is for
+    enum otpStatus status;              // how the answer to the request went
+    char* ciphertext;                   // the ciphertext received from otp_d, decrypted in place
+    size_t ciphertextSize;              // size of the ciphertext
+
+    while(true){
+        pthread_mutex_lock(&queue->lock);
+        while(queue->head == NULL && !queue->done) pthread_cond_wait(&queue->changed, &queue->lock);
+        get = queue->head;
+        if(get != NULL){
+            queue->head = get->next;
+            if(queue->head == NULL) queue->tail = NULL;
+        }
+        pthread_mutex_unlock(&queue->lock);
+        if(get == NULL) break;
+
+        // a post is answered once it's stored, otp_d closes the connection if it can't be
+        if(get->mode == MODE_POST){
+            status = otpRecvAck(&queue->conn);
+            if(status == OTP_BUSY) reportBusy(queue->conn.retryAfter);
+            if(status != OTP_OK){
+                fprintf(stderr, "otp ERROR: otp_d didn't store the post for user \"%s\"\n", get->user);
+                queue->failures++;
+            }
+            free(get->user);
+            free(get);
+            continue;
+        }
+
+        // find out whether there's a ciphertext for the user
+        status = otpRecvAnswer(&queue->conn, &ciphertextSize);
+        if(status == OTP_EMPTY){
+            fprintf(stderr, "otp ERROR: no ciphertext for user \"%s\"\n", get->user);
+            queue->failures++;
+        }
+        else{
+            // receive the ciphertext from otp_d
+            checkStatus(&queue->conn, status, "otp ERROR reading from socket");
+            ciphertext = malloc(ciphertextSize + 1);
+            if(ciphertext == NULL) error("otp ERROR on malloc");
+            checkStatus(&queue->conn, otpRecvBody(&queue->conn, ciphertext, ciphertextSize),
+                        "otp ERROR reading from socket");
+
+            // turn the ciphertext into plaintext in place with the key, the key has already been checked
+            if(!unpackCiphertext(&ciphertext, &ciphertextSize)){
+                fprintf(stderr, "otp ERROR: the ciphertext for user \"%s\" has bad characters\n", get->user);
+                queue->failures++;
+            }
+            else if(get->keySize < ciphertextSize){
+                fprintf(stderr, "otp ERROR: \"%s\" not long enough for the ciphertext\n", get->keyName);
+                queue->failures++;
+            }
+            else if(decryptText(ciphertext, get->key, ciphertext, ciphertextSize) != CIPHER_OK){
+                fprintf(stderr, "otp ERROR: the ciphertext for user \"%s\" has bad characters\n", get->user);
+                queue->failures++;
+            }
+            else{
+                // print the plaintext followed by a newline
+                ciphertext[ciphertextSize] = '\0';
+                printf("%s\n", ciphertext);
+                fflush(stdout);
+            }
+            free(ciphertext);
         }
-        ptr += i;               // move pointer ahead by the number of bytes sent
-        length -= i;
+
+        free(get->user);
+        free(get->keyName);
+        free(get->key);
+        free(get);
     }
-    return true;
+
+    // otp_d closes the connection once it has handled every request, or sooner if one failed
+    status = otpWaitForClose(&queue->conn);
+    if(status == OTP_BUSY) reportBusy(queue->conn.retryAfter);
+    if(status != OTP_OK){
+        fprintf(stderr, "otp ERROR: otp_d didn't finish the batch\n");
+        queue->failures++;
+    }
+    return NULL;
 }
 
 /*******************************************************************************
- *                                  recvAll                                    *
- * This function makes sure all of the data in a buffer is received. If the    *
- * connection is interrupted, recv() will be called again until all the data is*
- * received, in which case 'true' is returned.                                 *
- * Adapted from:                                                               *
- * https://stackoverflow.com/questions/13479760/c-socket-recv-and-send-all-data
+ *                                  runDrain                                   *
+ * This function takes all of a user's ciphertexts in one request and prints  *
+ * each one as soon as it's decrypted, with its own key file, or with its own  *
+ * slice of the pad if padName isn't NULL. Without a pad no more are taken     *
+ * than there are keys, since a ciphertext that can't be decrypted is gone for *
+ * good. A ciphertext with a problem is reported and the rest are still        *
+ * printed. The return value is the exit status for otp.                       *
  ******************************************************************************/
-bool recvAll(int socket, void* buffer, size_t length){
-    char* ptr = (char*)buffer;  // initialize a pointer to the start of the buffer
-    
-    // once length is 0, all of the data from the buffer has been received
-    while(length > 0){
-        ssize_t i = recv(socket, ptr, length, 0);
-        if(i < 1){
+int runDrain(const char* user, char** keyNames, int numKeys, const char* padName, uint64_t maxCount,
+             uint64_t maxBytes, int portNumber){
+    struct otpConnection conn;          // the connection to otp_d
+    struct pad pad;                     // the memory-mapped pad, if there is one
+    enum otpStatus status;              // OTP_EMPTY once the drain is over
+    char* ciphertext;                   // each ciphertext received from otp_d, decrypted in place
+    size_t ciphertextSize;              // size of the ciphertext
+    uint64_t numDrained = 0;            // how many ciphertexts have arrived
+    int failures = 0;                   // how many of them couldn't be decrypted
+
+    if(padName != NULL && !openPad(&pad, padName)) error("otp ERROR opening pad file\n");
+    if(padName == NULL && (maxCount == 0 || maxCount > (uint64_t)numKeys)) maxCount = numKeys;
+
+    connectToServer(&conn, portNumber);
+    checkStatus(&conn, otpSendDrain(&conn, user, maxCount, maxBytes), "otp ERROR writing to socket");
+    while((status = otpRecvDrained(&conn, &ciphertext, &ciphertextSize)) == OTP_OK){
+        if(!decryptDrained(user, ciphertext, ciphertextSize, padName == NULL ? keyNames[numDrained] : padName,
+                           padName == NULL ? NULL : &pad)){
+            failures++;
+        }
+        numDrained++;
+        free(ciphertext);
+    }
+    checkStatus(&conn, status == OTP_EMPTY ? OTP_OK : status, "otp ERROR reading from socket");
+
+    if(numDrained == 0){
+        fprintf(stderr, "otp ERROR: no ciphertext for user \"%s\"\n", user);
+        failures++;
+    }
+    if(padName != NULL) closePad(&pad);
+    otpClose(&conn);
+    return failures > 0 ? 1 : 0;
+}
+
+/*******************************************************************************
+ *                                  decryptDrained                             *
+ * This function decrypts one ciphertext of a drain in place and prints it     *
+ * followed by a newline. With a pad the slice named by the ciphertext's       *
+ * offset header is used, otherwise the key in the file keyName. It returns    *
+ * false, having said why, if the ciphertext couldn't be decrypted.            *
+ ******************************************************************************/
+bool decryptDrained(const char* user, char* ciphertext, size_t ciphertextSize, const char* keyName,
+                    const struct pad* pad){
+    char* key = NULL;                   // the key read from keyName, without a pad
+    const char* slice;                  // where the ciphertext's key starts
+    size_t keySize;                     // how much key there is from there
+    size_t offset;                      // where the ciphertext's slice of the pad starts
+    enum cipherResult cipherResult;     // whether the ciphertext and key were good
+
+    if(pad != NULL){
+        // find the slice of the pad the ciphertext was made with
+        if(ciphertextSize < PAD_HEADER_SIZE || !decodePadOffset(ciphertext, &offset)){
+            fprintf(stderr, "otp ERROR: the ciphertext for user \"%s\" wasn't made with a pad\n", user);
             return false;
         }
-        ptr += i;               // move pointer ahead by the number of bytes received
-        length -= i;
+        ciphertext += PAD_HEADER_SIZE;
+        ciphertextSize -= PAD_HEADER_SIZE;
+        slice = offset <= pad->size ? pad->text + offset : NULL;
+        keySize = offset <= pad->size ? pad->size - offset : 0;
     }
+    else{
+        key = readLineFile(keyName, &keySize);
+        if(key == NULL){
+            perror("otp ERROR opening key file");
+            return false;
+        }
+        slice = key;
+    }
+
+    if(keySize < ciphertextSize){
+        fprintf(stderr, "otp ERROR: \"%s\" not long enough for the ciphertext\n", keyName);
+        free(key);
+        return false;
+    }
+    cipherResult = decryptText(ciphertext, slice, ciphertext, ciphertextSize);
+    free(key);
+    if(cipherResult == CIPHER_BAD_TEXT){
+        fprintf(stderr, "otp ERROR: the ciphertext for user \"%s\" has bad characters\n", user);
+        return false;
+    }
+    if(cipherResult == CIPHER_BAD_KEY){
+        fprintf(stderr, "otp ERROR: \"%s\" has bad characters\n", keyName);
+        return false;
+    }
+
+    // print the plaintext followed by a newline, otpRecvDrained() null terminated it
+    printf("%s\n", ciphertext);
+    fflush(stdout);
+    return true;
+}
+
+/*******************************************************************************
+ *                                  parseLimit                                 *
+ * This function reads a whole command line argument as a limit for a drain.  *
+ * It returns false if it isn't a number.                                      *
+ ******************************************************************************/
+bool parseLimit(const char* text, uint64_t* limit){
+    char* endPtr;                       // points to the end of the number
+    unsigned long long number;
+
+    errno = 0;
+    number = strtoull(text, &endPtr, 10);
+    if(errno != 0 || endPtr == text || *endPtr != '\0' || text[0] == '-') return false;
+    *limit = number;
     return true;
 }
+
+/*******************************************************************************
+ *                                  showStats                                  *
+ * This function asks otp_d for a snapshot of its counters and prints it as it *
+ * was sent, one "name value" per line.                                        *
+ ******************************************************************************/
+void showStats(int portNumber){
+    struct otpConnection conn;      // the connection to otp_d
+    char* text;                     // the snapshot sent from otp_d
+    size_t textSize;                // the size of the snapshot
+
+    connectToServer(&conn, portNumber);
+    checkStatus(&conn, otpStats(&conn, &text, &textSize), "otp ERROR: otp_d didn't send its stats");
+    fwrite(text, sizeof(char), textSize, stdout);
+    fflush(stdout);
+
+    free(text);
+    otpClose(&conn);
+}
@@ -0,0 +1,616 @@
+/*******************************************************************************
+** Program name: otp_async.c
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  Functions for the asynchronous client API, see otp_async.h.
+**               Each connection keeps the requests it hasn't sent yet in one
+**               buffer, so everything queued since the last run goes out in
+**               one send(), and reads its answers into another, taking them
+**               apart a piece at a time however they arrive. A finished
+**               request is put on a list and its callback only runs once the
+**               sockets have all been dealt with, so a callback can queue
+**               more requests without getting in the way of the receiving.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include "otp_cipher.h"
+#include "otp_async.h"
+
+#define ASYNC_EVENTS 64                 // the most events one otpAsyncRun() takes from epoll at once
+
+// function prototypes:
+static enum otpStatus queueRequest(struct otpAsync* async, char mode, const char* user, const char* body,
+                                   size_t bodySize, void (*callback)(void* arg, struct otpAsyncResult* result),
+                                   void* arg);
+static struct asyncConnection* pickConnection(struct otpAsync* async);
+static uint64_t monotonicMilliseconds(void);
+static bool openConnection(struct otpAsync* async, struct asyncConnection* conn);
+static char* reserveOutput(struct asyncConnection* conn, size_t size);
+static void watchOutput(struct otpAsync* async, struct asyncConnection* conn, bool watch);
+static void sendOutput(struct otpAsync* async, struct asyncConnection* conn);
+static void receiveInput(struct otpAsync* async, struct asyncConnection* conn);
+static bool handleInput(struct otpAsync* async, struct asyncConnection* conn, size_t size);
+static bool startAnswer(struct otpAsync* async, struct asyncConnection* conn);
+static void finishGet(struct otpAsync* async, struct asyncConnection* conn);
+static void finishRequest(struct otpAsync* async, struct asyncConnection* conn, enum otpStatus status, int error);
+static void failConnection(struct otpAsync* async, struct asyncConnection* conn, enum otpStatus status, int error,
+                           uint64_t retryAfter);
+static int runCallbacks(struct otpAsync* async);
+
+/*******************************************************************************
+ *                                  otpAsyncOpen                               *
+ * This function gets an otpAsync ready to spread requests over up to          *
+ * numConnections connections to otp_d on the given port of host, or of this   *
+ * machine if host is NULL. Only looking the host up blocks, the connections   *
+ * are made without blocking as the requests need them. OTP_FAILED is returned *
+ * with errno set to EHOSTUNREACH if the host can't be found, or to EINVAL if  *
+ * numConnections isn't 1 to MAX_ASYNC_CONNECTIONS.                            *
+ ******************************************************************************/
+enum otpStatus otpAsyncOpen(struct otpAsync* async, const char* host, int portNumber, unsigned int numConnections){
+    struct addrinfo hints;
+    struct addrinfo* addresses;         // the addresses host was resolved to
+    char port[16];                      // the port number as text, for getaddrinfo()
+    int savedErrno;
+
+    memset(async, 0, sizeof(*async));
+    async->epollFD = -1;
+    if(numConnections < 1 || numConnections > MAX_ASYNC_CONNECTIONS){
+        errno = EINVAL;
+        return OTP_FAILED;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;          // otp_d only listens on IPv4
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", portNumber);
+    if(getaddrinfo(host != NULL ? host : "localhost", port, &hints, &addresses) != 0){
+        errno = EHOSTUNREACH;
+        return OTP_FAILED;
+    }
+    memcpy(&async->address, addresses->ai_addr, addresses->ai_addrlen);
+    async->addressSize = addresses->ai_addrlen;
+    freeaddrinfo(addresses);
+
+    async->epollFD = epoll_create1(0);
+    async->connections = calloc(numConnections, sizeof(struct asyncConnection));
+    if(async->epollFD < 0 || async->connections == NULL){
+        savedErrno = errno;
+        otpAsyncClose(async);
+        errno = savedErrno;
+        return OTP_FAILED;
+    }
+    async->numConnections = numConnections;
+
+    // every connection is marked closed before an allocation can fail, so otpAsyncClose()
+    // doesn't close descriptor 0 for the ones that weren't reached
+    for(unsigned int i = 0; i < numConnections; i++){
+        async->connections[i].fd = -1;
+    }
+    for(unsigned int i = 0; i < numConnections; i++){
+        async->connections[i].input = malloc(ASYNC_INPUT_SIZE);
+        if(async->connections[i].input == NULL){
+            otpAsyncClose(async);
+            errno = ENOMEM;
+            return OTP_FAILED;
+        }
+    }
+    return OTP_OK;
+}
+
+/*******************************************************************************
+ *                                  otpAsyncClose                              *
+ * This function closes every connection and frees everything otpAsyncOpen()   *
+ * set up. The callback of each request still waiting is run first, with       *
+ * OTP_FAILED and errno set to ECANCELED, so whatever it was given can be      *
+ * freed. A post among them may have been stored anyway. It mustn't be called  *
+ * from a callback.                                                            *
+ ******************************************************************************/
+void otpAsyncClose(struct otpAsync* async){
+    for(unsigned int i = 0; i < async->numConnections; i++){
+        failConnection(async, &async->connections[i], OTP_FAILED, ECANCELED, 0);
+        free(async->connections[i].output);
+        free(async->connections[i].input);
+    }
+    runCallbacks(async);
+    free(async->connections);
+    async->connections = NULL;
+    async->numConnections = 0;
+    if(async->epollFD >= 0) close(async->epollFD);
+    async->epollFD = -1;
+}
+
+/*******************************************************************************
+ *                                  otpAsyncPost                               *
+ * This function queues a post of a ciphertext for a user, packed first if the *
+ * flags have FLAG_PACKED. The ciphertext is copied, so its buffer can be used *
+ * again straight away. The callback is given OTP_OK once otp_d says the post  *
+ * is stored. OTP_FAILED is returned, with errno set and without the callback  *
+ * ever being run, if the post couldn't be queued.                             *
+ ******************************************************************************/
+enum otpStatus otpAsyncPost(struct otpAsync* async, const char* user, const char* ciphertext, size_t ciphertextSize,
+                            void (*callback)(void* arg, struct otpAsyncResult* result), void* arg){
+    return queueRequest(async, MODE_POST, user, ciphertext, ciphertextSize, callback, arg);
+}
+
+/*******************************************************************************
+ *                                  otpAsyncGet                                *
+ * This function queues a get of the oldest ciphertext for a user. The         *
+ * callback is given OTP_OK with the ciphertext, unpacked if it was packed     *
+ * unless the flags have FLAG_BINARY, or OTP_EMPTY if the user had none.       *
+ * OTP_FAILED is returned the same way as for otpAsyncPost().                  *
+ ******************************************************************************/
+enum otpStatus otpAsyncGet(struct otpAsync* async, const char* user,
+                           void (*callback)(void* arg, struct otpAsyncResult* result), void* arg){
+    return queueRequest(async, MODE_GET, user, NULL, 0, callback, arg);
+}
+
+/*******************************************************************************
+ *                                  otpAsyncRun                                *
+ * This function waits up to timeout milliseconds (-1 for as long as it takes, *
+ * 0 for not at all) for any connection to be ready, sends and receives all it *
+ * can on each one that is, and then runs the callback of every request that   *
+ * finished. It returns how many did, or -1 with errno set if epoll failed.    *
+ ******************************************************************************/
+int otpAsyncRun(struct otpAsync* async, int timeout){
+    struct epoll_event events[ASYNC_EVENTS];
+    struct asyncConnection* conn;       // the connection an event is for
+    int numEvents;                      // how many events epoll_wait() returned
+    int error;                          // the result of a non-blocking connect()
+    socklen_t errorSize;
+
+    numEvents = epoll_wait(async->epollFD, events, ASYNC_EVENTS, timeout);
+    if(numEvents < 0) return errno == EINTR ? 0 : -1;
+
+    for(int i = 0; i < numEvents; i++){
+        conn = events[i].data.ptr;
+
+        // a connection that was being made is ready once it can be written to, or has failed
+        if(conn->connecting && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))){
+            error = 0;
+            errorSize = sizeof(error);
+            if(getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &errorSize) < 0) error = errno;
+            if(error != 0){
+                failConnection(async, conn, OTP_FAILED, error, 0);
+                continue;
+            }
+            conn->connecting = false;
+        }
+
+        if(!conn->connecting && (events[i].events & EPOLLOUT)) sendOutput(async, conn);
+        if(conn->fd >= 0 && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) receiveInput(async, conn);
+    }
+    return runCallbacks(async);
+}
+
+/*******************************************************************************
+ *                                  otpAsyncFd                                 *
+ * This function returns a descriptor that's readable whenever otpAsyncRun()   *
+ * has something to do, for waiting on along with the caller's own.            *
+ ******************************************************************************/
+int otpAsyncFd(const struct otpAsync* async){
+    return async->epollFD;
+}
+
+/*******************************************************************************
+ *                                  otpAsyncPending                            *
+ * This function returns how many requests are queued or sent and haven't had  *
+ * their callbacks run yet.                                                    *
+ ******************************************************************************/
+size_t otpAsyncPending(const struct otpAsync* async){
+    return async->pending;
+}
+
+/*******************************************************************************
+ *                                  queueRequest                               *
+ * This function adds a request to the output of the least busy connection,    *
+ * connecting it first if it isn't, and has epoll watch for room to send it.   *
+ * Posts ask to be answered once they're stored, the same as otpSendRequest()  *
+ * makes them.                                                                 *
+ ******************************************************************************/
+static enum otpStatus queueRequest(struct otpAsync* async, char mode, const char* user, const char* body,
+                                   size_t bodySize, void (*callback)(void* arg, struct otpAsyncResult* result),
+                                   void* arg){
+    struct asyncConnection* conn = pickConnection(async);
+    struct asyncRequest* request;       // the request being queued
+    bool pack = mode == MODE_POST && (async->flags & FLAG_PACKED) && !(async->flags & FLAG_BINARY);
+    uint32_t flags = async->flags | (mode == MODE_POST ? FLAG_ACK : 0);
+    struct requestHeader header = {PROTOCOL_VERSION, mode, flags, strlen(user), pack ? packedSize(bodySize) : bodySize};
+    char* output;                       // where the request goes in the connection's output
+
+    if(conn->fd < 0 && !openConnection(async, conn)) return OTP_FAILED;
+    request = calloc(1, sizeof(struct asyncRequest));
+    output = reserveOutput(conn, REQUEST_HEADER_SIZE + header.userSize + header.bodySize);
+    if(request == NULL || output == NULL){
+        free(request);
+        errno = ENOMEM;
+        return OTP_FAILED;
+    }
+
+    encodeRequestHeader(&header, (unsigned char*)output);
+    memcpy(output + REQUEST_HEADER_SIZE, user, header.userSize);
+    if(pack){
+        packText(body, bodySize, output + REQUEST_HEADER_SIZE + header.userSize);
+    }
+    else if(bodySize > 0){
+        memcpy(output + REQUEST_HEADER_SIZE + header.userSize, body, bodySize);
+    }
+    conn->outputSize += REQUEST_HEADER_SIZE + header.userSize + header.bodySize;
+
+    // the answers come back in the order the requests were sent
+    request->mode = mode;
+    request->callback = callback;
+    request->arg = arg;
+    if(conn->tail != NULL) conn->tail->next = request;
+    else conn->head = request;
+    conn->tail = request;
+    conn->pending++;
+    async->pending++;
+
+    if(!conn->watchingOutput) watchOutput(async, conn, true);
+    return OTP_OK;
+}
+
+/*******************************************************************************
+ *                                  pickConnection                             *
+ * This function returns the connection with the fewest requests waiting,      *
+ * starting the search after the last one picked so ties are dealt out in      *
+ * turn. A connection otp_d turned away is skipped until it said to try again, *
+ * unless they all are.                                                        *
+ ******************************************************************************/
+static struct asyncConnection* pickConnection(struct otpAsync* async){
+    unsigned int best = async->nextConnection; // the least busy connection found so far
+    bool found = false;                 // true once a connection that isn't waiting has been found
+    uint64_t now = monotonicMilliseconds();
+    struct asyncConnection* conn;
+    unsigned int index;
+
+    for(unsigned int i = 0; i < async->numConnections; i++){
+        index = (async->nextConnection + i) % async->numConnections;
+        conn = &async->connections[index];
+        if(conn->fd < 0 && conn->retryAt > now) continue;
+        if(!found || conn->pending < async->connections[best].pending) best = index;
+        found = true;
+    }
+    async->nextConnection = (best + 1) % async->numConnections;
+    return &async->connections[best];
+}
+
+/*******************************************************************************
+ *                                  monotonicMilliseconds                      *
+ * This function returns the time on CLOCK_MONOTONIC in milliseconds.          *
+ ******************************************************************************/
+static uint64_t monotonicMilliseconds(void){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*******************************************************************************
+ *                                  openConnection                             *
+ * This function starts a non-blocking connect() to otp_d and adds the socket  *
+ * to epoll, watching for it to be writable, which is when the connect() has   *
+ * finished. False is returned with errno set if it couldn't be started.       *
+ ******************************************************************************/
+static bool openConnection(struct otpAsync* async, struct asyncConnection* conn){
+    struct epoll_event event;
+    int noDelay = 1;                    // requests are already gathered into one send()
+    int savedErrno;
+
+    conn->fd = socket(async->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(conn->fd < 0) return false;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    event.events = EPOLLIN | EPOLLOUT;
+    event.data.ptr = conn;
+    if((connect(conn->fd, (struct sockaddr*)&async->address, async->addressSize) < 0 && errno != EINPROGRESS) ||
+       epoll_ctl(async->epollFD, EPOLL_CTL_ADD, conn->fd, &event) < 0){
+        savedErrno = errno;
+        close(conn->fd);
+        conn->fd = -1;
+        errno = savedErrno;
+        return false;
+    }
+    conn->connecting = true;
+    conn->watchingOutput = true;
+    return true;
+}
+
+/*******************************************************************************
+ *                                  reserveOutput                              *
+ * This function makes room for size more bytes at the end of a connection's   *
+ * output and returns where they go, or NULL if there's no memory. What's      *
+ * already been sent is dropped from the front first.                          *
+ ******************************************************************************/
+static char* reserveOutput(struct asyncConnection* conn, size_t size){
+    size_t capacity = conn->outputCapacity > 0 ? conn->outputCapacity : 4096; // the new size of output
+    char* output;
+
+    memmove(conn->output, conn->output + conn->outputSent, conn->outputSize - conn->outputSent);
+    conn->outputSize -= conn->outputSent;
+    conn->outputSent = 0;
+
+    while(capacity - conn->outputSize < size){
+        if(capacity > SIZE_MAX / 2) return NULL;
+        capacity *= 2;
+    }
+    if(capacity != conn->outputCapacity){
+        output = realloc(conn->output, capacity);
+        if(output == NULL) return NULL;
+        conn->output = output;
+        conn->outputCapacity = capacity;
+    }
+    return conn->output + conn->outputSize;
+}
+
+/*******************************************************************************
+ *                                  watchOutput                                *
+ * This function tells epoll whether to say when a connection has room to      *
+ * send. It only needs to while there's output waiting, otherwise a socket     *
+ * with room would wake otpAsyncRun() every time.                              *
+ ******************************************************************************/
+static void watchOutput(struct otpAsync* async, struct asyncConnection* conn, bool watch){
+    struct epoll_event event;
+
+    event.events = EPOLLIN | (watch ? EPOLLOUT : 0);
+    event.data.ptr = conn;
+    epoll_ctl(async->epollFD, EPOLL_CTL_MOD, conn->fd, &event);
+    conn->watchingOutput = watch;
+}
+
+/*******************************************************************************
+ *                                  sendOutput                                 *
+ * This function sends as much of a connection's output as the socket takes.   *
+ * If the send fails, otp_d may have turned the connection away as busy, so    *
+ * whatever it sent is received before the connection is failed.               *
+ ******************************************************************************/
+static void sendOutput(struct otpAsync* async, struct asyncConnection* conn){
+    ssize_t sent;
+    int savedErrno;
+
+    while(conn->outputSent < conn->outputSize){
+        sent = send(conn->fd, conn->output + conn->outputSent, conn->outputSize - conn->outputSent, MSG_NOSIGNAL);
+        if(sent < 0 && errno == EINTR) continue;
+        if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if(sent < 0){
+            savedErrno = errno;
+            receiveInput(async, conn);
+            if(conn->fd >= 0) failConnection(async, conn, OTP_FAILED, savedErrno, 0);
+            return;
+        }
+        conn->outputSent += sent;
+    }
+    conn->outputSize = 0;
+    conn->outputSent = 0;
+    watchOutput(async, conn, false);
+}
+
+/*******************************************************************************
+ *                                  receiveInput                               *
+ * This function receives everything waiting on a connection and hands it to   *
+ * handleInput(). The rest of a body too big for the input buffer is received  *
+ * straight into the body instead. If otp_d closed the connection or it        *
+ * failed, every request still waiting on it fails.                            *
+ ******************************************************************************/
+static void receiveInput(struct otpAsync* async, struct asyncConnection* conn){
+    ssize_t received;
+
+    while(true){
+        if(conn->inBody && conn->bodySize - conn->bodyReceived >= ASYNC_INPUT_SIZE){
+            received = recv(conn->fd, conn->body + conn->bodyReceived, conn->bodySize - conn->bodyReceived, 0);
+            if(received > 0){
+                conn->bodyReceived += received;
+                if(conn->bodyReceived == conn->bodySize) finishGet(async, conn);
+                continue;
+            }
+        }
+        else{
+            received = recv(conn->fd, conn->input, ASYNC_INPUT_SIZE, 0);
+            if(received > 0){
+                if(!handleInput(async, conn, received)) return;
+                continue;
+            }
+        }
+        if(received < 0 && errno == EINTR) continue;
+        if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        failConnection(async, conn, OTP_FAILED, received == 0 ? ECONNRESET : errno, 0);
+        return;
+    }
+}
+
+/*******************************************************************************
+ *                                  handleInput                                *
+ * This function takes apart the size bytes just received into a connection's  *
+ * input, which can end part way through a header or a body. The part that     *
+ * has arrived is kept in the header or the body until the rest does. False is *
+ * returned if the connection failed.                                          *
+ ******************************************************************************/
+static bool handleInput(struct otpAsync* async, struct asyncConnection* conn, size_t size){
+    const char* input = conn->input;    // what hasn't been handled yet
+    size_t length;                      // how much of it goes in the header or body
+
+    while(size > 0){
+        if(!conn->inBody){
+            length = RESPONSE_HEADER_SIZE - conn->headerReceived;
+            if(length > size) length = size;
+            memcpy(conn->header + conn->headerReceived, input, length);
+            conn->headerReceived += length;
+            if(conn->headerReceived < RESPONSE_HEADER_SIZE) return true;
+            conn->headerReceived = 0;
+            if(!startAnswer(async, conn)) return false;
+        }
+        else{
+            length = conn->bodySize - conn->bodyReceived;
+            if(length > size) length = size;
+            memcpy(conn->body + conn->bodyReceived, input, length);
+            conn->bodyReceived += length;
+        }
+        input += length;
+        size -= length;
+        if(conn->inBody && conn->bodyReceived == conn->bodySize) finishGet(async, conn);
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                                  startAnswer                                *
+ * This function reads a response header that has just arrived. It finishes a  *
+ * post or an empty get, or gets ready to receive a get's ciphertext. A busy   *
+ * header fails every request on the connection with OTP_BUSY, and anything    *
+ * the request doesn't expect fails them with EPROTO. False is returned if the *
+ * connection failed.                                                          *
+ ******************************************************************************/
+static bool startAnswer(struct otpAsync* async, struct asyncConnection* conn){
+    struct responseHeader response;
+    struct asyncRequest* request = conn->head; // the request the answer is for
+
+    if(!decodeResponseHeader(conn->header, &response)){
+        failConnection(async, conn, OTP_FAILED, EPROTO, 0);
+        return false;
+    }
+    if(response.status == STATUS_BUSY){
+        conn->retryAt = monotonicMilliseconds() + response.bodySize;
+        failConnection(async, conn, OTP_BUSY, 0, response.bodySize);
+        return false;
+    }
+    if(request == NULL || (request->mode == MODE_POST && (response.status != 's' || response.bodySize != 0)) ||
+       (response.status != 's' && response.status != 'f')){
+        failConnection(async, conn, OTP_FAILED, EPROTO, 0);
+        return false;
+    }
+
+    if(request->mode == MODE_POST){
+        finishRequest(async, conn, OTP_OK, 0);
+    }
+    else if(response.status == 'f'){
+        finishRequest(async, conn, OTP_EMPTY, 0);
+    }
+    else{
+        conn->body = response.bodySize < SIZE_MAX ? malloc(response.bodySize + 1) : NULL;
+        if(conn->body == NULL){
+            failConnection(async, conn, OTP_FAILED, ENOMEM, 0);
+            return false;
+        }
+        conn->bodySize = response.bodySize;
+        conn->bodyReceived = 0;
+        conn->inBody = true;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                                  finishGet                                  *
+ * This function hands a get's ciphertext, now that all of it has arrived, to  *
+ * its request. A packed one is unpacked first unless the flags have           *
+ * FLAG_BINARY, and if the packing is bad the request fails with EPROTO.       *
+ ******************************************************************************/
+static void finishGet(struct otpAsync* async, struct asyncConnection* conn){
+    struct otpAsyncResult* result = &conn->head->result; // what the get's callback is given
+    char* unpacked;                     // the characters packed in the ciphertext
+    int error;                          // why unpacking failed
+
+    conn->body[conn->bodySize] = '\0';
+    result->ciphertext = conn->body;
+    result->ciphertextSize = conn->bodySize;
+    conn->body = NULL;
+    conn->inBody = false;
+
+    if(!(async->flags & FLAG_BINARY) && result->ciphertextSize > 0 && result->ciphertext[0] == PACKED_MARKER){
+        unpacked = malloc(unpackedSize(result->ciphertextSize) + 1);
+        error = unpacked == NULL ? ENOMEM : EPROTO;
+        if(unpacked == NULL || !unpackText(result->ciphertext, result->ciphertextSize, unpacked,
+                                           &result->ciphertextSize)){
+            free(unpacked);
+            free(result->ciphertext);
+            result->ciphertext = NULL;
+            result->ciphertextSize = 0;
+            finishRequest(async, conn, OTP_FAILED, error);
+            return;
+        }
+        unpacked[result->ciphertextSize] = '\0';
+        free(result->ciphertext);
+        result->ciphertext = unpacked;
+    }
+    finishRequest(async, conn, OTP_OK, 0);
+}
+
+/*******************************************************************************
+ *                                  finishRequest                              *
+ * This function takes the oldest request off a connection and puts it on the  *
+ * list of those whose callbacks are waiting to be run.                        *
+ ******************************************************************************/
+static void finishRequest(struct otpAsync* async, struct asyncConnection* conn, enum otpStatus status, int error){
+    struct asyncRequest* request = conn->head; // the request that finished
+
+    conn->head = request->next;
+    if(conn->head == NULL) conn->tail = NULL;
+    conn->pending--;
+
+    request->result.status = status;
+    request->error = error;
+    request->next = NULL;
+    if(async->doneTail != NULL) async->doneTail->next = request;
+    else async->doneHead = request;
+    async->doneTail = request;
+}
+
+/*******************************************************************************
+ *                                  failConnection                             *
+ * This function closes a connection and fails every request waiting on it,    *
+ * with retryAfter for OTP_BUSY or error as the errno for OTP_FAILED. The next *
+ * request given to the connection connects it again.                          *
+ ******************************************************************************/
+static void failConnection(struct otpAsync* async, struct asyncConnection* conn, enum otpStatus status, int error,
+                           uint64_t retryAfter){
+    if(conn->fd >= 0) close(conn->fd);
+    conn->fd = -1;
+    conn->connecting = false;
+    conn->watchingOutput = false;
+    conn->outputSize = 0;
+    conn->outputSent = 0;
+    conn->headerReceived = 0;
+    free(conn->body);
+    conn->body = NULL;
+    conn->inBody = false;
+
+    while(conn->head != NULL){
+        conn->head->result.retryAfter = retryAfter;
+        finishRequest(async, conn, status, error);
+    }
+}
+
+/*******************************************************************************
+ *                                  runCallbacks                               *
+ * This function runs the callback of every finished request, oldest first,    *
+ * with errno set for OTP_FAILED, and frees the requests. It returns how many  *
+ * there were.                                                                 *
+ ******************************************************************************/
+static int runCallbacks(struct otpAsync* async){
+    struct asyncRequest* request;       // the request whose callback is run
+    int count = 0;
+
+    while(async->doneHead != NULL){
+        request = async->doneHead;
+        async->doneHead = request->next;
+        if(async->doneHead == NULL) async->doneTail = NULL;
+        async->pending--;
+
+        errno = request->error;
+        request->callback(request->arg, &request->result);
+        free(request);
+        count++;
+    }
+    return count;
+}
@@ -0,0 +1,113 @@
+/*******************************************************************************
+** Program name: otp_async.h
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  Declarations for the asynchronous client API, for a program
+**               that wants many posts and gets to otp_d in flight at once
+**               from a single thread. Where otp_client.h blocks on each call,
+**               here a post or get is only queued, along with a callback to
+**               tell when it's done, and otpAsyncRun() does the sending and
+**               receiving for every request whenever the sockets are ready.
+**
+**               Requests are pipelined on a few non-blocking connections,
+**               each new one going to the connection with the fewest waiting,
+**               and otp_d answers each connection's requests in the order
+**               they were sent. Requests on different connections can be
+**               handled in either order, so a get is only sure to find a post
+**               whose callback has already run.
+**
+**               otpAsyncFd() is an epoll descriptor that's readable whenever
+**               otpAsyncRun() has something to do, so the API can be driven by
+**               the caller's own poll() or epoll loop as well as by calling
+**               otpAsyncRun() with a timeout.
+**
+**               A connection that fails, or that otp_d turns away as busy,
+**               fails every request waiting on it and is connected again for
+**               the next request given to it. One turned away isn't given any
+**               until otp_d's retryAfter has passed, unless every connection
+**               is waiting. otp_d serves a connection until it closes, so with
+**               a forked otp_d there shouldn't be more connections than its
+**               --max-connections, or the ones left in its queue would never
+**               be served. Streamed requests, drains and stats are left to
+**               otp_client.h.
+*******************************************************************************/
+#ifndef OTP_ASYNC_H
+#define OTP_ASYNC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include "otp_client.h"
+#include "otp_protocol.h"
+
+#define MAX_ASYNC_CONNECTIONS 256       // the most connections one otpAsync can spread its requests over
+#define ASYNC_INPUT_SIZE 65536          // the size of each connection's receive buffer
+
+// what became of a request, handed to its callback
+struct otpAsyncResult {
+    enum otpStatus status;              // OTP_OK, OTP_EMPTY for a get that found nothing, OTP_BUSY or OTP_FAILED
+    uint64_t retryAfter;                // the milliseconds otp_d asked for with OTP_BUSY
+    char* ciphertext;                   // a get's ciphertext with a null terminator, the callback frees it
+    size_t ciphertextSize;              // the size of the ciphertext
+};
+
+// a request queued or sent whose answer hasn't arrived
+struct asyncRequest {
+    char mode;                          // MODE_POST or MODE_GET
+    void (*callback)(void* arg, struct otpAsyncResult* result); // told what became of the request
+    void* arg;                          // handed to the callback
+    struct otpAsyncResult result;       // filled in when the request finishes
+    int error;                          // the errno for the callback with OTP_FAILED
+    struct asyncRequest* next;          // the next request sent on the connection, or finished
+};
+
+// one of the non-blocking connections the requests are pipelined on
+struct asyncConnection {
+    int fd;                             // the connection's socket, -1 until it's needed again
+    bool connecting;                    // true until the non-blocking connect() has finished
+    bool watchingOutput;                // true while epoll is watching for room to send
+    char* output;                       // the requests waiting to be sent
+    size_t outputSize;                  // the bytes in output
+    size_t outputSent;                  // how many of them have been sent
+    size_t outputCapacity;              // the size of output
+    char* input;                        // ASYNC_INPUT_SIZE bytes for what's received, until it's handled
+    unsigned char header[RESPONSE_HEADER_SIZE]; // the response header being received
+    size_t headerReceived;              // how much of it has arrived
+    bool inBody;                        // true while the body of an answer is being received
+    char* body;                         // the body of the answer being received
+    size_t bodySize;                    // its size
+    size_t bodyReceived;                // how much of it has arrived
+    struct asyncRequest* head;          // the oldest request, the next answer is for it
+    struct asyncRequest* tail;          // the newest request
+    size_t pending;                     // the requests waiting for answers
+    uint64_t retryAt;                   // when otp_d said to try again after OTP_BUSY, in ms on CLOCK_MONOTONIC
+};
+
+// the connections and requests of the asynchronous API
+struct otpAsync {
+    int epollFD;                        // watches every connection, see otpAsyncFd()
+    struct sockaddr_storage address;    // where otp_d was found, for connecting again
+    socklen_t addressSize;              // the size of address
+    struct asyncConnection* connections; // the connections
+    unsigned int numConnections;        // how many there are
+    unsigned int nextConnection;        // where the search for the least busy connection starts
+    struct asyncRequest* doneHead;      // the oldest finished request whose callback hasn't run
+    struct asyncRequest* doneTail;      // the newest one
+    size_t pending;                     // the requests whose callbacks haven't run
+    uint32_t flags;                     // sent with every request, FLAG_BINARY, FLAG_PACKED or 0
+};
+
+// function prototypes:
+enum otpStatus otpAsyncOpen(struct otpAsync* async, const char* host, int portNumber, unsigned int numConnections);
+void otpAsyncClose(struct otpAsync* async);
+enum otpStatus otpAsyncPost(struct otpAsync* async, const char* user, const char* ciphertext, size_t ciphertextSize,
+                            void (*callback)(void* arg, struct otpAsyncResult* result), void* arg);
+enum otpStatus otpAsyncGet(struct otpAsync* async, const char* user,
+                           void (*callback)(void* arg, struct otpAsyncResult* result), void* arg);
+int otpAsyncRun(struct otpAsync* async, int timeout);
+int otpAsyncFd(const struct otpAsync* async);
+size_t otpAsyncPending(const struct otpAsync* async);
+
+#endif
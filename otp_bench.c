@@ -0,0 +1,644 @@
+/*******************************************************************************
+** Program name: otp_bench.c
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  This program is a load generator for measuring otp_d. It starts
+**               a number of posting clients and a number of getting clients,
+**               each a thread with its own connection to an otp_d already
+**               running on this machine, and times every request they send:
+**                    otp_bench [--posters N] [--getters N] [--requests N]
+**                              [--sizes SIZE,SIZE,...] [--users N]
+**                              [--reconnect|--async N] port
+**               Each post is a random ciphertext of one of the given sizes for
+**               one of the users bench0, bench1, ..., and each get asks for one
+**               of those users' ciphertexts. With --reconnect every request gets
+**               a new connection, the way otp sends them, instead of each client
+**               keeping one connection open.
+**
+**               With --async N there are no client threads. The clients are
+**               instead driven by a single thread through the asynchronous
+**               client API (see otp_async.h), which pipelines every client's
+**               request in flight over N shared connections, the way a gateway
+**               fanning in many producers would. Each client still sends its
+**               next request once the last one's answer has arrived, so
+**               --posters 200 --getters 200 keeps 400 requests in flight.
+**
+**               When every client is done, the throughput and the 50th, 99th
+**               and 99.9th percentile latencies of the posts and of the gets are
+**               printed, along with a histogram of the latencies. Posts ask otp_d
+**               to answer once they're stored (FLAG_ACK), so a post's latency is
+**               from sending the request until otp_d says it's stored, and synced
+**               if otp_d was started with --durability. A get's latency is from
+**               sending the request until the last byte of the answer arrived,
+**               and gets that find no ciphertext are counted as empty.
+**
+**               If otp_d turns a client away because it's busy, the client waits
+**               as long as otp_d asked, connects again and repeats the request,
+**               and the number of times that happened is printed as well.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include "otp_protocol.h"
+#include "otp_async.h"
+
+#define MAX_SIZES 32                    // the most message sizes that can be given with --sizes
+#define HISTOGRAM_BUCKETS 40            // latency buckets, each twice as wide as the last
+#define DISCARD_SIZE 65536              // the size of the buffer the answers to gets are read into
+
+// a client thread and what it measured
+struct client {
+    pthread_t thread;
+    unsigned int number;                // the client's number, used to seed its random numbers
+    char mode;                          // MODE_POST or MODE_GET
+    double* latencies;                  // the latency of each request, in microseconds
+    size_t completed;                   // how many requests finished
+    size_t empty;                       // how many gets found no ciphertext
+    size_t failed;                      // how many requests failed
+    size_t busy;                        // how many times otp_d turned the client away
+    uint64_t retryAfter;                // the milliseconds otp_d asked the client to wait
+    uint64_t random;                    // the client's random numbers (--async)
+    double start;                       // when the request in flight was sent (--async)
+    size_t size;                        // the size of the post in flight (--async)
+    unsigned long long bytes;           // the ciphertext characters sent or received
+};
+
+// the latencies of one kind of request from every client, sorted
+struct summary {
+    const char* name;                   // "post" or "get"
+    double* latencies;                  // every latency, sorted, in microseconds
+    size_t completed;                   // how many requests finished
+    size_t empty;                       // how many gets found no ciphertext
+    size_t failed;                      // how many requests failed
+    size_t busy;                        // how many times otp_d turned a client away
+    unsigned long long bytes;           // the ciphertext characters sent or received
+};
+
+// function prototypes:
+void* runClient(void* arg);
+bool postRequest(int socketFD, struct client* self, uint64_t* random);
+bool getRequest(int socketFD, struct client* self, uint64_t* random);
+bool turnedAway(int socketFD, struct client* self);
+void runAsync(struct client* clients, unsigned int numClients);
+void sendAsync(struct client* self);
+void finishAsync(void* arg, struct otpAsyncResult* result);
+int connectToServer(int portNumber);
+bool parseSizes(char* list);
+uint64_t nextRandom(uint64_t* state);
+double now(void);
+void summarize(struct client* clients, unsigned int numClients, char mode, struct summary* summary);
+int compareLatencies(const void* a, const void* b);
+double percentile(const struct summary* summary, double p);
+void printSummary(const struct summary* summary, double elapsed);
+
+// error function used for reporting issues
+void error(const char *msg) { perror(msg); exit(1); }
+
+// global variables
+int portNumber;                         // the port otp_d is listening on
+size_t requestsPerClient = 1000;        // how many requests each client sends
+size_t sizes[MAX_SIZES] = {1024};       // the sizes of the ciphertexts that are posted
+unsigned int numSizes = 1;              // how many sizes there are
+unsigned int numUsers = 16;             // how many users the requests are spread over
+bool reconnect = false;                 // true if every request gets a new connection
+unsigned int asyncConnections = 0;      // the connections shared with --async, 0 for a thread per client
+struct otpAsync async;                  // the asynchronous API the clients share with --async
+uint64_t asyncRetryAfter = 0;           // the longest wait otp_d asked for since the last --async retry
+char* ciphertext;                       // random characters that every post is taken from
+pthread_barrier_t startLine;            // holds the clients back until they're all ready
+
+int main(int argc, char *argv[]){
+    unsigned int numPosters = 4;        // the number of posting clients
+    unsigned int numGetters = 4;        // the number of getting clients
+    unsigned int numClients;            // the number of clients of both kinds
+    struct client* clients;             // the clients
+    struct summary posts, gets;         // what the clients measured
+    size_t largest = 0;                 // the biggest size in sizes
+    double start, elapsed;              // when the clients started, and how long they took
+    char* endPtr;                       // points to the end of a number given as an option
+    long value;                         // a number given as an option
+    int option;                         // the option returned by getopt_long()
+    struct option longOptions[] = {
+        {"posters", required_argument, NULL, 'p'},
+        {"getters", required_argument, NULL, 'g'},
+        {"requests", required_argument, NULL, 'n'},
+        {"sizes", required_argument, NULL, 's'},
+        {"users", required_argument, NULL, 'u'},
+        {"reconnect", no_argument, NULL, 'r'},
+        {"async", required_argument, NULL, 'a'},
+        {NULL, 0, NULL, 0}
+    };
+    const char* usage = "otp_bench USAGE: %s [--posters N] [--getters N] [--requests N] "
+                        "[--sizes SIZE,SIZE,...] [--users N] [--reconnect|--async N] port\n";
+
+    // parse the command line options, any of the counts can be 0 but there has to be a user
+    while((option = getopt_long(argc, argv, "p:g:n:s:u:ra:", longOptions, NULL)) != -1){
+        if(option == 's'){
+            if(!parseSizes(optarg)){
+                fprintf(stderr, "otp_bench ERROR: --sizes must be up to %d positive numbers\n", MAX_SIZES); exit(1);
+            }
+            continue;
+        }
+        if(option == 'r'){
+            reconnect = true;
+            continue;
+        }
+        if(option != 'p' && option != 'g' && option != 'n' && option != 'u' && option != 'a'){
+            fprintf(stderr, usage, argv[0]); exit(1);
+        }
+
+        errno = 0;
+        value = strtol(optarg, &endPtr, 10);
+        if(errno != 0 || *endPtr != '\0' || value < (option == 'u' || option == 'a' ? 1 : 0) || value > 100000000 ||
+           (option == 'a' && value > MAX_ASYNC_CONNECTIONS)){
+            fprintf(stderr, "otp_bench ERROR: \"%s\" isn't a valid number\n", optarg); exit(1);
+        }
+        if(option == 'p') numPosters = value;
+        if(option == 'g') numGetters = value;
+        if(option == 'n') requestsPerClient = value;
+        if(option == 'u') numUsers = value;
+        if(option == 'a') asyncConnections = value;
+    }
+    if(optind >= argc || (reconnect && asyncConnections > 0)) { fprintf(stderr, usage, argv[0]); exit(1); }
+    portNumber = atoi(argv[optind]);
+    numClients = numPosters + numGetters;
+    if(numClients == 0){
+        fprintf(stderr, "otp_bench ERROR: there has to be at least one poster or getter\n"); exit(1);
+    }
+
+    // a closed connection should be counted as a failed request, not end otp_bench
+    signal(SIGPIPE, SIG_IGN);
+
+    // every post sends a slice of the same random ciphertext
+    for(unsigned int s = 0; s < numSizes; s++){
+        if(sizes[s] > largest) largest = sizes[s];
+    }
+    ciphertext = malloc(largest);
+    if(ciphertext == NULL) error("otp_bench ERROR with malloc");
+    for(size_t i = 0; i < largest; i++){
+        ciphertext[i] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ "[rand() % 27];
+    }
+
+    clients = calloc(numClients, sizeof(struct client));
+    if(clients == NULL) error("otp_bench ERROR with malloc");
+    pthread_barrier_init(&startLine, NULL, numClients + 1);
+    for(unsigned int c = 0; c < numClients; c++){
+        clients[c].number = c;
+        clients[c].mode = c < numPosters ? MODE_POST : MODE_GET;
+        clients[c].latencies = malloc(requestsPerClient * sizeof(double) + 1);
+        if(clients[c].latencies == NULL) error("otp_bench ERROR with malloc");
+        if(asyncConnections == 0 && pthread_create(&clients[c].thread, NULL, runClient, &clients[c]) != 0){
+            fprintf(stderr, "otp_bench ERROR creating thread\n"); exit(1);
+        }
+    }
+
+    // start the clock once every client has connected, or straight away with --async
+    if(asyncConnections > 0){
+        start = now();
+        runAsync(clients, numClients);
+    }
+    else{
+        pthread_barrier_wait(&startLine);
+        start = now();
+        for(unsigned int c = 0; c < numClients; c++){
+            pthread_join(clients[c].thread, NULL);
+        }
+    }
+    elapsed = now() - start;
+
+    printf("otp_bench: %u posters, %u getters, %zu requests each, %u users, ",
+           numPosters, numGetters, requestsPerClient, numUsers);
+    if(asyncConnections > 0){
+        printf("one thread sharing %u connections\n", asyncConnections);
+    }
+    else{
+        printf("%s\n", reconnect ? "a new connection per request" : "one connection per client");
+    }
+    printf("finished in %.3f s\n", elapsed);
+
+    summarize(clients, numClients, MODE_POST, &posts);
+    summarize(clients, numClients, MODE_GET, &gets);
+    if(numPosters > 0) printSummary(&posts, elapsed);
+    if(numGetters > 0) printSummary(&gets, elapsed);
+
+    // free the memory on the heap
+    for(unsigned int c = 0; c < numClients; c++){
+        free(clients[c].latencies);
+    }
+    free(posts.latencies);
+    free(gets.latencies);
+    free(clients);
+    free(ciphertext);
+    pthread_barrier_destroy(&startLine);
+
+    return (posts.failed + gets.failed) > 0;
+}
+
+/*******************************************************************************
+ *                                  runClient                                  *
+ * This function is run by each client thread. It sends its requests one after *
+ * another, timing each one, and stops early if otp_d closes the connection.   *
+ * A request otp_d was too busy to take is sent again on a new connection.     *
+ ******************************************************************************/
+void* runClient(void* arg){
+    struct client* self = arg;
+    uint64_t random = 0x9E3779B97F4A7C15ULL * (self->number + 1); // this client's random numbers
+    int socketFD = -1;
+    double start;
+    bool success;
+
+    if(!reconnect) socketFD = connectToServer(portNumber);
+    pthread_barrier_wait(&startLine);
+
+    for(size_t r = 0; r < requestsPerClient; r++){
+        start = now();
+        if(reconnect) socketFD = connectToServer(portNumber);
+        if(self->mode == MODE_POST){
+            success = postRequest(socketFD, self, &random);
+        }
+        else{
+            success = getRequest(socketFD, self, &random);
+        }
+
+        if(!success && (self->retryAfter > 0 || turnedAway(socketFD, self))){
+            close(socketFD);
+            usleep(self->retryAfter * 1000);
+            self->retryAfter = 0;
+            if(!reconnect) socketFD = connectToServer(portNumber);
+            r--;
+            continue;
+        }
+        if(reconnect) close(socketFD);
+
+        if(!success){
+            self->failed++;
+            if(!reconnect) break;   // the connection can't be trusted after a failure
+            continue;
+        }
+        self->latencies[self->completed++] = (now() - start) * 1e6;
+    }
+
+    if(!reconnect) close(socketFD);
+    return NULL;
+}
+
+/*******************************************************************************
+ *                                  postRequest                                *
+ * This function posts a ciphertext of a random size for a random user and     *
+ * waits for otp_d to say it's stored.                                         *
+ ******************************************************************************/
+bool postRequest(int socketFD, struct client* self, uint64_t* random){
+    char user[32];
+    unsigned char header[REQUEST_HEADER_SIZE];
+    size_t size = sizes[nextRandom(random) % numSizes];
+    struct requestHeader request = {PROTOCOL_VERSION, MODE_POST, FLAG_ACK, 0, size};
+    struct responseHeader response;
+    struct iovec iov[3];
+
+    request.userSize = snprintf(user, sizeof(user), "bench%u", (unsigned int)(nextRandom(random) % numUsers));
+    encodeRequestHeader(&request, header);
+    iov[0].iov_base = header;
+    iov[0].iov_len = REQUEST_HEADER_SIZE;
+    iov[1].iov_base = user;
+    iov[1].iov_len = request.userSize;
+    iov[2].iov_base = ciphertext;
+    iov[2].iov_len = size;
+    if(!sendvAll(socketFD, iov, 3)) return false;
+
+    // the answer is just a header, otp_d closes the connection instead if the post failed
+    if(!recvAll(socketFD, header, RESPONSE_HEADER_SIZE) || !decodeResponseHeader(header, &response)){
+        return false;
+    }
+    if(response.status == STATUS_BUSY){
+        self->busy++;
+        self->retryAfter = response.bodySize > 0 ? response.bodySize : 1;
+        return false;
+    }
+    if(response.status != 's') return false;
+
+    self->bytes += size;
+    return true;
+}
+
+/*******************************************************************************
+ *                                  getRequest                                 *
+ * This function gets the oldest ciphertext of a random user and throws it     *
+ * away once it has all arrived.                                               *
+ ******************************************************************************/
+bool getRequest(int socketFD, struct client* self, uint64_t* random){
+    char user[32];
+    unsigned char header[REQUEST_HEADER_SIZE];
+    struct requestHeader request = {PROTOCOL_VERSION, MODE_GET, 0, 0, 0};
+    struct responseHeader response;
+    char discard[DISCARD_SIZE];         // where the ciphertext is read into
+    uint64_t remaining;                 // how much of the ciphertext is still to come
+    size_t size;
+    struct iovec iov[2];
+
+    request.userSize = snprintf(user, sizeof(user), "bench%u", (unsigned int)(nextRandom(random) % numUsers));
+    encodeRequestHeader(&request, header);
+    iov[0].iov_base = header;
+    iov[0].iov_len = REQUEST_HEADER_SIZE;
+    iov[1].iov_base = user;
+    iov[1].iov_len = request.userSize;
+    if(!sendvAll(socketFD, iov, 2)) return false;
+
+    // the answer is a header, and for an 's' the ciphertext
+    if(!recvAll(socketFD, header, RESPONSE_HEADER_SIZE) || !decodeResponseHeader(header, &response)){
+        return false;
+    }
+    if(response.status == STATUS_BUSY){
+        self->busy++;
+        self->retryAfter = response.bodySize > 0 ? response.bodySize : 1;
+        return false;
+    }
+    if(response.status != 's'){
+        self->empty++;
+        return true;
+    }
+    for(remaining = response.bodySize; remaining > 0; remaining -= size){
+        size = remaining < DISCARD_SIZE ? remaining : DISCARD_SIZE;
+        if(!recvAll(socketFD, discard, size)) return false;
+    }
+
+    self->bytes += response.bodySize;
+    return true;
+}
+
+/*******************************************************************************
+ *                                  turnedAway                                 *
+ * This function checks whether a failed request failed because otp_d was busy,*
+ * in which case otp_d sent a busy response before closing the connection.     *
+ * A post whose send failed finds out this way, before reading an answer.     *
+ ******************************************************************************/
+bool turnedAway(int socketFD, struct client* self){
+    unsigned char header[RESPONSE_HEADER_SIZE];
+    struct responseHeader response;
+
+    if(recv(socketFD, header, RESPONSE_HEADER_SIZE, MSG_WAITALL | MSG_DONTWAIT) != RESPONSE_HEADER_SIZE ||
+       !decodeResponseHeader(header, &response) || response.status != STATUS_BUSY){
+        return false;
+    }
+    self->busy++;
+    self->retryAfter = response.bodySize > 0 ? response.bodySize : 1;
+    return true;
+}
+
+/*******************************************************************************
+ *                                  runAsync                                   *
+ * This function drives every client from this one thread with --async. Each   *
+ * client's first request is queued, and each answer's callback queues that    *
+ * client's next one, until none are left. Clients otp_d turned away are sent  *
+ * again once the longest wait it asked for has passed.                        *
+ ******************************************************************************/
+void runAsync(struct client* clients, unsigned int numClients){
+    if(otpAsyncOpen(&async, NULL, portNumber, asyncConnections) != OTP_OK){
+        error("otp_bench ERROR opening the asynchronous connections");
+    }
+    for(unsigned int c = 0; c < numClients; c++){
+        clients[c].random = 0x9E3779B97F4A7C15ULL * (clients[c].number + 1);
+        sendAsync(&clients[c]);
+    }
+
+    while(otpAsyncPending(&async) > 0){
+        if(otpAsyncRun(&async, -1) < 0) error("otp_bench ERROR waiting for otp_d");
+        if(asyncRetryAfter == 0) continue;
+
+        usleep(asyncRetryAfter * 1000);
+        asyncRetryAfter = 0;
+        for(unsigned int c = 0; c < numClients; c++){
+            if(clients[c].retryAfter == 0) continue;
+            clients[c].retryAfter = 0;
+            sendAsync(&clients[c]);
+        }
+    }
+    otpAsyncClose(&async);
+}
+
+/*******************************************************************************
+ *                                  sendAsync                                  *
+ * This function queues a client's next request with --async, a post of a      *
+ * random size or a get, for a random user, unless it has sent them all.       *
+ ******************************************************************************/
+void sendAsync(struct client* self){
+    char user[32];
+    enum otpStatus status;
+
+    if(self->completed == requestsPerClient) return;
+    if(self->mode == MODE_POST) self->size = sizes[nextRandom(&self->random) % numSizes];
+    snprintf(user, sizeof(user), "bench%u", (unsigned int)(nextRandom(&self->random) % numUsers));
+
+    self->start = now();
+    if(self->mode == MODE_POST){
+        status = otpAsyncPost(&async, user, ciphertext, self->size, finishAsync, self);
+    }
+    else{
+        status = otpAsyncGet(&async, user, finishAsync, self);
+    }
+    if(status != OTP_OK) self->failed++;
+}
+
+/*******************************************************************************
+ *                                  finishAsync                                *
+ * This function is the callback for every request sent with --async. It       *
+ * times the request and sends the client's next one. A client whose request   *
+ * failed stops, the same as a client thread would.                            *
+ ******************************************************************************/
+void finishAsync(void* arg, struct otpAsyncResult* result){
+    struct client* self = arg;
+
+    if(result->status == OTP_BUSY){
+        self->busy++;
+        self->retryAfter = result->retryAfter > 0 ? result->retryAfter : 1;
+        if(self->retryAfter > asyncRetryAfter) asyncRetryAfter = self->retryAfter;
+        return;
+    }
+    if(result->status == OTP_FAILED){
+        self->failed++;
+        return;
+    }
+
+    self->latencies[self->completed++] = (now() - self->start) * 1e6;
+    if(result->status == OTP_EMPTY) self->empty++;
+    self->bytes += self->mode == MODE_POST ? self->size : result->ciphertextSize;
+    free(result->ciphertext);
+    sendAsync(self);
+}
+
+/*******************************************************************************
+ *                                  connectToServer                            *
+ * This function connects to otp_d on the given port of this machine and      *
+ * returns the connected socket. otp_bench exits if it can't connect.          *
+ ******************************************************************************/
+int connectToServer(int portNumber){
+    int socketFD;
+    struct sockaddr_in serverAddress;
+    struct hostent* serverHostInfo;
+
+    // Set up the server address struct
+    memset((char*)&serverAddress, '\0', sizeof(serverAddress)); // Clear out the address struct
+    serverAddress.sin_family = AF_INET;         // Create a network-capable socket
+    serverAddress.sin_port = htons(portNumber); // Store the port number
+    serverHostInfo = gethostbyname("localhost");    // Convert the machine name into a special form of address
+    if(serverHostInfo == NULL) { fprintf(stderr, "otp_bench ERROR: no such host\n"); exit(2); }
+
+    // Copy in the address
+    memcpy((char*)&serverAddress.sin_addr.s_addr, (char*)serverHostInfo->h_addr, serverHostInfo->h_length);
+
+    // Set up the socket
+    socketFD = socket(AF_INET, SOCK_STREAM, 0); // Create the socket
+    if(socketFD < 0) error("otp_bench ERROR opening socket");
+
+    // Connect to server's address
+    if(connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0){
+        fprintf(stderr, "otp_bench ERROR connecting to port %d\n", portNumber);
+        exit(2);
+    }
+    return socketFD;
+}
+
+/*******************************************************************************
+ *                                  parseSizes                                 *
+ * This function reads a comma separated list of message sizes into sizes. It *
+ * returns false if any of them isn't a positive number.                       *
+ ******************************************************************************/
+bool parseSizes(char* list){
+    char* endPtr;
+    unsigned long long size;
+
+    numSizes = 0;
+    for(char* item = strtok(list, ","); item != NULL; item = strtok(NULL, ",")){
+        errno = 0;
+        size = strtoull(item, &endPtr, 10);
+        if(errno != 0 || *endPtr != '\0' || size == 0 || size > SIZE_MAX / 2 || numSizes == MAX_SIZES){
+            return false;
+        }
+        sizes[numSizes++] = size;
+    }
+    return numSizes > 0;
+}
+
+/*******************************************************************************
+ *                                  nextRandom                                 *
+ * This function returns the next number from a client's xorshift generator.  *
+ * The numbers only pick sizes and users, so they don't need to be secure.     *
+ ******************************************************************************/
+uint64_t nextRandom(uint64_t* state){
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/*******************************************************************************
+ *                                  now                                        *
+ * This function returns the time in seconds from a clock that never jumps.    *
+ ******************************************************************************/
+double now(void){
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/*******************************************************************************
+ *                                  summarize                                  *
+ * This function gathers the latencies and counts of every client of the given *
+ * mode, and sorts the latencies so percentiles can be read off them.          *
+ ******************************************************************************/
+void summarize(struct client* clients, unsigned int numClients, char mode, struct summary* summary){
+    memset(summary, 0, sizeof(struct summary));
+    summary->name = mode == MODE_POST ? "post" : "get";
+
+    for(unsigned int c = 0; c < numClients; c++){
+        if(clients[c].mode == mode) summary->completed += clients[c].completed;
+    }
+    summary->latencies = malloc(summary->completed * sizeof(double) + 1);
+    if(summary->latencies == NULL) error("otp_bench ERROR with malloc");
+
+    summary->completed = 0;
+    for(unsigned int c = 0; c < numClients; c++){
+        if(clients[c].mode != mode) continue;
+        memcpy(summary->latencies + summary->completed, clients[c].latencies,
+               clients[c].completed * sizeof(double));
+        summary->completed += clients[c].completed;
+        summary->empty += clients[c].empty;
+        summary->failed += clients[c].failed;
+        summary->busy += clients[c].busy;
+        summary->bytes += clients[c].bytes;
+    }
+    qsort(summary->latencies, summary->completed, sizeof(double), compareLatencies);
+}
+
+/*******************************************************************************
+ *                                  compareLatencies                           *
+ * This function compares two latencies for qsort().                           *
+ ******************************************************************************/
+int compareLatencies(const void* a, const void* b){
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/*******************************************************************************
+ *                                  percentile                                 *
+ * This function returns the latency that p percent of the requests took no    *
+ * longer than, using the nearest rank.                                        *
+ ******************************************************************************/
+double percentile(const struct summary* summary, double p){
+    size_t rank;
+
+    if(summary->completed == 0) return 0;
+    rank = (size_t)(p / 100 * summary->completed + 0.999999);
+    if(rank < 1) rank = 1;
+    if(rank > summary->completed) rank = summary->completed;
+    return summary->latencies[rank - 1];
+}
+
+/*******************************************************************************
+ *                                  printSummary                               *
+ * This function prints the throughput and latency percentiles of one kind of  *
+ * request, followed by a histogram with buckets that double in width.         *
+ ******************************************************************************/
+void printSummary(const struct summary* summary, double elapsed){
+    size_t counts[HISTOGRAM_BUCKETS] = {0};
+    unsigned int bucket, first = HISTOGRAM_BUCKETS, last = 0;
+    size_t widest = 1;
+
+    printf("\n%s: %zu completed", summary->name, summary->completed);
+    if(summary->empty > 0) printf(" (%zu empty)", summary->empty);
+    if(summary->failed > 0) printf(", %zu failed", summary->failed);
+    if(summary->busy > 0) printf(", turned away %zu times", summary->busy);
+    printf("\n  throughput  %.0f requests/s, %.2f MB/s\n",
+           summary->completed / elapsed, summary->bytes / elapsed / 1e6);
+    if(summary->completed == 0) return;
+    printf("  latency us  p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+           percentile(summary, 50), percentile(summary, 99), percentile(summary, 99.9),
+           summary->latencies[summary->completed - 1]);
+
+    // bucket b holds the latencies from 2^(b-1) up to 2^b microseconds
+    for(size_t i = 0; i < summary->completed; i++){
+        bucket = 0;
+        while(bucket < HISTOGRAM_BUCKETS - 1 && summary->latencies[i] >= (double)(1ULL << bucket)) bucket++;
+        counts[bucket]++;
+        if(counts[bucket] > widest) widest = counts[bucket];
+        if(bucket < first) first = bucket;
+        if(bucket > last) last = bucket;
+    }
+    for(bucket = first; bucket <= last; bucket++){
+        printf("  < %10llu us %9zu |%.*s\n", 1ULL << bucket, counts[bucket],
+               (int)(counts[bucket] * 50 / widest), "##################################################");
+    }
+}
@@ -0,0 +1,944 @@
+/*******************************************************************************
+** Program name: otp_cipher.c
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  This file encrypts and decrypts text for otp. Each function
+**               checks the text and the key for bad characters in the same
+**               pass that it adds or subtracts the key, instead of looping over
+**               them separately first. On x86 the work is done 16, 32 or 64
+**               characters at a time with SSE2, AVX2 or AVX-512, whichever is
+**               the widest the CPU supports. It's picked the first time a
+**               function is called, and can be overridden by setting the
+**               OTP_CIPHER environment variable to scalar, sse2, avx2 or
+**               avx512. Every version gives exactly the same output as the
+**               scalar loops, which are the ones otp has always used. Binary
+**               text is XORed with its key by the same versions, which only
+**               differ in how many bytes they take at a time.
+**
+**               Packing and unpacking (see otp_cipher.h) are done by the same
+**               versions. A group's 8 values are put together with shifts in
+**               a 64 bit lane, pairs into 10 bits, then 20, then 40, and the
+**               low 5 bytes of each lane are stored, overlapping the next
+**               group's. Unpacking does the same shifts the other way.
+**
+**               A text long enough to split (see otp_cipher.h) is cut into
+**               equal slices, each a multiple of 64 characters but the last, and
+**               each slice is given to its own thread, with the calling thread
+**               doing the first. The threads are started for the one call and
+**               joined before it returns, which costs far less than the slices
+**               take. What each slice found is combined just as the vector
+**               versions combine their vectors, so the result is the same as
+**               doing the whole text on one thread.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "otp_cipher.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CIPHER_X86
+#include <immintrin.h>
+#endif
+
+typedef enum cipherResult (*cipherFunction)(const char* text, const char* key, char* output, size_t size);
+typedef bool (*validFunction)(const char* text, size_t size);
+typedef void (*xorFunction)(const char* input, const char* key, char* output, size_t size);
+typedef void (*packFunction)(const char* text, size_t numGroups, char* groups);
+typedef bool (*unpackFunction)(const char* groups, size_t numGroups, char* text);
+
+// one version of the cipher functions
+struct cipherKernels {
+    const char* name;                   // the name used with OTP_CIPHER
+    bool (*supported)(void);            // returns true if the CPU can run this version
+    cipherFunction encrypt;
+    cipherFunction decrypt;
+    validFunction valid;
+    xorFunction xor;
+    packFunction pack;                  // packs whole groups, the text has already been checked
+    unpackFunction unpack;              // unpacks whole groups with no padding, false if a value is over 26
+};
+
+// what a slice of text is having done to it
+enum cipherOperation {
+    OPERATION_ENCRYPT,
+    OPERATION_DECRYPT,
+    OPERATION_VALID,
+    OPERATION_XOR
+};
+
+// one thread's share of a text
+struct cipherSlice {
+    enum cipherOperation operation;     // what's done to the slice
+    const char* input;                  // the slice of the plaintext, ciphertext or text to check
+    const char* key;                    // the same slice of the key, NULL for OPERATION_VALID
+    char* output;                       // where the result goes, NULL for OPERATION_VALID
+    size_t size;                        // the characters in the slice
+    enum cipherResult result;           // what the slice had, CIPHER_BAD_TEXT if it isn't valid
+};
+
+// function prototypes:
+static void selectKernels(void);
+static enum cipherResult runSlices(enum cipherOperation operation, const char* input, const char* key, char* output,
+                                   size_t size);
+static void* runSlice(void* arg);
+static enum cipherResult combineResults(bool badText, bool badKey, enum cipherResult tail);
+static bool alwaysSupported(void);
+static enum cipherResult encryptScalar(const char* plaintext, const char* key, char* ciphertext, size_t size);
+static enum cipherResult decryptScalar(const char* ciphertext, const char* key, char* plaintext, size_t size);
+static bool validScalar(const char* text, size_t size);
+static void xorScalar(const char* input, const char* key, char* output, size_t size);
+static void packScalar(const char* text, size_t numGroups, char* groups);
+static bool unpackScalar(const char* groups, size_t numGroups, char* text);
+#ifdef CIPHER_X86
+static bool sse2Supported(void);
+static bool avx2Supported(void);
+static bool avx512Supported(void);
+static enum cipherResult encryptSSE2(const char* plaintext, const char* key, char* ciphertext, size_t size);
+static enum cipherResult decryptSSE2(const char* ciphertext, const char* key, char* plaintext, size_t size);
+static bool validSSE2(const char* text, size_t size);
+static void xorSSE2(const char* input, const char* key, char* output, size_t size);
+static void packSSE2(const char* text, size_t numGroups, char* groups);
+static bool unpackSSE2(const char* groups, size_t numGroups, char* text);
+static enum cipherResult encryptAVX2(const char* plaintext, const char* key, char* ciphertext, size_t size);
+static enum cipherResult decryptAVX2(const char* ciphertext, const char* key, char* plaintext, size_t size);
+static bool validAVX2(const char* text, size_t size);
+static void xorAVX2(const char* input, const char* key, char* output, size_t size);
+static void packAVX2(const char* text, size_t numGroups, char* groups);
+static bool unpackAVX2(const char* groups, size_t numGroups, char* text);
+static enum cipherResult encryptAVX512(const char* plaintext, const char* key, char* ciphertext, size_t size);
+static enum cipherResult decryptAVX512(const char* ciphertext, const char* key, char* plaintext, size_t size);
+static bool validAVX512(const char* text, size_t size);
+static void xorAVX512(const char* input, const char* key, char* output, size_t size);
+#endif
+
+// every version, best first
+static const struct cipherKernels allKernels[] = {
+#ifdef CIPHER_X86
+    {"avx512", avx512Supported, encryptAVX512, decryptAVX512, validAVX512, xorAVX512, packAVX2, unpackAVX2},
+    {"avx2", avx2Supported, encryptAVX2, decryptAVX2, validAVX2, xorAVX2, packAVX2, unpackAVX2},
+    {"sse2", sse2Supported, encryptSSE2, decryptSSE2, validSSE2, xorSSE2, packSSE2, unpackSSE2},
+#endif
+    {"scalar", alwaysSupported, encryptScalar, decryptScalar, validScalar, xorScalar, packScalar, unpackScalar}
+};
+
+static const struct cipherKernels* kernels = NULL; // the version in use, picked by selectKernels()
+static pthread_once_t kernelsPicked = PTHREAD_ONCE_INIT; // selectKernels() is only run once
+static unsigned int cipherThreads = 1;  // the most threads a text is split among
+
+// the value 0-26 of a character, 0 for a space, the same as the vector versions use
+static inline uint64_t symbolValue(char c){ return c == 32 ? 0 : (uint64_t)(c - 64) & 31; }
+
+/*******************************************************************************
+ *                                  encryptText                                *
+ * This function encrypts size characters of plaintext with the key into       *
+ * ciphertext, and checks both the plaintext and the key for bad characters.   *
+ ******************************************************************************/
+enum cipherResult encryptText(const char* plaintext, const char* key, char* ciphertext, size_t size){
+    pthread_once(&kernelsPicked, selectKernels);
+    if(cipherThreads > 1 && size >= 2 * CIPHER_SLICE_SIZE){
+        return runSlices(OPERATION_ENCRYPT, plaintext, key, ciphertext, size);
+    }
+    return kernels->encrypt(plaintext, key, ciphertext, size);
+}
+
+/*******************************************************************************
+ *                                  decryptText                                *
+ * This function decrypts size characters of ciphertext with the key into      *
+ * plaintext, and checks both the ciphertext and the key for bad characters.   *
+ ******************************************************************************/
+enum cipherResult decryptText(const char* ciphertext, const char* key, char* plaintext, size_t size){
+    pthread_once(&kernelsPicked, selectKernels);
+    if(cipherThreads > 1 && size >= 2 * CIPHER_SLICE_SIZE){
+        return runSlices(OPERATION_DECRYPT, ciphertext, key, plaintext, size);
+    }
+    return kernels->decrypt(ciphertext, key, plaintext, size);
+}
+
+/*******************************************************************************
+ *                                  validText                                  *
+ * This function returns true if size characters of text are all A-Z or space.*
+ ******************************************************************************/
+bool validText(const char* text, size_t size){
+    pthread_once(&kernelsPicked, selectKernels);
+    if(cipherThreads > 1 && size >= 2 * CIPHER_SLICE_SIZE){
+        return runSlices(OPERATION_VALID, text, NULL, NULL, size) == CIPHER_OK;
+    }
+    return kernels->valid(text, size);
+}
+
+/*******************************************************************************
+ *                                  xorText                                    *
+ * This function XORs size bytes of input with the key into output, which      *
+ * encrypts binary plaintext or decrypts binary ciphertext. Any byte is good.  *
+ ******************************************************************************/
+void xorText(const char* input, const char* key, char* output, size_t size){
+    pthread_once(&kernelsPicked, selectKernels);
+    if(cipherThreads > 1 && size >= 2 * CIPHER_SLICE_SIZE){
+        runSlices(OPERATION_XOR, input, key, output, size);
+        return;
+    }
+    kernels->xor(input, key, output, size);
+}
+
+/*******************************************************************************
+ *                                  packedSize                                 *
+ * This function returns the size of size characters once they're packed,      *
+ * PACKED_MARKER included.                                                     *
+ ******************************************************************************/
+size_t packedSize(size_t size){
+    return 1 + (size + PACKED_GROUP_CHARS - 1) / PACKED_GROUP_CHARS * PACKED_GROUP_SIZE;
+}
+
+/*******************************************************************************
+ *                                  unpackedSize                               *
+ * This function returns the most characters a packed text of packedSize bytes *
+ * can hold, which is enough room to unpack it into.                           *
+ ******************************************************************************/
+size_t unpackedSize(size_t packedSize){
+    return packedSize <= 1 ? 0 : (packedSize - 1) / PACKED_GROUP_SIZE * PACKED_GROUP_CHARS;
+}
+
+/*******************************************************************************
+ *                                  packText                                   *
+ * This function packs size characters of text into packedSize(size) bytes of  *
+ * packed, which must not overlap it. The text must already have been checked  *
+ * for bad characters, since a bad one is packed as something else.            *
+ ******************************************************************************/
+void packText(const char* text, size_t size, char* packed){
+    size_t numGroups = size / PACKED_GROUP_CHARS; // the groups with no padding
+    size_t left = size % PACKED_GROUP_CHARS;      // the characters in the last group if it's padded
+    uint64_t bits = 0;                  // the padded group's values
+
+    pthread_once(&kernelsPicked, selectKernels);
+    packed[0] = PACKED_MARKER;
+    kernels->pack(text, numGroups, packed + 1);
+    if(left == 0) return;
+
+    for(size_t j = 0; j < PACKED_GROUP_CHARS; j++){
+        bits |= (j < left ? symbolValue(text[numGroups * PACKED_GROUP_CHARS + j]) : 31) << (5 * j);
+    }
+    for(size_t b = 0; b < PACKED_GROUP_SIZE; b++){
+        packed[1 + numGroups * PACKED_GROUP_SIZE + b] = (char)(bits >> (8 * b));
+    }
+}
+
+/*******************************************************************************
+ *                                  unpackText                                 *
+ * This function unpacks a packed text into text, which has room for           *
+ * unpackedSize(packedSize) characters, and sets size to how many there were.  *
+ * It returns false if packed isn't a packed text or has a bad value in it.    *
+ ******************************************************************************/
+bool unpackText(const char* packed, size_t packedSize, char* text, size_t* size){
+    if(packedSize < 1 || packed[0] != PACKED_MARKER) return false;
+    return unpackGroups(packed + 1, packedSize - 1, text, size);
+}
+
+/*******************************************************************************
+ *                                  unpackGroups                               *
+ * This function unpacks whole groups, without the PACKED_MARKER, so a packed  *
+ * text can be unpacked a piece at a time. Only the last group of a piece can  *
+ * be padded, so a piece that isn't the end of its text should come back with  *
+ * every group full. It returns false if groupsSize isn't a whole number of    *
+ * groups or a value isn't 0-26.                                               *
+ ******************************************************************************/
+bool unpackGroups(const char* groups, size_t groupsSize, char* text, size_t* size){
+    size_t numGroups = groupsSize / PACKED_GROUP_SIZE; // the groups, the last of which can be padded
+    const char* last;                   // the last group
+    size_t count = PACKED_GROUP_CHARS;  // the characters in the last group
+    uint64_t bits = 0;                  // the last group's values
+    uint64_t value;                     // one of its values
+    bool good;                          // false once a bad value has been found
+
+    *size = 0;
+    if(groupsSize % PACKED_GROUP_SIZE != 0) return false;
+    if(numGroups == 0) return true;
+    pthread_once(&kernelsPicked, selectKernels);
+    good = kernels->unpack(groups, numGroups - 1, text);
+
+    // the padding is the value 31 in every slot after the last character
+    last = groups + (numGroups - 1) * PACKED_GROUP_SIZE;
+    for(size_t b = 0; b < PACKED_GROUP_SIZE; b++) bits |= (uint64_t)(unsigned char)last[b] << (8 * b);
+    while(count > 1 && (bits >> (5 * (count - 1)) & 31) == 31) count--;
+    text += (numGroups - 1) * PACKED_GROUP_CHARS;
+    for(size_t j = 0; j < count; j++){
+        value = bits >> (5 * j) & 31;
+        if(value > 26) good = false;
+        text[j] = value == 0 ? ' ' : (char)(value + 64);
+    }
+    *size = (numGroups - 1) * PACKED_GROUP_CHARS + count;
+    return good;
+}
+
+/*******************************************************************************
+ *                                  validPackedText                            *
+ * This function returns true if packed is a packed text with only the values  *
+ * 0-26 in it, a run of groups at a time so nothing has to be allocated.       *
+ ******************************************************************************/
+bool validPackedText(const char* packed, size_t packedSize){
+    char text[PACKED_GROUP_CHARS * 128]; // where each run of groups is unpacked to be checked
+    size_t numGroups;                   // the groups in packed
+    size_t run;                         // the groups in the next run
+    size_t size;                        // the characters in the last group
+
+    if(packedSize < 1 || packed[0] != PACKED_MARKER || (packedSize - 1) % PACKED_GROUP_SIZE != 0) return false;
+    numGroups = (packedSize - 1) / PACKED_GROUP_SIZE;
+    if(numGroups == 0) return true;
+    pthread_once(&kernelsPicked, selectKernels);
+
+    // every group but the last is full, the last one is checked with its padding
+    for(size_t g = 0; g + 1 < numGroups; g += run){
+        run = numGroups - 1 - g < 128 ? numGroups - 1 - g : 128;
+        if(!kernels->unpack(packed + 1 + g * PACKED_GROUP_SIZE, run, text)) return false;
+    }
+    return unpackGroups(packed + 1 + (numGroups - 1) * PACKED_GROUP_SIZE, PACKED_GROUP_SIZE, text, &size);
+}
+
+/*******************************************************************************
+ *                                  cipherKernelName                           *
+ * This function returns the name of the version of the cipher in use.         *
+ ******************************************************************************/
+const char* cipherKernelName(void){
+    pthread_once(&kernelsPicked, selectKernels);
+    return kernels->name;
+}
+
+/*******************************************************************************
+ *                                  useCipherKernel                            *
+ * This function switches to the version of the cipher with the given name, so *
+ * that each version can be timed and compared with the others. False is      *
+ * returned, and nothing changes, if there's no such version or the CPU can't  *
+ * run it.                                                                     *
+ ******************************************************************************/
+bool useCipherKernel(const char* name){
+    size_t numKernels = sizeof(allKernels) / sizeof(allKernels[0]);
+
+    // the usual pick is made first, so it can't overwrite this one later
+    pthread_once(&kernelsPicked, selectKernels);
+    for(size_t i = 0; i < numKernels; i++){
+        if(strcmp(name, allKernels[i].name) == 0 && allKernels[i].supported()){
+            kernels = &allKernels[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+/*******************************************************************************
+ *                                  setCipherThreads                           *
+ * This function sets the most threads a long text is split among, up to       *
+ * MAX_CIPHER_THREADS. 0 means one for each CPU that's online, and 1 does      *
+ * every text on the calling thread. It isn't safe to call while another       *
+ * thread is encrypting or decrypting.                                         *
+ ******************************************************************************/
+void setCipherThreads(unsigned int threads){
+    long numCPUs;                       // the CPUs online, for 0
+
+    if(threads == 0){
+        numCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = numCPUs > 0 ? (unsigned int)(numCPUs < MAX_CIPHER_THREADS ? numCPUs : MAX_CIPHER_THREADS) : 1;
+    }
+    cipherThreads = threads < MAX_CIPHER_THREADS ? threads : MAX_CIPHER_THREADS;
+}
+
+/*******************************************************************************
+ *                                  cipherThreadCount                          *
+ * This function returns the most threads a long text is split among.          *
+ ******************************************************************************/
+unsigned int cipherThreadCount(void){
+    return cipherThreads;
+}
+
+/*******************************************************************************
+ *                                  selectKernels                              *
+ * This function picks the version named by OTP_CIPHER if it's set and the CPU *
+ * supports it, otherwise the best version the CPU supports. It's run through  *
+ * pthread_once(), since otp_d's workers and the slice threads can all make    *
+ * the first call to the cipher at the same time.                              *
+ ******************************************************************************/
+static void selectKernels(void){
+    const char* forced = getenv("OTP_CIPHER");
+    size_t numKernels = sizeof(allKernels) / sizeof(allKernels[0]);
+
+#ifdef CIPHER_X86
+    __builtin_cpu_init();
+#endif
+    if(forced != NULL){
+        for(size_t i = 0; i < numKernels; i++){
+            if(strcmp(forced, allKernels[i].name) == 0 && allKernels[i].supported()){
+                kernels = &allKernels[i];
+                return;
+            }
+        }
+    }
+    for(size_t i = 0; i < numKernels; i++){
+        if(allKernels[i].supported()){
+            kernels = &allKernels[i];
+            return;
+        }
+    }
+}
+
+/*******************************************************************************
+ *                                  runSlices                                  *
+ * This function splits a text into a slice for each thread, as many as it has *
+ * whole CIPHER_SLICE_SIZE slices for up to cipherThreads, and does them all   *
+ * at once. A thread that can't be started has its slice done on the calling   *
+ * thread instead. It returns what the whole text had, the same as the kernel  *
+ * would have for it in one piece.                                             *
+ ******************************************************************************/
+static enum cipherResult runSlices(enum cipherOperation operation, const char* input, const char* key, char* output,
+                                   size_t size){
+    struct cipherSlice slices[MAX_CIPHER_THREADS]; // each thread's share of the text
+    pthread_t threads[MAX_CIPHER_THREADS];         // the thread doing each slice but the first
+    bool started[MAX_CIPHER_THREADS];              // true if a slice's thread was started
+    size_t numSlices = size / CIPHER_SLICE_SIZE;   // how many threads the text is split among
+    size_t sliceSize;                   // the characters in every slice but the last
+    size_t offset = 0;                  // where the next slice starts
+    bool badText = false;               // true if any slice had a bad character in its text
+    bool badKey = false;                // true if any slice had a bad character in its key
+
+    if(numSlices > cipherThreads) numSlices = cipherThreads;
+    sliceSize = (size / numSlices + 63) & ~(size_t)63;
+    for(size_t i = 0; i < numSlices; i++){
+        slices[i].operation = operation;
+        slices[i].input = input + offset;
+        slices[i].key = key == NULL ? NULL : key + offset;
+        slices[i].output = output == NULL ? NULL : output + offset;
+        slices[i].size = i == numSlices - 1 ? size - offset : sliceSize;
+        offset += slices[i].size;
+    }
+
+    // the calling thread does the first slice while the others do theirs
+    for(size_t i = 1; i < numSlices; i++){
+        started[i] = pthread_create(&threads[i], NULL, runSlice, &slices[i]) == 0;
+    }
+    runSlice(&slices[0]);
+    for(size_t i = 1; i < numSlices; i++){
+        if(started[i]) pthread_join(threads[i], NULL);
+        else runSlice(&slices[i]);
+    }
+
+    for(size_t i = 0; i < numSlices; i++){
+        if(slices[i].result == CIPHER_BAD_TEXT) badText = true;
+        if(slices[i].result == CIPHER_BAD_KEY) badKey = true;
+    }
+    return combineResults(badText, badKey, CIPHER_OK);
+}
+
+/*******************************************************************************
+ *                                  runSlice                                   *
+ * This function runs one slice of a text through the version of the cipher in *
+ * use. It's the start routine of each thread runSlices() starts.              *
+ ******************************************************************************/
+static void* runSlice(void* arg){
+    struct cipherSlice* slice = arg;    // the slice to do
+
+    switch(slice->operation){
+        case OPERATION_ENCRYPT:
+            slice->result = kernels->encrypt(slice->input, slice->key, slice->output, slice->size);
+            break;
+        case OPERATION_DECRYPT:
+            slice->result = kernels->decrypt(slice->input, slice->key, slice->output, slice->size);
+            break;
+        case OPERATION_VALID:
+            slice->result = kernels->valid(slice->input, slice->size) ? CIPHER_OK : CIPHER_BAD_TEXT;
+            break;
+        case OPERATION_XOR:
+            kernels->xor(slice->input, slice->key, slice->output, slice->size);
+            slice->result = CIPHER_OK;
+            break;
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+ *                                  combineResults                             *
+ * This function combines what a vector loop found with the result of the      *
+ * scalar loop that finished off the last few characters.                      *
+ ******************************************************************************/
+static enum cipherResult combineResults(bool badText, bool badKey, enum cipherResult tail){
+    if(badText || tail == CIPHER_BAD_TEXT) return CIPHER_BAD_TEXT;
+    if(badKey || tail == CIPHER_BAD_KEY) return CIPHER_BAD_KEY;
+    return CIPHER_OK;
+}
+
+static bool alwaysSupported(void){ return true; }
+
+/*******************************************************************************
+ *                                  encryptScalar                              *
+ * This function encrypts one character at a time.                            *
+ ******************************************************************************/
+static enum cipherResult encryptScalar(const char* plaintext, const char* key, char* ciphertext, size_t size){
+    bool badText = false;               // true if the plaintext has a bad character
+    bool badKey = false;                // true if the key has a bad character
+
+    // create ciphertext from the plaintext and the key
+    // we have 27 possible values with the space being value 0 and the uppercase letters A-Z being 1-26
+    // instead of using the values 0-26, we'll use ASCII values 65-90 representing letters A-Z and we'll
+    // treat the space as if it comes before the letters (ASCII 64), so we're using the values 64-90
+    for(size_t i = 0; i < size; i++){
+        if((plaintext[i] < 65 || plaintext[i] > 90) && plaintext[i] != 32) badText = true;
+        if((key[i] < 65 || key[i] > 90) && key[i] != 32) badKey = true;
+
+        if(key[i] == 32){       // if the key is a space, the ciphertext will equal the plaintext
+            ciphertext[i] = plaintext[i];
+        }
+        else if(plaintext[i] == 32){    // if the plaintext is a space, the ciphertext will equal the key
+            ciphertext[i] = key[i];
+        }
+        else{
+            ciphertext[i] = plaintext[i] + key[i] - 64;
+            if(ciphertext[i] > 90){
+                ciphertext[i] = ciphertext[i] % 91 + 64;
+            }
+            if(ciphertext[i] == 64){    // if we get a value of 64, change it to 32 (a space)
+                ciphertext[i] = 32;
+            }
+        }
+    }
+    return combineResults(badText, badKey, CIPHER_OK);
+}
+
+/*******************************************************************************
+ *                                  decryptScalar                              *
+ * This function decrypts one character at a time.                            *
+ ******************************************************************************/
+static enum cipherResult decryptScalar(const char* ciphertext, const char* key, char* plaintext, size_t size){
+    bool badText = false;               // true if the ciphertext has a bad character
+    bool badKey = false;                // true if the key has a bad character
+
+    // create plaintext from the ciphertext and the key, using the same values as encryptScalar()
+    for(size_t i = 0; i < size; i++){
+        if((ciphertext[i] < 65 || ciphertext[i] > 90) && ciphertext[i] != 32) badText = true;
+        if((key[i] < 65 || key[i] > 90) && key[i] != 32) badKey = true;
+
+        if(key[i] == 32){       // if the key is a space, the plaintext will equal the ciphertext
+            plaintext[i] = ciphertext[i];
+        }
+        else if(ciphertext[i] == 32){   // if the ciphertext is a space, treat the space as ASCII value 64
+            plaintext[i] = 91 - (key[i] - 64);
+        }
+        else{
+            plaintext[i] = ciphertext[i] - key[i] + 64;
+            if(plaintext[i] < 64){
+                plaintext[i] = plaintext[i] + 27;
+            }
+            if(plaintext[i] == 64){     // if we get a value of 64, change it to 32 (a space)
+                plaintext[i] = 32;
+            }
+        }
+    }
+    return combineResults(badText, badKey, CIPHER_OK);
+}
+
+/*******************************************************************************
+ *                                  validScalar                                *
+ * This function checks one character at a time.                             *
+ ******************************************************************************/
+static bool validScalar(const char* text, size_t size){
+    for(size_t i = 0; i < size; i++){
+        if((text[i] < 65 || text[i] > 90) && text[i] != 32){
+            return false;
+        }
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                                  xorScalar                                  *
+ * This function XORs one byte at a time.                                      *
+ ******************************************************************************/
+static void xorScalar(const char* input, const char* key, char* output, size_t size){
+    for(size_t i = 0; i < size; i++){
+        output[i] = input[i] ^ key[i];
+    }
+}
+
+/*******************************************************************************
+ *                                  packScalar                                 *
+ * This function packs one group at a time.                                    *
+ ******************************************************************************/
+static void packScalar(const char* text, size_t numGroups, char* groups){
+    uint64_t bits;                      // the group's values, the first in the lowest bits
+
+    for(size_t g = 0; g < numGroups; g++){
+        bits = 0;
+        for(size_t j = 0; j < PACKED_GROUP_CHARS; j++){
+            bits |= symbolValue(text[g * PACKED_GROUP_CHARS + j]) << (5 * j);
+        }
+        for(size_t b = 0; b < PACKED_GROUP_SIZE; b++){
+            groups[g * PACKED_GROUP_SIZE + b] = (char)(bits >> (8 * b));
+        }
+    }
+}
+
+/*******************************************************************************
+ *                                  unpackScalar                               *
+ * This function unpacks one group at a time.                                  *
+ ******************************************************************************/
+static bool unpackScalar(const char* groups, size_t numGroups, char* text){
+    uint64_t bits;                      // the group's values, the first in the lowest bits
+    uint64_t value;                     // one of its values
+    bool bad = false;                   // true if a value isn't 0-26
+
+    for(size_t g = 0; g < numGroups; g++){
+        bits = 0;
+        for(size_t b = 0; b < PACKED_GROUP_SIZE; b++){
+            bits |= (uint64_t)(unsigned char)groups[g * PACKED_GROUP_SIZE + b] << (8 * b);
+        }
+        for(size_t j = 0; j < PACKED_GROUP_CHARS; j++){
+            value = bits >> (5 * j) & 31;
+            if(value > 26) bad = true;
+            text[g * PACKED_GROUP_CHARS + j] = value == 0 ? ' ' : (char)(value + 64);
+        }
+    }
+    return !bad;
+}
+
+#ifdef CIPHER_X86
+/*******************************************************************************
+ * The vector versions work on the values 0-26 instead of ASCII. A character   *
+ * is good if it's a space or if subtracting 'A' leaves 0-25 (unsigned). Its   *
+ * value is 0 for a space and the character minus 64 otherwise. Encrypting     *
+ * adds the values and takes away 27 if the sum is over 26, decrypting         *
+ * subtracts them and adds 27 if the difference is negative. A result of 0 is  *
+ * written as a space and anything else has 64 added to it. For good input     *
+ * this matches the scalar loops exactly. For bad input the output doesn't     *
+ * matter, since the caller is told about the bad character.                   *
+ ******************************************************************************/
+static bool sse2Supported(void){ return __builtin_cpu_supports("sse2"); }
+static bool avx2Supported(void){ return __builtin_cpu_supports("avx2"); }
+static bool avx512Supported(void){ return __builtin_cpu_supports("avx512bw"); }
+
+// returns the values 0-26 of 16 characters, and sets bits in bad for any bad characters
+__attribute__((target("sse2")))
+static inline __m128i valuesSSE2(__m128i chars, __m128i* bad){
+    __m128i isSpace = _mm_cmpeq_epi8(chars, _mm_set1_epi8(32));
+    __m128i letter = _mm_sub_epi8(chars, _mm_set1_epi8(65));
+    __m128i isLetter = _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(25)), letter);
+    *bad = _mm_or_si128(*bad, _mm_andnot_si128(_mm_or_si128(isSpace, isLetter), _mm_set1_epi8(-1)));
+    return _mm_andnot_si128(isSpace, _mm_sub_epi8(chars, _mm_set1_epi8(64)));
+}
+
+// turns 16 values 0-26 back into characters
+__attribute__((target("sse2")))
+static inline __m128i charsSSE2(__m128i values){
+    __m128i isZero = _mm_cmpeq_epi8(values, _mm_setzero_si128());
+    return _mm_sub_epi8(_mm_add_epi8(values, _mm_set1_epi8(64)), _mm_and_si128(isZero, _mm_set1_epi8(32)));
+}
+
+__attribute__((target("sse2")))
+static enum cipherResult encryptSSE2(const char* plaintext, const char* key, char* ciphertext, size_t size){
+    __m128i badText = _mm_setzero_si128(), badKey = _mm_setzero_si128();
+    __m128i sum;
+    size_t i = 0;
+
+    for(; i + 16 <= size; i += 16){
+        sum = _mm_add_epi8(valuesSSE2(_mm_loadu_si128((const __m128i*)(plaintext + i)), &badText),
+                           valuesSSE2(_mm_loadu_si128((const __m128i*)(key + i)), &badKey));
+        sum = _mm_sub_epi8(sum, _mm_and_si128(_mm_cmpgt_epi8(sum, _mm_set1_epi8(26)), _mm_set1_epi8(27)));
+        _mm_storeu_si128((__m128i*)(ciphertext + i), charsSSE2(sum));
+    }
+    return combineResults(_mm_movemask_epi8(badText) != 0, _mm_movemask_epi8(badKey) != 0,
+                          encryptScalar(plaintext + i, key + i, ciphertext + i, size - i));
+}
+
+__attribute__((target("sse2")))
+static enum cipherResult decryptSSE2(const char* ciphertext, const char* key, char* plaintext, size_t size){
+    __m128i badText = _mm_setzero_si128(), badKey = _mm_setzero_si128();
+    __m128i difference;
+    size_t i = 0;
+
+    for(; i + 16 <= size; i += 16){
+        difference = _mm_sub_epi8(valuesSSE2(_mm_loadu_si128((const __m128i*)(ciphertext + i)), &badText),
+                                  valuesSSE2(_mm_loadu_si128((const __m128i*)(key + i)), &badKey));
+        difference = _mm_add_epi8(difference, _mm_and_si128(_mm_cmpgt_epi8(_mm_setzero_si128(), difference),
+                                                            _mm_set1_epi8(27)));
+        _mm_storeu_si128((__m128i*)(plaintext + i), charsSSE2(difference));
+    }
+    return combineResults(_mm_movemask_epi8(badText) != 0, _mm_movemask_epi8(badKey) != 0,
+                          decryptScalar(ciphertext + i, key + i, plaintext + i, size - i));
+}
+
+__attribute__((target("sse2")))
+static bool validSSE2(const char* text, size_t size){
+    __m128i bad = _mm_setzero_si128();
+    size_t i = 0;
+
+    for(; i + 16 <= size; i += 16){
+        valuesSSE2(_mm_loadu_si128((const __m128i*)(text + i)), &bad);
+    }
+    return _mm_movemask_epi8(bad) == 0 && validScalar(text + i, size - i);
+}
+
+__attribute__((target("sse2")))
+static void xorSSE2(const char* input, const char* key, char* output, size_t size){
+    size_t i = 0;
+
+    for(; i + 16 <= size; i += 16){
+        _mm_storeu_si128((__m128i*)(output + i), _mm_xor_si128(_mm_loadu_si128((const __m128i*)(input + i)),
+                                                               _mm_loadu_si128((const __m128i*)(key + i))));
+    }
+    xorScalar(input + i, key + i, output + i, size - i);
+}
+
+// puts the 8 values in each 64 bit lane together in its low 40 bits
+__attribute__((target("sse2")))
+static inline __m128i groupsSSE2(__m128i values){
+    values = _mm_or_si128(_mm_and_si128(values, _mm_set1_epi16(0xFF)), _mm_slli_epi16(_mm_srli_epi16(values, 8), 5));
+    values = _mm_or_si128(_mm_and_si128(values, _mm_set1_epi32(0xFFFF)),
+                          _mm_slli_epi32(_mm_srli_epi32(values, 16), 10));
+    return _mm_or_si128(_mm_and_si128(values, _mm_set1_epi64x(0xFFFFFFFF)),
+                        _mm_slli_epi64(_mm_srli_epi64(values, 32), 20));
+}
+
+// spreads the low 40 bits of each 64 bit lane back out into 8 values
+__attribute__((target("sse2")))
+static inline __m128i ungroupSSE2(__m128i groups){
+    groups = _mm_or_si128(_mm_and_si128(groups, _mm_set1_epi64x(0xFFFFF)),
+                          _mm_slli_epi64(_mm_srli_epi64(groups, 20), 32));
+    groups = _mm_or_si128(_mm_and_si128(groups, _mm_set1_epi32(0x3FF)), _mm_slli_epi32(_mm_srli_epi32(groups, 10), 16));
+    return _mm_or_si128(_mm_and_si128(groups, _mm_set1_epi16(0x1F)), _mm_slli_epi16(_mm_srli_epi16(groups, 5), 8));
+}
+
+// each 8 byte store overlaps the next group, so the last group is always left to the scalar loop
+__attribute__((target("sse2")))
+static void packSSE2(const char* text, size_t numGroups, char* groups){
+    __m128i bad = _mm_setzero_si128();  // not used, the text has already been checked
+    __m128i packed;
+    size_t g = 0;
+
+    for(; g + 3 <= numGroups; g += 2){
+        packed = groupsSSE2(valuesSSE2(_mm_loadu_si128((const __m128i*)(text + g * PACKED_GROUP_CHARS)), &bad));
+        _mm_storel_epi64((__m128i*)(groups + g * PACKED_GROUP_SIZE), packed);
+        _mm_storel_epi64((__m128i*)(groups + (g + 1) * PACKED_GROUP_SIZE), _mm_unpackhi_epi64(packed, packed));
+    }
+    packScalar(text + g * PACKED_GROUP_CHARS, numGroups - g, groups + g * PACKED_GROUP_SIZE);
+}
+
+__attribute__((target("sse2")))
+static bool unpackSSE2(const char* groups, size_t numGroups, char* text){
+    __m128i bad = _mm_setzero_si128();
+    __m128i values;
+    size_t g = 0;
+
+    for(; g + 3 <= numGroups; g += 2){
+        values = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)(groups + g * PACKED_GROUP_SIZE)),
+                                    _mm_loadl_epi64((const __m128i*)(groups + (g + 1) * PACKED_GROUP_SIZE)));
+        values = ungroupSSE2(_mm_and_si128(values, _mm_set1_epi64x(0xFFFFFFFFFF)));
+        bad = _mm_or_si128(bad, _mm_cmpgt_epi8(values, _mm_set1_epi8(26)));
+        _mm_storeu_si128((__m128i*)(text + g * PACKED_GROUP_CHARS), charsSSE2(values));
+    }
+    return unpackScalar(groups + g * PACKED_GROUP_SIZE, numGroups - g, text + g * PACKED_GROUP_CHARS) &&
+           _mm_movemask_epi8(bad) == 0;
+}
+
+// returns the values 0-26 of 32 characters, and sets bits in bad for any bad characters
+__attribute__((target("avx2")))
+static inline __m256i valuesAVX2(__m256i chars, __m256i* bad){
+    __m256i isSpace = _mm256_cmpeq_epi8(chars, _mm256_set1_epi8(32));
+    __m256i letter = _mm256_sub_epi8(chars, _mm256_set1_epi8(65));
+    __m256i isLetter = _mm256_cmpeq_epi8(_mm256_min_epu8(letter, _mm256_set1_epi8(25)), letter);
+    *bad = _mm256_or_si256(*bad, _mm256_andnot_si256(_mm256_or_si256(isSpace, isLetter), _mm256_set1_epi8(-1)));
+    return _mm256_andnot_si256(isSpace, _mm256_sub_epi8(chars, _mm256_set1_epi8(64)));
+}
+
+// turns 32 values 0-26 back into characters
+__attribute__((target("avx2")))
+static inline __m256i charsAVX2(__m256i values){
+    __m256i isZero = _mm256_cmpeq_epi8(values, _mm256_setzero_si256());
+    return _mm256_sub_epi8(_mm256_add_epi8(values, _mm256_set1_epi8(64)), _mm256_and_si256(isZero, _mm256_set1_epi8(32)));
+}
+
+__attribute__((target("avx2")))
+static enum cipherResult encryptAVX2(const char* plaintext, const char* key, char* ciphertext, size_t size){
+    __m256i badText = _mm256_setzero_si256(), badKey = _mm256_setzero_si256();
+    __m256i sum;
+    size_t i = 0;
+
+    for(; i + 32 <= size; i += 32){
+        sum = _mm256_add_epi8(valuesAVX2(_mm256_loadu_si256((const __m256i*)(plaintext + i)), &badText),
+                              valuesAVX2(_mm256_loadu_si256((const __m256i*)(key + i)), &badKey));
+        sum = _mm256_sub_epi8(sum, _mm256_and_si256(_mm256_cmpgt_epi8(sum, _mm256_set1_epi8(26)), _mm256_set1_epi8(27)));
+        _mm256_storeu_si256((__m256i*)(ciphertext + i), charsAVX2(sum));
+    }
+    return combineResults(_mm256_movemask_epi8(badText) != 0, _mm256_movemask_epi8(badKey) != 0,
+                          encryptScalar(plaintext + i, key + i, ciphertext + i, size - i));
+}
+
+__attribute__((target("avx2")))
+static enum cipherResult decryptAVX2(const char* ciphertext, const char* key, char* plaintext, size_t size){
+    __m256i badText = _mm256_setzero_si256(), badKey = _mm256_setzero_si256();
+    __m256i difference;
+    size_t i = 0;
+
+    for(; i + 32 <= size; i += 32){
+        difference = _mm256_sub_epi8(valuesAVX2(_mm256_loadu_si256((const __m256i*)(ciphertext + i)), &badText),
+                                     valuesAVX2(_mm256_loadu_si256((const __m256i*)(key + i)), &badKey));
+        difference = _mm256_add_epi8(difference, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_setzero_si256(), difference),
+                                                                  _mm256_set1_epi8(27)));
+        _mm256_storeu_si256((__m256i*)(plaintext + i), charsAVX2(difference));
+    }
+    return combineResults(_mm256_movemask_epi8(badText) != 0, _mm256_movemask_epi8(badKey) != 0,
+                          decryptScalar(ciphertext + i, key + i, plaintext + i, size - i));
+}
+
+__attribute__((target("avx2")))
+static bool validAVX2(const char* text, size_t size){
+    __m256i bad = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for(; i + 32 <= size; i += 32){
+        valuesAVX2(_mm256_loadu_si256((const __m256i*)(text + i)), &bad);
+    }
+    return _mm256_movemask_epi8(bad) == 0 && validScalar(text + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static void xorAVX2(const char* input, const char* key, char* output, size_t size){
+    size_t i = 0;
+
+    for(; i + 32 <= size; i += 32){
+        _mm256_storeu_si256((__m256i*)(output + i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(input + i)),
+                                                                     _mm256_loadu_si256((const __m256i*)(key + i))));
+    }
+    xorScalar(input + i, key + i, output + i, size - i);
+}
+
+// puts the 8 values in each 64 bit lane together in its low 40 bits
+__attribute__((target("avx2")))
+static inline __m256i groupsAVX2(__m256i values){
+    values = _mm256_or_si256(_mm256_and_si256(values, _mm256_set1_epi16(0xFF)),
+                             _mm256_slli_epi16(_mm256_srli_epi16(values, 8), 5));
+    values = _mm256_or_si256(_mm256_and_si256(values, _mm256_set1_epi32(0xFFFF)),
+                             _mm256_slli_epi32(_mm256_srli_epi32(values, 16), 10));
+    return _mm256_or_si256(_mm256_and_si256(values, _mm256_set1_epi64x(0xFFFFFFFF)),
+                           _mm256_slli_epi64(_mm256_srli_epi64(values, 32), 20));
+}
+
+// spreads the low 40 bits of each 64 bit lane back out into 8 values
+__attribute__((target("avx2")))
+static inline __m256i ungroupAVX2(__m256i groups){
+    groups = _mm256_or_si256(_mm256_and_si256(groups, _mm256_set1_epi64x(0xFFFFF)),
+                             _mm256_slli_epi64(_mm256_srli_epi64(groups, 20), 32));
+    groups = _mm256_or_si256(_mm256_and_si256(groups, _mm256_set1_epi32(0x3FF)),
+                             _mm256_slli_epi32(_mm256_srli_epi32(groups, 10), 16));
+    return _mm256_or_si256(_mm256_and_si256(groups, _mm256_set1_epi16(0x1F)),
+                           _mm256_slli_epi16(_mm256_srli_epi16(groups, 5), 8));
+}
+
+__attribute__((target("avx2")))
+static void packAVX2(const char* text, size_t numGroups, char* groups){
+    __m256i bad = _mm256_setzero_si256(); // not used, the text has already been checked
+    __m128i low, high;
+    size_t g = 0;
+
+    for(; g + 5 <= numGroups; g += 4){
+        __m256i packed = groupsAVX2(valuesAVX2(_mm256_loadu_si256((const __m256i*)(text + g * PACKED_GROUP_CHARS)),
+                                               &bad));
+        low = _mm256_castsi256_si128(packed);
+        high = _mm256_extracti128_si256(packed, 1);
+        _mm_storel_epi64((__m128i*)(groups + g * PACKED_GROUP_SIZE), low);
+        _mm_storel_epi64((__m128i*)(groups + (g + 1) * PACKED_GROUP_SIZE), _mm_unpackhi_epi64(low, low));
+        _mm_storel_epi64((__m128i*)(groups + (g + 2) * PACKED_GROUP_SIZE), high);
+        _mm_storel_epi64((__m128i*)(groups + (g + 3) * PACKED_GROUP_SIZE), _mm_unpackhi_epi64(high, high));
+    }
+    packSSE2(text + g * PACKED_GROUP_CHARS, numGroups - g, groups + g * PACKED_GROUP_SIZE);
+}
+
+__attribute__((target("avx2")))
+static bool unpackAVX2(const char* groups, size_t numGroups, char* text){
+    __m256i bad = _mm256_setzero_si256();
+    __m256i values;
+    __m128i low, high;
+    size_t g = 0;
+
+    for(; g + 5 <= numGroups; g += 4){
+        low = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)(groups + g * PACKED_GROUP_SIZE)),
+                                 _mm_loadl_epi64((const __m128i*)(groups + (g + 1) * PACKED_GROUP_SIZE)));
+        high = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)(groups + (g + 2) * PACKED_GROUP_SIZE)),
+                                  _mm_loadl_epi64((const __m128i*)(groups + (g + 3) * PACKED_GROUP_SIZE)));
+        values = _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+        values = ungroupAVX2(_mm256_and_si256(values, _mm256_set1_epi64x(0xFFFFFFFFFF)));
+        bad = _mm256_or_si256(bad, _mm256_cmpgt_epi8(values, _mm256_set1_epi8(26)));
+        _mm256_storeu_si256((__m256i*)(text + g * PACKED_GROUP_CHARS), charsAVX2(values));
+    }
+    return unpackSSE2(groups + g * PACKED_GROUP_SIZE, numGroups - g, text + g * PACKED_GROUP_CHARS) &&
+           _mm256_movemask_epi8(bad) == 0;
+}
+
+// returns the values 0-26 of 64 characters, and sets bits in bad for any bad characters
+__attribute__((target("avx512bw")))
+static inline __m512i valuesAVX512(__m512i chars, __mmask64* bad){
+    __mmask64 isSpace = _mm512_cmpeq_epi8_mask(chars, _mm512_set1_epi8(32));
+    __mmask64 isLetter = _mm512_cmple_epu8_mask(_mm512_sub_epi8(chars, _mm512_set1_epi8(65)), _mm512_set1_epi8(25));
+    *bad |= ~(isSpace | isLetter);
+    return _mm512_maskz_sub_epi8(~isSpace, chars, _mm512_set1_epi8(64));
+}
+
+// turns 64 values 0-26 back into characters
+__attribute__((target("avx512bw")))
+static inline __m512i charsAVX512(__m512i values){
+    return _mm512_mask_blend_epi8(_mm512_cmpeq_epi8_mask(values, _mm512_setzero_si512()),
+                                  _mm512_add_epi8(values, _mm512_set1_epi8(64)), _mm512_set1_epi8(32));
+}
+
+__attribute__((target("avx512bw")))
+static enum cipherResult encryptAVX512(const char* plaintext, const char* key, char* ciphertext, size_t size){
+    __mmask64 badText = 0, badKey = 0;
+    __m512i sum;
+    size_t i = 0;
+
+    for(; i + 64 <= size; i += 64){
+        sum = _mm512_add_epi8(valuesAVX512(_mm512_loadu_si512((const void*)(plaintext + i)), &badText),
+                              valuesAVX512(_mm512_loadu_si512((const void*)(key + i)), &badKey));
+        sum = _mm512_mask_sub_epi8(sum, _mm512_cmpgt_epu8_mask(sum, _mm512_set1_epi8(26)), sum, _mm512_set1_epi8(27));
+        _mm512_storeu_si512((void*)(ciphertext + i), charsAVX512(sum));
+    }
+    return combineResults(badText != 0, badKey != 0,
+                          encryptAVX2(plaintext + i, key + i, ciphertext + i, size - i));
+}
+
+__attribute__((target("avx512bw")))
+static enum cipherResult decryptAVX512(const char* ciphertext, const char* key, char* plaintext, size_t size){
+    __mmask64 badText = 0, badKey = 0;
+    __m512i difference;
+    size_t i = 0;
+
+    for(; i + 64 <= size; i += 64){
+        difference = _mm512_sub_epi8(valuesAVX512(_mm512_loadu_si512((const void*)(ciphertext + i)), &badText),
+                                     valuesAVX512(_mm512_loadu_si512((const void*)(key + i)), &badKey));
+        difference = _mm512_mask_add_epi8(difference, _mm512_cmplt_epi8_mask(difference, _mm512_setzero_si512()),
+                                          difference, _mm512_set1_epi8(27));
+        _mm512_storeu_si512((void*)(plaintext + i), charsAVX512(difference));
+    }
+    return combineResults(badText != 0, badKey != 0,
+                          decryptAVX2(ciphertext + i, key + i, plaintext + i, size - i));
+}
+
+__attribute__((target("avx512bw")))
+static bool validAVX512(const char* text, size_t size){
+    __mmask64 bad = 0;
+    size_t i = 0;
+
+    for(; i + 64 <= size; i += 64){
+        valuesAVX512(_mm512_loadu_si512((const void*)(text + i)), &bad);
+    }
+    return bad == 0 && validAVX2(text + i, size - i);
+}
+
+__attribute__((target("avx512bw")))
+static void xorAVX512(const char* input, const char* key, char* output, size_t size){
+    size_t i = 0;
+
+    for(; i + 64 <= size; i += 64){
+        _mm512_storeu_si512((void*)(output + i), _mm512_xor_si512(_mm512_loadu_si512((const void*)(input + i)),
+                                                                  _mm512_loadu_si512((const void*)(key + i))));
+    }
+    xorAVX2(input + i, key + i, output + i, size - i);
+}
+#endif
@@ -0,0 +1,73 @@
+/*******************************************************************************
+** Program name: otp_cipher.h
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  Declarations for the one time pad cipher used by otp. Text is
+**               made of the 27 characters A-Z and space, with the space being
+**               value 0 and A-Z being 1-26. Encrypting adds the key to the
+**               plaintext mod 27 and decrypting subtracts it.
+**
+**               Binary text can hold any byte. It's encrypted and decrypted by
+**               XORing it with a key of random bytes, so xorText() does both,
+**               and there are no bad characters to check for.
+**
+**               Every function works on buffers the caller owns, and the output
+**               of encryptText(), decryptText() and xorText() may be the same
+**               buffer as their input, to encrypt or decrypt in place. Each version of
+**               the cipher reads a character (or a vector of them) before it
+**               writes the result over it, so nothing is read after it's
+**               overwritten. The output must not overlap the key.
+**
+**               Every character is handled on its own, so a long text can be
+**               cut into slices that are done at the same time. After
+**               setCipherThreads(), a text of at least two CIPHER_SLICE_SIZE
+**               slices is split among that many threads, one slice each at
+**               most, and anything shorter is done on the calling thread as
+**               before. Until it's called only the calling thread is used.
+**
+**               Each of the 27 characters only needs 5 bits, so a text can be
+**               packed into groups of 8 characters in 5 bytes, with the first
+**               character in the lowest bits. A packed text starts with
+**               PACKED_MARKER, which A-Z and space never are, so it can always
+**               be told apart from one that isn't packed. A last group with
+**               fewer than 8 characters has its empty slots filled with the
+**               value 31, which no character has, so the packed text says
+**               exactly how long it is.
+*******************************************************************************/
+#ifndef OTP_CIPHER_H
+#define OTP_CIPHER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MAX_CIPHER_THREADS 256          // the most threads setCipherThreads() will use
+#define CIPHER_SLICE_SIZE ((size_t)4 << 20) // the least each thread is given, so short texts aren't split
+#define PACKED_MARKER '#'               // the first byte of a packed text
+#define PACKED_GROUP_CHARS 8            // the characters packed into each group
+#define PACKED_GROUP_SIZE 5             // the bytes each group takes
+
+// the result of encrypting or decrypting, the text is checked before the key
+enum cipherResult {
+    CIPHER_OK,                          // every character was A-Z or space
+    CIPHER_BAD_TEXT,                    // the plaintext or ciphertext has a bad character
+    CIPHER_BAD_KEY                      // the key has a bad character
+};
+
+// function prototypes:
+enum cipherResult encryptText(const char* plaintext, const char* key, char* ciphertext, size_t size);
+enum cipherResult decryptText(const char* ciphertext, const char* key, char* plaintext, size_t size);
+bool validText(const char* text, size_t size);
+void xorText(const char* input, const char* key, char* output, size_t size);
+const char* cipherKernelName(void);
+bool useCipherKernel(const char* name);
+void setCipherThreads(unsigned int threads);
+size_t packedSize(size_t size);
+size_t unpackedSize(size_t packedSize);
+void packText(const char* text, size_t size, char* packed);
+bool unpackText(const char* packed, size_t packedSize, char* text, size_t* size);
+bool unpackGroups(const char* groups, size_t groupsSize, char* text, size_t* size);
+bool validPackedText(const char* packed, size_t packedSize);
+unsigned int cipherThreadCount(void);
+
+#endif
@@ -0,0 +1,424 @@
+/*******************************************************************************
+** Program name: otp_client.c
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  Functions for the client API, see otp_client.h. None of them
+**               keep any state outside the connection, so two threads can use
+**               one connection as long as one only sends and the other only
+**               receives.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include "otp_cipher.h"
+#include "otp_protocol.h"
+#include "otp_client.h"
+
+// function prototypes:
+static enum otpStatus sendFailed(struct otpConnection* conn);
+static enum otpStatus recvFailed(void);
+static enum otpStatus recvResponseHeader(struct otpConnection* conn, struct responseHeader* response);
+static enum otpStatus unpackAnswer(struct otpConnection* conn, char** ciphertext, size_t* ciphertextSize);
+
+/*******************************************************************************
+ *                                  otpConnect                                 *
+ * This function connects to otp_d on the given port of host, or of this       *
+ * machine if host is NULL. OTP_FAILED is returned if the host can't be found, *
+ * with errno set to EHOSTUNREACH, or if nothing there takes the connection.   *
+ ******************************************************************************/
+enum otpStatus otpConnect(struct otpConnection* conn, const char* host, int portNumber){
+    struct addrinfo hints;
+    struct addrinfo* addresses;         // the addresses host was resolved to
+    char port[16];                      // the port number as text, for getaddrinfo()
+    int savedErrno = ECONNREFUSED;
+
+    conn->fd = -1;
+    conn->retryAfter = 0;
+    conn->flags = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;          // otp_d only listens on IPv4
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", portNumber);
+    if(getaddrinfo(host != NULL ? host : "localhost", port, &hints, &addresses) != 0){
+        errno = EHOSTUNREACH;
+        return OTP_FAILED;
+    }
+
+    // try each address until one takes the connection
+    for(struct addrinfo* address = addresses; address != NULL && conn->fd < 0; address = address->ai_next){
+        conn->fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if(conn->fd < 0){
+            savedErrno = errno;
+            continue;
+        }
+        if(connect(conn->fd, address->ai_addr, address->ai_addrlen) < 0){
+            savedErrno = errno;
+            close(conn->fd);
+            conn->fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+
+    if(conn->fd < 0){
+        errno = savedErrno;
+        return OTP_FAILED;
+    }
+    return OTP_OK;
+}
+
+/*******************************************************************************
+ *                                  otpClose                                   *
+ * This function closes a connection, whatever state it's in.                  *
+ ******************************************************************************/
+void otpClose(struct otpConnection* conn){
+    if(conn->fd >= 0) close(conn->fd);
+    conn->fd = -1;
+}
+
+/*******************************************************************************
+ *                                  otpSendRequest                             *
+ * This function sends a request to otp_d: the header, the username and, for a *
+ * 'post', the ciphertext, all with one call to sendmsg() if the socket has    *
+ * room for it. Posts of either kind ask to be answered once they're stored,   *
+ * so each one has to be followed by otpRecvAck(). The connection's flags are  *
+ * sent along with the request.                                                *
+ ******************************************************************************/
+enum otpStatus otpSendRequest(struct otpConnection* conn, char mode, const char* user, const char* body,
+                              size_t bodySize){
+    unsigned char header[REQUEST_HEADER_SIZE];
+    uint32_t flags = conn->flags | (mode == MODE_POST || mode == MODE_STREAM_POST ? FLAG_ACK : 0);
+    struct requestHeader request = {PROTOCOL_VERSION, mode, flags, strlen(user), bodySize};
+    struct iovec iov[3] = {
+        {header, REQUEST_HEADER_SIZE},
+        {(void*)user, request.userSize},
+        {(void*)body, bodySize}
+    };
+
+    encodeRequestHeader(&request, header);
+    if(!sendvAll(conn->fd, iov, 3)) return sendFailed(conn);
+    return OTP_OK;
+}
+
+/*******************************************************************************
+ *                                  otpSendChunk                               *
+ * This function sends the size of a chunk and the chunk in one go. An empty   *
+ * chunk ends a streamed post.                                                 *
+ ******************************************************************************/
+enum otpStatus otpSendChunk(struct otpConnection* conn, const char* chunk, size_t chunkSize){
+    unsigned char header[sizeof(uint64_t)];
+    struct iovec iov[2] = {
+        {header, chunkHeaderSize(PROTOCOL_VERSION)},
+        {(void*)chunk, chunkSize}
+    };
+
+    encodeChunkHeader(PROTOCOL_VERSION, chunkSize, header);
+    if(!sendvAll(conn->fd, iov, 2)) return sendFailed(conn);
+    return OTP_OK;
+}
+
+/*******************************************************************************
+ *                                  otpRecvAck                                 *
+ * This function receives otp_d's answer to a post. OTP_OK means otp_d says    *
+ * the ciphertext is stored. If the connection closed instead, which is how    *
+ * otp_d says the post may have been lost, OTP_FAILED is returned with errno   *
+ * set to ECONNRESET.                                                          *
+ ******************************************************************************/
+enum otpStatus otpRecvAck(struct otpConnection* conn){
+    struct responseHeader response;
+    enum otpStatus status;
+
+    status = recvResponseHeader(conn, &response);
+    if(status != OTP_OK) return status;
+    if(response.status != 's' || response.bodySize != 0){
+        errno = EPROTO;
+        return OTP_FAILED;
+    }
+    return OTP_OK;
+}
+
+/*******************************************************************************
+ *                                  otpRecvAnswer                              *
+ * This function receives the header of otp_d's answer to a 'get' or a stats   *
+ * request. OTP_OK means the body follows, and bodySize is set to its size, or *
+ * for a streamed 'get' the chunks follow. OTP_EMPTY means the user had no     *
+ * ciphertext.                                                                 *
+ ******************************************************************************/
+enum otpStatus otpRecvAnswer(struct otpConnection* conn, size_t* bodySize){
+    struct responseHeader response;
+    enum otpStatus status;
+
+    status = recvResponseHeader(conn, &response);
+    if(status != OTP_OK) return status;
+    if(response.status == 'f') return OTP_EMPTY;
+    if(response.status != 's'){
+        errno = EPROTO;
+        return OTP_FAILED;
+    }
+    *bodySize = response.bodySize;
+    return OTP_OK;
+}
+
+/*******************************************************************************
+ *                                  otpRecvBody                                *
+ * This function receives the bodySize characters that follow an answer, or a *
+ * chunk once its size has been received.                                      *
+ ******************************************************************************/
+enum otpStatus otpRecvBody(struct otpConnection* conn, void* body, size_t bodySize){
+    errno = 0;
+    if(!recvAll(conn->fd, body, bodySize)) return recvFailed();
+    return OTP_OK;
+}
+
+/*******************************************************************************
+ *                                  otpRecvChunkSize                           *
+ * This function receives the size of the next chunk of a streamed 'get', 0    *
+ * once the ciphertext is complete. A size bigger than any chunk otp_d sends   *
+ * fails with EPROTO, so the caller can size its buffer for MAX_CHUNK_SIZE.    *
+ ******************************************************************************/
+enum otpStatus otpRecvChunkSize(struct otpConnection* conn, size_t* chunkSize){
+    unsigned char header[sizeof(uint64_t)];
+    uint64_t size;
+
+    errno = 0;
+    if(!recvAll(conn->fd, header, chunkHeaderSize(PROTOCOL_VERSION))) return recvFailed();
+    size = decodeChunkHeader(PROTOCOL_VERSION, header);
+    if(size > MAX_CHUNK_SIZE){
+        errno = EPROTO;
+        return OTP_FAILED;
+    }
+    *chunkSize = size;
+    return OTP_OK;
+}
+
+/*******************************************************************************
+ *                                  otpShutdown                                *
+ * This function tells otp_d that no more requests will be sent on the         *
+ * connection. The answers to those already sent can still be received.        *
+ ******************************************************************************/
+enum otpStatus otpShutdown(struct otpConnection* conn){
+    return shutdown(conn->fd, SHUT_WR) == 0 ? OTP_OK : OTP_FAILED;
+}
+
+/*******************************************************************************
+ *                                  otpWaitForClose                            *
+ * This function waits for otp_d to close the connection, which it does once   *
+ * it has handled every request sent on it. OTP_BUSY is returned if otp_d      *
+ * turned the connection away instead, and OTP_FAILED with errno set to EPROTO *
+ * if anything else arrives.                                                   *
+ ******************************************************************************/
+enum otpStatus otpWaitForClose(struct otpConnection* conn){
+    unsigned char header[RESPONSE_HEADER_SIZE];
+    struct responseHeader response;
+    size_t received = 0;            // how much of a header has arrived
+    ssize_t i = 0;
+
+    while(received < RESPONSE_HEADER_SIZE){
+        i = recv(conn->fd, header + received, RESPONSE_HEADER_SIZE - received, 0);
+        if(i < 0 && errno == EINTR) continue;
+        if(i < 1) break;
+        received += i;
+    }
+    if(received == RESPONSE_HEADER_SIZE && decodeResponseHeader(header, &response) &&
+       response.status == STATUS_BUSY){
+        conn->retryAfter = response.bodySize;
+        return OTP_BUSY;
+    }
+    if(received == 0 && i == 0) return OTP_OK;
+    if(i >= 0) errno = EPROTO;
+    return OTP_FAILED;
+}
+
+/*******************************************************************************
+ *                                  otpPost                                    *
+ * This function posts a ciphertext for a user and waits for otp_d to say it's *
+ * stored. With FLAG_PACKED the ciphertext is packed first.                    *
+ ******************************************************************************/
+enum otpStatus otpPost(struct otpConnection* conn, const char* user, const char* ciphertext, size_t ciphertextSize){
+    enum otpStatus status;
+    char* packed;                       // the ciphertext packed, with FLAG_PACKED
+
+    if((conn->flags & FLAG_PACKED) && !(conn->flags & FLAG_BINARY)){
+        packed = malloc(packedSize(ciphertextSize));
+        if(packed == NULL) return OTP_FAILED;
+        packText(ciphertext, ciphertextSize, packed);
+        status = otpSendRequest(conn, MODE_POST, user, packed, packedSize(ciphertextSize));
+        free(packed);
+    }
+    else{
+        status = otpSendRequest(conn, MODE_POST, user, ciphertext, ciphertextSize);
+    }
+    if(status != OTP_OK) return status;
+    return otpRecvAck(conn);
+}
+
+/*******************************************************************************
+ *                                  otpGet                                     *
+ * This function takes the oldest ciphertext for a user from otp_d. On OTP_OK, *
+ * ciphertext is set to a buffer allocated with malloc(), which the caller     *
+ * frees, holding the ciphertext, unpacked if it was packed, and a null        *
+ * terminator.                                                                 *
+ ******************************************************************************/
+enum otpStatus otpGet(struct otpConnection* conn, const char* user, char** ciphertext, size_t* ciphertextSize){
+    enum otpStatus status;
+
+    status = otpSendRequest(conn, MODE_GET, user, NULL, 0);
+    if(status == OTP_OK) status = otpRecvAnswer(conn, ciphertextSize);
+    if(status != OTP_OK) return status;
+
+    *ciphertext = malloc(*ciphertextSize + 1);
+    if(*ciphertext == NULL) return OTP_FAILED;
+    status = otpRecvBody(conn, *ciphertext, *ciphertextSize);
+    if(status != OTP_OK){
+        free(*ciphertext);
+        *ciphertext = NULL;
+        return status;
+    }
+    (*ciphertext)[*ciphertextSize] = '\0';
+    return unpackAnswer(conn, ciphertext, ciphertextSize);
+}
+
+/*******************************************************************************
+ *                                  otpStats                                   *
+ * This function asks otp_d for a snapshot of its counters. On OTP_OK, text is *
+ * set to a buffer allocated with malloc(), which the caller frees, holding    *
+ * the snapshot, one "name value" per line, and a null terminator.             *
+ ******************************************************************************/
+enum otpStatus otpStats(struct otpConnection* conn, char** text, size_t* textSize){
+    enum otpStatus status;
+
+    status = otpSendRequest(conn, MODE_STATS, "", NULL, 0);
+    if(status == OTP_OK) status = otpRecvAnswer(conn, textSize);
+    if(status == OTP_EMPTY){
+        errno = EPROTO;
+        status = OTP_FAILED;
+    }
+    if(status != OTP_OK) return status;
+
+    *text = malloc(*textSize + 1);
+    if(*text == NULL) return OTP_FAILED;
+    status = otpRecvBody(conn, *text, *textSize);
+    if(status != OTP_OK){
+        free(*text);
+        *text = NULL;
+        return status;
+    }
+    (*text)[*textSize] = '\0';
+    return OTP_OK;
+}
+
+/*******************************************************************************
+ *                                  otpSendDrain                               *
+ * This function asks otp_d for all of a user's ciphertexts, at most maxCount  *
+ * of them and stopping once maxBytes or more have been sent, where 0 means no *
+ * limit. Each one is then read with otpRecvDrained().                         *
+ ******************************************************************************/
+enum otpStatus otpSendDrain(struct otpConnection* conn, const char* user, uint64_t maxCount, uint64_t maxBytes){
+    unsigned char limits[DRAIN_LIMITS_SIZE];
+
+    encodeDrainLimits(maxCount, maxBytes, limits);
+    return otpSendRequest(conn, MODE_DRAIN, user, (const char*)limits, DRAIN_LIMITS_SIZE);
+}
+
+/*******************************************************************************
+ *                                  otpRecvDrained                             *
+ * This function receives the next ciphertext of a drain, oldest first, into a *
+ * buffer allocated the same way as otpGet()'s. OTP_EMPTY means the drain is   *
+ * over and the connection is ready for another request.                       *
+ ******************************************************************************/
+enum otpStatus otpRecvDrained(struct otpConnection* conn, char** ciphertext, size_t* ciphertextSize){
+    enum otpStatus status;
+
+    status = otpRecvAnswer(conn, ciphertextSize);
+    if(status != OTP_OK) return status;
+
+    *ciphertext = malloc(*ciphertextSize + 1);
+    if(*ciphertext == NULL) return OTP_FAILED;
+    status = otpRecvBody(conn, *ciphertext, *ciphertextSize);
+    if(status != OTP_OK){
+        free(*ciphertext);
+        *ciphertext = NULL;
+        return status;
+    }
+    (*ciphertext)[*ciphertextSize] = '\0';
+    return unpackAnswer(conn, ciphertext, ciphertextSize);
+}
+
+/*******************************************************************************
+ *                                  unpackAnswer                               *
+ * This function swaps a packed ciphertext otpGet() or otpRecvDrained() has    *
+ * received for the characters packed in it, unless the connection is binary.  *
+ * A ciphertext that doesn't start with PACKED_MARKER is left as it is. If the *
+ * packing is bad the ciphertext is freed and OTP_FAILED is returned with      *
+ * errno set to EPROTO, since otp_d never stores a bad one.                    *
+ ******************************************************************************/
+static enum otpStatus unpackAnswer(struct otpConnection* conn, char** ciphertext, size_t* ciphertextSize){
+    char* unpacked;                     // the characters packed in the ciphertext
+
+    if((conn->flags & FLAG_BINARY) || *ciphertextSize == 0 || (*ciphertext)[0] != PACKED_MARKER) return OTP_OK;
+
+    unpacked = malloc(unpackedSize(*ciphertextSize) + 1);
+    if(unpacked != NULL && !unpackText(*ciphertext, *ciphertextSize, unpacked, ciphertextSize)){
+        free(unpacked);
+        unpacked = NULL;
+        errno = EPROTO;
+    }
+    free(*ciphertext);
+    *ciphertext = unpacked;
+    if(unpacked == NULL) return OTP_FAILED;
+    unpacked[*ciphertextSize] = '\0';
+    return OTP_OK;
+}
+
+/*******************************************************************************
+ *                                  sendFailed                                 *
+ * This function works out why a send failed. otp_d may have turned the        *
+ * connection away as busy, in which case its header is waiting to be read.    *
+ * Otherwise errno is left as the send set it.                                 *
+ ******************************************************************************/
+static enum otpStatus sendFailed(struct otpConnection* conn){
+    int savedErrno = errno;
+
+    if(otpWaitForClose(conn) == OTP_BUSY) return OTP_BUSY;
+    errno = savedErrno;
+    return OTP_FAILED;
+}
+
+/*******************************************************************************
+ *                                  recvFailed                                 *
+ * This function returns OTP_FAILED for a receive that didn't get everything.  *
+ * If otp_d closed the connection, which leaves errno alone, it's set to       *
+ * ECONNRESET.                                                                 *
+ ******************************************************************************/
+static enum otpStatus recvFailed(void){
+    if(errno == 0) errno = ECONNRESET;
+    return OTP_FAILED;
+}
+
+/*******************************************************************************
+ *                              recvResponseHeader                             *
+ * This function receives and decodes a response header, returning OTP_BUSY    *
+ * if it says otp_d was too busy.                                              *
+ ******************************************************************************/
+static enum otpStatus recvResponseHeader(struct otpConnection* conn, struct responseHeader* response){
+    unsigned char header[RESPONSE_HEADER_SIZE];
+
+    errno = 0;
+    if(!recvAll(conn->fd, header, RESPONSE_HEADER_SIZE)) return recvFailed();
+    if(!decodeResponseHeader(header, response)){
+        errno = EPROTO;
+        return OTP_FAILED;
+    }
+    if(response->status == STATUS_BUSY){
+        conn->retryAfter = response->bodySize;
+        return OTP_BUSY;
+    }
+    return OTP_OK;
+}
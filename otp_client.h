@@ -0,0 +1,78 @@
+/*******************************************************************************
+** Program name: otp_client.h
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  Declarations for the client side of the protocol in
+**               otp_protocol.h, which otp is built on and which any program
+**               linked with libotp can use to talk to otp_d. A connection is a
+**               handle holding the socket, and every call on it returns an
+**               otpStatus instead of printing or exiting, so the caller decides
+**               what a failure means. OTP_FAILED leaves errno set, to EPROTO if
+**               otp_d sent something that isn't part of the protocol.
+**
+**               The calls come in two layers. otpSendRequest(), otpSendChunk()
+**               and the otpRecv functions each move one piece of a request or
+**               an answer, so requests can be pipelined on one connection and
+**               their answers read by another thread, the way otp --batch does.
+**               otpPost(), otpGet() and otpStats() send one request and read
+**               its whole answer. A drain is sent with otpSendDrain() and its
+**               ciphertexts read one at a time with otpRecvDrained().
+**
+**               Setting FLAG_BINARY in a connection's flags marks every post
+**               sent on it as binary (see otp_protocol.h), so its ciphertexts
+**               can hold any byte.
+**
+**               Setting FLAG_PACKED instead makes otpPost() pack each
+**               ciphertext before sending it, and otpGet() and
+**               otpRecvDrained() unpack any packed ciphertext they receive
+**               whatever the flags, unless FLAG_BINARY is set. Either way the
+**               caller only sees the characters. A ciphertext sent with
+**               otpSendRequest() has to be packed already, with packText(), and
+**               one read with otpRecvBody() is handed over as it came.
+**
+**               A connection otp_d turned away because it was busy returns
+**               OTP_BUSY from whichever call noticed, with the milliseconds
+**               otp_d asked the client to wait in retryAfter.
+*******************************************************************************/
+#ifndef OTP_CLIENT_H
+#define OTP_CLIENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// what a call on a connection did
+enum otpStatus {
+    OTP_OK,                             // it worked
+    OTP_EMPTY,                          // a 'get' found no ciphertext for the user, or a drain is over
+    OTP_BUSY,                           // otp_d turned the connection away, see retryAfter
+    OTP_FAILED                          // the connection or otp_d failed, errno says why
+};
+
+// a connection to otp_d
+struct otpConnection {
+    int fd;                             // the connection's socket
+    uint64_t retryAfter;                // the milliseconds otp_d asked for after OTP_BUSY
+    uint32_t flags;                     // sent with every request, FLAG_BINARY, FLAG_PACKED or 0
+};
+
+// function prototypes:
+enum otpStatus otpConnect(struct otpConnection* conn, const char* host, int portNumber);
+void otpClose(struct otpConnection* conn);
+enum otpStatus otpSendRequest(struct otpConnection* conn, char mode, const char* user, const char* body,
+                              size_t bodySize);
+enum otpStatus otpSendChunk(struct otpConnection* conn, const char* chunk, size_t chunkSize);
+enum otpStatus otpRecvAck(struct otpConnection* conn);
+enum otpStatus otpRecvAnswer(struct otpConnection* conn, size_t* bodySize);
+enum otpStatus otpRecvBody(struct otpConnection* conn, void* body, size_t bodySize);
+enum otpStatus otpRecvChunkSize(struct otpConnection* conn, size_t* chunkSize);
+enum otpStatus otpShutdown(struct otpConnection* conn);
+enum otpStatus otpWaitForClose(struct otpConnection* conn);
+enum otpStatus otpPost(struct otpConnection* conn, const char* user, const char* ciphertext, size_t ciphertextSize);
+enum otpStatus otpGet(struct otpConnection* conn, const char* user, char** ciphertext, size_t* ciphertextSize);
+enum otpStatus otpStats(struct otpConnection* conn, char** text, size_t* textSize);
+enum otpStatus otpSendDrain(struct otpConnection* conn, const char* user, uint64_t maxCount, uint64_t maxBytes);
+enum otpStatus otpRecvDrained(struct otpConnection* conn, char** ciphertext, size_t* ciphertextSize);
+
+#endif
@@ -0,0 +1,466 @@
+/*******************************************************************************
+** Program name: otp_microbench.c
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  This program times the CPU heavy parts of otp and keygen on
+**               their own, without any files or sockets:
+**                    otp_microbench [--min-size N] [--max-size N] [--threads N] [--check]
+**               Encryption, decryption, the bad character check, the XOR of
+**               binary text and packing and unpacking text are timed for every version of the cipher the CPU
+**               can run (see otp_cipher.c), and key generation, text and
+**               binary, is timed for a single thread (see otp_random.c). Each is run over inputs of 64 characters up
+**               to 1 GB by default, four times bigger each step, and reported in
+**               GB/s. With --threads N the cipher is timed splitting each long
+**               input among up to N threads, the way otp does.
+**
+**               Before anything is timed, every version of the cipher is checked
+**               against the scalar one on inputs of many lengths, with and
+**               without bad characters, splitting a long input among threads is
+**               checked against doing it on one, and ChaCha20 is checked against the test
+**               vector in RFC 8439. If any check fails nothing is timed and
+**               otp_microbench exits with status 1. With --check only the checks
+**               are run.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include "otp_cipher.h"
+#include "otp_random.h"
+
+#define MIN_TIME 0.2                    // each measurement is repeated for at least this many seconds
+#define CHECK_LENGTHS 300               // every length up to this is checked, then a few big ones
+
+// the versions of the cipher, the first is the reference the others are checked against
+const char* kernelNames[] = {"scalar", "sse2", "avx2", "avx512"};
+#define NUM_KERNELS (sizeof(kernelNames) / sizeof(kernelNames[0]))
+
+// function prototypes:
+bool checkKernels(void);
+bool checkKernel(const char* name, char* text, char* key, char* expected, char* output, size_t size);
+bool checkThreads(void);
+bool checkChaCha(void);
+void timeSize(size_t size, char* text, char* key, char* output, char* packed);
+double timeOperation(int operation, size_t size, const char* text, const char* key, char* output, char* packed);
+void fillText(char* text, size_t size, uint64_t seed);
+uint64_t nextRandom(uint64_t* state);
+double now(void);
+bool parseSize(const char* arg, size_t* size);
+
+// error function used for reporting issues
+void error(const char *msg) { perror(msg); exit(1); }
+
+// the operations that are timed
+enum { ENCRYPT, DECRYPT, VALIDATE, XOR, PACK, UNPACK, KEYGEN, BINARY_KEYGEN };
+
+// global variables
+uint32_t benchKey[CHACHA_KEY_WORDS] = {1, 2, 3, 4, 5, 6, 7, 8}; // the key used to time keygen
+volatile int sink;                      // results are stored here so they can't be optimized away
+
+int main(int argc, char *argv[]){
+    size_t minSize = 64;                // the smallest input timed
+    size_t maxSize = (size_t)1 << 30;   // the biggest input timed
+    bool checkOnly = false;             // true if the user passed --check
+    size_t numThreads = 1;              // the most threads the cipher is timed with
+    char *text, *key, *output;          // the buffers every operation works on
+    char* packed;                       // the text packed, for timing packing and unpacking
+    int option;                         // the option returned by getopt_long()
+    struct option longOptions[] = {
+        {"min-size", required_argument, NULL, 'm'},
+        {"max-size", required_argument, NULL, 'M'},
+        {"threads", required_argument, NULL, 't'},
+        {"check", no_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}
+    };
+    const char* usage = "otp_microbench USAGE: %s [--min-size N] [--max-size N] [--threads N] [--check]\n";
+
+    // parse the command line options
+    while((option = getopt_long(argc, argv, "m:M:c", longOptions, NULL)) != -1){
+        if(option == 'm' && parseSize(optarg, &minSize)) continue;
+        if(option == 'M' && parseSize(optarg, &maxSize)) continue;
+        if(option == 't' && parseSize(optarg, &numThreads) && numThreads <= MAX_CIPHER_THREADS) continue;
+        if(option == 'c'){
+            checkOnly = true;
+            continue;
+        }
+        fprintf(stderr, usage, argv[0]); exit(1);
+    }
+    if(optind < argc || minSize > maxSize) { fprintf(stderr, usage, argv[0]); exit(1); }
+
+    printf("cipher versions this CPU can run:");
+    for(size_t k = 0; k < NUM_KERNELS; k++){
+        if(useCipherKernel(kernelNames[k])) printf(" %s", kernelNames[k]);
+    }
+    printf("\n");
+
+    // nothing is worth timing if it gives the wrong answer
+    if(!checkKernels() || !checkThreads() || !checkChaCha()) return 1;
+    if(checkOnly) return 0;
+
+    text = malloc(maxSize);
+    key = malloc(maxSize);
+    output = malloc(maxSize);
+    packed = malloc(packedSize(maxSize));
+    if(text == NULL || key == NULL || output == NULL || packed == NULL) error("otp_microbench ERROR with malloc");
+    fillText(text, maxSize, 1);
+    fillText(key, maxSize, 2);
+    setCipherThreads(numThreads);
+
+    printf("\n%12s  %-7s %14s %14s %14s %14s %14s %14s\n", "size", "version", "encrypt GB/s", "decrypt GB/s",
+           "validate GB/s", "xor GB/s", "pack GB/s", "unpack GB/s");
+    for(size_t size = minSize; size <= maxSize; size *= 4){
+        timeSize(size, text, key, output, packed);
+        if(size > maxSize / 4) break;
+    }
+
+    printf("\n%12s  %14s %14s\n", "size", "keygen GB/s", "binary GB/s");
+    for(size_t size = minSize; size <= maxSize; size *= 4){
+        printf("%12zu  %14.3f", size, timeOperation(KEYGEN, size, text, key, output, packed));
+        fflush(stdout);
+        printf(" %14.3f\n", timeOperation(BINARY_KEYGEN, size, text, key, output, packed));
+        if(size > maxSize / 4) break;
+    }
+
+    // free the memory on the heap
+    free(text);
+    free(key);
+    free(output);
+    free(packed);
+
+    return 0;
+}
+
+/*******************************************************************************
+ *                                  checkKernels                               *
+ * This function checks every version of the cipher the CPU can run against    *
+ * the scalar version, for every length up to CHECK_LENGTHS and a few lengths   *
+ * that aren't a multiple of any vector size.                                  *
+ ******************************************************************************/
+bool checkKernels(void){
+    size_t bigLengths[] = {4095, 4097, 65537, 1000003};
+    size_t maxLength = 1000003;         // the biggest of bigLengths
+    size_t numBig = sizeof(bigLengths) / sizeof(bigLengths[0]);
+    char *text, *key, *expected, *output;
+    bool success = true;
+    size_t length;
+
+    text = malloc(maxLength);
+    key = malloc(maxLength);
+    expected = malloc(maxLength);
+    output = malloc(maxLength);
+    if(text == NULL || key == NULL || expected == NULL || output == NULL){
+        error("otp_microbench ERROR with malloc");
+    }
+
+    for(size_t k = 1; k < NUM_KERNELS; k++){
+        if(!useCipherKernel(kernelNames[k])) continue;
+        for(size_t i = 0; i <= CHECK_LENGTHS + numBig && success; i++){
+            length = i <= CHECK_LENGTHS ? i : bigLengths[i - CHECK_LENGTHS - 1];
+            fillText(text, length, 3 * length + 1);
+            fillText(key, length, 3 * length + 2);
+            success = checkKernel(kernelNames[k], text, key, expected, output, length);
+        }
+        printf("checking %s against scalar: %s\n", kernelNames[k], success ? "ok" : "FAILED");
+        if(!success) break;
+    }
+
+    free(text);
+    free(key);
+    free(expected);
+    free(output);
+    return success;
+}
+
+/*******************************************************************************
+ *                                  checkKernel                                *
+ * This function checks that one version of the cipher gives the same results  *
+ * as the scalar version on a text and key of the given size, first as they    *
+ * are, then with a bad character put at each end of the text and of the key.  *
+ * The output is only compared when there are no bad characters, since otp     *
+ * never uses it otherwise, except for XOR, where every character is good.    *
+ * Packing is only checked with a good text, and unpacking has to give the     *
+ * text back and find a value of 31 put in the first group.                    *
+ ******************************************************************************/
+bool checkKernel(const char* name, char* text, char* key, char* expected, char* output, size_t size){
+    enum cipherResult expectedResult, result;
+    bool expectedValid, valid;
+    size_t unpacked;
+    char* target;
+    size_t position;
+    char saved;
+
+    // case 0 has no bad character, cases 1-4 put one at the start or end of the text or key
+    for(int badCase = 0; badCase <= 4; badCase++){
+        if(badCase > 0 && size == 0) break;
+        target = badCase <= 2 ? text : key;
+        position = badCase % 2 == 1 ? 0 : size - 1;
+        saved = badCase > 0 ? target[position] : 0;
+        if(badCase > 0) target[position] = badCase <= 2 ? 'a' : '\n';
+
+        for(int operation = ENCRYPT; operation <= UNPACK; operation++){
+            if(operation == PACK || operation == UNPACK){
+                if(!validText(text, size)) continue;
+                useCipherKernel(kernelNames[0]);
+                packText(text, size, expected);
+                useCipherKernel(name);
+                if(operation == PACK){
+                    packText(text, size, output);
+                    if(memcmp(output, expected, packedSize(size)) != 0) return false;
+                    continue;
+                }
+                if(!unpackText(expected, packedSize(size), output, &unpacked) || unpacked != size ||
+                   memcmp(output, text, size) != 0) return false;
+                expected[1] |= 0x1F;
+                if(size > 0 && (unpackText(expected, packedSize(size), output, &unpacked) ||
+                                validPackedText(expected, packedSize(size)))) return false;
+                continue;
+            }
+            useCipherKernel(kernelNames[0]);
+            if(operation == ENCRYPT) expectedResult = encryptText(text, key, expected, size);
+            if(operation == DECRYPT) expectedResult = decryptText(text, key, expected, size);
+            if(operation == VALIDATE) expectedValid = validText(text, size);
+            if(operation == XOR) xorText(text, key, expected, size);
+            useCipherKernel(name);
+            if(operation == ENCRYPT) result = encryptText(text, key, output, size);
+            if(operation == DECRYPT) result = decryptText(text, key, output, size);
+            if(operation == VALIDATE){
+                valid = validText(text, size);
+                if(valid != expectedValid) return false;
+                continue;
+            }
+            if(operation == XOR){
+                xorText(text, key, output, size);
+                if(memcmp(output, expected, size) != 0) return false;
+                continue;
+            }
+            if(result != expectedResult) return false;
+            if(result == CIPHER_OK && memcmp(output, expected, size) != 0) return false;
+        }
+
+        if(badCase > 0) target[position] = saved;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                                  checkThreads                               *
+ * This function checks that a text long enough to be split among threads      *
+ * gives the same results as it does on one thread, with the version of the    *
+ * cipher the CPU would pick, and with a bad character put at either end of    *
+ * the text or the key, or just past the first thread's slice of the text.     *
+ ******************************************************************************/
+bool checkThreads(void){
+    size_t size = 3 * CIPHER_SLICE_SIZE + 1001; // split unevenly among three threads
+    size_t positions[] = {0, size / 3 + 64, size - 1};
+    char *text, *key, *expected, *output;
+    enum cipherResult expectedResult, result;
+    bool success = true;
+    char saved;
+
+    text = malloc(size);
+    key = malloc(size);
+    expected = malloc(size);
+    output = malloc(size);
+    if(text == NULL || key == NULL || expected == NULL || output == NULL){
+        error("otp_microbench ERROR with malloc");
+    }
+    fillText(text, size, 4);
+    fillText(key, size, 5);
+
+    // case 0 has no bad character, the others put one in the text, then the key, at each position
+    for(size_t badCase = 0; badCase <= 6 && success; badCase++){
+        char* target = badCase <= 3 ? text : key;
+        size_t position = positions[(badCase + 2) % 3];
+
+        saved = target[position];
+        if(badCase > 0) target[position] = '\n';
+        setCipherThreads(1);
+        expectedResult = encryptText(text, key, expected, size);
+        setCipherThreads(8);
+        result = encryptText(text, key, output, size);
+        success = result == expectedResult && (result != CIPHER_OK || memcmp(output, expected, size) == 0);
+
+        setCipherThreads(1);
+        expectedResult = decryptText(text, key, expected, size);
+        setCipherThreads(8);
+        result = decryptText(text, key, output, size);
+        success = success && result == expectedResult &&
+                  (result != CIPHER_OK || memcmp(output, expected, size) == 0);
+        success = success && validText(text, size) == (badCase == 0 || badCase > 3);
+
+        setCipherThreads(1);
+        xorText(text, key, expected, size);
+        setCipherThreads(8);
+        xorText(text, key, output, size);
+        success = success && memcmp(output, expected, size) == 0;
+        target[position] = saved;
+    }
+    setCipherThreads(1);
+    printf("checking 8 threads against one: %s\n", success ? "ok" : "FAILED");
+
+    free(text);
+    free(key);
+    free(expected);
+    free(output);
+    return success;
+}
+
+/*******************************************************************************
+ *                                  checkChaCha                                *
+ * This function checks the ChaCha20 block function against the test vector in *
+ * section 2.3.2 of RFC 8439, and checks that a key block only holds A-Z and   *
+ * space and comes out the same every time for the same key and block number, *
+ * and that a binary key block does too.                                      *
+ ******************************************************************************/
+bool checkChaCha(void){
+    const uint32_t in[16] = {
+        0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+        0x03020100, 0x07060504, 0x0b0a0908, 0x0f0e0d0c,
+        0x13121110, 0x17161514, 0x1b1a1918, 0x1f1e1d1c,
+        0x00000001, 0x09000000, 0x4a000000, 0x00000000
+    };
+    const uint32_t expected[16] = {
+        0xe4e7f110, 0x15593bd1, 0x1fdd0f50, 0xc47120a3,
+        0xc7f4d1c7, 0x0368c033, 0x9aaa2204, 0x4e6cd4c3,
+        0x466482d2, 0x09aa9f07, 0x05d7c214, 0xa2028bd9,
+        0xd19c12b5, 0xb94e16de, 0xe883d0cb, 0x4e3c50a2
+    };
+    uint32_t out[16];
+    char first[1000], second[1000];
+    bool success;
+
+    chachaBlock(out, in);
+    success = memcmp(out, expected, sizeof(out)) == 0;
+
+    makeKeyBlock(benchKey, 7, first, sizeof(first));
+    makeKeyBlock(benchKey, 7, second, sizeof(second));
+    success = success && validText(first, sizeof(first)) && memcmp(first, second, sizeof(first)) == 0;
+
+    makeBinaryKeyBlock(benchKey, 7, first, sizeof(first));
+    makeBinaryKeyBlock(benchKey, 7, second, sizeof(second));
+    success = success && memcmp(first, second, sizeof(first)) == 0;
+
+    printf("checking ChaCha20 against RFC 8439: %s\n", success ? "ok" : "FAILED");
+    return success;
+}
+
+/*******************************************************************************
+ *                                  timeSize                                   *
+ * This function prints a line of the table for each version of the cipher at *
+ * one input size.                                                             *
+ ******************************************************************************/
+void timeSize(size_t size, char* text, char* key, char* output, char* packed){
+    for(size_t k = 0; k < NUM_KERNELS; k++){
+        if(!useCipherKernel(kernelNames[k])) continue;
+        printf("%12zu  %-7s", size, kernelNames[k]);
+        fflush(stdout);
+        for(int operation = ENCRYPT; operation <= UNPACK; operation++){
+            printf(" %14.3f", timeOperation(operation, size, text, key, output, packed));
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+}
+
+/*******************************************************************************
+ *                                  timeOperation                              *
+ * This function runs an operation on size characters over and over for at    *
+ * least MIN_TIME seconds, and returns how many GB (10^9 characters) it got    *
+ * through per second.                                                         *
+ ******************************************************************************/
+double timeOperation(int operation, size_t size, const char* text, const char* key, char* output, char* packed){
+    double start = now(), elapsed;
+    unsigned long long runs = 0;
+    size_t unpacked;
+
+    if(operation == UNPACK) packText(text, size, packed);
+
+    do{
+        if(operation == ENCRYPT) sink = encryptText(text, key, output, size);
+        if(operation == DECRYPT) sink = decryptText(text, key, output, size);
+        if(operation == VALIDATE) sink = validText(text, size);
+        if(operation == XOR){
+            xorText(text, key, output, size);
+            sink = output[size - 1];
+        }
+        if(operation == PACK){
+            packText(text, size, packed);
+            sink = packed[packedSize(size) - 1];
+        }
+        if(operation == UNPACK){
+            sink = unpackText(packed, packedSize(size), output, &unpacked);
+        }
+        if(operation == KEYGEN){
+            makeKeyBlock(benchKey, runs, output, size);
+            sink = output[size - 1];
+        }
+        if(operation == BINARY_KEYGEN){
+            makeBinaryKeyBlock(benchKey, runs, output, size);
+            sink = output[size - 1];
+        }
+        runs++;
+        elapsed = now() - start;
+    }while(elapsed < MIN_TIME);
+
+    return (double)size * runs / elapsed / 1e9;
+}
+
+/*******************************************************************************
+ *                                  fillText                                   *
+ * This function fills a buffer with characters A-Z and space. They only need *
+ * to look random to the cipher, so a quick generator seeded with seed is used.*
+ ******************************************************************************/
+void fillText(char* text, size_t size, uint64_t seed){
+    uint64_t state = 0x9E3779B97F4A7C15ULL * (seed + 1);
+
+    for(size_t i = 0; i < size; i++){
+        text[i] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ "[(nextRandom(&state) >> 32) % 27];
+    }
+}
+
+/*******************************************************************************
+ *                                  nextRandom                                 *
+ * This function returns the next number from an xorshift generator.          *
+ ******************************************************************************/
+uint64_t nextRandom(uint64_t* state){
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/*******************************************************************************
+ *                                  now                                        *
+ * This function returns the time in seconds from a clock that never jumps.    *
+ ******************************************************************************/
+double now(void){
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/*******************************************************************************
+ *                                  parseSize                                  *
+ * This function reads a positive size, which can end in K, M or G.            *
+ ******************************************************************************/
+bool parseSize(const char* arg, size_t* size){
+    char* endPtr;
+    unsigned long long value;
+    int shift = 0;
+
+    errno = 0;
+    value = strtoull(arg, &endPtr, 10);
+    if(*endPtr == 'K') shift = 10;
+    if(*endPtr == 'M') shift = 20;
+    if(*endPtr == 'G') shift = 30;
+    if(shift > 0) endPtr++;
+    if(errno != 0 || *endPtr != '\0' || value == 0 || value > (SIZE_MAX >> shift)) return false;
+    *size = (size_t)value << shift;
+    return true;
+}
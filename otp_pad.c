@@ -0,0 +1,154 @@
+/*******************************************************************************
+** Program name: otp_pad.c
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  Functions for using one large key (a pad) for many messages,
+**               see otp_pad.h. The ledger holds the offset of the first unused
+**               character of the pad as a decimal number, and is locked with
+**               flock() while it's read and advanced so that otp clients
+**               posting at the same time never get the same slice.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include "otp_pad.h"
+
+#define LEDGER_SUFFIX ".ledger"         // added to the pad's filename to get the ledger's
+#define LEDGER_SIZE 32                  // more than enough characters for the offset
+
+// function prototypes:
+static int openLedger(const char* padName);
+
+/*******************************************************************************
+ *                                  openPad                                    *
+ * This function memory-maps a pad so that slices of it can be used as keys    *
+ * without reading them. The newline keygen puts at the end isn't part of it. *
+ ******************************************************************************/
+bool openPad(struct pad* pad, const char* name){
+    struct stat padStat;
+    int fd;
+    void* map;
+
+    fd = open(name, O_RDONLY);
+    if(fd < 0) return false;
+    if(fstat(fd, &padStat) != 0 || padStat.st_size == 0){
+        close(fd);
+        return false;
+    }
+
+    map = mmap(NULL, padStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);                          // the mapping stays valid without the descriptor
+    if(map == MAP_FAILED) return false;
+
+    pad->name = name;
+    pad->text = map;
+    pad->mapSize = padStat.st_size;
+    pad->size = padStat.st_size;
+    if(pad->text[pad->size - 1] == '\n') pad->size--;
+    return true;
+}
+
+/*******************************************************************************
+ *                                  closePad                                   *
+ * This function unmaps a pad.                                                 *
+ ******************************************************************************/
+void closePad(struct pad* pad){
+    munmap((void*)pad->text, pad->mapSize);
+    pad->text = NULL;
+}
+
+/*******************************************************************************
+ *                                  reservePad                                 *
+ * This function takes the next size unused characters of the pad, setting    *
+ * offset to where they start and moving the ledger past them. False is        *
+ * returned with errno set to ENOSPC if the rest of the pad is too short.      *
+ ******************************************************************************/
+bool reservePad(struct pad* pad, size_t size, size_t* offset){
+    char ledger[LEDGER_SIZE];           // the ledger's contents
+    ssize_t ledgerSize;                 // how much of the ledger was read
+    unsigned long long used = 0;        // how much of the pad was used before this call
+    bool success = false;
+    int fd;
+
+    fd = openLedger(pad->name);
+    if(fd < 0) return false;
+
+    // only one otp at a time can read and move the ledger
+    if(flock(fd, LOCK_EX) != 0){
+        close(fd);
+        return false;
+    }
+
+    ledgerSize = pread(fd, ledger, sizeof(ledger) - 1, 0);
+    if(ledgerSize >= 0){
+        ledger[ledgerSize] = '\0';
+        if(ledgerSize > 0) used = strtoull(ledger, NULL, 10);
+
+        if(used > pad->size || size > pad->size - used){
+            errno = ENOSPC;
+        }
+        else{
+            // write the new offset and make sure it's on disk before the slice is used, so a
+            // crash can never hand the same slice out twice
+            ledgerSize = snprintf(ledger, sizeof(ledger), "%llu\n", used + size);
+            success = pwrite(fd, ledger, ledgerSize, 0) == ledgerSize &&
+                      ftruncate(fd, ledgerSize) == 0 && fsync(fd) == 0;
+            *offset = used;
+        }
+    }
+
+    close(fd);                          // closing the ledger also unlocks it
+    return success;
+}
+
+/*******************************************************************************
+ *                                  openLedger                                 *
+ * This function opens a pad's ledger, creating it if this is the first time   *
+ * the pad has been used.                                                      *
+ ******************************************************************************/
+static int openLedger(const char* padName){
+    char* ledgerName;
+    int fd;
+
+    ledgerName = malloc(strlen(padName) + sizeof(LEDGER_SUFFIX));
+    if(ledgerName == NULL) return -1;
+    sprintf(ledgerName, "%s%s", padName, LEDGER_SUFFIX);
+    fd = open(ledgerName, O_RDWR | O_CREAT, 0600);
+    free(ledgerName);
+    return fd;
+}
+
+/*******************************************************************************
+ *                                  encodePadOffset                            *
+ * This function writes an offset into the pad as PAD_HEADER_SIZE letters, a  *
+ * base 26 number with 'A' as 0, so the header is valid ciphertext.            *
+ ******************************************************************************/
+void encodePadOffset(size_t offset, char* header){
+    for(int i = PAD_HEADER_SIZE - 1; i >= 0; i--){
+        header[i] = 'A' + offset % 26;
+        offset /= 26;
+    }
+}
+
+/*******************************************************************************
+ *                                  decodePadOffset                            *
+ * This function reads an offset written by encodePadOffset(). False is        *
+ * returned if the header isn't made of letters.                               *
+ ******************************************************************************/
+bool decodePadOffset(const char* header, size_t* offset){
+    *offset = 0;
+    for(int i = 0; i < PAD_HEADER_SIZE; i++){
+        if(header[i] < 'A' || header[i] > 'Z') return false;
+        *offset = *offset * 26 + (header[i] - 'A');
+    }
+    return true;
+}
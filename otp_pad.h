@@ -0,0 +1,36 @@
+/*******************************************************************************
+** Program name: otp_pad.h
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  Declarations for using one large key (a pad) for many messages.
+**               The pad is memory-mapped, and a small ledger file next to it,
+**               <pad>.ledger, holds how much of the pad has been used so far.
+**               Each post takes the next unused slice of the pad and records
+**               where that slice starts in a header at the front of the
+**               ciphertext, so a get knows which slice decrypts it.
+*******************************************************************************/
+#ifndef OTP_PAD_H
+#define OTP_PAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define PAD_HEADER_SIZE 14              // the size of the offset header, 26^14 > 2^64
+
+// a memory-mapped pad
+struct pad {
+    const char* name;                   // the pad's filename
+    const char* text;                   // the pad's characters
+    size_t size;                        // the number of characters, not counting the newline
+    size_t mapSize;                     // the size of the mapping
+};
+
+// function prototypes:
+bool openPad(struct pad* pad, const char* name);
+void closePad(struct pad* pad);
+bool reservePad(struct pad* pad, size_t size, size_t* offset);
+void encodePadOffset(size_t offset, char* header);
+bool decodePadOffset(const char* header, size_t* offset);
+
+#endif
@@ -0,0 +1,274 @@
+/*******************************************************************************
+** Program name: otp_pool.c
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  Functions for the pool of worker threads used by otp_d
+**               --threads, see otp_pool.h. Tasks are handed to the workers in
+**               turn. Each deque has its own lock, so a worker taking its own
+**               tasks only ever competes with a thief, and the pool's lock is
+**               only used to count the waiting tasks and to put idle workers to
+**               sleep until there's something to do.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include "otp_pool.h"
+
+#define DEQUE_START_SIZE 64             // the number of tasks a deque has room for at first
+#define ARENA_START_SIZE 65536          // the size of a new arena's block
+#define ARENA_MAX_SIZE (16 << 20)       // the biggest block an arena keeps between requests
+#define ARENA_ALIGN 16                  // every allocation starts on a multiple of this
+
+// function prototypes:
+static void* runWorker(void* arg);
+static bool takeTask(struct worker* self, void** task);
+static bool pushBack(struct deque* deque, void* task);
+static bool popFront(struct deque* deque, void** task);
+static bool popBack(struct deque* deque, void** task);
+
+/*******************************************************************************
+ *                                  startPool                                  *
+ * This function starts numWorkers threads, each of which runs handler on the  *
+ * tasks it's given or steals. It returns false if they couldn't be started.  *
+ ******************************************************************************/
+bool startPool(struct pool* pool, unsigned int numWorkers, void (*handler)(void* task, struct arena* arena)){
+    pool->workers = calloc(numWorkers, sizeof(struct worker));
+    if(pool->workers == NULL) return false;
+    pool->numWorkers = numWorkers;
+    pool->nextWorker = 0;
+    pool->queued = 0;
+    pool->handler = handler;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    for(unsigned int w = 0; w < numWorkers; w++){
+        struct worker* worker = &pool->workers[w];
+        worker->number = w;
+        worker->pool = pool;
+        worker->deque.tasks = malloc(DEQUE_START_SIZE * sizeof(void*));
+        if(worker->deque.tasks == NULL) return false;
+        worker->deque.capacity = DEQUE_START_SIZE;
+        pthread_mutex_init(&worker->deque.lock, NULL);
+        initArena(&worker->arena);
+    }
+
+    // the workers are only started once every deque exists, since any of them can be stolen from
+    for(unsigned int w = 0; w < numWorkers; w++){
+        if(pthread_create(&pool->workers[w].thread, NULL, runWorker, &pool->workers[w]) != 0){
+            return false;
+        }
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                                  submitPool                                 *
+ * This function hands a task to the next worker in turn and wakes an idle     *
+ * worker to run it. It returns false if the task couldn't be queued.          *
+ ******************************************************************************/
+bool submitPool(struct pool* pool, void* task){
+    struct worker* worker = &pool->workers[pool->nextWorker];
+
+    pool->nextWorker = (pool->nextWorker + 1) % pool->numWorkers;
+    if(!pushBack(&worker->deque, task)) return false;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    return true;
+}
+
+/*******************************************************************************
+ *                                  runWorker                                  *
+ * This function is run by each worker thread. It runs tasks for as long as    *
+ * the server is up, sleeping whenever every deque is empty.                   *
+ ******************************************************************************/
+static void* runWorker(void* arg){
+    struct worker* self = arg;
+    struct pool* pool = self->pool;
+    void* task;
+
+    while(true){
+        if(takeTask(self, &task)){
+            pthread_mutex_lock(&pool->lock);
+            pool->queued--;
+            pthread_mutex_unlock(&pool->lock);
+
+            pool->handler(task, &self->arena);
+            resetArena(&self->arena);
+            continue;
+        }
+
+        // queued is only raised after a task is pushed, so a task can't be missed here
+        pthread_mutex_lock(&pool->lock);
+        while(pool->queued == 0) pthread_cond_wait(&pool->wake, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+ *                                  takeTask                                   *
+ * This function takes the oldest task from the worker's own deque, or if it's *
+ * empty, the newest task from the first other deque that has one, starting    *
+ * with the next worker's so thieves spread out. False is returned if every    *
+ * deque is empty.                                                             *
+ ******************************************************************************/
+static bool takeTask(struct worker* self, void** task){
+    struct pool* pool = self->pool;
+
+    if(popFront(&self->deque, task)) return true;
+    for(unsigned int w = 1; w < pool->numWorkers; w++){
+        if(popBack(&pool->workers[(self->number + w) % pool->numWorkers].deque, task)) return true;
+    }
+    return false;
+}
+
+/*******************************************************************************
+ *                                  pushBack                                   *
+ * This function adds a task to the back of a deque, doubling the ring buffer  *
+ * if it's full.                                                               *
+ ******************************************************************************/
+static bool pushBack(struct deque* deque, void* task){
+    void** tasks;
+
+    pthread_mutex_lock(&deque->lock);
+    if(deque->count == deque->capacity){
+        tasks = malloc(2 * deque->capacity * sizeof(void*));
+        if(tasks == NULL){
+            pthread_mutex_unlock(&deque->lock);
+            return false;
+        }
+        // unwrap the ring buffer into the start of the new one
+        for(size_t i = 0; i < deque->count; i++){
+            tasks[i] = deque->tasks[(deque->front + i) % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->capacity *= 2;
+        deque->front = 0;
+    }
+    deque->tasks[(deque->front + deque->count) % deque->capacity] = task;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+    return true;
+}
+
+/*******************************************************************************
+ *                                  popFront                                   *
+ * This function takes the oldest task off a deque, which is how a worker      *
+ * takes its own tasks, so connections are served in the order they came in.  *
+ ******************************************************************************/
+static bool popFront(struct deque* deque, void** task){
+    bool found = false;
+
+    pthread_mutex_lock(&deque->lock);
+    if(deque->count > 0){
+        *task = deque->tasks[deque->front];
+        deque->front = (deque->front + 1) % deque->capacity;
+        deque->count--;
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+/*******************************************************************************
+ *                                  popBack                                    *
+ * This function takes the newest task off a deque, which is how a worker      *
+ * steals, so it only competes with the owner when one task is left.           *
+ ******************************************************************************/
+static bool popBack(struct deque* deque, void** task){
+    bool found = false;
+
+    pthread_mutex_lock(&deque->lock);
+    if(deque->count > 0){
+        deque->count--;
+        *task = deque->tasks[(deque->front + deque->count) % deque->capacity];
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+/*******************************************************************************
+ *                                  initArena                                  *
+ * This function sets up an empty arena. Its block is allocated the first time *
+ * it's used.                                                                  *
+ ******************************************************************************/
+void initArena(struct arena* arena){
+    memset(arena, 0, sizeof(struct arena));
+}
+
+/*******************************************************************************
+ *                                  arenaAlloc                                 *
+ * This function hands out size bytes that stay valid until the arena is      *
+ * reset. They're carved out of the arena's block if there's room, otherwise  *
+ * they're allocated separately, and the block grows at the next reset so the *
+ * next request like this one fits. NULL is returned if there's no memory.     *
+ ******************************************************************************/
+void* arenaAlloc(struct arena* arena, size_t size){
+    struct arenaOverflow* overflow;
+    size_t aligned = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    void* memory;
+
+    if(aligned < size) return NULL;     // size was too big to round up
+    arena->wanted += aligned;
+
+    if(arena->block == NULL && arena->wanted <= ARENA_START_SIZE){
+        arena->block = malloc(ARENA_START_SIZE);
+        if(arena->block != NULL) arena->capacity = ARENA_START_SIZE;
+    }
+    if(arena->block != NULL && aligned <= arena->capacity - arena->used){
+        memory = arena->block + arena->used;
+        arena->used += aligned;
+        return memory;
+    }
+
+    overflow = malloc(sizeof(struct arenaOverflow) + size);
+    if(overflow == NULL) return NULL;
+    overflow->next = arena->overflow;
+    arena->overflow = overflow;
+    return overflow->data;
+}
+
+/*******************************************************************************
+ *                                  resetArena                                 *
+ * This function gives back everything handed out by the arena. If the last   *
+ * request needed more than the block holds, the block is replaced with one    *
+ * big enough, up to ARENA_MAX_SIZE so one huge post doesn't tie up memory.    *
+ ******************************************************************************/
+void resetArena(struct arena* arena){
+    struct arenaOverflow* next;
+    char* block;
+
+    while(arena->overflow != NULL){
+        next = arena->overflow->next;
+        free(arena->overflow);
+        arena->overflow = next;
+    }
+
+    if(arena->wanted > arena->capacity && arena->wanted <= ARENA_MAX_SIZE){
+        block = malloc(arena->wanted);
+        if(block != NULL){
+            free(arena->block);
+            arena->block = block;
+            arena->capacity = arena->wanted;
+        }
+    }
+    arena->used = 0;
+    arena->wanted = 0;
+}
+
+/*******************************************************************************
+ *                                  freeArena                                  *
+ * This function frees all of an arena's memory.                               *
+ ******************************************************************************/
+void freeArena(struct arena* arena){
+    arena->wanted = 0;                  // so the block isn't grown just before it's freed
+    resetArena(arena);
+    free(arena->block);
+    initArena(arena);
+}
@@ -0,0 +1,77 @@
+/*******************************************************************************
+** Program name: otp_pool.h
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  Declarations for the pool of worker threads used by otp_d
+**               --threads. Each connection with a whole request waiting is a
+**               task, and each worker has its own double-ended queue of tasks.
+**               A worker takes tasks from the front of its own queue, and when
+**               that's empty it steals from the back of another worker's queue,
+**               so no worker sits idle while another has a backlog. Each worker
+**               also has an arena that the buffers for a request are carved out
+**               of, which is reused for every request instead of calling
+**               malloc() and free() each time.
+*******************************************************************************/
+#ifndef OTP_POOL_H
+#define OTP_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// a bigger allocation made when a request didn't fit in an arena's block
+struct arenaOverflow {
+    struct arenaOverflow* next;         // the next overflow allocation, or NULL
+    char data[];                        // the allocation itself
+};
+
+// memory for one request at a time, given back all at once by resetArena()
+struct arena {
+    char* block;                        // the arena's reusable block
+    size_t capacity;                    // the size of the block
+    size_t used;                        // how much of the block has been handed out
+    size_t wanted;                      // how much has been asked for since the last reset
+    struct arenaOverflow* overflow;     // allocations that didn't fit in the block
+};
+
+// the tasks waiting for one worker, oldest at the front
+struct deque {
+    void** tasks;                       // a ring buffer of tasks, each a connection with a request
+    size_t capacity;                    // the size of the ring buffer
+    size_t front;                       // where the oldest task is
+    size_t count;                       // how many tasks are waiting
+    pthread_mutex_t lock;               // held while the deque is read or changed
+};
+
+struct pool;
+
+// a worker thread with its own tasks and memory
+struct worker {
+    pthread_t thread;
+    unsigned int number;                // the worker's number, 0 to numWorkers - 1
+    struct pool* pool;                  // the pool the worker belongs to
+    struct deque deque;                 // the tasks handed to this worker
+    struct arena arena;                 // the memory for the request being handled
+};
+
+// a fixed number of workers that run every task handed to the pool
+struct pool {
+    struct worker* workers;             // the workers
+    unsigned int numWorkers;            // how many workers there are
+    unsigned int nextWorker;            // the worker the next task is handed to
+    size_t queued;                      // the number of tasks in all of the deques
+    pthread_mutex_t lock;               // held while queued is read or changed
+    pthread_cond_t wake;                // signaled when a task is added
+    void (*handler)(void* task, struct arena* arena); // runs a task on a worker
+};
+
+// function prototypes:
+bool startPool(struct pool* pool, unsigned int numWorkers, void (*handler)(void* task, struct arena* arena));
+bool submitPool(struct pool* pool, void* task);
+void initArena(struct arena* arena);
+void* arenaAlloc(struct arena* arena, size_t size);
+void resetArena(struct arena* arena);
+void freeArena(struct arena* arena);
+
+#endif
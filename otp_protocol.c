@@ -0,0 +1,253 @@
+/*******************************************************************************
+** Program name: otp_protocol.c
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  Functions to build and read the headers otp and otp_d send each
+**               other, see otp_protocol.h. A version 1 request header is laid
+**               out as:
+**                  bytes 0-1    "OT"
+**                  byte  2      the version
+**                  byte  3      the mode
+**                  bytes 4-7    flags
+**                  bytes 8-11   the size of the username
+**                  bytes 12-15  reserved, 0
+**                  bytes 16-23  the size of the ciphertext
+**               and a version 1 response header as:
+**                  bytes 0-1    "OT"
+**                  byte  2      the version
+**                  byte  3      's' or 'f'
+**                  bytes 4-7    flags
+**                  bytes 8-15   the size of the ciphertext
+**               The limits a 'D' request can carry as its body are:
+**                  bytes 0-7    the most ciphertexts to send
+**                  bytes 8-15   the most bytes of ciphertext to send
+**               Every number is little endian.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "otp_protocol.h"
+
+// function prototypes:
+static void putLE32(unsigned char* buffer, uint32_t value);
+static void putLE64(unsigned char* buffer, uint64_t value);
+static uint32_t getLE32(const unsigned char* buffer);
+static uint64_t getLE64(const unsigned char* buffer);
+
+/*******************************************************************************
+ *                              encodeRequestHeader                            *
+ * This function writes a version 1 request header into buffer, which must    *
+ * hold REQUEST_HEADER_SIZE bytes.                                             *
+ ******************************************************************************/
+void encodeRequestHeader(const struct requestHeader* header, unsigned char* buffer){
+    memcpy(buffer, PROTOCOL_MAGIC, 2);
+    buffer[2] = PROTOCOL_VERSION;
+    buffer[3] = header->mode;
+    putLE32(buffer + 4, header->flags);
+    putLE32(buffer + 8, header->userSize);
+    putLE32(buffer + 12, 0);
+    putLE64(buffer + 16, header->bodySize);
+}
+
+/*******************************************************************************
+ *                              decodeRequestHeader                            *
+ * This function reads a request header written by encodeRequestHeader(). False*
+ * is returned if it isn't a header for a version this program understands.    *
+ ******************************************************************************/
+bool decodeRequestHeader(const unsigned char* buffer, struct requestHeader* header){
+    if(memcmp(buffer, PROTOCOL_MAGIC, 2) != 0 || buffer[2] != PROTOCOL_VERSION) return false;
+    header->version = buffer[2];
+    header->mode = buffer[3];
+    header->flags = getLE32(buffer + 4);
+    header->userSize = getLE32(buffer + 8);
+    header->bodySize = getLE64(buffer + 16);
+    return true;
+}
+
+/*******************************************************************************
+ *                              encodeResponsePrefix                           *
+ * This function writes what comes before the ciphertext in a response into   *
+ * buffer, which must hold MAX_PREFIX_SIZE bytes, and returns its size. For    *
+ * version 1 that's a response header. For version 0 it's the status, followed *
+ * by the ciphertext's size if withSize is true.                               *
+ ******************************************************************************/
+size_t encodeResponsePrefix(unsigned int version, char status, bool withSize, uint64_t bodySize,
+                            unsigned char* buffer){
+    size_t size;
+
+    if(version == 0){
+        buffer[0] = status;
+        if(!withSize) return sizeof(char);
+        size = bodySize;
+        memcpy(buffer + sizeof(char), &size, sizeof(size_t));
+        return sizeof(char) + sizeof(size_t);
+    }
+
+    memcpy(buffer, PROTOCOL_MAGIC, 2);
+    buffer[2] = PROTOCOL_VERSION;
+    buffer[3] = status;
+    putLE32(buffer + 4, 0);
+    putLE64(buffer + 8, bodySize);
+    return RESPONSE_HEADER_SIZE;
+}
+
+/*******************************************************************************
+ *                              decodeResponseHeader                           *
+ * This function reads a version 1 response header. False is returned if it   *
+ * isn't one.                                                                  *
+ ******************************************************************************/
+bool decodeResponseHeader(const unsigned char* buffer, struct responseHeader* header){
+    if(memcmp(buffer, PROTOCOL_MAGIC, 2) != 0 || buffer[2] != PROTOCOL_VERSION) return false;
+    header->version = buffer[2];
+    header->status = buffer[3];
+    header->flags = getLE32(buffer + 4);
+    header->bodySize = getLE64(buffer + 8);
+    return true;
+}
+
+/*******************************************************************************
+ *                                chunkHeaderSize                              *
+ * This function returns the size of the number that comes before each chunk, *
+ * a size_t in version 0 and 8 bytes in version 1.                             *
+ ******************************************************************************/
+size_t chunkHeaderSize(unsigned int version){
+    return version == 0 ? sizeof(size_t) : sizeof(uint64_t);
+}
+
+/*******************************************************************************
+ *                               encodeChunkHeader                             *
+ * This function writes the size of a chunk into buffer, which must hold       *
+ * chunkHeaderSize(version) bytes.                                             *
+ ******************************************************************************/
+void encodeChunkHeader(unsigned int version, uint64_t chunkSize, unsigned char* buffer){
+    size_t size = chunkSize;
+
+    if(version == 0) memcpy(buffer, &size, sizeof(size_t));
+    else putLE64(buffer, chunkSize);
+}
+
+/*******************************************************************************
+ *                               decodeChunkHeader                             *
+ * This function reads the size of a chunk written by encodeChunkHeader().     *
+ ******************************************************************************/
+uint64_t decodeChunkHeader(unsigned int version, const unsigned char* buffer){
+    size_t size;
+
+    if(version != 0) return getLE64(buffer);
+    memcpy(&size, buffer, sizeof(size_t));
+    return size;
+}
+
+/*******************************************************************************
+ *                               encodeDrainLimits                             *
+ * This function writes the limits of a drain into buffer, which must hold     *
+ * DRAIN_LIMITS_SIZE bytes. A limit of 0 means there isn't one. otp_d stops    *
+ * once it has sent maxCount ciphertexts, or once it has sent maxBytes or more *
+ * bytes of them. A ciphertext is never split, so the last one can go past     *
+ * maxBytes.                                                                   *
+ ******************************************************************************/
+void encodeDrainLimits(uint64_t maxCount, uint64_t maxBytes, unsigned char* buffer){
+    putLE64(buffer, maxCount);
+    putLE64(buffer + 8, maxBytes);
+}
+
+/*******************************************************************************
+ *                               decodeDrainLimits                             *
+ * This function reads the limits written by encodeDrainLimits().              *
+ ******************************************************************************/
+void decodeDrainLimits(const unsigned char* buffer, uint64_t* maxCount, uint64_t* maxBytes){
+    *maxCount = getLE64(buffer);
+    *maxBytes = getLE64(buffer + 8);
+}
+
+/*******************************************************************************
+ *                                  sendvAll                                   *
+ * This function sends every buffer in iov, in order, with as few calls to     *
+ * sendmsg() as the socket allows, usually just one. The iov array is changed  *
+ * as it's sent. It returns true once everything has been sent.                *
+ ******************************************************************************/
+bool sendvAll(int socket, struct iovec* iov, int iovcnt){
+    struct msghdr message;
+    ssize_t i;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = iovcnt;
+
+    while(message.msg_iovlen > 0){
+        // skip over buffers that have been completely sent
+        if(message.msg_iov->iov_len == 0){
+            message.msg_iov++;
+            message.msg_iovlen--;
+            continue;
+        }
+
+        i = sendmsg(socket, &message, MSG_NOSIGNAL);
+        if(i < 0 && errno == EINTR) continue;
+        if(i < 1) return false;
+
+        // move past what was sent, which may end part way through a buffer
+        while(i > 0){
+            if((size_t)i >= message.msg_iov->iov_len){
+                i -= message.msg_iov->iov_len;
+                message.msg_iov->iov_len = 0;
+                message.msg_iov++;
+                message.msg_iovlen--;
+            }
+            else{
+                message.msg_iov->iov_base = (char*)message.msg_iov->iov_base + i;
+                message.msg_iov->iov_len -= i;
+                i = 0;
+            }
+        }
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                                  recvAll                                    *
+ * This function makes sure all of the data in a buffer is received. If the    *
+ * connection is interrupted, recv() will be called again until all the data is*
+ * received, in which case 'true' is returned.                                 *
+ * Adapted from:                                                               *
+ * https://stackoverflow.com/questions/13479760/c-socket-recv-and-send-all-data
+ ******************************************************************************/
+bool recvAll(int socket, void* buffer, size_t length){
+    char* ptr = (char*)buffer;  // initialize a pointer to the start of the buffer
+
+    // once length is 0, all of the data from the buffer has been received
+    while(length > 0){
+        ssize_t i = recv(socket, ptr, length, 0);
+        if(i < 0 && errno == EINTR) continue;
+        if(i < 1){
+            return false;
+        }
+        ptr += i;               // move pointer ahead by the number of bytes received
+        length -= i;
+    }
+    return true;
+}
+
+// little endian helpers, these don't depend on the byte order of the host
+static void putLE32(unsigned char* buffer, uint32_t value){
+    for(int i = 0; i < 4; i++) buffer[i] = value >> (8 * i);
+}
+
+static void putLE64(unsigned char* buffer, uint64_t value){
+    for(int i = 0; i < 8; i++) buffer[i] = value >> (8 * i);
+}
+
+static uint32_t getLE32(const unsigned char* buffer){
+    uint32_t value = 0;
+    for(int i = 3; i >= 0; i--) value = (value << 8) | buffer[i];
+    return value;
+}
+
+static uint64_t getLE64(const unsigned char* buffer){
+    uint64_t value = 0;
+    for(int i = 7; i >= 0; i--) value = (value << 8) | buffer[i];
+    return value;
+}
@@ -0,0 +1,133 @@
+/*******************************************************************************
+** Program name: otp_protocol.h
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  Constants and functions shared by otp and otp_d for the
+**               requests they send each other, and by the client API in
+**               otp_client.c. Every request has a mode:
+**                  'p' post:  the request carries the ciphertext, and otp_d
+**                             doesn't answer unless the header asks it to
+**                             with FLAG_ACK, in which case it answers 's'
+**                             once the ciphertext is stored, and synced to
+**                             disk if otp_d was started with --durability,
+**                             or closes the connection if it couldn't be
+**                  'g' get:   otp_d answers 's' with the ciphertext, or 'f' if
+**                             there isn't one
+**                  'P' post, streamed: the ciphertext follows as chunks,
+**                             and FLAG_ACK works the same as for a 'p'
+**                  'G' get, streamed:  otp_d answers 's' followed by the
+**                             ciphertext as chunks, or 'f' if there isn't one
+**                  'S' stats: otp_d answers 's' with a snapshot of its
+**                             counters as text, one "name value" per line,
+**                             the username is ignored
+**                  'D' drain: otp_d answers with every ciphertext the user
+**                             has, oldest first, each sent the same way as
+**                             the answer to a 'g', and then 'f'. A version 1
+**                             request can carry limits as its body, see
+**                             encodeDrainLimits(), otherwise it drains all
+**               When otp_d is already serving as many connections as it's been
+**               told to and has no room left to hold another one until a slot
+**               frees up, it answers a new connection straight away with a
+**               version 1 header with the status 'b' (busy) and closes it,
+**               without reading a request. The header's size field is how many
+**               milliseconds the client should wait before trying again.
+**               A chunk is its size followed by that many characters, and a
+**               chunk of size 0 ends the ciphertext.
+**
+**               A ciphertext is made of A-Z and space unless the post's header
+**               has FLAG_BINARY, in which case it's made of bytes XORed with a
+**               binary key and can hold any of them, newlines and nulls
+**               included. otp_d stores it without checking it for bad
+**               characters, and a 'get' sends it back exactly as it was posted.
+**               It's up to the client to remember which of its users' posts
+**               were binary, otp_d answers a 'get' the same way for both.
+**
+**               A post whose header has FLAG_PACKED carries its A-Z and space
+**               ciphertext packed 5 bits a character (see packText() in
+**               otp_cipher.h), which cuts it to about 5/8 of its size. otp_d
+**               checks it as packed, stores it packed and sends it back packed.
+**               A packed ciphertext starts with PACKED_MARKER, which a text one
+**               never does, so a client that understands packing can tell
+**               from the answer to a 'get' whether to unpack it, and the
+**               client API in otp_client.c does that itself.
+**
+**               Version 1 requests start with a fixed size header, see
+**               encodeRequestHeader(), followed by the username and, for a 'p',
+**               the ciphertext. Every number is a fixed width little endian
+**               integer, so otp and otp_d don't have to agree on the size or byte
+**               order of size_t, and otp can send a whole request with a single
+**               writev(). otp_d answers with a response header and then the
+**               ciphertext or chunks.
+**
+**               Version 0 is the original layout, which otp_d still accepts. It
+**               starts with the mode character instead of a header, followed by
+**               the username's size and the username, then for a 'p' the
+**               ciphertext's size and the ciphertext. Sizes are native size_t,
+**               and the answer to a 'g' is 's', the size and the ciphertext, or
+**               just 'f'. A version 1 header starts with 'O', which is never a
+**               mode, so otp_d can tell the two apart from the first byte.
+*******************************************************************************/
+#ifndef OTP_PROTOCOL_H
+#define OTP_PROTOCOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define MODE_POST 'p'                   // post a whole ciphertext
+#define MODE_GET 'g'                    // get a whole ciphertext
+#define MODE_STREAM_POST 'P'            // post a ciphertext as chunks
+#define MODE_STREAM_GET 'G'             // get a ciphertext as chunks
+#define MODE_STATS 'S'                  // get a snapshot of otp_d's counters
+#define MODE_DRAIN 'D'                  // get all of a user's ciphertexts at once
+
+#define STATUS_BUSY 'b'                 // otp_d turned the connection away, try again later
+
+#define FLAG_ACK 1                      // answer a post once it's stored (version 1 only)
+#define FLAG_BINARY 2                   // a post's ciphertext can hold any byte (version 1 only)
+#define FLAG_PACKED 4                   // a post's ciphertext is packed 5 bits a character (version 1 only)
+
+#define STREAM_CHUNK_SIZE 65536         // the size of the chunks otp and otp_d send
+#define MAX_CHUNK_SIZE (1 << 20)        // the biggest chunk either side will accept
+
+#define PROTOCOL_MAGIC "OT"             // the first two bytes of every version 1 header
+#define PROTOCOL_VERSION 1              // the newest version, the one otp sends
+#define REQUEST_HEADER_SIZE 24          // the size of a version 1 request header
+#define RESPONSE_HEADER_SIZE 16         // the size of a version 1 response header
+#define MAX_PREFIX_SIZE 16              // the most that's sent before a response's ciphertext
+#define DRAIN_LIMITS_SIZE 16            // the size of the limits a 'D' can carry as its body
+
+// the fields of a request header
+struct requestHeader {
+    unsigned int version;               // the version of the protocol the request uses
+    char mode;                          // one of the modes above
+    uint32_t flags;                     // FLAG_ACK, FLAG_BINARY and FLAG_PACKED, or 0
+    uint32_t userSize;                  // the size of the username
+    uint64_t bodySize;                  // the size of the ciphertext of a 'p' or the limits of a 'D', otherwise 0
+};
+
+// the fields of a response header
+struct responseHeader {
+    unsigned int version;               // the version of the protocol the response uses
+    char status;                        // 's' for success, 'f' for failure or 'b' for busy
+    uint32_t flags;                     // not used yet, always 0
+    uint64_t bodySize;                  // the size of the body, or the milliseconds to wait after a 'b'
+};
+
+// function prototypes:
+void encodeRequestHeader(const struct requestHeader* header, unsigned char* buffer);
+bool decodeRequestHeader(const unsigned char* buffer, struct requestHeader* header);
+size_t encodeResponsePrefix(unsigned int version, char status, bool withSize, uint64_t bodySize,
+                            unsigned char* buffer);
+bool decodeResponseHeader(const unsigned char* buffer, struct responseHeader* header);
+size_t chunkHeaderSize(unsigned int version);
+void encodeChunkHeader(unsigned int version, uint64_t chunkSize, unsigned char* buffer);
+uint64_t decodeChunkHeader(unsigned int version, const unsigned char* buffer);
+void encodeDrainLimits(uint64_t maxCount, uint64_t maxBytes, unsigned char* buffer);
+void decodeDrainLimits(const unsigned char* buffer, uint64_t* maxCount, uint64_t* maxBytes);
+bool sendvAll(int socket, struct iovec* iov, int iovcnt);
+bool recvAll(int socket, void* buffer, size_t length);
+
+#endif
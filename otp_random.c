@@ -0,0 +1,130 @@
+/*******************************************************************************
+** Program name: otp_random.c
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  Functions for making random key characters, see otp_random.h.
+**               They're kept apart from keygen's main() so that the generator
+**               can be timed and checked on its own.
+*******************************************************************************/
+#include <string.h>
+#include "otp_random.h"
+
+#define REJECT_LIMIT 243                // the largest multiple of 27 that fits in a byte
+
+// function prototypes:
+static void startStream(uint32_t state[16], const uint32_t key[CHACHA_KEY_WORDS], uint64_t blockNumber);
+static void streamBytes(uint32_t state[16], unsigned char bytes[64]);
+
+/*******************************************************************************
+ *                                  makeKeyBlock                               *
+ * This function fills a block of the key with random characters. The block's *
+ * number is used as the ChaCha20 nonce, so every block gets its own stream.   *
+ * Each byte below 243 becomes a character (243 is 27 * 9, so all 27 come up   *
+ * equally often) and the rest are thrown away.                                *
+ ******************************************************************************/
+void makeKeyBlock(const uint32_t key[CHACHA_KEY_WORDS], uint64_t blockNumber, char* block, size_t blockSize){
+    uint32_t state[16];                 // the ChaCha20 input: constants, key, counter and nonce
+    unsigned char bytes[64];            // 64 bytes of ChaCha20 output
+    size_t made = 0;                    // how many characters of the block have been made
+    int randNum;                        // a random number from 0-26 representing a space or A-Z
+
+    startStream(state, key, blockNumber);
+    while(made < blockSize){
+        streamBytes(state, bytes);
+        for(int j = 0; j < 64 && made < blockSize; j++){
+            if(bytes[j] >= REJECT_LIMIT) continue;
+            randNum = bytes[j] % 27;
+            // if the random number equals 1-26 then add the corresponding ASCII character (A-Z),
+            // if it equals 0 then add a space to the key
+            block[made++] = randNum != 0 ? randNum + 64 : ' ';
+        }
+    }
+}
+
+/*******************************************************************************
+ *                              makeBinaryKeyBlock                             *
+ * This function fills a block of a binary key with random bytes, using the    *
+ * block's number as the nonce the same way makeKeyBlock() does. Every byte is *
+ * good, so none are thrown away.                                              *
+ ******************************************************************************/
+void makeBinaryKeyBlock(const uint32_t key[CHACHA_KEY_WORDS], uint64_t blockNumber, char* block, size_t blockSize){
+    uint32_t state[16];                 // the ChaCha20 input: constants, key, counter and nonce
+    unsigned char bytes[64];            // 64 bytes of ChaCha20 output
+    size_t made = 0;                    // how many bytes of the block have been made
+    size_t count;
+
+    startStream(state, key, blockNumber);
+    while(made < blockSize){
+        streamBytes(state, bytes);
+        count = blockSize - made < sizeof(bytes) ? blockSize - made : sizeof(bytes);
+        memcpy(block + made, bytes, count);
+        made += count;
+    }
+}
+
+/*******************************************************************************
+ *                                  startStream                                *
+ * This function sets up the ChaCha20 input for a block of the key: "expand    *
+ * 32-byte k", then the key, then the counter and the nonce.                   *
+ ******************************************************************************/
+static void startStream(uint32_t state[16], const uint32_t key[CHACHA_KEY_WORDS], uint64_t blockNumber){
+    state[0] = 0x61707865; state[1] = 0x3320646e; state[2] = 0x79622d32; state[3] = 0x6b206574;
+    memcpy(&state[4], key, CHACHA_KEY_WORDS * sizeof(uint32_t));
+    state[12] = 0;
+    state[13] = (uint32_t)blockNumber;
+    state[14] = (uint32_t)(blockNumber >> 32);
+    state[15] = 0;
+}
+
+/*******************************************************************************
+ *                                  streamBytes                                *
+ * This function makes the next 64 bytes of the stream, in little endian       *
+ * order, and moves the counter on.                                            *
+ ******************************************************************************/
+static void streamBytes(uint32_t state[16], unsigned char bytes[64]){
+    uint32_t stream[16];                // 64 bytes of ChaCha20 output
+
+    chachaBlock(stream, state);
+    state[12]++;
+
+    for(int w = 0; w < 16; w++){
+        bytes[4 * w] = stream[w];
+        bytes[4 * w + 1] = stream[w] >> 8;
+        bytes[4 * w + 2] = stream[w] >> 16;
+        bytes[4 * w + 3] = stream[w] >> 24;
+    }
+}
+
+/*******************************************************************************
+ *                                  chachaBlock                                *
+ * This function runs the 20 rounds of the ChaCha20 block function (RFC 8439)  *
+ * on a 16 word input and stores the 16 word result in out.                    *
+ ******************************************************************************/
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTER_ROUND(a, b, c, d) \
+    a += b; d ^= a; d = ROTL(d, 16); \
+    c += d; b ^= c; b = ROTL(b, 12); \
+    a += b; d ^= a; d = ROTL(d, 8);  \
+    c += d; b ^= c; b = ROTL(b, 7)
+
+void chachaBlock(uint32_t out[16], const uint32_t in[16]){
+    uint32_t x[16];
+
+    memcpy(x, in, sizeof(x));
+    for(int round = 0; round < 20; round += 2){
+        // column round
+        QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+        QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+        QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+        QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+        // diagonal round
+        QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+        QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+        QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+        QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+    }
+    for(int w = 0; w < 16; w++){
+        out[w] = x[w] + in[w];
+    }
+}
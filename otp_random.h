@@ -0,0 +1,25 @@
+/*******************************************************************************
+** Program name: otp_random.h
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  Declarations for making random key characters, used by keygen.
+**               The random bytes come from the ChaCha20 stream cipher (RFC
+**               8439), and bytes of 243 or more are thrown away so the rest can
+**               be taken mod 27 with every character equally likely. A binary
+**               key is the ChaCha20 bytes as they are, since any byte is good.
+*******************************************************************************/
+#ifndef OTP_RANDOM_H
+#define OTP_RANDOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHACHA_KEY_WORDS 8              // a ChaCha20 key is 256 bits
+
+// function prototypes:
+void makeKeyBlock(const uint32_t key[CHACHA_KEY_WORDS], uint64_t blockNumber, char* block, size_t blockSize);
+void makeBinaryKeyBlock(const uint32_t key[CHACHA_KEY_WORDS], uint64_t blockNumber, char* block, size_t blockSize);
+void chachaBlock(uint32_t out[16], const uint32_t in[16]);
+
+#endif
@@ -0,0 +1,930 @@
+/*******************************************************************************
+** Program name: otp_segment.c
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  This file is the segment backend of the otp_d store, which is
+**               used with otp_d --store=segment. Instead of one file per
+**               ciphertext, posts are appended as records to the newest of a
+**               few large segment-<number>.log files. When a ciphertext is
+**               taken by a 'get', a tombstone record is appended to the same
+**               segment, so each segment can be replayed on its own when otp_d
+**               starts. Segments are never rewritten in place. A background
+**               compactor thread copies the few live records out of a segment
+**               once most of it is dead, then deletes the old segment.
+**               When posts are synced (--durability), a full segment is synced
+**               before the next one takes over, so only the active segment ever
+**               has posts in it that haven't reached the disk. The exception is
+**               a streamed post, which reserves room for its record and is
+**               copied in with the store's lock let go, so it syncs its own
+**               segment.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <sched.h>
+#include <errno.h>
+#include "otp_store.h"
+
+#define SEGMENT_MAGIC 0x5350544fU       // "OTPS" when written on a little-endian host
+#define RECORD_PUT 1                    // a record that holds a ciphertext
+#define RECORD_TOMBSTONE 2              // a record that marks a ciphertext as consumed
+#define RECORD_PENDING 3                // a put whose ciphertext is still being copied in, dead if it's replayed
+#ifndef SEGMENT_SIZE
+#define SEGMENT_SIZE (64L * 1024 * 1024) // a new segment is started once the active one is this big
+#endif
+#define COMPACT_BATCH 64                // the most records the compactor moves per hold of the lock
+#define COMPACT_RETRY_DELAY 1000000     // microseconds before a segment that couldn't be compacted is tried again
+#define MAX_USER_SIZE (1 << 20)         // a longer username means the record is corrupt
+#define COPY_CHUNK_SIZE 65536           // how much of a spooled ciphertext is copied at a time
+
+// the header at the start of every record, followed by the username and ciphertext for a put
+struct recordHeader {
+    uint32_t magic;                     // always SEGMENT_MAGIC
+    uint32_t type;                      // RECORD_PUT or RECORD_TOMBSTONE
+    uint64_t seq;                       // the sequence number of the message
+    uint32_t userSize;                  // the size of the username (0 for a tombstone)
+    uint32_t reserved;                  // always 0
+    uint64_t dataSize;                  // the size of the ciphertext (0 for a tombstone)
+};
+
+// a put record found while replaying the segments
+struct replayedPut {
+    unsigned long long seq;             // the sequence number of the message
+    struct segment* segment;            // the segment the record is in
+    off_t offset;                       // where the ciphertext starts in the segment
+    size_t size;                        // the size of the ciphertext
+    size_t recordSize;                  // the size of the whole record
+    char* user;                         // the username
+};
+
+// function prototypes:
+static struct segment* addSegment(struct store* store, unsigned int id);
+static bool nextSegment(struct store* store);
+static bool writePutRecord(struct store* store, const char* user, unsigned long long seq, const char* ciphertext,
+                           size_t ciphertextSize, off_t* recordOffset);
+static bool replaySegment(struct segment* segment, const char* filename, struct replayedPut** puts,
+                          size_t* numPuts, size_t* putsCapacity, unsigned long long** tombstones,
+                          size_t* numTombstones, size_t* tombstonesCapacity);
+static int compareSegmentIds(const void* a, const void* b);
+static int compareReplayedPuts(const void* a, const void* b);
+static int compareSeqs(const void* a, const void* b);
+static bool writeRecord(struct segment* segment, const struct iovec* parts, int numParts, off_t* recordOffset);
+static bool writeTombstone(struct segment* segment, unsigned long long seq);
+static bool writeAt(int fd, const void* buffer, size_t size, off_t offset);
+static bool copyRange(int fromFD, off_t fromOffset, int toFD, off_t toOffset, size_t size);
+static void linkLive(struct segment* segment, struct storedMessage* message);
+static void unlinkLive(struct segment* segment, struct storedMessage* message);
+static bool needsCompacting(struct store* store, struct segment* segment);
+static void* runCompactor(void* arg);
+static bool moveMessage(struct store* store, struct segment* from, struct segment** to);
+static void deleteSegment(struct store* store, struct segment* segment);
+
+/*******************************************************************************
+ *                                  openSegments                               *
+ * This function replays every segment file in the current directory to       *
+ * rebuild the index, then starts the compactor. A ciphertext is live unless a *
+ * tombstone for its sequence number was found. If a crash left two copies of *
+ * a live ciphertext (one being compacted and its copy), the copy in the newer *
+ * segment is used. A record cut short by a crash is truncated away.           *
+ ******************************************************************************/
+bool openSegments(struct store* store){
+    DIR* dir;                           // declare DIR pointer
+    struct dirent* dirEnt;              // pointer for directory entry
+    unsigned int* ids = NULL;           // the id of every segment in the directory
+    size_t numIds = 0, idsCapacity = 0;
+    unsigned int* grownIds;
+    unsigned int id;                    // the id parsed from a segment filename
+    int parsed;                         // the number of characters sscanf() matched
+    char filename[FILENAME_SIZE];       // the name of a segment file
+    struct replayedPut* puts = NULL;    // every put record in every segment
+    size_t numPuts = 0, putsCapacity = 0;
+    unsigned long long* tombstones = NULL; // the sequence number of every tombstone
+    size_t numTombstones = 0, tombstonesCapacity = 0;
+    struct segment* segment;
+    struct storedMessage* message;
+    bool dead;                          // true if a put has a tombstone or a newer copy
+    bool success = true;
+
+    // find the segments in the current directory
+    dir = opendir(".");
+    if(dir == NULL) return false;
+    while((dirEnt = readdir(dir)) != NULL){
+        parsed = 0;
+        if(sscanf(dirEnt->d_name, "segment-%u.log%n", &id, &parsed) != 1 || dirEnt->d_name[parsed] != '\0'
+           || parsed == 0){
+            continue;
+        }
+        if(numIds == idsCapacity){
+            idsCapacity = idsCapacity ? idsCapacity * 2 : 16;
+            grownIds = realloc(ids, idsCapacity * sizeof(unsigned int));
+            if(grownIds == NULL){
+                success = false;
+                break;
+            }
+            ids = grownIds;
+        }
+        ids[numIds++] = id;
+    }
+    closedir(dir);
+    qsort(ids, numIds, sizeof(unsigned int), compareSegmentIds);
+
+    // replay the segments oldest first
+    for(size_t i = 0; success && i < numIds; i++){
+        segment = addSegment(store, ids[i]);
+        snprintf(filename, sizeof(filename), "segment-%u.log", ids[i]);
+        if(segment == NULL || !replaySegment(segment, filename, &puts, &numPuts, &putsCapacity,
+                                             &tombstones, &numTombstones, &tombstonesCapacity)){
+            success = false;
+        }
+    }
+    free(ids);
+
+    // queue the live ciphertexts in the order they were posted
+    qsort(puts, numPuts, sizeof(struct replayedPut), compareReplayedPuts);
+    qsort(tombstones, numTombstones, sizeof(unsigned long long), compareSeqs);
+    for(size_t i = 0; i < numPuts; i++){
+        dead = bsearch(&puts[i].seq, tombstones, numTombstones, sizeof(unsigned long long), compareSeqs) != NULL
+               || (i > 0 && puts[i - 1].seq == puts[i].seq);
+        if(success && !dead){
+            message = pushMessage(&store->index, puts[i].user, puts[i].seq);
+            if(message == NULL){
+                success = false;
+            }
+            else{
+                message->segment = puts[i].segment;
+                message->offset = puts[i].offset;
+                message->size = puts[i].size;
+                message->recordSize = puts[i].recordSize;
+                linkLive(puts[i].segment, message);
+                puts[i].segment->deadBytes -= puts[i].recordSize;
+            }
+        }
+        if(puts[i].seq >= store->index.nextSeq) store->index.nextSeq = puts[i].seq + 1;
+        free(puts[i].user);
+    }
+    if(numTombstones > 0 && tombstones[numTombstones - 1] >= store->index.nextSeq){
+        store->index.nextSeq = tombstones[numTombstones - 1] + 1;
+    }
+    free(puts);
+    free(tombstones);
+    if(!success) return false;
+
+    // keep appending to the newest segment unless it's full
+    for(segment = store->segments; segment != NULL && segment->next != NULL; segment = segment->next);
+    if(segment == NULL || segment->size >= SEGMENT_SIZE){
+        segment = addSegment(store, segment == NULL ? 0 : segment->id + 1);
+        if(segment == NULL) return false;
+    }
+    store->active = segment;
+
+    // the compactor starts by looking for segments that were left mostly dead last time
+    if(pthread_create(&store->compactor, NULL, runCompactor, store) != 0){
+        return false;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                                  closeSegments                              *
+ * This function stops the compactor and closes and frees every segment.       *
+ ******************************************************************************/
+void closeSegments(struct store* store){
+    struct segment* segment;
+
+    pthread_mutex_lock(&store->lock);
+    store->stopping = true;
+    pthread_cond_signal(&store->compactorWake);
+    pthread_mutex_unlock(&store->lock);
+    pthread_join(store->compactor, NULL);
+
+    while((segment = store->segments) != NULL){
+        store->segments = segment->next;
+        close(segment->fd);
+        free(segment);
+    }
+    store->active = NULL;
+}
+
+/*******************************************************************************
+ *                              appendSegmentMessage                           *
+ * This function appends a put record for a ciphertext to the active segment, *
+ * starting a new segment first if the active one is full, and adds it to the  *
+ * back of the user's queue. The store's lock must be held.                    *
+ ******************************************************************************/
+bool appendSegmentMessage(struct store* store, const char* user, const char* ciphertext,
+                          size_t ciphertextSize, char* location, size_t locationSize){
+    struct recordHeader header;
+    struct storedMessage* message;
+    off_t recordOffset;                 // where the record starts in the segment
+    size_t userSize = strlen(user);
+    unsigned long long seq = store->index.nextSeq++;
+
+    if(!writePutRecord(store, user, seq, ciphertext, ciphertextSize, &recordOffset)){
+        return false;
+    }
+
+    message = pushMessage(&store->index, user, seq);
+    if(message == NULL){
+        // the record is on disk but can't be queued, so it's marked as consumed straight away
+        store->active->deadBytes += sizeof(header) + userSize + ciphertextSize;
+        writeTombstone(store->active, seq);
+        return false;
+    }
+    message->segment = store->active;
+    message->offset = recordOffset + sizeof(header) + userSize;
+    message->size = ciphertextSize;
+    message->recordSize = sizeof(header) + userSize + ciphertextSize;
+    linkLive(store->active, message);
+
+    snprintf(location, locationSize, "segment-%u.log:%lld", store->active->id, (long long)recordOffset);
+    return true;
+}
+
+/*******************************************************************************
+ *                              appendCachedMessage                            *
+ * This function appends a put record for a message that was held in the      *
+ * cache and points the message at it. The record keeps the sequence number   *
+ * the message was given when it was posted, so replaying queues it where it   *
+ * was posted. Room for the record is reserved under the lock with its header  *
+ * marked pending, and the ciphertext is written with the lock let go, so the  *
+ * caller must keep anyone else from freeing the message meanwhile. The        *
+ * store's lock must be held, and is held again on return.                     *
+ ******************************************************************************/
+bool appendCachedMessage(struct store* store, struct storedMessage* message){
+    struct recordHeader header;
+    struct iovec parts[2];              // the header and username of the record
+    struct segment* segment;            // the segment the record is reserved in
+    off_t recordOffset;                 // where the record starts in the segment
+    size_t userSize = strlen(message->user);
+    bool success;
+
+    if(userSize > MAX_USER_SIZE){
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    // start a new segment once the active one is full, the old one may now need compacting
+    if(store->active->size >= SEGMENT_SIZE){
+        if(!nextSegment(store)) return false;
+        pthread_cond_signal(&store->compactorWake);
+    }
+    segment = store->active;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = SEGMENT_MAGIC;
+    header.type = RECORD_PENDING;
+    header.seq = message->seq;
+    header.userSize = userSize;
+    header.dataSize = message->size;
+    parts[0].iov_base = &header;
+    parts[0].iov_len = sizeof(header);
+    parts[1].iov_base = message->user;
+    parts[1].iov_len = userSize;
+    if(!writeRecord(segment, parts, 2, &recordOffset)) return false;
+    segment->size += message->size;
+    segment->copying++;
+
+    pthread_mutex_unlock(&store->lock);
+    success = writeAt(segment->fd, message->cached, message->size, recordOffset + sizeof(header) + userSize);
+    pthread_mutex_lock(&store->lock);
+
+    segment->copying--;
+    header.type = RECORD_PUT;
+    if(!success || !writeAt(segment->fd, &header, sizeof(header), recordOffset)){
+        segment->deadBytes += sizeof(header) + userSize + message->size;  // a pending record is dead to a replay
+        if(needsCompacting(store, segment)) pthread_cond_signal(&store->compactorWake);
+        return false;
+    }
+    message->segment = segment;
+    message->offset = recordOffset + sizeof(header) + userSize;
+    message->recordSize = sizeof(header) + userSize + message->size;
+    linkLive(segment, message);
+    return true;
+}
+
+/*******************************************************************************
+ *                              appendSegmentFile                              *
+ * This function appends a put record for a ciphertext that was streamed into *
+ * a spool file and adds it to the back of the user's queue. Room for the      *
+ * whole record is reserved at the end of the active segment under the lock,   *
+ * with its header marked pending, and the ciphertext is then copied in a      *
+ * chunk at a time with the lock let go, so a ciphertext of many GB doesn't    *
+ * hold up every other request. The record only becomes a put once it's       *
+ * complete. If posts are synced, the segment is synced before this returns,   *
+ * since it may no longer be the active one. The store's lock mustn't be held. *
+ ******************************************************************************/
+bool appendSegmentFile(struct store* store, const char* user, int fd, size_t size,
+                       char* location, size_t locationSize){
+    struct recordHeader header;
+    struct iovec parts[2];              // the header and username of the record
+    struct segment* segment;            // the segment the record is reserved in
+    struct storedMessage* message = NULL;
+    off_t recordOffset;                 // where the record starts in the segment
+    size_t userSize = strlen(user);
+    size_t recordSize = sizeof(header) + userSize + size;
+    int syncFD = -1;                    // the segment, for syncing it with the lock let go
+    bool success;
+
+    if(userSize > MAX_USER_SIZE){
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = SEGMENT_MAGIC;
+    header.type = RECORD_PENDING;
+    header.userSize = userSize;
+    header.dataSize = size;
+    parts[0].iov_base = &header;
+    parts[0].iov_len = sizeof(header);
+    parts[1].iov_base = (void*)user;
+    parts[1].iov_len = userSize;
+
+    // reserve the record, the segment can't be deleted while it's being copied into
+    pthread_mutex_lock(&store->lock);
+    success = store->active->size < SEGMENT_SIZE || nextSegment(store);
+    segment = store->active;
+    header.seq = store->index.nextSeq++;
+    if(success) success = writeRecord(segment, parts, 2, &recordOffset);
+    if(success){
+        segment->size += size;
+        segment->copying++;
+    }
+    pthread_mutex_unlock(&store->lock);
+    if(!success) return false;
+
+    success = copyRange(fd, 0, segment->fd, recordOffset + sizeof(header) + userSize, size);
+
+    pthread_mutex_lock(&store->lock);
+    segment->copying--;
+    header.type = RECORD_PUT;
+    if(success && writeAt(segment->fd, &header, sizeof(header), recordOffset)){
+        message = pushMessage(&store->index, user, header.seq);
+        if(message == NULL){
+            // the record is complete but can't be queued, so it's marked as consumed straight away
+            writeTombstone(segment, header.seq);
+        }
+    }
+    if(message == NULL){
+        segment->deadBytes += recordSize;  // a pending record is dead to a replay
+        if(needsCompacting(store, segment)) pthread_cond_signal(&store->compactorWake);
+    }
+    else{
+        message->segment = segment;
+        message->offset = recordOffset + sizeof(header) + userSize;
+        message->size = size;
+        message->recordSize = recordSize;
+        linkLive(segment, message);
+        if(store->durability != DURABILITY_NONE) syncFD = dup(segment->fd);
+    }
+    pthread_mutex_unlock(&store->lock);
+    if(message == NULL) return false;
+
+    if(store->durability != DURABILITY_NONE){
+        success = syncFD >= 0 && fdatasync(syncFD) == 0;
+        if(syncFD >= 0) close(syncFD);
+        if(!success) return false;
+    }
+    snprintf(location, locationSize, "segment-%u.log:%lld", segment->id, (long long)recordOffset);
+    return true;
+}
+
+/*******************************************************************************
+ *                              dropSegmentMessage                             *
+ * This function appends a tombstone for a message to the segment it's in and *
+ * counts its record as dead, waking the compactor if the segment is now       *
+ * mostly dead. The message itself is freed by the caller. The store's lock    *
+ * must be held.                                                               *
+ ******************************************************************************/
+void dropSegmentMessage(struct store* store, struct storedMessage* message){
+    struct recordHeader header;
+    struct iovec parts[1];
+    struct segment* segment = message->segment;
+    off_t recordOffset;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = SEGMENT_MAGIC;
+    header.type = RECORD_TOMBSTONE;
+    header.seq = message->seq;
+    parts[0].iov_base = &header;
+    parts[0].iov_len = sizeof(header);
+    if(!writeRecord(segment, parts, 1, &recordOffset)){
+        perror("otp_d ERROR writing tombstone");
+    }
+    else{
+        segment->deadBytes += sizeof(header);
+    }
+
+    unlinkLive(segment, message);
+    segment->deadBytes += message->recordSize;
+    if(needsCompacting(store, segment)){
+        pthread_cond_signal(&store->compactorWake);
+    }
+}
+
+/*******************************************************************************
+ *                                  writePutRecord                             *
+ * This function appends a put record holding a user's ciphertext to the       *
+ * active segment, starting a new segment first if the active one is full.     *
+ * The store's lock must be held.                                              *
+ ******************************************************************************/
+static bool writePutRecord(struct store* store, const char* user, unsigned long long seq, const char* ciphertext,
+                           size_t ciphertextSize, off_t* recordOffset){
+    struct recordHeader header;
+    struct iovec parts[3];              // the header, username and ciphertext of the record
+    size_t userSize = strlen(user);
+
+    if(userSize > MAX_USER_SIZE){
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    // start a new segment once the active one is full, the old one may now need compacting
+    if(store->active->size >= SEGMENT_SIZE){
+        if(!nextSegment(store)) return false;
+        pthread_cond_signal(&store->compactorWake);
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = SEGMENT_MAGIC;
+    header.type = RECORD_PUT;
+    header.seq = seq;
+    header.userSize = userSize;
+    header.dataSize = ciphertextSize;
+    parts[0].iov_base = &header;
+    parts[0].iov_len = sizeof(header);
+    parts[1].iov_base = (void*)user;
+    parts[1].iov_len = userSize;
+    parts[2].iov_base = (void*)ciphertext;
+    parts[2].iov_len = ciphertextSize;
+    return writeRecord(store->active, parts, 3, recordOffset);
+}
+
+/*******************************************************************************
+ *                                  addSegment                                 *
+ * This function opens (creating if needed) the segment file with the given id *
+ * and adds it to the end of the store's list of segments.                     *
+ ******************************************************************************/
+static struct segment* addSegment(struct store* store, unsigned int id){
+    char filename[FILENAME_SIZE];       // the name of the segment file
+    struct segment* segment;
+    struct segment** link;
+    struct stat fileInfo;
+
+    segment = calloc(1, sizeof(struct segment));
+    if(segment == NULL) return NULL;
+    segment->id = id;
+
+    snprintf(filename, sizeof(filename), "segment-%u.log", id);
+    segment->fd = open(filename, O_RDWR | O_CREAT, 0600);
+    if(segment->fd < 0 || fstat(segment->fd, &fileInfo) != 0){
+        if(segment->fd >= 0) close(segment->fd);
+        free(segment);
+        return NULL;
+    }
+    segment->size = fileInfo.st_size;
+    segment->deadBytes = fileInfo.st_size;  // replaying marks the live records
+
+    for(link = &store->segments; *link != NULL; link = &(*link)->next);
+    *link = segment;
+    return segment;
+}
+
+/*******************************************************************************
+ *                                  nextSegment                                *
+ * This function makes a new segment the active one once the old one is full. *
+ * If posts are being synced, whatever is left of the old segment is synced    *
+ * first, and the new segment's name is synced into the data directory. The   *
+ * store's lock must be held.                                                  *
+ ******************************************************************************/
+static bool nextSegment(struct store* store){
+    struct segment* segment;
+
+    if(store->durability != DURABILITY_NONE && fdatasync(store->active->fd) != 0){
+        return false;
+    }
+    segment = addSegment(store, store->active->id + 1);
+    if(segment == NULL) return false;
+    store->active = segment;
+    return store->durability == DURABILITY_NONE || syncDirectory(".");
+}
+
+/*******************************************************************************
+ *                                  replaySegment                              *
+ * This function reads every record in a segment, adding its puts and          *
+ * tombstones to the given arrays. If the segment ends with a record that was  *
+ * cut short or is corrupt, the segment is truncated just before it.           *
+ ******************************************************************************/
+static bool replaySegment(struct segment* segment, const char* filename, struct replayedPut** puts,
+                          size_t* numPuts, size_t* putsCapacity, unsigned long long** tombstones,
+                          size_t* numTombstones, size_t* tombstonesCapacity){
+    FILE* file;
+    struct recordHeader header;
+    off_t offset = 0;                   // where the current record starts
+    size_t recordSize;
+    struct replayedPut* put;
+    void* grown;
+    bool success = true;
+
+    file = fopen(filename, "r");
+    if(!file) return false;
+
+    while(offset < segment->size){
+        if(fread(&header, sizeof(header), 1, file) != 1 || header.magic != SEGMENT_MAGIC
+           || (header.type != RECORD_PUT && header.type != RECORD_TOMBSTONE && header.type != RECORD_PENDING)
+           || header.userSize > MAX_USER_SIZE
+           || header.dataSize > (uint64_t)(segment->size - offset)){
+            break;
+        }
+        recordSize = sizeof(header) + header.userSize + header.dataSize;
+        if(offset + (off_t)recordSize > segment->size) break;
+
+        if(header.type == RECORD_PENDING){
+            // its copy never finished, so it's dead space
+            if(fseeko(file, header.userSize + header.dataSize, SEEK_CUR) != 0) break;
+        }
+        else if(header.type == RECORD_TOMBSTONE){
+            if(*numTombstones == *tombstonesCapacity){
+                *tombstonesCapacity = *tombstonesCapacity ? *tombstonesCapacity * 2 : 256;
+                grown = realloc(*tombstones, *tombstonesCapacity * sizeof(unsigned long long));
+                if(grown == NULL){ success = false; break; }
+                *tombstones = grown;
+            }
+            (*tombstones)[(*numTombstones)++] = header.seq;
+        }
+        else{
+            if(*numPuts == *putsCapacity){
+                *putsCapacity = *putsCapacity ? *putsCapacity * 2 : 256;
+                grown = realloc(*puts, *putsCapacity * sizeof(struct replayedPut));
+                if(grown == NULL){ success = false; break; }
+                *puts = grown;
+            }
+            put = &(*puts)[*numPuts];
+            put->user = malloc(header.userSize + 1);
+            if(put->user == NULL){ success = false; break; }
+            if(fread(put->user, 1, header.userSize, file) != header.userSize){
+                free(put->user);
+                break;
+            }
+            put->user[header.userSize] = '\0';
+            put->seq = header.seq;
+            put->segment = segment;
+            put->offset = offset + sizeof(header) + header.userSize;
+            put->size = header.dataSize;
+            put->recordSize = recordSize;
+            (*numPuts)++;
+            if(fseeko(file, header.dataSize, SEEK_CUR) != 0) break;
+        }
+        offset += recordSize;
+    }
+    fclose(file);
+
+    // anything after the last good record was cut short by a crash
+    if(success && offset < segment->size){
+        fprintf(stderr, "otp_d: truncating %s from %lld to %lld bytes\n", filename,
+                (long long)segment->size, (long long)offset);
+        if(ftruncate(segment->fd, offset) != 0) return false;
+        segment->deadBytes -= segment->size - offset;
+        segment->size = offset;
+    }
+    return success;
+}
+
+/*******************************************************************************
+ *                              compareSegmentIds                              *
+ * This function is used with qsort() to order segment ids from low to high.   *
+ ******************************************************************************/
+static int compareSegmentIds(const void* a, const void* b){
+    unsigned int idA = *(const unsigned int*)a;
+    unsigned int idB = *(const unsigned int*)b;
+    return idA < idB ? -1 : idA > idB;
+}
+
+/*******************************************************************************
+ *                              compareReplayedPuts                            *
+ * This function is used with qsort() to order puts by sequence number. Copies *
+ * of the same message are ordered newest segment first, so the copy that is   *
+ * kept is the one the compactor made.                                         *
+ ******************************************************************************/
+static int compareReplayedPuts(const void* a, const void* b){
+    const struct replayedPut* putA = a;
+    const struct replayedPut* putB = b;
+
+    if(putA->seq != putB->seq){
+        return putA->seq < putB->seq ? -1 : 1;
+    }
+    return putA->segment->id > putB->segment->id ? -1 : putA->segment->id < putB->segment->id;
+}
+
+/*******************************************************************************
+ *                                  compareSeqs                                *
+ * This function is used with qsort() and bsearch() on sequence numbers.       *
+ ******************************************************************************/
+static int compareSeqs(const void* a, const void* b){
+    unsigned long long seqA = *(const unsigned long long*)a;
+    unsigned long long seqB = *(const unsigned long long*)b;
+    return seqA < seqB ? -1 : seqA > seqB;
+}
+
+/*******************************************************************************
+ *                                  writeRecord                                *
+ * This function appends a record made up of the given parts to a segment. If *
+ * the record can't be written completely, whatever was written is truncated   *
+ * away so the segment never ends with half a record. The end of the segment   *
+ * is its size rather than the end of the file, which can fall short of a      *
+ * record that's still being copied in. The store's lock must be held.         *
+ ******************************************************************************/
+static bool writeRecord(struct segment* segment, const struct iovec* parts, int numParts, off_t* recordOffset){
+    struct iovec remaining[3];          // the parts not yet written
+    int first = 0;                      // the first part in remaining not yet completely written
+    ssize_t i;
+
+    memcpy(remaining, parts, numParts * sizeof(struct iovec));
+    *recordOffset = segment->size;
+
+    while(first < numParts){
+        i = pwritev(segment->fd, remaining + first, numParts - first, segment->size);
+        if(i < 0 && errno == EINTR) continue;
+        if(i < 0){
+            if(ftruncate(segment->fd, *recordOffset) != 0){
+                perror("otp_d ERROR truncating segment");
+            }
+            segment->size = *recordOffset;
+            return false;
+        }
+        segment->size += i;
+
+        // skip past the parts that were written
+        while(first < numParts && (size_t)i >= remaining[first].iov_len){
+            i -= remaining[first].iov_len;
+            first++;
+        }
+        if(first < numParts){
+            remaining[first].iov_base = (char*)remaining[first].iov_base + i;
+            remaining[first].iov_len -= i;
+        }
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                                  writeTombstone                             *
+ * This function appends a tombstone for a sequence number to a segment and    *
+ * counts it as dead. The store's lock must be held.                           *
+ ******************************************************************************/
+static bool writeTombstone(struct segment* segment, unsigned long long seq){
+    struct recordHeader header;
+    struct iovec parts[1];
+    off_t recordOffset;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = SEGMENT_MAGIC;
+    header.type = RECORD_TOMBSTONE;
+    header.seq = seq;
+    parts[0].iov_base = &header;
+    parts[0].iov_len = sizeof(header);
+    if(!writeRecord(segment, parts, 1, &recordOffset)) return false;
+    segment->deadBytes += sizeof(header);
+    return true;
+}
+
+/*******************************************************************************
+ *                                  writeAt                                    *
+ * This function writes the whole buffer to a file at the given offset.        *
+ ******************************************************************************/
+static bool writeAt(int fd, const void* buffer, size_t size, off_t offset){
+    const char* ptr = buffer;
+    ssize_t i;
+
+    while(size > 0){
+        i = pwrite(fd, ptr, size, offset);
+        if(i < 0 && errno == EINTR) continue;
+        if(i < 1) return false;
+        ptr += i;
+        offset += i;
+        size -= i;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                                  copyRange                                  *
+ * This function copies size bytes from one file to another, at the given      *
+ * offsets in each, a chunk of COPY_CHUNK_SIZE at a time so that a ciphertext  *
+ * bigger than memory can be copied.                                           *
+ ******************************************************************************/
+static bool copyRange(int fromFD, off_t fromOffset, int toFD, off_t toOffset, size_t size){
+    char chunk[COPY_CHUNK_SIZE];        // holds one chunk while it's copied
+    ssize_t i;
+
+    while(size > 0){
+        i = pread(fromFD, chunk, size < sizeof(chunk) ? size : sizeof(chunk), fromOffset);
+        if(i < 0 && errno == EINTR) continue;
+        if(i < 1 || !writeAt(toFD, chunk, i, toOffset)) return false;
+        fromOffset += i;
+        toOffset += i;
+        size -= i;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                                  linkLive                                   *
+ * This function adds a message to the front of its segment's live list.       *
+ ******************************************************************************/
+static void linkLive(struct segment* segment, struct storedMessage* message){
+    message->segPrev = NULL;
+    message->segNext = segment->live;
+    if(segment->live != NULL) segment->live->segPrev = message;
+    segment->live = message;
+}
+
+/*******************************************************************************
+ *                                  unlinkLive                                 *
+ * This function removes a message from its segment's live list.               *
+ ******************************************************************************/
+static void unlinkLive(struct segment* segment, struct storedMessage* message){
+    if(message->segPrev != NULL){
+        message->segPrev->segNext = message->segNext;
+    }
+    else{
+        segment->live = message->segNext;
+    }
+    if(message->segNext != NULL) message->segNext->segPrev = message->segPrev;
+    message->segPrev = NULL;
+    message->segNext = NULL;
+}
+
+/*******************************************************************************
+ *                                  needsCompacting                            *
+ * This function returns true if a segment that is no longer being appended to *
+ * is at least three quarters dead. One that a record is still being copied   *
+ * into is left alone until the copy is done.                                  *
+ ******************************************************************************/
+static bool needsCompacting(struct store* store, struct segment* segment){
+    if(segment == store->active || segment->copying > 0) return false;
+    return segment->live == NULL || segment->deadBytes >= segment->size / 4 * 3;
+}
+
+/*******************************************************************************
+ *                                  runCompactor                               *
+ * This function is run by the compactor thread. It waits until a segment      *
+ * needs compacting, then moves that segment's live messages to the active     *
+ * segment a batch at a time, letting go of the lock between batches so the    *
+ * server isn't held up. Once nothing in the segment is live, the segments its *
+ * messages were moved to are synced and it's deleted. A segment that couldn't *
+ * be compacted, say because the disk is full, is left alone for               *
+ * COMPACT_RETRY_DELAY rather than being tried again straight away.            *
+ ******************************************************************************/
+static void* runCompactor(void* arg){
+    struct store* store = arg;
+    struct segment* victim;             // the segment being compacted
+    struct segment* to = NULL;          // the segment the last message was moved to
+    struct segment* unsynced = NULL;    // an earlier segment messages were moved to, if that changed
+    struct segment* previous;
+    int syncFDs[2];                     // the segments to sync, with the lock let go
+    struct timespec until;              // when the next failed segment can be tried again, on CLOCK_MONOTONIC
+    uint64_t retryAt;                   // the same as a storeClock() time, 0 if nothing is waiting
+    uint64_t now;
+
+    pthread_mutex_lock(&store->lock);
+    while(!store->stopping){
+        now = storeClock();
+        retryAt = 0;
+        for(victim = store->segments; victim != NULL; victim = victim->next){
+            if(!needsCompacting(store, victim)) continue;
+            if(victim->retryAt <= now) break;
+            if(retryAt == 0 || victim->retryAt < retryAt) retryAt = victim->retryAt;
+        }
+        if(victim == NULL && retryAt == 0){
+            pthread_cond_wait(&store->compactorWake, &store->lock);
+            continue;
+        }
+        if(victim == NULL){
+            until.tv_sec = retryAt / 1000000;
+            until.tv_nsec = (retryAt % 1000000) * 1000;
+            pthread_cond_timedwait(&store->compactorWake, &store->lock, &until);
+            continue;
+        }
+
+        for(int i = 0; i < COMPACT_BATCH && victim->live != NULL; i++){
+            previous = to;
+            if(!moveMessage(store, victim, &to)){
+                perror("otp_d ERROR compacting segment");
+                victim->retryAt = now + COMPACT_RETRY_DELAY;
+                break;
+            }
+            if(unsynced == NULL && previous != NULL && previous != to) unsynced = previous;
+        }
+        if(victim->live == NULL){
+            // the copies must be on disk before the originals are deleted
+            syncFDs[0] = to != NULL ? dup(to->fd) : -1;
+            syncFDs[1] = unsynced != NULL ? dup(unsynced->fd) : -1;
+            to = NULL;
+            unsynced = NULL;
+            pthread_mutex_unlock(&store->lock);
+            for(int i = 0; i < 2; i++){
+                if(syncFDs[i] < 0) continue;
+                fdatasync(syncFDs[i]);
+                close(syncFDs[i]);
+            }
+            pthread_mutex_lock(&store->lock);
+            deleteSegment(store, victim);
+        }
+
+        pthread_mutex_unlock(&store->lock);
+        sched_yield();
+        pthread_mutex_lock(&store->lock);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return NULL;
+}
+
+/*******************************************************************************
+ *                                  moveMessage                                *
+ * This function copies the first live message in a segment to the end of the *
+ * active segment and points the message at the copy. Room for the copy is     *
+ * reserved under the lock with its header marked pending, and the ciphertext  *
+ * is copied a chunk at a time with the lock let go. If the message was got    *
+ * meanwhile the copy is left pending, which makes it dead. The copy has the   *
+ * same sequence number, so replaying finds it if the original is still there. *
+ * The segment the copy went to is given back in to. The store's lock must be  *
+ * held, and is held again on return.                                          *
+ ******************************************************************************/
+static bool moveMessage(struct store* store, struct segment* from, struct segment** to){
+    struct storedMessage* message = from->live;
+    unsigned long long seq = message->seq;
+    size_t size = message->size;
+    size_t recordSize = message->recordSize;
+    size_t headerAndUser = recordSize - size;
+    off_t dataStart = message->offset;
+    struct recordHeader header;
+    struct iovec parts[1];
+    struct segment* segment;            // the segment the copy is reserved in
+    off_t recordOffset;
+    bool success;
+
+    // start a new segment if the active one is full
+    if(store->active->size >= SEGMENT_SIZE && !nextSegment(store)){
+        return false;
+    }
+    segment = store->active;
+
+    errno = EIO;                        // if the read comes up short
+    if(pread(from->fd, &header, sizeof(header), dataStart - headerAndUser) != sizeof(header)){
+        return false;
+    }
+    header.type = RECORD_PENDING;
+    parts[0].iov_base = &header;
+    parts[0].iov_len = sizeof(header);
+    if(!writeRecord(segment, parts, 1, &recordOffset)) return false;
+    segment->size += headerAndUser - sizeof(header) + size;
+    *to = segment;
+
+    // the username is copied along with the ciphertext, and only the compactor deletes segments
+    pthread_mutex_unlock(&store->lock);
+    success = copyRange(from->fd, dataStart - (headerAndUser - sizeof(header)), segment->fd,
+                        recordOffset + sizeof(header), headerAndUser - sizeof(header) + size);
+    pthread_mutex_lock(&store->lock);
+
+    for(message = from->live; message != NULL && message->seq != seq; message = message->segNext);
+    header.type = RECORD_PUT;
+    if(!success || message == NULL || !writeAt(segment->fd, &header, sizeof(header), recordOffset)){
+        segment->deadBytes += recordSize;
+        return message == NULL;
+    }
+
+    unlinkLive(from, message);
+    from->deadBytes += recordSize;
+    message->segment = segment;
+    message->offset = recordOffset + headerAndUser;
+    linkLive(segment, message);
+    return true;
+}
+
+/*******************************************************************************
+ *                                  deleteSegment                              *
+ * This function removes a segment with nothing live in it from the store and  *
+ * deletes its file.                                                           *
+ ******************************************************************************/
+static void deleteSegment(struct store* store, struct segment* segment){
+    char filename[FILENAME_SIZE];       // the name of the segment file
+    struct segment** link;
+
+    for(link = &store->segments; *link != NULL && *link != segment; link = &(*link)->next);
+    if(*link == NULL) return;
+    *link = segment->next;
+
+    snprintf(filename, sizeof(filename), "segment-%u.log", segment->id);
+    close(segment->fd);
+    remove(filename);
+    free(segment);
+}
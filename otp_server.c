@@ -0,0 +1,2839 @@
+/*******************************************************************************
+** Program name: otp_server.c
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  The server run by otp_d, which is part of libotp so any program
+**               can run it with runServer() (see otp_server.h). The options
+**               below are otp_d's, each one is a field of serverOptions.
+**               otp_d stands for One Time Pad Daemon. Its function is to receive
+**               encrypted data (a ciphertext) and to send it back when requested.
+**               Sockets are used to communicate with the otp program (the client).
+**               otp will connect with otp_d in 'get' mode or 'post' mode. If connected
+**               in 'get' mode then otp_d will retrieve a user's ciphertext and send
+**               it back if one exists. If connected in 'post' mode then otp_d will
+**               take the username and ciphertext sent from otp and write the ciphertext
+**               to a file. By default otp_d serves up to 5 connections at once,
+**               and a connection made while all 5 are busy waits in the parent's
+**               queue. Once a connection gets a slot, a child is forked
+**               off to handle the 'get' or 'post'. If there is an error in a child
+**               process it will exit, but the parent will continue running. When a
+**               child terminates, a signal handler for SIGCHLD will immediately reap
+**               the zombie child process, and decrement the global counter.
+**
+**               When started with --epoll, otp_d instead runs as a single process
+**               with an epoll event loop. Every connection is non-blocking and has
+**               its own incremental parser for the mode, username size, username,
+**               ciphertext size and ciphertext, so thousands of clients can be
+**               served at once without forking or sleeping. Since there is
+**               only one process, it keeps an in-memory queue of each user's
+**               ciphertexts (see otp_store.c) so a 'get' doesn't scan the directory.
+**               With --store=segment, ciphertexts are appended to a few large
+**               segment files instead of one file each (see otp_segment.c).
+**
+**               A ciphertext can also be posted or retrieved as a stream of chunks
+**               (modes 'P' and 'G', see otp_protocol.h). A streamed post is spooled
+**               to disk as it arrives, so otp_d never holds more than one chunk of
+**               it in memory.
+**
+**               A drain ('D') takes all of a user's ciphertexts in one request,
+**               oldest first, each sent back like the answer to a 'get' and
+**               the lot ended by an 'f'. A version 1 drain can be limited to a
+**               number of ciphertexts or of bytes. Without an index the user's
+**               directory is only scanned once for the whole drain.
+**
+**               Every ciphertext is checked for bad characters once, when it's
+**               posted, and a bad one is never stored. A post with FLAG_BINARY
+**               in its header holds a binary ciphertext, which can have any
+**               byte in it including newlines and nulls, so it isn't checked,
+**               and is stored and sent back byte for byte. A post with
+**               FLAG_PACKED holds a packed ciphertext, which is checked for
+**               values that aren't A-Z or space instead (all at once when it's
+**               committed, if it was streamed) and is stored and sent back
+**               still packed. Since what's stored is known
+**               to be good, a 'get' of either kind sends the ciphertext straight
+**               from its file or segment to the socket with sendfile(), so it's
+**               never copied into otp_d at all.
+**
+**               A connection isn't limited to one request. Once a request has been
+**               handled otp_d waits for the next one on the same connection, and
+**               only closes it when otp does, so otp --batch can pipeline many posts
+**               and gets without reconnecting.
+**
+**               Requests can use either version of the protocol in otp_protocol.h:
+**               the original layout of native size_t fields (version 0), or a fixed
+**               size little endian header (version 1). Each request is answered
+**               in the version it was sent in.
+**
+**               When started with --threads N, otp_d instead waits for requests on
+**               every connection with epoll, and hands each connection with a
+**               request waiting to one of a fixed pool of N worker threads (see
+**               otp_pool.c). A worker handles the requests that have arrived with
+**               the same blocking code as the forked children, then gives the
+**               connection back to epoll. Idle workers steal connections queued
+**               for busy ones, and each worker reuses its own arena for request
+**               buffers. Like --epoll, the workers share the in-memory index of
+**               the store.
+**
+**               With --io-uring, otp_d runs like --epoll but with io_uring (see
+**               otp_uring.c): accepts, receives and sends are queued in a ring,
+**               and everything queued while handling the last batch of
+**               completions is submitted, and the next batch waited for, in one
+**               system call. A request is parsed from one receive into a buffer
+**               instead of one recv() per field. With --io-uring=all, the open,
+**               write and close of a posted ciphertext's file, and the open,
+**               size and removal of one taken by a get, are linked and submitted
+**               through the ring too. If the kernel has no io_uring otp_d uses
+**               --epoll instead.
+**
+**               Every mode counts its requests, bytes, connections and queued
+**               ciphertexts, and times each phase of a request, in counters shared
+**               by all of its processes and threads (see otp_stats.c). A stats
+**               request ('S') is answered with a snapshot of them.
+**
+**               --max-connections N limits how many connections any mode serves
+**               at once (5 when forking, no limit otherwise). Connections beyond
+**               it wait in a queue of up to --queue N (64), and once that's full
+**               too, otp_d answers with a busy status ('b') telling the client
+**               how many milliseconds to wait (--retry-after, 1000) and closes
+**               the connection, instead of letting it sit in the listen backlog.
+**
+**               --cache-size BYTES (with an optional K, M or G) gives the
+**               store a cache of recent posts in memory (see otp_store.c), for
+**               traffic where most messages are fetched soon after they're
+**               posted. A cached post is written to disk --write-behind MS
+**               (5000) after it arrived, unless a get takes it first and it
+**               never touches the disk at all. When the cache is full its
+**               oldest posts are written early to make room, and a post bigger
+**               than the whole cache is stored as usual. Only a single process
+**               can hold the cache, and a cached post is lost if otp_d dies
+**               before writing it, so it needs --epoll, --io-uring or
+**               --threads and the default --durability=none. With
+**               --io-uring=all, files are no longer stored and taken through
+**               the ring, since the cache decides where each post is.
+**
+**               Ciphertexts are kept under --data-dir DIR (the current
+**               directory by default), which is made if it doesn't exist. Each
+**               user's files are in a directory of their own (see otp_store.c).
+**
+**               --durability says how sure a post is to be on disk before a
+**               client that asked for an answer (FLAG_ACK) gets one. With none
+**               (the default) it's up to the kernel. With fsync each post is
+**               synced on its own before it's answered. With group a syncer
+**               thread syncs the posts that have piled up all at once, waiting
+**               --group-window USEC first to let more join in, and each post is
+**               answered once the sync it was part of has finished. Meanwhile
+**               the event loops park the connection and go on serving others,
+**               and the blocking modes wait. Forked children can't share a
+**               sync, so group works like fsync without --epoll, --io-uring or
+**               --threads.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include "otp_protocol.h"
+#include "otp_store.h"
+#include "otp_pool.h"
+#include "otp_stats.h"
+#include "otp_uring.h"
+#include "otp_server.h"
+
+#define MAX_EVENTS 256                  // the most epoll events handled per call to epoll_wait()
+#define FORK_MAX_CONNECTIONS 5          // the most children the default mode runs at once
+#define RING_ENTRIES 1024               // the size of the submission queue with --io-uring
+#define RING_FILES 256                  // the posts that can be written through the ring at once
+#define RING_MAX_WRITE (1 << 30)        // bigger posts are written with write() instead of the ring
+#define INPUT_SIZE 4096                 // the most a --io-uring connection receives ahead of its parser
+#define RING_STEP_MASK 7                // the bits of a completion's user data that hold its ringStep
+
+// the states of a connection's incremental parser in --epoll mode, a connection moves
+// through these in order, the same order that otp sends the fields of a request
+enum connState {
+    READ_MODE,                          // waiting for the mode byte, or the first byte of a header
+    READ_HEADER,                        // waiting for the rest of a version 1 header
+    READ_USER_SIZE,                     // waiting for the size of the username
+    READ_USER,                          // waiting for the username
+    READ_LIMITS,                        // waiting for the limits of a drain ('D' only)
+    READ_CIPHERTEXT_SIZE,               // waiting for the size of the ciphertext ('p' only)
+    READ_CIPHERTEXT,                    // waiting for the ciphertext ('p' only)
+    READ_CHUNK_SIZE,                    // waiting for the size of the next chunk ('P' only)
+    READ_CHUNK,                         // waiting for a chunk of the ciphertext ('P' only)
+    WRITE_RESPONSE,                     // sending the response back to otp
+    WAIT_STORAGE,                       // waiting for the ring to store or take a file (--io-uring only)
+    WAIT_SYNC                           // waiting for a stored post to be synced (--durability=group only)
+};
+
+// the epoll data of the --threads dispatcher's own descriptors, a connection's is its struct connection
+#define DISPATCH_LISTEN NULL            // the listening socket
+#define DISPATCH_WAKE ((void*)&wakeFD)  // the eventfd the workers bump when they close a connection
+
+// what an operation submitted to the ring with --io-uring was for, kept in the low bits of
+// its user data next to the connection's address, the listening socket's accept is 0
+enum ringStep {
+    STEP_RECEIVE = 1,                   // receiving on the connection's socket
+    STEP_SEND,                          // sending on the connection's socket
+    STEP_POLL,                          // waiting for room to sendfile() on the socket
+    STEP_OPEN,                          // opening a ciphertext file
+    STEP_FILE,                          // writing a posted ciphertext, or finding a file's size
+    STEP_CLOSE,                         // closing a posted ciphertext's file
+    STEP_UNLINK                         // removing a ciphertext file that was taken
+};
+
+// a client connection in --epoll mode
+struct connection {
+    int fd;                             // the connection's socket
+    enum connState state;               // which field the parser is waiting for
+    char mode;                          // one of the modes in otp_protocol.h
+    unsigned int version;               // the version of the protocol the request uses
+    uint32_t flags;                     // the flags in a version 1 header, 0 for version 0
+    unsigned char header[REQUEST_HEADER_SIZE]; // a version 1 header, or the size of a chunk
+    size_t userSize;                    // the size of the username sent from otp
+    size_t ciphertextSize;              // the size of the ciphertext sent from otp
+    char* user;                         // a buffer for the username we receive from otp
+    char* ciphertext;                   // a buffer for the ciphertext we receive from otp
+    char* field;                        // where the field currently being read is stored
+    size_t fieldSize;                   // the size of the field currently being read
+    size_t fieldRead;                   // how much of the field has been read so far
+    char* response;                     // a buffer holding the response for a 'get'
+    size_t responseSize;                // the size of the response
+    size_t responseSent;                // how much of the response has been sent so far
+    size_t fileRemaining;               // how much of reader to send once the response is sent
+    size_t chunkSize;                   // the size of the chunk being received ('P' only)
+    char* chunk;                        // a buffer for the chunk being received ('P' only)
+    size_t chunkCapacity;               // the size of the chunk buffer
+    struct ciphertextWriter writer;     // where a streamed post is spooled ('P' only)
+    bool spooling;                      // true while writer holds an unfinished post
+    struct ciphertextReader reader;     // the ciphertext being sent back for a 'get'
+    bool streaming;                     // true until the last chunk of a 'G' is queued
+    struct ciphertextDrain drain;       // the ciphertexts left to send back for a 'D'
+    bool draining;                      // true until the 'f' that ends a 'D' is queued
+    uint32_t events;                    // what epoll is waiting for, EPOLLIN, EPOLLOUT or nothing
+    uint64_t started;                   // when the request's first byte arrived, 0 between requests
+    uint64_t sendStarted;               // when the response started to be sent
+    char* input;                        // bytes received ahead of the parser (--io-uring only)
+    size_t inputStart;                  // the first of them not yet parsed
+    size_t inputEnd;                    // the end of them
+    bool direct;                        // true if the receive is straight into the field
+    unsigned int inFlight;              // ring operations that haven't completed yet
+    int ringError;                      // the first errno one of them returned, or 0
+    int ringSlot;                       // the registered file a post is written through, or -1
+    unsigned long long seq;             // the sequence number of the post being written
+    char filename[FILENAME_SIZE];       // the file the ring is writing or taking
+    struct statx fileInfo;              // the size of the file the ring is taking
+    uint64_t phaseStarted;              // when the ring started storing or looking up, or the sync began
+    unsigned long long ticket;          // the sync a stored post is waiting for, 0 if it isn't
+    struct connection* syncPrev;        // the connection ahead of this one waiting for a sync
+    struct connection* syncNext;        // the connection behind this one waiting for a sync
+};
+
+// the connections waiting for their posts to be synced, in the order they were stored
+struct syncQueue {
+    struct connection* head;            // the oldest, which is synced first
+    struct connection* tail;            // the newest
+};
+
+// connections accepted while every slot was taken, served oldest first as slots free up
+struct waitingQueue {
+    int* fds;                           // a ring buffer of connection sockets
+    size_t capacity;                    // the most connections that can wait
+    size_t front;                       // where the oldest connection is
+    size_t count;                       // how many connections are waiting
+};
+
+// function prototypes:
+static bool sendAll(int socket, void* buffer, size_t length, int flags);
+static bool recvCounted(int socket, void* buffer, size_t length);
+static bool sendCiphertextAll(int socket, struct ciphertextReader* reader, size_t size);
+static void catchSIGCHLD(int signo);
+static bool admitConnection(int fd, long active);
+static int nextWaiting(long active);
+static void closeWaiting(void);
+static void rejectConnection(int fd);
+static void runForkLoop(int listenSocketFD);
+static void spawnChild(int establishedConnectionFD);
+static void handleForkedConnection(int establishedConnectionFD);
+static void runThreadLoop(int listenSocketFD, unsigned int numThreads);
+static void handleThreadedConnection(void* task, struct arena* arena);
+static void startThreadedConnection(int establishedConnectionFD);
+static bool rearmThreadedConnection(struct connection* conn);
+static void releaseThreadedConnection(struct connection* conn);
+static bool readThreadedRequest(struct connection* conn, bool* ready);
+static bool readyForWorker(struct connection* conn);
+static bool serveThreadedRequest(struct connection* conn, struct arena* arena);
+static bool handleRequest(int establishedConnectionFD, struct arena* arena);
+static bool serveRequest(int establishedConnectionFD, struct requestHeader* request, uint64_t started, struct arena* arena);
+static bool answerRequest(int establishedConnectionFD, const struct requestHeader* request, const char* user,
+                          const char* ciphertext, const unsigned char* limits, struct arena* arena);
+static bool recvRequestHeader(int establishedConnectionFD, struct requestHeader* request);
+static enum ciphertextEncoding postEncoding(uint32_t flags);
+static void runEventLoop(int listenSocketFD);
+static void raiseFileLimit(void);
+static void runRingLoop(int listenSocketFD);
+static bool submitAccept(int listenSocketFD, bool multishot);
+static void addRingConnection(int fd);
+static void completeRingOperation(uint64_t userData, int result);
+static bool finishSocketOperation(struct connection* conn, enum ringStep step, int result);
+static bool pumpConnection(struct connection* conn);
+static bool queueSocketOperation(struct connection* conn, enum ringStep step, void* buffer, size_t length, int flags);
+static bool beginRingStore(struct connection* conn);
+static bool beginRingLookup(struct connection* conn);
+static bool finishStorage(struct connection* conn);
+static bool respondToRingGet(struct connection* conn, bool found);
+static bool submitSyncPoll(void);
+static bool completePost(struct connection* conn, const char* filename, unsigned long long ticket);
+static bool answerPost(struct connection* conn);
+static void leaveSyncQueue(struct connection* conn);
+static void finishSyncs(int epollFD);
+static bool addConnection(int epollFD, int fd);
+static struct connection* openConnection(int fd);
+static void closeConnection(struct connection* conn);
+static void resetConnection(struct connection* conn);
+static bool serviceConnection(int epollFD, struct connection* conn);
+static void expectField(struct connection* conn, enum connState state, void* field, size_t fieldSize);
+static bool readConnection(struct connection* conn);
+static bool finishField(struct connection* conn);
+static bool validMode(char mode);
+static bool expectCiphertext(struct connection* conn);
+static void expectChunkSize(struct connection* conn);
+static bool writeConnection(struct connection* conn);
+static bool beginStreamResponse(struct connection* conn);
+static bool beginStatsResponse(struct connection* conn);
+static void nextStreamChunk(struct connection* conn);
+static bool beginDrainResponse(struct connection* conn);
+static void nextDrained(struct connection* conn);
+static bool receiveStream(int establishedConnectionFD, unsigned int version, uint32_t flags, const char* user,
+                          uint64_t started, struct arena* arena);
+static bool answerStoredPost(int establishedConnectionFD, unsigned int version, uint32_t flags, const char* filename,
+                             unsigned long long ticket);
+static bool sendStream(int establishedConnectionFD, unsigned int version, const char* user);
+static bool sendDrain(int establishedConnectionFD, unsigned int version, const char* user, uint64_t maxCount,
+                      uint64_t maxBytes);
+static bool sendStats(int establishedConnectionFD, unsigned int version, struct arena* arena);
+static size_t makeStatsResponse(unsigned int version, char* response);
+static bool startFailed(const char* msg, int listenSocketFD);
+
+// error function used for reporting issues
+static void error(const char *msg) { perror(msg); exit(1); }
+
+// global variables
+static volatile sig_atomic_t numChildPids = 0; // the number of child processes spawned, changed by catchSIGCHLD
+static long maxConnections = 0;         // the most connections served at once, 0 for no limit
+static struct waitingQueue waiting;     // connections waiting for one of the maxConnections slots
+static long retryAfter = DEFAULT_RETRY_AFTER; // the milliseconds a client turned away is told to wait
+static long activeConnections = 0;      // the connections being served with --epoll or --threads
+static int wakeFD = -1;                 // tells the --threads dispatcher a connection has closed
+static struct store store;              // where ciphertexts are kept
+static int dispatchFD = -1;             // the epoll set of idle connections with --threads
+static struct serverStats* stats;       // the counters returned by a stats request
+static struct ring* ring = NULL;        // the io_uring instance with --io-uring, NULL otherwise
+static int ringSlots[RING_FILES];       // the registered files no post is being written through
+static unsigned int numRingSlots = 0;   // how many of them there are
+static bool ringFiles = false;          // true if ciphertext files are opened and written through the ring
+static struct syncQueue syncWaiting;    // connections whose posts are waiting for the syncer
+
+/*******************************************************************************
+ *                                  initServerOptions                          *
+ * This function fills in the options otp_d starts with when it's given only   *
+ * a port: forked children, a file per ciphertext in the current directory,    *
+ * no syncing, and the default limits.                                         *
+ ******************************************************************************/
+void initServerOptions(struct serverOptions* options, int portNumber){
+    memset(options, 0, sizeof(struct serverOptions));
+    options->mode = SERVER_FORK;
+    options->backend = STORE_FILES;
+    options->durability = DURABILITY_NONE;
+    options->maxConnections = -1;
+    options->queueSize = DEFAULT_QUEUE;
+    options->retryAfter = DEFAULT_RETRY_AFTER;
+    options->writeBehind = DEFAULT_WRITE_BEHIND;
+    options->portNumber = portNumber;
+}
+
+/*******************************************************************************
+ *                                  runServer                                  *
+ * This function listens on the options' port and serves connections the way  *
+ * they say, forever. It returns false, with a message printed and errno set,  *
+ * only if the server couldn't start. Since the data directory becomes the     *
+ * current directory and the server's state is kept in this file, a process    *
+ * can only run one server.                                                    *
+ ******************************************************************************/
+bool runServer(const struct serverOptions* options){
+    int listenSocketFD;
+    bool singleProcess;                 // true unless connections are served by forked children
+    uint64_t queuedMessages, queuedBytes; // what the store holds when otp_d starts
+
+    singleProcess = options->mode != SERVER_FORK;
+    if(options->mode == SERVER_THREADS && (options->numThreads < 1 || options->numThreads > MAX_THREADS)){
+        fprintf(stderr, "otp_d ERROR: --threads must be from 1 to %d\n", MAX_THREADS);
+        errno = EINVAL;
+        return false;
+    }
+
+    // segments are found through the in-memory index, which only a single process can keep
+    if(options->backend == STORE_SEGMENTS && !singleProcess){
+        fprintf(stderr, "otp_d ERROR: --store=segment needs --epoll, --io-uring or --threads\n");
+        errno = EINVAL;
+        return false;
+    }
+
+    // the cache is in one process's memory, and its posts aren't on disk until they're written behind
+    if(options->cacheSize > 0 && (!singleProcess || options->durability != DURABILITY_NONE)){
+        fprintf(stderr, "otp_d ERROR: --cache-size needs --epoll, --io-uring or --threads, and --durability=none\n");
+        errno = EINVAL;
+        return false;
+    }
+
+    // each forked child is a whole process, so the default mode is always limited unless told otherwise
+    maxConnections = options->maxConnections;
+    if(maxConnections < 0) maxConnections = singleProcess ? 0 : FORK_MAX_CONNECTIONS;
+    retryAfter = options->retryAfter;
+    ringFiles = options->mode == SERVER_URING && options->ringFiles && options->cacheSize == 0;
+    waiting.capacity = options->queueSize;
+    waiting.fds = malloc((options->queueSize > 0 ? options->queueSize : 1) * sizeof(int));
+    if(waiting.fds == NULL) return startFailed("otp_d ERROR with malloc", -1);
+
+    // Set up the address struct for this process (the server)
+    struct sockaddr_in serverAddress;
+    memset((char *)&serverAddress, '\0', sizeof(serverAddress)); // Clear out the address struct
+    serverAddress.sin_family = AF_INET;         // Create a network-capable socket
+    serverAddress.sin_port = htons(options->portNumber); // Store the port number
+    serverAddress.sin_addr.s_addr = INADDR_ANY; // Any address is allowed for connection to this process
+
+    // Set up the socket
+    listenSocketFD = socket(AF_INET, SOCK_STREAM, 0); // Create the socket
+    if(listenSocketFD < 0) return startFailed("otp_d ERROR opening socket", -1);
+
+    // Enable the socket to begin listening and connect to the port
+    if(bind(listenSocketFD, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0)
+        return startFailed("otp_d ERROR on binding", listenSocketFD);
+
+    // every file otp_d keeps is relative to the data directory
+    if(options->dataDir != NULL){
+        if(mkdir(options->dataDir, 0700) != 0 && errno != EEXIST){
+            return startFailed("otp_d ERROR making the data directory", listenSocketFD);
+        }
+        if(chdir(options->dataDir) != 0) return startFailed("otp_d ERROR changing to the data directory", listenSocketFD);
+    }
+
+    // get the store ready, with --epoll, --io-uring or --threads this builds the index of
+    // stored ciphertexts once, after which it's kept up to date by every post and get
+    if(!openStore(&store, options->backend, singleProcess, options->durability, options->groupWindow)){
+        return startFailed("otp_d ERROR opening the ciphertext store", listenSocketFD);
+    }
+    if(options->cacheSize > 0 && !openCache(&store, options->cacheSize, options->writeBehind)){
+        return startFailed("otp_d ERROR starting the cache", listenSocketFD);
+    }
+
+    // the counters are shared with the forked children, so they have to exist before any fork
+    if(!measureStore(&store, &queuedMessages, &queuedBytes)){
+        return startFailed("otp_d ERROR measuring the ciphertext store", listenSocketFD);
+    }
+    stats = openStats(options->backend == STORE_SEGMENTS ? "segment" : "files", queuedMessages, queuedBytes);
+    if(stats == NULL) return startFailed("otp_d ERROR mapping the stats counters", listenSocketFD);
+
+    // every mode accepts as fast as clients arrive, and decides for itself whether to serve a
+    // connection, hold it until a slot is free, or turn it away (see admitConnection())
+    listen(listenSocketFD, SOMAXCONN);
+    switch(options->mode){
+        case SERVER_EPOLL:
+            runEventLoop(listenSocketFD);
+            break;
+        case SERVER_URING:
+            runRingLoop(listenSocketFD);
+            break;
+        case SERVER_THREADS:
+            runThreadLoop(listenSocketFD, options->numThreads);
+            break;
+        default:
+            runForkLoop(listenSocketFD);
+    }
+
+    // parent closes the listening socket
+    close(listenSocketFD);
+    closeStore(&store);
+
+    return true;
+}
+
+/*******************************************************************************
+ *                                  startFailed                                *
+ * This function reports why runServer() couldn't start, closes the listening  *
+ * socket if there is one yet, and returns false with errno left as it was.   *
+ ******************************************************************************/
+static bool startFailed(const char* msg, int listenSocketFD){
+    int savedErrno = errno;
+
+    perror(msg);
+    if(listenSocketFD >= 0) close(listenSocketFD);
+    errno = savedErrno;
+    return false;
+}
+
+/*******************************************************************************
+ *                                  runForkLoop                                *
+ * This function accepts connections and forks off a child process to handle   *
+ * each one, with at most maxConnections child processes running at any given  *
+ * time. Connections that arrive while every child is busy wait in the queue   *
+ * until one exits, or are turned away if the queue is full. SIGCHLD is only   *
+ * let in while the parent sleeps in ppoll(), so numChildPids can't change     *
+ * between being checked and being acted on, and the parent never spins.      *
+ ******************************************************************************/
+static void runForkLoop(int listenSocketFD){
+    int establishedConnectionFD;
+    sigset_t childSignal;               // just SIGCHLD
+    sigset_t waitMask;                  // the signal mask while the parent is sleeping
+    struct pollfd listening;            // wakes the parent when a connection arrives
+
+    // instantiate sigaction struct: parent will use SIGCHLD_action
+    struct sigaction SIGCHLD_action = {{0}};
+
+    // parent will use the catchSIGCHLD signal handler function to catch SIGCHLD, use SA_NOCLDSTOP
+    // so that SIGCHLD won't be raised if a child process stops or continues, only if it terminates
+    SIGCHLD_action.sa_handler = catchSIGCHLD;
+    sigfillset(&SIGCHLD_action.sa_mask);
+    SIGCHLD_action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+
+    // parent uses the handler catchSIGCHLD to reap zombie children
+    sigaction(SIGCHLD, &SIGCHLD_action, NULL);
+
+    // hold SIGCHLD back except while sleeping, when it's what wakes the parent up
+    sigemptyset(&childSignal);
+    sigaddset(&childSignal, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &childSignal, &waitMask);
+    sigdelset(&waitMask, SIGCHLD);
+
+    // a busy client is turned away without waiting on it, so the parent never blocks in accept()
+    fcntl(listenSocketFD, F_SETFL, fcntl(listenSocketFD, F_GETFL) | O_NONBLOCK);
+    listening.fd = listenSocketFD;
+    listening.events = POLLIN;
+
+    while(true){
+        // start a child for each waiting connection there's now room for
+        while((establishedConnectionFD = nextWaiting(numChildPids)) >= 0){
+            spawnChild(establishedConnectionFD);
+        }
+
+        // sleep until a connection arrives or a child exits
+        if(ppoll(&listening, 1, NULL, &waitMask) < 0){
+            if(errno != EINTR) perror("otp_d ERROR on ppoll");
+            continue;
+        }
+
+        // accept every connection that is waiting, and serve, queue or turn away each one
+        while((establishedConnectionFD = accept(listenSocketFD, NULL, NULL)) >= 0){
+            if(admitConnection(establishedConnectionFD, numChildPids)){
+                spawnChild(establishedConnectionFD);
+            }
+        }
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+            perror("otp_d ERROR on accept");
+        }
+    }
+}
+
+/*******************************************************************************
+ *                                  spawnChild                                 *
+ * This function forks off a child process to handle a connection. The child  *
+ * lets SIGCHLD back in and closes its copies of the waiting connections, so a *
+ * connection only stays open for as long as the child serving it does.      *
+ ******************************************************************************/
+static void spawnChild(int establishedConnectionFD){
+    pid_t spawnPid;                     // the return value of a fork() call
+    sigset_t childSignal;               // just SIGCHLD
+
+    spawnPid = fork();
+    if(spawnPid == -1){
+        perror("otp_d ERROR spawning child process");
+        rejectConnection(establishedConnectionFD);
+        return;
+    }
+
+    if(spawnPid == 0){
+        // this is the child
+        sigemptyset(&childSignal);
+        sigaddset(&childSignal, SIGCHLD);
+        sigprocmask(SIG_UNBLOCK, &childSignal, NULL);
+        closeWaiting();
+        handleForkedConnection(establishedConnectionFD);
+    }
+
+    // this is the parent
+    numChildPids++;     // increment the # of child processes currently running
+    countConnection(stats, 1);  // the connection is counted closed when the child is reaped
+    close(establishedConnectionFD);
+}
+
+/*******************************************************************************
+ *                                  admitConnection                            *
+ * This function decides what happens to a connection that was just accepted, *
+ * given how many are being served. It returns true if there's a slot for it, *
+ * in which case the caller serves it. Otherwise it waits in the queue behind  *
+ * any that are already waiting, or if the queue is full it's turned away.    *
+ ******************************************************************************/
+static bool admitConnection(int fd, long active){
+    if((maxConnections == 0 || active < maxConnections) && waiting.count == 0) return true;
+
+    if(waiting.count == waiting.capacity){
+        rejectConnection(fd);
+        return false;
+    }
+    waiting.fds[(waiting.front + waiting.count) % waiting.capacity] = fd;
+    waiting.count++;
+    countWaiting(stats, 1);
+    return false;
+}
+
+/*******************************************************************************
+ *                                  nextWaiting                                *
+ * This function takes the connection that has waited longest off the queue   *
+ * and returns it, if there's a slot for it given how many are being served.  *
+ * Otherwise -1 is returned.                                                   *
+ ******************************************************************************/
+static int nextWaiting(long active){
+    int fd;
+
+    if(waiting.count == 0 || (maxConnections != 0 && active >= maxConnections)) return -1;
+    fd = waiting.fds[waiting.front];
+    waiting.front = (waiting.front + 1) % waiting.capacity;
+    waiting.count--;
+    countWaiting(stats, -1);
+    return fd;
+}
+
+/*******************************************************************************
+ *                                  closeWaiting                               *
+ * This function closes every waiting connection, which a forked child does   *
+ * with its copies since they belong to the parent.                            *
+ ******************************************************************************/
+static void closeWaiting(void){
+    while(waiting.count > 0){
+        close(waiting.fds[waiting.front]);
+        waiting.front = (waiting.front + 1) % waiting.capacity;
+        waiting.count--;
+    }
+}
+
+/*******************************************************************************
+ *                                  rejectConnection                           *
+ * This function turns a connection away without reading from it. The client  *
+ * is sent a busy header with how long to wait before trying again, and the    *
+ * connection is closed. The socket buffer of a new connection always has room *
+ * for the header, so the send never blocks.                                   *
+ ******************************************************************************/
+static void rejectConnection(int fd){
+    unsigned char header[MAX_PREFIX_SIZE];
+    size_t headerSize;
+
+    headerSize = encodeResponsePrefix(PROTOCOL_VERSION, STATUS_BUSY, true, retryAfter, header);
+    send(fd, header, headerSize, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+    countRejected(stats);
+}
+
+
+/*******************************************************************************
+ *                            handleForkedConnection                           *
+ * This function is run by a child process to handle the requests on a single  *
+ * connection using blocking reads and writes. The child exits once otp closes *
+ * the connection or a request fails.                                          *
+ ******************************************************************************/
+static void handleForkedConnection(int establishedConnectionFD){
+    struct arena arena;                 // the memory for each request on the connection
+
+    // sleep for 2 seconds
+    sleep(2);
+
+    // handle requests in the order they were sent until otp closes the connection
+    initArena(&arena);
+    while(handleRequest(establishedConnectionFD, &arena)){
+        resetArena(&arena);
+    }
+    freeArena(&arena);
+
+    // child processes close the established connection corresponding with themselves
+    close(establishedConnectionFD);
+
+    // child exits normally
+    exit(0);
+}
+
+/*******************************************************************************
+ *                                  runThreadLoop                              *
+ * This function accepts connections and hands each one to a pool of           *
+ * numThreads worker threads (see otp_pool.c) whenever a whole request has     *
+ * arrived on it. The dispatcher reads requests without blocking, the way      *
+ * --epoll does, so a client that sends part of a request and stalls only      *
+ * holds up its own connection rather than a worker. A streamed post is handed *
+ * over a chunk at a time. Connections wait in an epoll set between requests, *
+ * and EPOLLONESHOT makes sure only the dispatcher or one worker at a time has *
+ * a given connection. The workers share one process, so unlike the forked    *
+ * children they share the in-memory index of the store. With                 *
+ * --max-connections, connections past the limit wait unread until a worker   *
+ * closes one and wakes the dispatcher through wakeFD.                         *
+ ******************************************************************************/
+static void runThreadLoop(int listenSocketFD, unsigned int numThreads){
+    int establishedConnectionFD;
+    struct pool pool;                   // the worker threads
+    struct epoll_event event;           // an event to register
+    struct epoll_event events[MAX_EVENTS]; // the events returned by epoll_wait()
+    int numEvents;
+    eventfd_t closed;                   // how many connections the workers have closed
+    struct connection* conn;
+    bool ready;                         // true once a connection has a whole request for a worker
+
+    // a client hanging up must only end its own connection, not the whole process
+    signal(SIGPIPE, SIG_IGN);
+
+    dispatchFD = epoll_create1(0);
+    if(dispatchFD < 0) error("otp_d ERROR creating epoll instance");
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = DISPATCH_LISTEN;
+    if(epoll_ctl(dispatchFD, EPOLL_CTL_ADD, listenSocketFD, &event) < 0){
+        error("otp_d ERROR adding listening socket to epoll");
+    }
+    if(maxConnections > 0){
+        wakeFD = eventfd(0, EFD_NONBLOCK);
+        if(wakeFD < 0) error("otp_d ERROR creating eventfd");
+        event.data.ptr = DISPATCH_WAKE;
+        if(epoll_ctl(dispatchFD, EPOLL_CTL_ADD, wakeFD, &event) < 0){
+            error("otp_d ERROR adding eventfd to epoll");
+        }
+    }
+
+    if(!startPool(&pool, numThreads, handleThreadedConnection)){
+        error("otp_d ERROR starting worker threads");
+    }
+
+    while(true){
+        numEvents = epoll_wait(dispatchFD, events, MAX_EVENTS, -1);
+        if(numEvents < 0){
+            if(errno == EINTR) continue;
+            error("otp_d ERROR on epoll_wait");
+        }
+
+        for(int e = 0; e < numEvents; e++){
+            // a new connection waits in the epoll set for its first request, if there's room for it
+            if(events[e].data.ptr == DISPATCH_LISTEN){
+                establishedConnectionFD = accept(listenSocketFD, NULL, NULL);
+                if(establishedConnectionFD < 0){
+                    perror("otp_d ERROR on accept");
+                    continue;
+                }
+                if(admitConnection(establishedConnectionFD, __atomic_load_n(&activeConnections, __ATOMIC_RELAXED))){
+                    startThreadedConnection(establishedConnectionFD);
+                }
+                continue;
+            }
+
+            // a worker closed a connection, so there may be room for the ones waiting
+            if(events[e].data.ptr == DISPATCH_WAKE){
+                eventfd_read(wakeFD, &closed);
+                while((establishedConnectionFD =
+                       nextWaiting(__atomic_load_n(&activeConnections, __ATOMIC_RELAXED))) >= 0){
+                    startThreadedConnection(establishedConnectionFD);
+                }
+                continue;
+            }
+
+            // read what's arrived, and only once a whole request is here does it go to a worker
+            conn = events[e].data.ptr;
+            __atomic_load_n(&conn->events, __ATOMIC_ACQUIRE); // pairs with rearmThreadedConnection()
+            if((events[e].events & (EPOLLERR | EPOLLHUP) && !(events[e].events & EPOLLIN)) ||
+               !readThreadedRequest(conn, &ready)){
+                releaseThreadedConnection(conn);
+            }
+            else if(!ready){
+                if(!rearmThreadedConnection(conn)) releaseThreadedConnection(conn);
+            }
+            else if(!submitPool(&pool, conn)){
+                perror("otp_d ERROR queueing connection");
+                releaseThreadedConnection(conn);
+            }
+        }
+    }
+}
+
+/*******************************************************************************
+ *                           handleThreadedConnection                          *
+ * This function is run by a worker thread when the dispatcher has read a      *
+ * whole request on a connection, or the next piece of a streamed post. It     *
+ * does what the request asks and sends the answer, then gives the connection  *
+ * back to the epoll set for the dispatcher to read the next one.              *
+ ******************************************************************************/
+static void handleThreadedConnection(void* task, struct arena* arena){
+    struct connection* conn = task;
+
+    if(!serveThreadedRequest(conn, arena) || !rearmThreadedConnection(conn)){
+        releaseThreadedConnection(conn);
+    }
+}
+
+/*******************************************************************************
+ *                           startThreadedConnection                           *
+ * This function counts a connection as being served and adds it to the epoll *
+ * set to wait for its first request.                                          *
+ ******************************************************************************/
+static void startThreadedConnection(int establishedConnectionFD){
+    struct epoll_event event;           // registers the connection in the epoll set
+    struct connection* conn;
+
+    conn = calloc(1, sizeof(struct connection));
+    if(conn == NULL){
+        perror("otp_d ERROR with malloc");
+        close(establishedConnectionFD);
+        return;
+    }
+    conn->fd = establishedConnectionFD;
+    conn->reader.fd = -1;
+    conn->ringSlot = -1;
+    expectField(conn, READ_MODE, &conn->mode, sizeof(char));
+    __atomic_fetch_add(&activeConnections, 1, __ATOMIC_RELAXED);
+    countConnection(stats, 1);
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = conn;
+    if(epoll_ctl(dispatchFD, EPOLL_CTL_ADD, establishedConnectionFD, &event) < 0){
+        perror("otp_d ERROR adding connection to epoll");
+        releaseThreadedConnection(conn);
+    }
+}
+
+/*******************************************************************************
+ *                           rearmThreadedConnection                           *
+ * This function gives a connection back to the epoll set to wait for more of *
+ * its request. Whoever had the connection mustn't touch it afterwards, since  *
+ * the dispatcher may already have it. It returns false if it couldn't be.    *
+ ******************************************************************************/
+static bool rearmThreadedConnection(struct connection* conn){
+    struct epoll_event event;           // re-arms the connection in the epoll set
+    int fd = conn->fd;                  // read first, the connection may be freed once it's re-armed
+
+    // everything done to the connection so far happens before the dispatcher's acquire
+    __atomic_store_n(&conn->events, EPOLLIN, __ATOMIC_RELEASE);
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = conn;
+    if(epoll_ctl(dispatchFD, EPOLL_CTL_MOD, fd, &event) < 0){
+        perror("otp_d ERROR re-adding connection to epoll");
+        return false;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                          releaseThreadedConnection                          *
+ * This function closes a connection, which also takes it out of the epoll    *
+ * set, frees everything it owns and frees its slot. A request that was cut    *
+ * off is counted as a failure, and a streamed post that never got its last    *
+ * chunk is thrown away. If connections can be waiting for a slot, the         *
+ * dispatcher is woken to start the next one.                                  *
+ ******************************************************************************/
+static void releaseThreadedConnection(struct connection* conn){
+    if(conn->started != 0) countRequest(stats, conn->mode, conn->started, false);
+    close(conn->fd);
+    if(conn->spooling) abortCiphertext(&conn->writer);
+    free(conn->user);
+    free(conn->ciphertext);
+    free(conn->chunk);
+    free(conn);
+    countConnection(stats, -1);
+    __atomic_fetch_sub(&activeConnections, 1, __ATOMIC_RELAXED);
+    if(wakeFD >= 0) eventfd_write(wakeFD, 1);
+}
+
+/*******************************************************************************
+ *                              readThreadedRequest                            *
+ * This function is run by the --threads dispatcher to read whatever has       *
+ * arrived on a connection without blocking. Fields are decoded by             *
+ * finishField() the same as with --epoll, up to the one that would act on    *
+ * the request, which is left whole in the connection for a worker and sets   *
+ * ready. It returns false if the connection should be closed, either because *
+ * of an error or because otp closed it.                                       *
+ ******************************************************************************/
+static bool readThreadedRequest(struct connection* conn, bool* ready){
+    ssize_t i;
+
+    *ready = false;
+    while(true){
+        // a zero length field (an empty username or ciphertext) is complete right away
+        if(conn->fieldRead == conn->fieldSize){
+            if(readyForWorker(conn)){
+                *ready = true;
+                return true;
+            }
+            if(!finishField(conn)) return false;
+            continue;
+        }
+
+        i = recv(conn->fd, conn->field + conn->fieldRead, conn->fieldSize - conn->fieldRead, MSG_DONTWAIT);
+        if(i < 0){
+            if(errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK; // nothing more to read for now
+        }
+        if(i == 0){
+            return false;                   // otp closed the connection
+        }
+        countBytes(stats, i, 0);
+        conn->fieldRead += i;
+    }
+}
+
+/*******************************************************************************
+ *                                readyForWorker                               *
+ * This function says whether the field a --threads connection just finished  *
+ * is the last one its worker needs: the end of a request, the username of a  *
+ * streamed post (which opens its spool file), one of its chunks, or the empty *
+ * chunk that ends it. Anything else is decoded by the dispatcher.            *
+ ******************************************************************************/
+static bool readyForWorker(struct connection* conn){
+    switch(conn->state){
+        case READ_USER:
+            // a post still has its ciphertext to come, and a drain may have its limits
+            if(conn->mode == MODE_POST) return false;
+            return conn->mode != MODE_DRAIN || conn->version == 0 || conn->ciphertextSize != DRAIN_LIMITS_SIZE;
+
+        case READ_CHUNK_SIZE:
+            return decodeChunkHeader(conn->version, conn->header) == 0;
+
+        case READ_LIMITS:
+        case READ_CIPHERTEXT:
+        case READ_CHUNK:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/*******************************************************************************
+ *                             serveThreadedRequest                            *
+ * This function is run by a worker on a --threads connection the dispatcher   *
+ * has marked ready. A streamed post's username opens its spool file and each  *
+ * chunk is added to it, and the empty chunk at the end stores it. Anything     *
+ * else is a whole request, which is answered with answerRequest(). Once a     *
+ * request is done it's counted and the parser waits for the next one. It      *
+ * returns false if there was an error and the connection should be closed.    *
+ ******************************************************************************/
+static bool serveThreadedRequest(struct connection* conn, struct arena* arena){
+    struct requestHeader request;       // the request as answerRequest() takes it
+    unsigned char limits[DRAIN_LIMITS_SIZE] = {0}; // the limits of a drain, none unless they were sent
+    char filename[FILENAME_SIZE];       // the name of the file which contains the ciphertext
+    unsigned long long ticket;          // what to wait for before the post is on disk
+    uint64_t phaseStarted;              // when the ciphertext started to be stored
+    bool success;
+
+    if(conn->mode == MODE_STREAM_POST && conn->state == READ_USER){
+        conn->user[conn->userSize] = '\0';
+        if(!beginCiphertext(&store, &conn->writer, postEncoding(conn->flags))){
+            perror("otp_d ERROR opening file");
+            return false;
+        }
+        conn->spooling = true;
+        expectChunkSize(conn);
+        return true;
+    }
+    if(conn->mode == MODE_STREAM_POST && conn->state == READ_CHUNK){
+        if(!writeCiphertext(&conn->writer, conn->chunk, conn->chunkSize)){
+            perror("otp_d ERROR writing to file");
+            return false;
+        }
+        expectChunkSize(conn);
+        return true;
+    }
+
+    if(conn->mode == MODE_STREAM_POST){
+        // the empty chunk at the end, store the ciphertext for the user
+        countLatency(stats, PHASE_RECEIVE, conn->started);
+        conn->spooling = false;
+        conn->ciphertextSize = conn->writer.size;
+        phaseStarted = statsClock();
+        success = commitCiphertext(&store, &conn->writer, conn->user, filename, sizeof(filename), &ticket);
+        if(success){
+            countLatency(stats, PHASE_STORE, phaseStarted);
+            countQueued(stats, 1, conn->ciphertextSize);
+            success = answerStoredPost(conn->fd, conn->version, conn->flags, filename, ticket);
+        }
+        else{
+            perror("otp_d ERROR opening file");
+        }
+    }
+    else if(conn->mode == MODE_DRAIN && conn->state == READ_USER && conn->version != 0 && conn->ciphertextSize != 0){
+        fprintf(stderr, "otp_d ERROR: bad drain limits\n");
+        success = false;
+    }
+    else{
+        if(conn->state == READ_USER) conn->user[conn->userSize] = '\0';
+        if(conn->state == READ_CIPHERTEXT) conn->ciphertext[conn->ciphertextSize] = '\0';
+        if(conn->state == READ_LIMITS) memcpy(limits, conn->header, DRAIN_LIMITS_SIZE);
+        request.version = conn->version;
+        request.mode = conn->mode;
+        request.flags = conn->flags;
+        request.userSize = conn->userSize;
+        request.bodySize = conn->ciphertextSize;
+        countLatency(stats, PHASE_RECEIVE, conn->started);
+        success = answerRequest(conn->fd, &request, conn->user, conn->ciphertext, limits, arena);
+    }
+
+    countRequest(stats, conn->mode, conn->started, success);
+    conn->started = 0;
+    if(!success) return false;
+
+    free(conn->user);
+    free(conn->ciphertext);
+    conn->user = NULL;
+    conn->ciphertext = NULL;
+    conn->ciphertextSize = 0;
+    expectField(conn, READ_MODE, &conn->mode, sizeof(char));
+    return true;
+}
+
+/*******************************************************************************
+ *                                  handleRequest                              *
+ * This function handles a single request on a connection served by a forked  *
+ * child, and counts it once it's done (see otp_stats.c).                      *
+ * It returns false if otp closed the connection instead of sending a request, *
+ * or if there was an error and the connection should be closed.              *
+ ******************************************************************************/
+static bool handleRequest(int establishedConnectionFD, struct arena* arena){
+    struct requestHeader request;       // the mode and sizes sent from otp
+    uint64_t started;                   // when the request arrived
+    bool success;
+
+    // get the mode and the size of the username from otp, the connection is finished if
+    // there isn't another request
+    if(!recvRequestHeader(establishedConnectionFD, &request)){
+        return false;
+    }
+    started = statsClock();
+
+    success = validMode(request.mode) && serveRequest(establishedConnectionFD, &request, started, arena);
+    countRequest(stats, request.mode, started, success);
+    return success;
+}
+
+/*******************************************************************************
+ *                                  serveRequest                               *
+ * This function receives the rest of a request on a blocking connection once  *
+ * its header has arrived, then answers it with answerRequest(). A streamed    *
+ * post is received and answered by receiveStream() instead. The username and  *
+ * ciphertext are kept in the arena, which the caller resets once the request  *
+ * is done. It returns false if there was an error and the connection should   *
+ * be closed.                                                                  *
+ ******************************************************************************/
+static bool serveRequest(int establishedConnectionFD, struct requestHeader* request, uint64_t started, struct arena* arena){
+    char* ciphertext = NULL;            // a buffer for the ciphertext we receive from otp
+    char* user = NULL;                  // a buffer for the username we receive from otp
+    size_t ciphertextSize;              // the size of the ciphertext
+    unsigned char limits[DRAIN_LIMITS_SIZE] = {0}; // the limits of a drain, none unless they're sent
+
+    // allocate memory for the username
+    user = arenaAlloc(arena, (request->userSize + 1) * sizeof(char));
+    if(user == NULL){
+        perror("otp_d ERROR with malloc");
+        return false;
+    }
+
+    // get the username from otp
+    if(!recvCounted(establishedConnectionFD, user, request->userSize)){
+        perror("otp_d ERROR reading from socket");
+        return false;
+    }
+    user[request->userSize] = '\0';
+
+    // streamed 'post' and 'get' modes
+    if(request->mode == MODE_STREAM_POST){
+        return receiveStream(establishedConnectionFD, request->version, request->flags, user, started, arena);
+    }
+
+    // 'post' mode
+    if(request->mode == MODE_POST){
+        // get the size of the ciphertext to be sent from otp, which version 1 puts in the header
+        ciphertextSize = request->bodySize;
+        if(request->version == 0 && !recvCounted(establishedConnectionFD, &ciphertextSize, sizeof(size_t))){
+            perror("otp_d ERROR reading from socket");
+            return false;
+        }
+        request->bodySize = ciphertextSize;
+
+        // allocate memory for the ciphertext
+        ciphertext = ciphertextSize < SIZE_MAX ? arenaAlloc(arena, (ciphertextSize + 1) * sizeof(char)) : NULL;
+        if(ciphertext == NULL){
+            perror("otp_d ERROR on malloc");
+            return false;
+        }
+
+        // get the ciphertext from otp
+        if(!recvCounted(establishedConnectionFD, ciphertext, ciphertextSize)){
+            perror("otp_d ERROR reading from socket");
+            return false;
+        }
+        ciphertext[ciphertextSize] = '\0';
+    }
+
+    // a drain's limits are its body, and a drain sent without them has none
+    if(request->mode == MODE_DRAIN && request->bodySize != 0){
+        if(request->bodySize != DRAIN_LIMITS_SIZE){
+            fprintf(stderr, "otp_d ERROR: bad drain limits\n");
+            return false;
+        }
+        if(!recvCounted(establishedConnectionFD, limits, DRAIN_LIMITS_SIZE)){
+            perror("otp_d ERROR reading from socket");
+            return false;
+        }
+    }
+
+    countLatency(stats, PHASE_RECEIVE, started);
+    return answerRequest(establishedConnectionFD, request, user, ciphertext, limits, arena);
+}
+
+/*******************************************************************************
+ *                                  answerRequest                              *
+ * This function does what a request asks for once all of it has arrived, and  *
+ * answers in the same version of the protocol it was sent in, blocking until  *
+ * the answer is sent. The ciphertext of a post is request->bodySize long, and *
+ * limits holds a drain's limits. It's shared by the forked children and the   *
+ * --threads workers. It returns false if there was an error and the           *
+ * connection should be closed.                                                *
+ ******************************************************************************/
+static bool answerRequest(int establishedConnectionFD, const struct requestHeader* request, const char* user,
+                          const char* ciphertext, const unsigned char* limits, struct arena* arena){
+    unsigned char prefix[MAX_PREFIX_SIZE]; // what's sent before the ciphertext for a 'get'
+    size_t prefixSize;                  // the size of the prefix
+    struct ciphertextReader reader = {.fd = -1, .remaining = 0}; // the ciphertext sent for a 'get'
+    char filename[FILENAME_SIZE];       // the name of a file which contains ciphertext
+    unsigned long long ticket;          // what to wait for before the post is on disk
+    uint64_t maxCount, maxBytes;        // a drain's limits once they're decoded
+    uint64_t phaseStarted;              // when the phase being timed started
+    bool success;
+
+    // 'post' mode, write the ciphertext to a file
+    if(request->mode == MODE_POST){
+        phaseStarted = statsClock();
+        if(!storeCiphertext(&store, user, ciphertext, request->bodySize, postEncoding(request->flags), filename,
+                           sizeof(filename), &ticket)){
+            perror("otp_d ERROR storing ciphertext");
+            return false;
+        }
+        countLatency(stats, PHASE_STORE, phaseStarted);
+        countQueued(stats, 1, request->bodySize);
+        return answerStoredPost(establishedConnectionFD, request->version, request->flags, filename, ticket);
+    }
+
+    if(request->mode == MODE_STREAM_GET){
+        return sendStream(establishedConnectionFD, request->version, user);
+    }
+    if(request->mode == MODE_DRAIN){
+        decodeDrainLimits(limits, &maxCount, &maxBytes);
+        return sendDrain(establishedConnectionFD, request->version, user, maxCount, maxBytes);
+    }
+    if(request->mode == MODE_STATS){
+        return sendStats(establishedConnectionFD, request->version, arena);
+    }
+
+    // 'get' mode, send 's' for success and the ciphertext if we've found a ciphertext file
+    // for the user, otherwise, send 'f' for failure if the user doesn't have a ciphertext file
+    phaseStarted = statsClock();
+    if(openOldestCiphertext(&store, user, &reader)){
+        countQueued(stats, -1, -(int64_t)reader.remaining);
+        prefixSize = encodeResponsePrefix(request->version, 's', true, reader.remaining, prefix);
+    }
+    else{
+        prefixSize = encodeResponsePrefix(request->version, 'f', false, 0, prefix);
+    }
+    countLatency(stats, PHASE_LOOKUP, phaseStarted);
+
+    // the ciphertext goes straight from its file to the socket after the prefix, which is held
+    // back until then so the two go out together rather than the prefix waiting on an ack
+    phaseStarted = statsClock();
+    success = sendAll(establishedConnectionFD, prefix, prefixSize, reader.remaining > 0 ? MSG_MORE : 0) &&
+              sendCiphertextAll(establishedConnectionFD, &reader, reader.remaining);
+    if(success) countLatency(stats, PHASE_SEND, phaseStarted);
+    else perror("otp_d ERROR writing to socket");
+    closeCiphertext(&reader);
+    return success;
+}
+
+/*******************************************************************************
+ *                                  sendStats                                  *
+ * This function answers a stats request on a blocking connection with a      *
+ * snapshot of otp_d's counters. It returns false if there was an error and   *
+ * the connection should be closed.                                            *
+ ******************************************************************************/
+static bool sendStats(int establishedConnectionFD, unsigned int version, struct arena* arena){
+    char* response;                     // the prefix followed by the snapshot
+    size_t responseSize;                // the size of the response
+    uint64_t phaseStarted;              // when the response started to be sent
+
+    response = arenaAlloc(arena, MAX_PREFIX_SIZE + STATS_TEXT_SIZE);
+    if(response == NULL){
+        perror("otp_d ERROR with malloc");
+        return false;
+    }
+    responseSize = makeStatsResponse(version, response);
+
+    phaseStarted = statsClock();
+    if(!sendAll(establishedConnectionFD, response, responseSize, 0)){
+        perror("otp_d ERROR writing to socket");
+        return false;
+    }
+    countLatency(stats, PHASE_SEND, phaseStarted);
+    return true;
+}
+
+/*******************************************************************************
+ *                               makeStatsResponse                             *
+ * This function fills response with the answer to a stats request, an 's'    *
+ * prefix with the size of the snapshot followed by the snapshot itself, and   *
+ * returns its size. response must have room for MAX_PREFIX_SIZE plus          *
+ * STATS_TEXT_SIZE characters.                                                 *
+ ******************************************************************************/
+static size_t makeStatsResponse(unsigned int version, char* response){
+    unsigned char prefix[MAX_PREFIX_SIZE]; // the prefix, which can't be made until the snapshot's size is known
+    size_t prefixSize;                  // the size of the prefix
+    size_t textSize;                    // the size of the snapshot
+    struct cacheCounters cache;         // what the store's cache has done, if it has one
+
+    textSize = formatStats(stats, response + MAX_PREFIX_SIZE, STATS_TEXT_SIZE);
+    if(store.cacheBudget > 0){
+        readCacheCounters(&store, &cache);
+        textSize += formatCacheStats(&cache, response + MAX_PREFIX_SIZE + textSize, STATS_TEXT_SIZE - textSize);
+    }
+    prefixSize = encodeResponsePrefix(version, 's', true, textSize, prefix);
+    memmove(response + prefixSize, response + MAX_PREFIX_SIZE, textSize);
+    memcpy(response, prefix, prefixSize);
+    return prefixSize + textSize;
+}
+
+/*******************************************************************************
+ *                              recvRequestHeader                              *
+ * This function receives the start of a request, which is a version 1 header  *
+ * if the first byte is 'O', or otherwise the mode and the username's size of  *
+ * a version 0 request. It returns false if there's no request to receive, or  *
+ * if the request couldn't be read.                                            *
+ ******************************************************************************/
+static bool recvRequestHeader(int establishedConnectionFD, struct requestHeader* request){
+    unsigned char header[REQUEST_HEADER_SIZE]; // a version 1 request header
+    size_t userSize;                    // the size of the username in a version 0 request
+
+    if(!recvCounted(establishedConnectionFD, header, sizeof(char))){
+        return false;
+    }
+
+    // a version 0 request starts with its mode
+    if(header[0] != PROTOCOL_MAGIC[0]){
+        request->version = 0;
+        request->mode = header[0];
+        request->flags = 0;
+        request->bodySize = 0;
+        if(!recvCounted(establishedConnectionFD, &userSize, sizeof(size_t))){
+            perror("otp_d ERROR reading from socket");
+            return false;
+        }
+        if(userSize > UINT32_MAX){
+            fprintf(stderr, "otp_d ERROR: username is too long\n");
+            return false;
+        }
+        request->userSize = userSize;
+        return true;
+    }
+
+    // otherwise the whole header is read at once
+    if(!recvCounted(establishedConnectionFD, header + sizeof(char), REQUEST_HEADER_SIZE - sizeof(char))){
+        perror("otp_d ERROR reading from socket");
+        return false;
+    }
+    if(!decodeRequestHeader(header, request)){
+        fprintf(stderr, "otp_d ERROR: unknown request header\n");
+        return false;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                                  postEncoding                               *
+ * This function returns how a post with the given header flags is encoded.    *
+ * FLAG_BINARY wins if both it and FLAG_PACKED are set, since any byte is      *
+ * good in a binary ciphertext.                                                *
+ ******************************************************************************/
+static enum ciphertextEncoding postEncoding(uint32_t flags){
+    if(flags & FLAG_BINARY) return ENCODING_BINARY;
+    if(flags & FLAG_PACKED) return ENCODING_PACKED;
+    return ENCODING_TEXT;
+}
+
+/*******************************************************************************
+ *                                  receiveStream                              *
+ * This function receives a streamed 'post' on a blocking connection. Each     *
+ * chunk is written to a spool file as it arrives, and the ciphertext is only  *
+ * stored once the empty chunk at the end has been received. It returns false  *
+ * if there was an error and the connection should be closed.                  *
+ ******************************************************************************/
+static bool receiveStream(int establishedConnectionFD, unsigned int version, uint32_t flags, const char* user,
+                   uint64_t started, struct arena* arena){
+    struct ciphertextWriter writer;     // the spool file the chunks are written to
+    char* chunk;                        // a buffer for one chunk of the ciphertext
+    unsigned char chunkHeader[sizeof(uint64_t)]; // the size of the chunk as it was sent
+    uint64_t chunkSize;                 // the size of the chunk sent from otp
+    char filename[FILENAME_SIZE];       // the name of the file which contains the ciphertext
+    size_t ciphertextSize;              // the size of the whole ciphertext
+    unsigned long long ticket;          // what to wait for before the post is on disk
+    uint64_t phaseStarted;              // when the ciphertext started to be stored
+
+    chunk = arenaAlloc(arena, MAX_CHUNK_SIZE);
+    if(chunk == NULL){
+        perror("otp_d ERROR with malloc");
+        return false;
+    }
+    if(!beginCiphertext(&store, &writer, postEncoding(flags))){
+        perror("otp_d ERROR opening file");
+        return false;
+    }
+
+    while(true){
+        // get the size of the next chunk, a chunk of size 0 means the ciphertext is complete
+        if(!recvCounted(establishedConnectionFD, chunkHeader, chunkHeaderSize(version))){
+            perror("otp_d ERROR reading from socket");
+            abortCiphertext(&writer);
+            return false;
+        }
+        chunkSize = decodeChunkHeader(version, chunkHeader);
+        if(chunkSize == 0) break;
+        if(chunkSize > MAX_CHUNK_SIZE){
+            fprintf(stderr, "otp_d ERROR: chunk of %llu characters is too big\n", (unsigned long long)chunkSize);
+            abortCiphertext(&writer);
+            return false;
+        }
+
+        // get the chunk from otp and add it to the spool file
+        if(!recvCounted(establishedConnectionFD, chunk, chunkSize)){
+            perror("otp_d ERROR reading from socket");
+            abortCiphertext(&writer);
+            return false;
+        }
+        if(!writeCiphertext(&writer, chunk, chunkSize)){
+            perror("otp_d ERROR writing to file");
+            abortCiphertext(&writer);
+            return false;
+        }
+    }
+
+    countLatency(stats, PHASE_RECEIVE, started);
+
+    // store the ciphertext for the user
+    ciphertextSize = writer.size;
+    phaseStarted = statsClock();
+    if(!commitCiphertext(&store, &writer, user, filename, sizeof(filename), &ticket)){
+        perror("otp_d ERROR opening file");
+        return false;
+    }
+    countLatency(stats, PHASE_STORE, phaseStarted);
+    countQueued(stats, 1, ciphertextSize);
+    return answerStoredPost(establishedConnectionFD, version, flags, filename, ticket);
+}
+
+/*******************************************************************************
+ *                                  answerStoredPost                           *
+ * This function finishes a post on a blocking connection once it's stored.    *
+ * The path to the file is printed, and with group commit the worker or child  *
+ * waits here until the post has been synced. 's' is then sent back if the     *
+ * header asked for it with FLAG_ACK. It returns false if the post may not be  *
+ * on disk or the answer couldn't be sent, and the connection should be       *
+ * closed, which is how the client learns the post failed.                    *
+ ******************************************************************************/
+static bool answerStoredPost(int establishedConnectionFD, unsigned int version, uint32_t flags, const char* filename,
+                      unsigned long long ticket){
+    unsigned char prefix[MAX_PREFIX_SIZE]; // the 's' sent back
+    size_t prefixSize;                  // the size of the prefix
+    uint64_t phaseStarted;              // when the wait for the sync started
+
+    // print the path to the file
+    printf("%s\n", filename);
+    fflush(stdout);
+
+    phaseStarted = statsClock();
+    if(!waitForSync(&store, ticket)){
+        fprintf(stderr, "otp_d ERROR: %s may not be on disk\n", filename);
+        return false;
+    }
+    if(ticket != 0) countLatency(stats, PHASE_SYNC, phaseStarted);
+
+    if(!(flags & FLAG_ACK)) return true;
+    prefixSize = encodeResponsePrefix(version, 's', false, 0, prefix);
+    if(!sendAll(establishedConnectionFD, prefix, prefixSize, 0)){
+        perror("otp_d ERROR writing to socket");
+        return false;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                                  sendStream                                 *
+ * This function answers a streamed 'get' on a blocking connection. The user's *
+ * oldest ciphertext is sent back a chunk at a time, followed by an empty      *
+ * chunk. The chunks are sent from the store with sendfile(). It returns false *
+ * if there was an error and the connection should be closed.                  *
+ ******************************************************************************/
+static bool sendStream(int establishedConnectionFD, unsigned int version, const char* user){
+    struct ciphertextReader reader;     // the ciphertext being sent back
+    size_t chunkSize;                   // the size of the next chunk
+    unsigned char prefix[MAX_PREFIX_SIZE]; // the answer's prefix, then each chunk's size
+    size_t prefixSize;                  // the size of the answer's prefix
+    bool found;                         // true if the user has a ciphertext
+    uint64_t phaseStarted;              // when the phase being timed started
+
+    // send 's' for success if we've found a ciphertext for the user, otherwise, send 'f'
+    // for failure if the user doesn't have a ciphertext
+    phaseStarted = statsClock();
+    found = openOldestCiphertext(&store, user, &reader);
+    if(found) countQueued(stats, -1, -(int64_t)reader.remaining);
+    countLatency(stats, PHASE_LOOKUP, phaseStarted);
+
+    phaseStarted = statsClock();
+    prefixSize = encodeResponsePrefix(version, found ? 's' : 'f', false, 0, prefix);
+    if(!sendAll(establishedConnectionFD, prefix, prefixSize, found ? MSG_MORE : 0)){
+        perror("otp_d ERROR writing to socket");
+        if(found) closeCiphertext(&reader);
+        return false;
+    }
+    if(!found){
+        countLatency(stats, PHASE_SEND, phaseStarted);
+        return true;    // nothing more to send if the given user doesn't have a ciphertext
+    }
+
+    // send each chunk's size and then the chunk straight from the file, ending with a chunk
+    // of size 0, an error cuts the stream off without the empty chunk so otp knows the
+    // ciphertext is incomplete
+    do{
+        chunkSize = reader.remaining < STREAM_CHUNK_SIZE ? reader.remaining : STREAM_CHUNK_SIZE;
+        encodeChunkHeader(version, chunkSize, prefix);
+        if(!sendAll(establishedConnectionFD, prefix, chunkHeaderSize(version), chunkSize > 0 ? MSG_MORE : 0) ||
+           !sendCiphertextAll(establishedConnectionFD, &reader, chunkSize)){
+            perror("otp_d ERROR writing to socket");
+            closeCiphertext(&reader);
+            return false;
+        }
+    }while(chunkSize > 0);
+    countLatency(stats, PHASE_SEND, phaseStarted);
+
+    closeCiphertext(&reader);
+    return true;
+}
+
+/*******************************************************************************
+ *                                  sendDrain                                  *
+ * This function answers a drain on a blocking connection. Each ciphertext     *
+ * taken is sent the same way as the answer to a 'get', an 's' and its size    *
+ * and then the ciphertext straight from its file, and an 'f' ends the answer  *
+ * once the user has no more or the limits have been reached. It returns false *
+ * if there was an error and the connection should be closed.                  *
+ ******************************************************************************/
+static bool sendDrain(int establishedConnectionFD, unsigned int version, const char* user, uint64_t maxCount,
+                      uint64_t maxBytes){
+    struct ciphertextDrain drain;       // the ciphertexts left to send
+    struct ciphertextReader reader;     // the ciphertext being sent back
+    unsigned char prefix[MAX_PREFIX_SIZE]; // what's sent before each ciphertext, then the 'f'
+    size_t prefixSize;                  // the size of the prefix
+    bool found;                         // true if another ciphertext was taken
+    uint64_t phaseStarted;              // when the phase being timed started
+    uint64_t sendStarted;               // when the answer started to be sent
+    bool success = true;
+
+    phaseStarted = statsClock();
+    if(!beginDrain(&store, user, maxCount, maxBytes, &drain)){
+        perror("otp_d ERROR with malloc");
+        return false;
+    }
+    countLatency(stats, PHASE_LOOKUP, phaseStarted);
+
+    // an error cuts the answer off without the 'f', so otp knows it's incomplete
+    sendStarted = statsClock();
+    do{
+        phaseStarted = statsClock();
+        found = openNextDrained(&store, &drain, &reader);
+        if(found) countQueued(stats, -1, -(int64_t)reader.remaining);
+        countLatency(stats, PHASE_LOOKUP, phaseStarted);
+
+        prefixSize = encodeResponsePrefix(version, found ? 's' : 'f', found, found ? reader.remaining : 0, prefix);
+        success = sendAll(establishedConnectionFD, prefix, prefixSize, found ? MSG_MORE : 0) &&
+                  (!found || sendCiphertextAll(establishedConnectionFD, &reader, reader.remaining));
+        if(found) closeCiphertext(&reader);
+    }while(success && found);
+    endDrain(&drain);
+
+    if(success) countLatency(stats, PHASE_SEND, sendStarted);
+    else perror("otp_d ERROR writing to socket");
+    return success;
+}
+
+/*******************************************************************************
+ *                                  runEventLoop                               *
+ * This function serves every connection from a single process. The listening  *
+ * socket and all client sockets are non-blocking and registered with epoll,   *
+ * and each connection's parser advances as far as the bytes that have arrived *
+ * allow before control returns to epoll_wait().                               *
+ ******************************************************************************/
+static void runEventLoop(int listenSocketFD){
+    int epollFD;                        // the epoll instance
+    int numEvents;                      // the number of events returned by epoll_wait()
+    int establishedConnectionFD;
+    struct epoll_event event;           // used to register a socket with epoll
+    struct epoll_event events[MAX_EVENTS];
+    struct connection* conn;
+    bool keepOpen;                      // false once a connection is finished or has failed
+    bool synced;                        // true if the syncer finished a sync during this pass
+
+    // a client that disconnects early must not kill the whole server
+    signal(SIGPIPE, SIG_IGN);
+    raiseFileLimit();
+
+    epollFD = epoll_create1(0);
+    if(epollFD < 0) error("otp_d ERROR creating epoll instance");
+
+    // with group commit the syncer's eventfd says when parked posts can be answered
+    if(store.syncFD >= 0){
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = &syncWaiting;
+        if(epoll_ctl(epollFD, EPOLL_CTL_ADD, store.syncFD, &event) < 0){
+            error("otp_d ERROR adding the syncer to epoll");
+        }
+    }
+
+    // register the listening socket, its data pointer is left NULL to tell it apart from clients
+    fcntl(listenSocketFD, F_SETFL, fcntl(listenSocketFD, F_GETFL) | O_NONBLOCK);
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if(epoll_ctl(epollFD, EPOLL_CTL_ADD, listenSocketFD, &event) < 0){
+        error("otp_d ERROR adding listening socket to epoll");
+    }
+
+    while(true){
+        numEvents = epoll_wait(epollFD, events, MAX_EVENTS, -1);
+        if(numEvents < 0){
+            if(errno == EINTR) continue;
+            error("otp_d ERROR on epoll_wait");
+        }
+
+        synced = false;
+        for(int i = 0; i < numEvents; i++){
+            conn = events[i].data.ptr;
+
+            // parked posts are answered after the other events, one of which may close them
+            if(events[i].data.ptr == &syncWaiting){
+                synced = true;
+                continue;
+            }
+
+            // the listening socket is readable, accept every connection that is waiting and
+            // serve, queue or turn away each one
+            if(conn == NULL){
+                while((establishedConnectionFD = accept4(listenSocketFD, NULL, NULL, SOCK_NONBLOCK)) >= 0){
+                    if(admitConnection(establishedConnectionFD, activeConnections)){
+                        addConnection(epollFD, establishedConnectionFD);
+                    }
+                }
+                if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+                    perror("otp_d ERROR on accept");
+                }
+                continue;
+            }
+
+            // a client socket is ready, advance its parser or its response
+            if(events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN)){
+                keepOpen = false;
+            }
+            else{
+                keepOpen = serviceConnection(epollFD, conn);
+            }
+
+            // closing the socket also removes it from the epoll instance
+            if(!keepOpen){
+                closeConnection(conn);
+            }
+        }
+        if(synced) finishSyncs(epollFD);
+
+        // serve the connections that were waiting for the ones that just closed
+        while((establishedConnectionFD = nextWaiting(activeConnections)) >= 0){
+            addConnection(epollFD, establishedConnectionFD);
+        }
+    }
+}
+
+/*******************************************************************************
+ *                                  raiseFileLimit                             *
+ * This function raises the open file limit as high as we're allowed, since   *
+ * every client of a single process server needs a descriptor.                *
+ ******************************************************************************/
+static void raiseFileLimit(void){
+    struct rlimit fileLimit;            // the limit on open file descriptors
+
+    if(getrlimit(RLIMIT_NOFILE, &fileLimit) == 0){
+        fileLimit.rlim_cur = fileLimit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fileLimit);
+    }
+}
+
+/*******************************************************************************
+ *                                  addConnection                              *
+ * This function starts serving a connection in --epoll mode, registering it  *
+ * with epoll to wait for its first request. It returns false if it couldn't  *
+ * be, in which case it's closed.                                              *
+ ******************************************************************************/
+static bool addConnection(int epollFD, int fd){
+    struct epoll_event event;           // registers the connection with epoll
+    struct connection* conn;
+
+    conn = openConnection(fd);
+    if(conn == NULL){
+        perror("otp_d ERROR with malloc");
+        close(fd);
+        return false;
+    }
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = conn;
+    conn->events = EPOLLIN;
+    if(epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &event) < 0){
+        perror("otp_d ERROR adding connection to epoll");
+        closeConnection(conn);
+        return false;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                                serviceConnection                            *
+ * This function reads requests and writes responses on a connection until it  *
+ * would block. Pipelined requests are handled one after another, a response   *
+ * is sent as soon as its request has been parsed, and epoll is only asked to  *
+ * wait for EPOLLOUT while a response is stuck behind a full socket buffer.    *
+ * While a post waits for its sync, epoll waits for nothing on the connection, *
+ * so pipelined requests behind it stay in the socket until it's answered.    *
+ * It returns false if the connection should be closed.                        *
+ ******************************************************************************/
+static bool serviceConnection(int epollFD, struct connection* conn){
+    struct epoll_event event;           // used to switch between EPOLLIN and EPOLLOUT
+    bool blocked = false;               // true once the socket can't be read or written
+    uint32_t events;                    // what epoll should wait for now
+
+    while(!blocked){
+        if(conn->state == WRITE_RESPONSE){
+            if(!writeConnection(conn)) return false;
+            blocked = conn->state == WRITE_RESPONSE;
+        }
+        else{
+            if(!readConnection(conn)) return false;
+            blocked = conn->state != WRITE_RESPONSE;
+        }
+    }
+
+    // wait for whichever of reading or writing is blocked
+    if(conn->state == WAIT_SYNC) events = 0;
+    else events = conn->state == WRITE_RESPONSE ? EPOLLOUT : EPOLLIN;
+    if(conn->events != events){
+        conn->events = events;
+        memset(&event, 0, sizeof(event));
+        event.events = events;
+        event.data.ptr = conn;
+        epoll_ctl(epollFD, EPOLL_CTL_MOD, conn->fd, &event);
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                                  openConnection                             *
+ * This function allocates the state for a newly accepted connection, which    *
+ * starts out waiting for the mode byte.                                       *
+ ******************************************************************************/
+static struct connection* openConnection(int fd){
+    struct connection* conn = calloc(1, sizeof(struct connection));
+    if(conn == NULL) return NULL;
+
+    conn->fd = fd;
+    conn->reader.fd = -1;
+    conn->ringSlot = -1;
+    expectField(conn, READ_MODE, &conn->mode, sizeof(char));
+    activeConnections++;
+    countConnection(stats, 1);
+    return conn;
+}
+
+/*******************************************************************************
+ *                                  closeConnection                            *
+ * This function closes a connection's socket and frees everything it owns. A  *
+ * streamed post that never got its last chunk is thrown away, and a request   *
+ * that was cut off is counted as a failure.                                   *
+ ******************************************************************************/
+static void closeConnection(struct connection* conn){
+    if(conn->ticket != 0) leaveSyncQueue(conn);
+    if(conn->started != 0) countRequest(stats, conn->mode, conn->started, false);
+    activeConnections--;
+    countConnection(stats, -1);
+    close(conn->fd);
+    if(conn->spooling) abortCiphertext(&conn->writer);
+    closeCiphertext(&conn->reader);
+    free(conn->user);
+    free(conn->ciphertext);
+    free(conn->chunk);
+    free(conn->response);
+    free(conn->input);
+    endDrain(&conn->drain);
+    free(conn);
+}
+
+/*******************************************************************************
+ *                                  resetConnection                            *
+ * This function counts the request that just finished on a connection, frees *
+ * what was held for it and gets the parser ready for the next request.        *
+ ******************************************************************************/
+static void resetConnection(struct connection* conn){
+    countRequest(stats, conn->mode, conn->started, true);
+    conn->started = 0;
+    free(conn->user);
+    free(conn->ciphertext);
+    free(conn->response);
+    closeCiphertext(&conn->reader);
+    conn->user = NULL;
+    conn->ciphertext = NULL;
+    conn->response = NULL;
+    conn->responseSize = 0;
+    conn->responseSent = 0;
+    conn->fileRemaining = 0;
+    conn->streaming = false;
+    endDrain(&conn->drain);
+    conn->draining = false;
+    expectField(conn, READ_MODE, &conn->mode, sizeof(char));
+}
+
+/*******************************************************************************
+ *                                  expectField                                *
+ * This function moves a connection's parser to the given state, and sets the  *
+ * buffer and size of the field that has to be read before it can move on.     *
+ ******************************************************************************/
+static void expectField(struct connection* conn, enum connState state, void* field, size_t fieldSize){
+    conn->state = state;
+    conn->field = field;
+    conn->fieldSize = fieldSize;
+    conn->fieldRead = 0;
+}
+
+/*******************************************************************************
+ *                                  readConnection                             *
+ * This function reads whatever has arrived on a connection without blocking,  *
+ * completing as many fields as it can, until a response is ready or a post   *
+ * has to wait for its sync. It returns false if the connection should be      *
+ * closed, either because of an error or because it is finished.               *
+ ******************************************************************************/
+static bool readConnection(struct connection* conn){
+    ssize_t i;
+
+    while(conn->state != WRITE_RESPONSE && conn->state != WAIT_SYNC){
+        // a zero length field (an empty username or ciphertext) is complete right away
+        if(conn->fieldRead == conn->fieldSize){
+            if(!finishField(conn)) return false;
+            continue;
+        }
+
+        i = recv(conn->fd, conn->field + conn->fieldRead, conn->fieldSize - conn->fieldRead, 0);
+        if(i < 0){
+            if(errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK; // nothing more to read for now
+        }
+        if(i == 0){
+            return false;                   // otp closed the connection
+        }
+        countBytes(stats, i, 0);
+        conn->fieldRead += i;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                                  finishField                                *
+ * This function is called once a field has been completely read. It acts on   *
+ * the field and moves the parser on to the next one. It returns false if the  *
+ * connection should be closed.                                                *
+ ******************************************************************************/
+static bool finishField(struct connection* conn){
+    char filename[FILENAME_SIZE];       // the name of a file which contains ciphertext
+    struct requestHeader request;       // a decoded version 1 header
+    uint64_t chunkSize;                 // the size of a chunk as it was sent
+    unsigned long long ticket;          // what to wait for before a post is on disk
+    uint64_t phaseStarted;              // when the phase being timed started
+
+    switch(conn->state){
+        case READ_MODE:
+            conn->started = statsClock();
+
+            // a version 1 request starts with a header instead of the mode
+            if(conn->mode == PROTOCOL_MAGIC[0]){
+                conn->header[0] = conn->mode;
+                expectField(conn, READ_HEADER, conn->header + sizeof(char), REQUEST_HEADER_SIZE - sizeof(char));
+                return true;
+            }
+            if(!validMode(conn->mode)) return false;
+            conn->version = 0;
+            conn->flags = 0;
+            expectField(conn, READ_USER_SIZE, &conn->userSize, sizeof(size_t));
+            return true;
+
+        case READ_HEADER:
+            if(!decodeRequestHeader(conn->header, &request)){
+                fprintf(stderr, "otp_d ERROR: unknown request header\n");
+                return false;
+            }
+            if(!validMode(request.mode)) return false;
+            conn->version = request.version;
+            conn->flags = request.flags;
+            conn->mode = request.mode;
+            conn->userSize = request.userSize;
+            conn->ciphertextSize = request.bodySize;
+            /* falls through, the header holds the size of the username */
+
+        case READ_USER_SIZE:
+            // allocate memory on the heap for the username
+            conn->user = malloc((conn->userSize + 1) * sizeof(char));
+            if(conn->user == NULL){
+                perror("otp_d ERROR with malloc");
+                return false;
+            }
+            expectField(conn, READ_USER, conn->user, conn->userSize);
+            return true;
+
+        case READ_USER:
+            conn->user[conn->userSize] = '\0';
+            if(conn->mode == MODE_POST){
+                // version 1 already sent the size of the ciphertext in the header
+                if(conn->version != 0) return expectCiphertext(conn);
+                expectField(conn, READ_CIPHERTEXT_SIZE, &conn->ciphertextSize, sizeof(size_t));
+                return true;
+            }
+            if(conn->mode == MODE_STREAM_POST){
+                if(!beginCiphertext(&store, &conn->writer, postEncoding(conn->flags))){
+                    perror("otp_d ERROR opening file");
+                    return false;
+                }
+                conn->spooling = true;
+                expectChunkSize(conn);
+                return true;
+            }
+            if(conn->mode == MODE_DRAIN){
+                // a drain's limits are its body, and a drain sent without them has none
+                if(conn->version != 0 && conn->ciphertextSize == DRAIN_LIMITS_SIZE){
+                    expectField(conn, READ_LIMITS, conn->header, DRAIN_LIMITS_SIZE);
+                    return true;
+                }
+                if(conn->version != 0 && conn->ciphertextSize != 0){
+                    fprintf(stderr, "otp_d ERROR: bad drain limits\n");
+                    return false;
+                }
+                memset(conn->header, 0, DRAIN_LIMITS_SIZE);
+            }
+            /* falls through, nothing more is read for the other modes */
+
+        case READ_LIMITS:
+            countLatency(stats, PHASE_RECEIVE, conn->started);
+            if(ringFiles && store.backend == STORE_FILES && conn->mode != MODE_STATS && conn->mode != MODE_DRAIN){
+                return beginRingLookup(conn);   // the ring opens and removes the file
+            }
+            if(conn->mode == MODE_STREAM_GET){
+                return beginStreamResponse(conn);
+            }
+            if(conn->mode == MODE_DRAIN){
+                return beginDrainResponse(conn);
+            }
+            if(conn->mode == MODE_STATS){
+                return beginStatsResponse(conn);
+            }
+
+            // 'get' mode, the response is 's' and the ciphertext, or just 'f', and the
+            // ciphertext is sent from its file once the prefix has gone
+            conn->response = malloc(MAX_PREFIX_SIZE);
+            if(conn->response == NULL){
+                perror("otp_d ERROR with malloc");
+                return false;
+            }
+            phaseStarted = statsClock();
+            if(openOldestCiphertext(&store, conn->user, &conn->reader)){
+                countQueued(stats, -1, -(int64_t)conn->reader.remaining);
+                conn->responseSize = encodeResponsePrefix(conn->version, 's', true, conn->reader.remaining,
+                                                          (unsigned char*)conn->response);
+                conn->fileRemaining = conn->reader.remaining;
+            }
+            else{
+                conn->responseSize = encodeResponsePrefix(conn->version, 'f', false, 0,
+                                                          (unsigned char*)conn->response);
+            }
+            countLatency(stats, PHASE_LOOKUP, phaseStarted);
+            conn->responseSent = 0;
+            conn->sendStarted = statsClock();
+            conn->state = WRITE_RESPONSE;
+            return true;
+
+        case READ_CIPHERTEXT_SIZE:
+            return expectCiphertext(conn);
+
+        case READ_CIPHERTEXT:
+            conn->ciphertext[conn->ciphertextSize] = '\0';
+            countLatency(stats, PHASE_RECEIVE, conn->started);
+            // the ring can't sync the file and its directory on its own, so fsync posts are stored here
+            if(ringFiles && store.backend == STORE_FILES && store.durability != DURABILITY_FSYNC &&
+               numRingSlots > 0 && conn->ciphertextSize < RING_MAX_WRITE){
+                return beginRingStore(conn);    // the ring writes the file
+            }
+
+            // write the ciphertext to a file
+            phaseStarted = statsClock();
+            if(!storeCiphertext(&store, conn->user, conn->ciphertext, conn->ciphertextSize, postEncoding(conn->flags),
+                                filename, sizeof(filename), &ticket)){
+                perror("otp_d ERROR storing ciphertext");
+                return false;
+            }
+            countLatency(stats, PHASE_STORE, phaseStarted);
+            countQueued(stats, 1, conn->ciphertextSize);
+            return completePost(conn, filename, ticket);
+
+        case READ_CHUNK_SIZE:
+            // a chunk of size 0 means the streamed ciphertext is complete
+            chunkSize = decodeChunkHeader(conn->version, conn->header);
+            if(chunkSize == 0){
+                countLatency(stats, PHASE_RECEIVE, conn->started);
+                conn->spooling = false;
+                conn->ciphertextSize = conn->writer.size;
+                phaseStarted = statsClock();
+                if(!commitCiphertext(&store, &conn->writer, conn->user, filename, sizeof(filename), &ticket)){
+                    perror("otp_d ERROR opening file");
+                    return false;
+                }
+                countLatency(stats, PHASE_STORE, phaseStarted);
+                countQueued(stats, 1, conn->ciphertextSize);
+                return completePost(conn, filename, ticket);
+            }
+            if(chunkSize > MAX_CHUNK_SIZE){
+                fprintf(stderr, "otp_d ERROR: chunk of %llu characters is too big\n", (unsigned long long)chunkSize);
+                return false;
+            }
+            conn->chunkSize = chunkSize;
+
+            // the chunk buffer only grows, most chunks are the same size
+            if(conn->chunkSize > conn->chunkCapacity){
+                free(conn->chunk);
+                conn->chunk = malloc(conn->chunkSize);
+                if(conn->chunk == NULL){
+                    perror("otp_d ERROR with malloc");
+                    return false;
+                }
+                conn->chunkCapacity = conn->chunkSize;
+            }
+            expectField(conn, READ_CHUNK, conn->chunk, conn->chunkSize);
+            return true;
+
+        case READ_CHUNK:
+            if(!writeCiphertext(&conn->writer, conn->chunk, conn->chunkSize)){
+                perror("otp_d ERROR writing to file");
+                return false;
+            }
+            expectChunkSize(conn);
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/*******************************************************************************
+ *                                  completePost                               *
+ * This function finishes a post on an --epoll or --io-uring connection once   *
+ * it's stored, and prints the path to the file. With group commit the        *
+ * connection is parked at the back of syncWaiting until finishSyncs() finds  *
+ * its post synced, and the loop goes on serving everyone else meanwhile.     *
+ * Otherwise it's answered straight away. It returns false if the connection  *
+ * should be closed.                                                           *
+ ******************************************************************************/
+static bool completePost(struct connection* conn, const char* filename, unsigned long long ticket){
+    // print the path to the file
+    printf("%s\n", filename);
+    fflush(stdout);
+
+    if(ticket == 0) return answerPost(conn);
+    conn->ticket = ticket;
+    conn->phaseStarted = statsClock();
+    conn->state = WAIT_SYNC;
+    conn->syncPrev = syncWaiting.tail;
+    conn->syncNext = NULL;
+    if(syncWaiting.tail != NULL) syncWaiting.tail->syncNext = conn;
+    else syncWaiting.head = conn;
+    syncWaiting.tail = conn;
+    return true;
+}
+
+/*******************************************************************************
+ *                                  answerPost                                 *
+ * This function answers a post that's as durable as it's going to get. If    *
+ * the header asked with FLAG_ACK the response is 's', otherwise the post is  *
+ * finished and the parser waits for the next request. It returns false if    *
+ * there's no memory.                                                          *
+ ******************************************************************************/
+static bool answerPost(struct connection* conn){
+    if(!(conn->flags & FLAG_ACK)){
+        resetConnection(conn);          // a 'post' is finished once it's stored
+        return true;
+    }
+    conn->response = malloc(MAX_PREFIX_SIZE);
+    if(conn->response == NULL){
+        perror("otp_d ERROR with malloc");
+        return false;
+    }
+    conn->responseSize = encodeResponsePrefix(conn->version, 's', false, 0, (unsigned char*)conn->response);
+    conn->responseSent = 0;
+    conn->sendStarted = statsClock();
+    conn->state = WRITE_RESPONSE;
+    return true;
+}
+
+/*******************************************************************************
+ *                                  leaveSyncQueue                             *
+ * This function takes a connection off syncWaiting, either because its post  *
+ * is done waiting or because it's being closed.                              *
+ ******************************************************************************/
+static void leaveSyncQueue(struct connection* conn){
+    if(conn->syncPrev != NULL) conn->syncPrev->syncNext = conn->syncNext;
+    else syncWaiting.head = conn->syncNext;
+    if(conn->syncNext != NULL) conn->syncNext->syncPrev = conn->syncPrev;
+    else syncWaiting.tail = conn->syncPrev;
+    conn->syncPrev = NULL;
+    conn->syncNext = NULL;
+    conn->ticket = 0;
+}
+
+/*******************************************************************************
+ *                                  finishSyncs                                *
+ * This function is called when the store's eventfd says the syncer finished a *
+ * sync. Tickets are handed out in the order posts are stored, which is the   *
+ * order of syncWaiting, so the posts it covered are all at the front. Each is *
+ * answered and its connection moved along, with epoll, or with the ring if   *
+ * epollFD is -1. If the sync failed they're closed instead, so their clients *
+ * know the posts may be lost.                                                 *
+ ******************************************************************************/
+static void finishSyncs(int epollFD){
+    struct connection* conn;
+    enum syncState state;
+    eventfd_t count;                    // the number of syncs finished since the last read
+    bool keepOpen;
+
+    eventfd_read(store.syncFD, &count);
+    while((conn = syncWaiting.head) != NULL && (state = checkSync(&store, conn->ticket)) != SYNC_WAITING){
+        leaveSyncQueue(conn);
+        if(state == SYNC_DONE){
+            countLatency(stats, PHASE_SYNC, conn->phaseStarted);
+            keepOpen = answerPost(conn) && (epollFD < 0 ? pumpConnection(conn) : serviceConnection(epollFD, conn));
+        }
+        else{
+            fprintf(stderr, "otp_d ERROR: a post for \"%s\" may not be on disk\n", conn->user);
+            keepOpen = false;
+        }
+        if(!keepOpen) closeConnection(conn);
+    }
+}
+
+/*******************************************************************************
+ *                                  validMode                                  *
+ * This function checks that a request's mode is one otp_d knows.              *
+ ******************************************************************************/
+static bool validMode(char mode){
+    if(mode != MODE_POST && mode != MODE_GET && mode != MODE_STREAM_POST && mode != MODE_STREAM_GET &&
+       mode != MODE_STATS && mode != MODE_DRAIN){
+        fprintf(stderr, "otp_d ERROR: unknown mode '%c'\n", mode);
+        return false;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                                  expectCiphertext                           *
+ * This function allocates the buffer for a posted ciphertext once its size is  *
+ * known and waits for the ciphertext. It returns false if there's no memory.  *
+ ******************************************************************************/
+static bool expectCiphertext(struct connection* conn){
+    // allocate memory on the heap for the ciphertext
+    conn->ciphertext = malloc((conn->ciphertextSize + 1) * sizeof(char));
+    if(conn->ciphertext == NULL){
+        perror("otp_d ERROR on malloc");
+        return false;
+    }
+    expectField(conn, READ_CIPHERTEXT, conn->ciphertext, conn->ciphertextSize);
+    return true;
+}
+
+/*******************************************************************************
+ *                                  expectChunkSize                            *
+ * This function waits for the size of the next chunk of a streamed 'post',    *
+ * which is sent differently in each version of the protocol.                 *
+ ******************************************************************************/
+static void expectChunkSize(struct connection* conn){
+    expectField(conn, READ_CHUNK_SIZE, conn->header, chunkHeaderSize(conn->version));
+}
+
+/*******************************************************************************
+ *                                  writeConnection                            *
+ * This function sends as much of a connection's response as the socket will   *
+ * take without blocking. After the response buffer comes any ciphertext that  *
+ * is sent from its file with sendfile(), and a streamed 'get' then refills    *
+ * the buffer with the next chunk's size. Once the whole response is sent the  *
+ * connection goes back to waiting for a request. It returns false if there    *
+ * was an error and the connection should be closed.                           *
+ ******************************************************************************/
+static bool writeConnection(struct connection* conn){
+    ssize_t i;
+
+    while(true){
+        if(conn->responseSent < conn->responseSize){
+            // anything still to come after the buffer is sent with it instead of after an ack
+            i = send(conn->fd, conn->response + conn->responseSent, conn->responseSize - conn->responseSent,
+                     conn->fileRemaining > 0 || conn->streaming || conn->draining ? MSG_MORE : 0);
+            if(i >= 0){
+                conn->responseSent += i;
+                countBytes(stats, 0, i);
+            }
+        }
+        else if(conn->fileRemaining > 0){
+            // a ciphertext that comes up short is cut off, so otp knows it's incomplete
+            i = sendCiphertext(&conn->reader, conn->fd, conn->fileRemaining);
+            if(i == 0) return false;
+            if(i > 0){
+                conn->fileRemaining -= i;
+                countBytes(stats, 0, i);
+            }
+        }
+        else if(conn->streaming){
+            nextStreamChunk(conn);
+            continue;
+        }
+        else if(conn->draining){
+            nextDrained(conn);
+            continue;
+        }
+        else break;
+
+        if(i < 0){
+            if(errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK; // wait for EPOLLOUT
+        }
+    }
+
+    countLatency(stats, PHASE_SEND, conn->sendStarted);
+    resetConnection(conn);
+    return true;
+}
+
+/*******************************************************************************
+ *                               beginStreamResponse                           *
+ * This function starts the response to a streamed 'get'. The response buffer  *
+ * holds one chunk's size at a time, and starts out holding just the 's' or    *
+ * 'f', or a header with one of them. It returns false if the connection       *
+ * should be closed.                                                           *
+ ******************************************************************************/
+static bool beginStreamResponse(struct connection* conn){
+    uint64_t phaseStarted;              // when the lookup started
+
+    conn->response = malloc(MAX_PREFIX_SIZE);
+    if(conn->response == NULL){
+        perror("otp_d ERROR with malloc");
+        return false;
+    }
+
+    phaseStarted = statsClock();
+    conn->streaming = openOldestCiphertext(&store, conn->user, &conn->reader);
+    if(conn->streaming) countQueued(stats, -1, -(int64_t)conn->reader.remaining);
+    countLatency(stats, PHASE_LOOKUP, phaseStarted);
+
+    conn->responseSize = encodeResponsePrefix(conn->version, conn->streaming ? 's' : 'f', false, 0,
+                                              (unsigned char*)conn->response);
+    conn->responseSent = 0;
+    conn->sendStarted = statsClock();
+    conn->state = WRITE_RESPONSE;
+    return true;
+}
+
+/*******************************************************************************
+ *                               beginStatsResponse                            *
+ * This function starts the response to a stats request, which is sent from   *
+ * the response buffer like any other. It returns false if the connection      *
+ * should be closed.                                                           *
+ ******************************************************************************/
+static bool beginStatsResponse(struct connection* conn){
+    conn->response = malloc(MAX_PREFIX_SIZE + STATS_TEXT_SIZE);
+    if(conn->response == NULL){
+        perror("otp_d ERROR with malloc");
+        return false;
+    }
+
+    conn->responseSize = makeStatsResponse(conn->version, conn->response);
+    conn->responseSent = 0;
+    conn->sendStarted = statsClock();
+    conn->state = WRITE_RESPONSE;
+    return true;
+}
+
+/*******************************************************************************
+ *                                  nextStreamChunk                            *
+ * This function fills the response buffer with the size of the next chunk of  *
+ * a streamed 'get', and the chunk itself is sent from the file after it. Once *
+ * the empty chunk at the end is queued the stream is finished.                *
+ ******************************************************************************/
+static void nextStreamChunk(struct connection* conn){
+    size_t chunkSize = conn->reader.remaining < STREAM_CHUNK_SIZE ? conn->reader.remaining : STREAM_CHUNK_SIZE;
+
+    if(chunkSize == 0) conn->streaming = false;
+    encodeChunkHeader(conn->version, chunkSize, (unsigned char*)conn->response);
+    conn->responseSize = chunkHeaderSize(conn->version);
+    conn->responseSent = 0;
+    conn->fileRemaining = chunkSize;
+}
+
+/*******************************************************************************
+ *                               beginDrainResponse                            *
+ * This function starts the response to a drain. The response buffer holds the *
+ * prefix of one ciphertext at a time, each sent from its file after it, and   *
+ * then the 'f' at the end. It returns false if the connection should be       *
+ * closed.                                                                     *
+ ******************************************************************************/
+static bool beginDrainResponse(struct connection* conn){
+    uint64_t maxCount, maxBytes;        // the drain's limits, 0 for none
+
+    conn->response = malloc(MAX_PREFIX_SIZE);
+    if(conn->response == NULL){
+        perror("otp_d ERROR with malloc");
+        return false;
+    }
+
+    decodeDrainLimits(conn->header, &maxCount, &maxBytes);
+    if(!beginDrain(&store, conn->user, maxCount, maxBytes, &conn->drain)){
+        perror("otp_d ERROR with malloc");
+        return false;
+    }
+    conn->draining = true;
+    conn->sendStarted = statsClock();
+    conn->state = WRITE_RESPONSE;
+    nextDrained(conn);
+    return true;
+}
+
+/*******************************************************************************
+ *                                  nextDrained                                *
+ * This function takes the next ciphertext of a drain and fills the response   *
+ * buffer with its prefix, and the ciphertext itself is sent from the file     *
+ * after it. Once there are no more the buffer holds the 'f', and the drain is *
+ * finished.                                                                   *
+ ******************************************************************************/
+static void nextDrained(struct connection* conn){
+    uint64_t phaseStarted = statsClock(); // when the lookup started
+
+    closeCiphertext(&conn->reader);
+    if(openNextDrained(&store, &conn->drain, &conn->reader)){
+        countQueued(stats, -1, -(int64_t)conn->reader.remaining);
+        conn->responseSize = encodeResponsePrefix(conn->version, 's', true, conn->reader.remaining,
+                                                  (unsigned char*)conn->response);
+        conn->fileRemaining = conn->reader.remaining;
+    }
+    else{
+        conn->responseSize = encodeResponsePrefix(conn->version, 'f', false, 0, (unsigned char*)conn->response);
+        conn->draining = false;
+        endDrain(&conn->drain);
+    }
+    countLatency(stats, PHASE_LOOKUP, phaseStarted);
+    conn->responseSent = 0;
+}
+
+/*******************************************************************************
+ *                                  runRingLoop                                *
+ * This function serves every connection from a single process, like          *
+ * runEventLoop(), but with io_uring. Each connection always has one operation *
+ * in the ring, a receive or a send. With --io-uring=all it can instead be the *
+ * open, write and close of a posted ciphertext's file (or the open, size and  *
+ * removal of one being taken for a get), linked so they go to the kernel      *
+ * together. Every operation queued by a pass through the completions is       *
+ * submitted, and the next completions waited for, in a single                 *
+ * io_uring_enter(). If the kernel has no io_uring, otp_d falls back to        *
+ * runEventLoop(), and if it's too old for the file operations, the files are  *
+ * handled the same way as with --epoll.                                       *
+ ******************************************************************************/
+static void runRingLoop(int listenSocketFD){
+    static struct ring uring;           // the ring, ring points to it once it's ready
+    const unsigned char socketOps[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_POLL_ADD};
+    const unsigned char fileOps[] = {IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE, IORING_OP_STATX,
+                                     IORING_OP_UNLINKAT};
+    struct io_uring_cqe cqe;            // a completion
+    bool multishot = true;              // false if the kernel can't keep one accept going
+    int establishedConnectionFD;
+
+    if(!openRing(&uring, RING_ENTRIES)){
+        fprintf(stderr, "otp_d: io_uring isn't available (%s), using --epoll instead\n", strerror(errno));
+        runEventLoop(listenSocketFD);
+        return;
+    }
+    if(!ringSupports(&uring, socketOps, sizeof(socketOps))){
+        fprintf(stderr, "otp_d: this kernel's io_uring is too old, using --epoll instead\n");
+        closeRing(&uring);
+        runEventLoop(listenSocketFD);
+        return;
+    }
+    ring = &uring;
+
+    // a write has to find the file a linked open put in its slot, which needs IORING_FEAT_LINKED_FILE
+    if(ringFiles && (!ringSupports(ring, fileOps, sizeof(fileOps)) || !(ring->features & IORING_FEAT_LINKED_FILE) ||
+                     !registerRingFiles(ring, RING_FILES))){
+        fprintf(stderr, "otp_d: this kernel's io_uring can't handle the files, using it for sockets only\n");
+        ringFiles = false;
+    }
+    for(int slot = RING_FILES - 1; ringFiles && slot >= 0; slot--){
+        ringSlots[numRingSlots++] = slot;
+    }
+
+    // a client that disconnects early must not kill the whole server
+    signal(SIGPIPE, SIG_IGN);
+    raiseFileLimit();
+
+    if(!submitAccept(listenSocketFD, multishot)) error("otp_d ERROR queueing accept");
+    if(store.syncFD >= 0 && !submitSyncPoll()) error("otp_d ERROR queueing a poll of the syncer");
+    while(true){
+        // a full completion queue refuses new submissions until it's been read
+        if(submitRing(ring, 1) < 0 && errno != EBUSY && errno != EAGAIN){
+            error("otp_d ERROR on io_uring_enter");
+        }
+
+        while(nextCompletion(ring, &cqe)){
+            // the syncer has finished a sync, answer the posts it covered and wait for the next
+            if(cqe.user_data == (uint64_t)(uintptr_t)&syncWaiting){
+                finishSyncs(-1);
+                if(!submitSyncPoll()) error("otp_d ERROR queueing a poll of the syncer");
+                continue;
+            }
+            if(cqe.user_data != 0){
+                completeRingOperation(cqe.user_data, cqe.res);
+                continue;
+            }
+
+            // an accepted connection is served, queued or turned away
+            if(cqe.res >= 0){
+                if(admitConnection(cqe.res, activeConnections)) addRingConnection(cqe.res);
+            }
+            else if(cqe.res == -EINVAL && multishot){
+                multishot = false;
+            }
+            else if(cqe.res != -EAGAIN && cqe.res != -EINTR && cqe.res != -ECONNABORTED){
+                fprintf(stderr, "otp_d ERROR on accept: %s\n", strerror(-cqe.res));
+            }
+            if(!(cqe.flags & IORING_CQE_F_MORE) && !submitAccept(listenSocketFD, multishot)){
+                error("otp_d ERROR queueing accept");
+            }
+        }
+
+        // serve the connections that were waiting for the ones that just closed
+        while((establishedConnectionFD = nextWaiting(activeConnections)) >= 0){
+            addRingConnection(establishedConnectionFD);
+        }
+    }
+}
+
+/*******************************************************************************
+ *                                  submitAccept                               *
+ * This function queues an accept on the listening socket. A multishot accept *
+ * keeps completing for every new connection until the kernel drops it.       *
+ ******************************************************************************/
+static bool submitAccept(int listenSocketFD, bool multishot){
+    struct io_uring_sqe* sqe;
+
+    if(!getRingEntries(ring, &sqe, 1)) return false;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenSocketFD;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    if(multishot) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = 0;
+    return true;
+}
+
+/*******************************************************************************
+ *                                  submitSyncPoll                             *
+ * This function queues a poll of the store's eventfd with group commit, which *
+ * completes once the syncer has finished a sync.                              *
+ ******************************************************************************/
+static bool submitSyncPoll(void){
+    struct io_uring_sqe* sqe;
+
+    if(!getRingEntries(ring, &sqe, 1)) return false;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = store.syncFD;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = (uint64_t)(uintptr_t)&syncWaiting;
+    return true;
+}
+
+/*******************************************************************************
+ *                                  addRingConnection                          *
+ * This function starts serving a connection with --io-uring by queueing its  *
+ * first receive. The connection is closed if it can't be.                     *
+ ******************************************************************************/
+static void addRingConnection(int fd){
+    struct connection* conn;
+
+    conn = openConnection(fd);
+    if(conn == NULL){
+        perror("otp_d ERROR with malloc");
+        close(fd);
+        return;
+    }
+    conn->input = malloc(INPUT_SIZE);
+    if(conn->input == NULL){
+        perror("otp_d ERROR with malloc");
+        closeConnection(conn);
+        return;
+    }
+    if(!pumpConnection(conn)) closeConnection(conn);
+}
+
+/*******************************************************************************
+ *                              completeRingOperation                          *
+ * This function handles the completion of an operation a connection had in   *
+ * the ring. Socket operations move the connection straight on. The linked   *
+ * file operations only do once the last of them is done, and the first of    *
+ * them to fail decides whether they worked. A failed removal doesn't count,  *
+ * the file is out of the index either way. The connection is closed if it's *
+ * finished or something went wrong.                                           *
+ ******************************************************************************/
+static void completeRingOperation(uint64_t userData, int result){
+    struct connection* conn = (struct connection*)(uintptr_t)(userData & ~(uint64_t)RING_STEP_MASK);
+    enum ringStep step = userData & RING_STEP_MASK;
+    bool keepOpen;
+
+    conn->inFlight--;
+    if(step == STEP_RECEIVE || step == STEP_SEND || step == STEP_POLL){
+        keepOpen = finishSocketOperation(conn, step, result) && pumpConnection(conn);
+    }
+    else{
+        // a get's open returns the descriptor, a post's opens straight into its slot
+        if(step == STEP_OPEN && conn->ringSlot < 0 && result >= 0) conn->reader.fd = result;
+        if(step == STEP_FILE && conn->ringSlot >= 0 && result >= 0 && (size_t)result != conn->ciphertextSize + 1){
+            result = -EIO;              // a short write
+        }
+        if(result < 0 && step != STEP_UNLINK && conn->ringError == 0) conn->ringError = -result;
+        if(conn->inFlight > 0) return;
+        keepOpen = finishStorage(conn) && pumpConnection(conn);
+    }
+
+    if(!keepOpen) closeConnection(conn);
+}
+
+/*******************************************************************************
+ *                              finishSocketOperation                          *
+ * This function accounts for a receive, send or poll that completed on a     *
+ * connection's socket. It returns false if the connection should be closed,  *
+ * because of an error or because otp closed it.                               *
+ ******************************************************************************/
+static bool finishSocketOperation(struct connection* conn, enum ringStep step, int result){
+    if(step == STEP_POLL) return result >= 0;
+    if(result <= 0) return false;
+
+    if(step == STEP_SEND){
+        conn->responseSent += result;
+        countBytes(stats, 0, result);
+    }
+    else if(conn->direct){
+        conn->fieldRead += result;
+        countBytes(stats, result, 0);
+    }
+    else{
+        conn->inputEnd += result;
+        countBytes(stats, result, 0);
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                                  pumpConnection                             *
+ * This function moves a --io-uring connection along as far as it can go      *
+ * without waiting, then queues the operation it has to wait for. Fields are   *
+ * filled from the bytes already received, so a small request, or several      *
+ * pipelined ones, only take one receive, and a field too big for the input    *
+ * buffer is received straight into place. A ciphertext being sent back still *
+ * goes out with sendfile(), which io_uring has no operation for, and the ring *
+ * only waits for room on the socket when it's full. It returns false if the  *
+ * connection should be closed, in which case nothing is left in the ring.    *
+ ******************************************************************************/
+static bool pumpConnection(struct connection* conn){
+    size_t length;
+    ssize_t i;
+
+    while(true){
+        if(conn->state == WAIT_STORAGE || conn->state == WAIT_SYNC) return true;
+
+        if(conn->state == WRITE_RESPONSE){
+            if(conn->responseSent < conn->responseSize){
+                // anything still to come after the buffer is sent with it instead of after an ack
+                return queueSocketOperation(conn, STEP_SEND, conn->response + conn->responseSent,
+                                            conn->responseSize - conn->responseSent,
+                                            conn->fileRemaining > 0 || conn->streaming || conn->draining ?
+                                            MSG_MORE : 0);
+            }
+            if(conn->fileRemaining > 0){
+                // a ciphertext that comes up short is cut off, so otp knows it's incomplete
+                i = sendCiphertext(&conn->reader, conn->fd, conn->fileRemaining);
+                if(i == 0) return false;
+                if(i > 0){
+                    conn->fileRemaining -= i;
+                    countBytes(stats, 0, i);
+                    continue;
+                }
+                if(errno == EINTR) continue;
+                if(errno != EAGAIN && errno != EWOULDBLOCK) return false;
+                return queueSocketOperation(conn, STEP_POLL, NULL, 0, POLLOUT);
+            }
+            if(conn->streaming){
+                nextStreamChunk(conn);
+                continue;
+            }
+            if(conn->draining){
+                nextDrained(conn);
+                continue;
+            }
+            countLatency(stats, PHASE_SEND, conn->sendStarted);
+            resetConnection(conn);
+            continue;
+        }
+
+        // a zero length field (an empty username or ciphertext) is complete right away
+        if(conn->fieldRead == conn->fieldSize){
+            if(!finishField(conn)) return false;
+            continue;
+        }
+
+        // fill the field from what has already arrived
+        if(conn->inputStart < conn->inputEnd){
+            length = conn->inputEnd - conn->inputStart;
+            if(length > conn->fieldSize - conn->fieldRead) length = conn->fieldSize - conn->fieldRead;
+            memcpy(conn->field + conn->fieldRead, conn->input + conn->inputStart, length);
+            conn->inputStart += length;
+            conn->fieldRead += length;
+            continue;
+        }
+
+        // receive more, but never past the end of a big field so the next request isn't copied twice
+        conn->inputStart = conn->inputEnd = 0;
+        conn->direct = conn->fieldSize - conn->fieldRead >= INPUT_SIZE;
+        if(conn->direct){
+            return queueSocketOperation(conn, STEP_RECEIVE, conn->field + conn->fieldRead,
+                                        conn->fieldSize - conn->fieldRead, 0);
+        }
+        return queueSocketOperation(conn, STEP_RECEIVE, conn->input, INPUT_SIZE, 0);
+    }
+}
+
+/*******************************************************************************
+ *                              queueSocketOperation                           *
+ * This function queues a receive, send or poll on a connection's socket. For *
+ * a poll, flags are the events to wait for. It returns false if the ring is  *
+ * full.                                                                       *
+ ******************************************************************************/
+static bool queueSocketOperation(struct connection* conn, enum ringStep step, void* buffer, size_t length, int flags){
+    struct io_uring_sqe* sqe;
+
+    if(!getRingEntries(ring, &sqe, 1)){
+        perror("otp_d ERROR queueing socket operation");
+        return false;
+    }
+    sqe->fd = conn->fd;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | step;
+    if(step == STEP_POLL){
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = flags;
+    }
+    else{
+        sqe->opcode = step == STEP_SEND ? IORING_OP_SEND : IORING_OP_RECV;
+        sqe->addr = (uint64_t)(uintptr_t)buffer;
+        sqe->len = length > UINT_MAX ? UINT_MAX : length;
+        sqe->msg_flags = flags | (step == STEP_SEND ? MSG_NOSIGNAL : 0);
+    }
+    conn->inFlight++;
+    return true;
+}
+
+/*******************************************************************************
+ *                                  beginRingStore                             *
+ * This function stores a posted ciphertext through the ring. The file is     *
+ * opened straight into one of the registered slots, written with its newline *
+ * and closed, all linked in one submit, and the close runs even if the write *
+ * fails so the slot is always given back. It returns false if the ciphertext *
+ * is bad or the ring is full.                                                 *
+ ******************************************************************************/
+static bool beginRingStore(struct connection* conn){
+    struct io_uring_sqe* sqes[3];       // the open, write and close
+    uint64_t tag = (uint64_t)(uintptr_t)conn;
+
+    if(!reserveCiphertextFile(&store, conn->user, conn->ciphertext, conn->ciphertextSize, postEncoding(conn->flags),
+                              &conn->seq, conn->filename, sizeof(conn->filename))){
+        perror("otp_d ERROR storing ciphertext");
+        return false;
+    }
+    if(!getRingEntries(ring, sqes, 3)){
+        perror("otp_d ERROR queueing file operations");
+        return false;
+    }
+    conn->ringSlot = ringSlots[--numRingSlots];
+    conn->ciphertext[conn->ciphertextSize] = '\n';  // the file ends with a newline
+
+    sqes[0]->opcode = IORING_OP_OPENAT;
+    sqes[0]->fd = AT_FDCWD;
+    sqes[0]->addr = (uint64_t)(uintptr_t)conn->filename;
+    sqes[0]->len = 0666;
+    sqes[0]->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    sqes[0]->file_index = conn->ringSlot + 1;
+    sqes[0]->flags = IOSQE_IO_LINK;
+    sqes[0]->user_data = tag | STEP_OPEN;
+
+    sqes[1]->opcode = IORING_OP_WRITE;
+    sqes[1]->fd = conn->ringSlot;
+    sqes[1]->addr = (uint64_t)(uintptr_t)conn->ciphertext;
+    sqes[1]->len = conn->ciphertextSize + 1;
+    sqes[1]->off = 0;
+    sqes[1]->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    sqes[1]->user_data = tag | STEP_FILE;
+
+    sqes[2]->opcode = IORING_OP_CLOSE;
+    sqes[2]->file_index = conn->ringSlot + 1;
+    sqes[2]->user_data = tag | STEP_CLOSE;
+
+    conn->inFlight += 3;
+    conn->ringError = 0;
+    conn->phaseStarted = statsClock();
+    conn->state = WAIT_STORAGE;
+    return true;
+}
+
+/*******************************************************************************
+ *                                  beginRingLookup                            *
+ * This function takes the user's oldest ciphertext file out of the index and *
+ * has the ring open it, find its size and remove it, linked in one submit.   *
+ * If the user has none, the 'f' response is started instead. It returns     *
+ * false if the connection should be closed.                                   *
+ ******************************************************************************/
+static bool beginRingLookup(struct connection* conn){
+    struct io_uring_sqe* sqes[3];       // the open, statx and unlink
+    uint64_t tag = (uint64_t)(uintptr_t)conn;
+
+    // this is called again if a file couldn't be opened, the lookup is timed from the first try
+    if(conn->response == NULL){
+        conn->response = malloc(MAX_PREFIX_SIZE);
+        if(conn->response == NULL){
+            perror("otp_d ERROR with malloc");
+            return false;
+        }
+        conn->phaseStarted = statsClock();
+    }
+
+    if(!takeOldestCiphertextFile(&store, conn->user, conn->filename, sizeof(conn->filename))){
+        return respondToRingGet(conn, false);
+    }
+    if(!getRingEntries(ring, sqes, 3)){
+        perror("otp_d ERROR queueing file operations");
+        return false;
+    }
+
+    sqes[0]->opcode = IORING_OP_OPENAT;
+    sqes[0]->fd = AT_FDCWD;
+    sqes[0]->addr = (uint64_t)(uintptr_t)conn->filename;
+    sqes[0]->open_flags = O_RDONLY;
+    sqes[0]->flags = IOSQE_IO_LINK;
+    sqes[0]->user_data = tag | STEP_OPEN;
+
+    sqes[1]->opcode = IORING_OP_STATX;
+    sqes[1]->fd = AT_FDCWD;
+    sqes[1]->addr = (uint64_t)(uintptr_t)conn->filename;
+    sqes[1]->len = STATX_SIZE;
+    sqes[1]->off = (uint64_t)(uintptr_t)&conn->fileInfo;
+    sqes[1]->flags = IOSQE_IO_LINK;
+    sqes[1]->user_data = tag | STEP_FILE;
+
+    // the descriptor can still be read after the file is removed, it's only for one-time use
+    sqes[2]->opcode = IORING_OP_UNLINKAT;
+    sqes[2]->fd = AT_FDCWD;
+    sqes[2]->addr = (uint64_t)(uintptr_t)conn->filename;
+    sqes[2]->user_data = tag | STEP_UNLINK;
+
+    conn->inFlight += 3;
+    conn->ringError = 0;
+    conn->state = WAIT_STORAGE;
+    return true;
+}
+
+/*******************************************************************************
+ *                                  finishStorage                              *
+ * This function is called once the ring has finished with a ciphertext file. *
+ * A post's file joins the user's queue, or is removed if it wasn't written.  *
+ * A get's file is sent back, or if it couldn't be opened the user's next one *
+ * is tried, the same as openOldestCiphertext() does. It returns false if the *
+ * connection should be closed.                                                *
+ ******************************************************************************/
+static bool finishStorage(struct connection* conn){
+    unsigned long long ticket = 0;      // what to wait for before the post is on disk
+
+    if(conn->ringSlot >= 0){
+        ringSlots[numRingSlots++] = conn->ringSlot;
+        conn->ringSlot = -1;
+        if(conn->ringError == 0 && !addCiphertextFile(&store, conn->user, conn->seq, conn->filename, &ticket)){
+            conn->ringError = ENOMEM;
+        }
+        if(conn->ringError != 0){
+            errno = conn->ringError;
+            perror("otp_d ERROR storing ciphertext");
+            remove(conn->filename);
+            return false;
+        }
+        countLatency(stats, PHASE_STORE, conn->phaseStarted);
+        countQueued(stats, 1, conn->ciphertextSize);
+        return completePost(conn, conn->filename, ticket);
+    }
+
+    // the newline at the end of the file isn't part of the ciphertext
+    if(conn->ringError == 0 && conn->fileInfo.stx_size >= 1){
+        conn->reader.offset = 0;
+        conn->reader.remaining = conn->fileInfo.stx_size - 1;
+        return respondToRingGet(conn, true);
+    }
+    closeCiphertext(&conn->reader);
+    return beginRingLookup(conn);
+}
+
+/*******************************************************************************
+ *                                  respondToRingGet                           *
+ * This function starts the response to a get or streamed get once the ring   *
+ * has opened the ciphertext, or found there isn't one. Either way it's sent  *
+ * the same as with --epoll.                                                   *
+ ******************************************************************************/
+static bool respondToRingGet(struct connection* conn, bool found){
+    countLatency(stats, PHASE_LOOKUP, conn->phaseStarted);
+    if(found) countQueued(stats, -1, -(int64_t)conn->reader.remaining);
+
+    if(conn->mode == MODE_STREAM_GET){
+        conn->streaming = found;
+        conn->responseSize = encodeResponsePrefix(conn->version, found ? 's' : 'f', false, 0,
+                                                  (unsigned char*)conn->response);
+    }
+    else if(found){
+        conn->responseSize = encodeResponsePrefix(conn->version, 's', true, conn->reader.remaining,
+                                                  (unsigned char*)conn->response);
+        conn->fileRemaining = conn->reader.remaining;
+    }
+    else{
+        conn->responseSize = encodeResponsePrefix(conn->version, 'f', false, 0, (unsigned char*)conn->response);
+    }
+    conn->responseSent = 0;
+    conn->sendStarted = statsClock();
+    conn->state = WRITE_RESPONSE;
+    return true;
+}
+
+/*******************************************************************************
+ *                                  sendAll                                    *
+ * This function makes sure all of the data in a buffer is sent. If the        *
+ * connection is interrupted, send() will be called again until all the data is*
+ * sent, in which case 'true' is returned. The flags are passed to send(), so  *
+ * MSG_MORE can hold a small header back until the data after it is sent.      *
+ * Adapted from:                                                               *
+ * https://stackoverflow.com/questions/13479760/c-socket-recv-and-send-all-data
+ ******************************************************************************/
+static bool sendAll(int socket, void* buffer, size_t length, int flags){
+    char* ptr = (char*)buffer;  // initialize a pointer to the start of the buffer
+
+    // once length is 0, all of the data from the buffer has been sent
+    while(length > 0){
+        ssize_t i = send(socket, ptr, length, flags);
+        if(i < 1){
+            return false;
+        }
+        countBytes(stats, 0, i);
+        ptr += i;               // move pointer ahead by the number of bytes sent
+        length -= i;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                                sendCiphertextAll                            *
+ * This function sends the next size characters of a ciphertext from the      *
+ * store straight to a socket, calling sendCiphertext() again after a partial  *
+ * send or an interruption. It returns false if they couldn't all be sent.    *
+ ******************************************************************************/
+static bool sendCiphertextAll(int socket, struct ciphertextReader* reader, size_t size){
+    while(size > 0){
+        ssize_t i = sendCiphertext(reader, socket, size);
+        if(i < 0 && errno == EINTR) continue;
+        if(i < 1){
+            return false;
+        }
+        countBytes(stats, 0, i);
+        size -= i;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                                  recvCounted                                *
+ * This function receives all of length like recvAll() in otp_protocol.c,      *
+ * counting the bytes as they arrive so the stats include partial requests.    *
+ ******************************************************************************/
+static bool recvCounted(int socket, void* buffer, size_t length){
+    char* ptr = (char*)buffer;  // initialize a pointer to the start of the buffer
+
+    // once length is 0, all of the data from the buffer has been received
+    while(length > 0){
+        ssize_t i = recv(socket, ptr, length, 0);
+        if(i < 1){
+            return false;
+        }
+        countBytes(stats, i, 0);
+        ptr += i;               // move pointer ahead by the number of bytes received
+        length -= i;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                                  catchSIGCHLD                               *
+ * This function catches SIGCHLD signals and waits for the terminated child    *
+ * processes in order to reap these zombies. It also importantly decrements    *
+ * the number of child processes currently running which is important for      *
+ * allowing 5 concurrent child processes to run at any given time.             *
+ ******************************************************************************/
+static void catchSIGCHLD(int signo){
+    int status;
+
+    // continue waiting for child processes not yet terminated as long as waitpid is returning
+    // a value > 0 (which would be a child pid), this is in case another child process
+    // terminates while we're in the sig handler, use WNOHANG so we're not blocking
+    while(waitpid(-1, &status, WNOHANG) > 0){
+        // decrement the number of child processes running once we've waited for a terminated one
+        numChildPids--;
+        countConnection(stats, -1);
+    }
+}
@@ -0,0 +1,52 @@
+/*******************************************************************************
+** Program name: otp_server.h
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  Declarations for running the otp_d server from any program
+**               linked with libotp. otp_d itself only turns its command line
+**               into a serverOptions and calls runServer(), so every option it
+**               takes has a field here with the same meaning.
+*******************************************************************************/
+#ifndef OTP_SERVER_H
+#define OTP_SERVER_H
+
+#include <stdbool.h>
+#include "otp_store.h"
+
+#define MAX_THREADS 1024                // the most worker threads SERVER_THREADS can start
+#define DEFAULT_QUEUE 64                // the most connections that wait for a slot, unless told otherwise
+#define DEFAULT_RETRY_AFTER 1000        // the milliseconds a busy client is told to wait, unless told otherwise
+#define DEFAULT_WRITE_BEHIND 5000       // the milliseconds a cached post waits to be written, unless told otherwise
+
+// how the server serves its connections
+enum serverMode {
+    SERVER_FORK,                        // a forked child per connection, the default
+    SERVER_EPOLL,                       // one process with an epoll event loop (--epoll)
+    SERVER_URING,                       // one process with an io_uring event loop (--io-uring)
+    SERVER_THREADS                      // a pool of worker threads (--threads)
+};
+
+// everything a server can be told when it starts
+struct serverOptions {
+    enum serverMode mode;               // how connections are served
+    bool ringFiles;                     // with SERVER_URING, store and take files through the ring too
+    unsigned int numThreads;            // the worker threads with SERVER_THREADS, 1 to MAX_THREADS
+    enum storeBackend backend;          // how ciphertexts are kept on disk
+    const char* dataDir;                // where ciphertexts are kept, NULL for the current directory
+    enum durability durability;         // how sure a post is to be on disk before it's answered
+    long groupWindow;                   // microseconds the syncer waits for more posts with DURABILITY_GROUP
+    size_t cacheSize;                   // the most bytes of recent posts kept in memory, 0 for no cache
+    long writeBehind;                   // milliseconds a cached post waits before it's written to disk
+    long maxConnections;                // the most connections served at once, 0 for no limit,
+                                        // -1 for 5 with SERVER_FORK and no limit otherwise
+    long queueSize;                     // the most connections that wait for a slot
+    long retryAfter;                    // the milliseconds a client turned away is told to wait
+    int portNumber;                     // the port to listen on
+};
+
+// function prototypes:
+void initServerOptions(struct serverOptions* options, int portNumber);
+bool runServer(const struct serverOptions* options);
+
+#endif
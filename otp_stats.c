@@ -0,0 +1,301 @@
+/*******************************************************************************
+** Program name: otp_stats.c
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  Functions for the live counters kept by otp_d, see otp_stats.h.
+**               The counters are only ever added to with relaxed atomics, and a
+**               snapshot just reads them, so counting costs a few instructions per
+**               request and a snapshot costs the same however busy otp_d is. A
+**               snapshot can be a request or two out of step between counters,
+**               which doesn't matter for numbers that are scraped every second.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "otp_protocol.h"
+#include "otp_stats.h"
+#include "otp_store.h"
+
+// the names of the kinds of request and the phases, in the order of their enums
+static const char* requestNames[NUM_STATS_REQUESTS] = {"post", "get", "stream_post", "stream_get", "stats", "drain"};
+static const char* phaseNames[NUM_STATS_PHASES] = {"receive", "store", "sync", "lookup", "send", "total"};
+
+// function prototypes:
+static int requestKind(char mode);
+static unsigned int latencyBucket(uint64_t micros);
+static uint64_t percentile(const uint64_t buckets[LATENCY_BUCKETS], uint64_t count, unsigned int percent);
+static void appendLine(char* buffer, size_t bufferSize, size_t* used, const char* format, ...);
+
+/*******************************************************************************
+ *                                  openStats                                  *
+ * This function makes a zeroed set of counters in memory that's shared with  *
+ * any process forked after it, starting the queued counts at what the store  *
+ * already holds. It returns NULL if the memory couldn't be mapped.           *
+ ******************************************************************************/
+struct serverStats* openStats(const char* storeName, uint64_t queuedMessages, uint64_t queuedBytes){
+    struct serverStats* stats;
+
+    stats = mmap(NULL, sizeof(struct serverStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(stats == MAP_FAILED) return NULL;
+
+    // the mapping is already zeroed, so only the counters that don't start at 0 are set
+    stats->started = statsClock() / 1000000;
+    stats->storeName = storeName;
+    stats->queuedMessages = queuedMessages;
+    stats->queuedBytes = queuedBytes;
+    return stats;
+}
+
+/*******************************************************************************
+ *                                  statsClock                                 *
+ * This function returns the time in microseconds on a clock that never goes  *
+ * backwards, which is what every latency is measured with.                    *
+ ******************************************************************************/
+uint64_t statsClock(void){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*******************************************************************************
+ *                                  countRequest                               *
+ * This function counts a request once it's finished, along with how long it   *
+ * took if it succeeded. A request with a mode otp_d doesn't know is only      *
+ * counted as a failure.                                                       *
+ ******************************************************************************/
+void countRequest(struct serverStats* stats, char mode, uint64_t started, bool success){
+    int kind = requestKind(mode);
+
+    if(kind >= 0) __atomic_fetch_add(&stats->requests[kind], 1, __ATOMIC_RELAXED);
+    if(!success){
+        __atomic_fetch_add(&stats->failures, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    countLatency(stats, PHASE_TOTAL, started);
+}
+
+/*******************************************************************************
+ *                                  countLatency                               *
+ * This function counts the time since started against one phase, in this     *
+ * second's buckets. The first count in a new second takes over the slot the  *
+ * ring had for STATS_WINDOW seconds ago and empties it. A count made by       *
+ * another thread while the slot is being emptied can be lost, which is a fair *
+ * trade for never taking a lock.                                              *
+ ******************************************************************************/
+void countLatency(struct serverStats* stats, enum statsPhase phase, uint64_t started){
+    uint64_t now = statsClock();
+    int64_t second = now / 1000000;
+    struct latencySecond* slot = &stats->window[second % STATS_WINDOW];
+    int64_t seen = __atomic_load_n(&slot->second, __ATOMIC_ACQUIRE);
+
+    if(seen != second &&
+       __atomic_compare_exchange_n(&slot->second, &seen, second, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+        for(int p = 0; p < NUM_STATS_PHASES; p++){
+            for(int b = 0; b < LATENCY_BUCKETS; b++){
+                __atomic_store_n(&slot->buckets[p][b], 0, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    __atomic_fetch_add(&slot->buckets[phase][latencyBucket(now > started ? now - started : 0)], 1,
+                       __ATOMIC_RELAXED);
+}
+
+/*******************************************************************************
+ *                                  countBytes                                 *
+ * This function counts bytes read from and sent to clients.                   *
+ ******************************************************************************/
+void countBytes(struct serverStats* stats, uint64_t bytesIn, uint64_t bytesOut){
+    if(bytesIn > 0) __atomic_fetch_add(&stats->bytesIn, bytesIn, __ATOMIC_RELAXED);
+    if(bytesOut > 0) __atomic_fetch_add(&stats->bytesOut, bytesOut, __ATOMIC_RELAXED);
+}
+
+/*******************************************************************************
+ *                                  countConnection                            *
+ * This function counts a connection being opened (change is 1) or closed      *
+ * (change is -1). It only uses lock-free atomics, so it's safe to call from a *
+ * signal handler.                                                             *
+ ******************************************************************************/
+void countConnection(struct serverStats* stats, int change){
+    if(change > 0) __atomic_fetch_add(&stats->connectionsAccepted, change, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->connectionsActive, change, __ATOMIC_RELAXED);
+}
+
+/*******************************************************************************
+ *                                  countWaiting                               *
+ * This function counts a connection starting (change is 1) or finishing       *
+ * (change is -1) a wait for a slot when otp_d is at its limit.                *
+ ******************************************************************************/
+void countWaiting(struct serverStats* stats, int change){
+    __atomic_fetch_add(&stats->connectionsWaiting, change, __ATOMIC_RELAXED);
+}
+
+/*******************************************************************************
+ *                                  countRejected                              *
+ * This function counts a connection that was turned away as busy.             *
+ ******************************************************************************/
+void countRejected(struct serverStats* stats){
+    __atomic_fetch_add(&stats->connectionsRejected, 1, __ATOMIC_RELAXED);
+}
+
+/*******************************************************************************
+ *                                  countQueued                                *
+ * This function counts ciphertexts being added to the store (positive) or     *
+ * taken out of it (negative).                                                 *
+ ******************************************************************************/
+void countQueued(struct serverStats* stats, int64_t messages, int64_t bytes){
+    __atomic_fetch_add(&stats->queuedMessages, messages, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->queuedBytes, bytes, __ATOMIC_RELAXED);
+}
+
+/*******************************************************************************
+ *                                  formatStats                                *
+ * This function writes a snapshot of the counters into buffer as text, one    *
+ * "name value" per line, and returns its size. The latency percentiles are    *
+ * the upper bound of the bucket they fall in, so they're never understated,   *
+ * and never overstated by more than a factor of 2. Each phase's buckets for   *
+ * the last STATS_WINDOW seconds are added up first.                           *
+ ******************************************************************************/
+size_t formatStats(struct serverStats* stats, char* buffer, size_t bufferSize){
+    uint64_t buckets[NUM_STATS_PHASES][LATENCY_BUCKETS]; // the window's buckets added together
+    uint64_t count;                     // the number of latencies counted for a phase
+    int64_t now = statsClock() / 1000000;
+    int64_t second;                     // the second a slot of the ring is for
+    size_t used = 0;                    // how much of buffer has been written
+    int b;
+
+    appendLine(buffer, bufferSize, &used, "uptime_seconds %lld\n", (long long)(now - stats->started));
+    appendLine(buffer, bufferSize, &used, "connections_accepted %llu\n",
+               (unsigned long long)__atomic_load_n(&stats->connectionsAccepted, __ATOMIC_RELAXED));
+    appendLine(buffer, bufferSize, &used, "connections_active %lld\n",
+               (long long)__atomic_load_n(&stats->connectionsActive, __ATOMIC_RELAXED));
+    appendLine(buffer, bufferSize, &used, "connections_waiting %lld\n",
+               (long long)__atomic_load_n(&stats->connectionsWaiting, __ATOMIC_RELAXED));
+    appendLine(buffer, bufferSize, &used, "connections_rejected %llu\n",
+               (unsigned long long)__atomic_load_n(&stats->connectionsRejected, __ATOMIC_RELAXED));
+    for(int r = 0; r < NUM_STATS_REQUESTS; r++){
+        appendLine(buffer, bufferSize, &used, "requests_%s %llu\n", requestNames[r],
+                   (unsigned long long)__atomic_load_n(&stats->requests[r], __ATOMIC_RELAXED));
+    }
+    appendLine(buffer, bufferSize, &used, "requests_failed %llu\n",
+               (unsigned long long)__atomic_load_n(&stats->failures, __ATOMIC_RELAXED));
+    appendLine(buffer, bufferSize, &used, "bytes_in %llu\n",
+               (unsigned long long)__atomic_load_n(&stats->bytesIn, __ATOMIC_RELAXED));
+    appendLine(buffer, bufferSize, &used, "bytes_out %llu\n",
+               (unsigned long long)__atomic_load_n(&stats->bytesOut, __ATOMIC_RELAXED));
+    appendLine(buffer, bufferSize, &used, "store_%s_messages %lld\n", stats->storeName,
+               (long long)__atomic_load_n(&stats->queuedMessages, __ATOMIC_RELAXED));
+    appendLine(buffer, bufferSize, &used, "store_%s_bytes %lld\n", stats->storeName,
+               (long long)__atomic_load_n(&stats->queuedBytes, __ATOMIC_RELAXED));
+
+    // add up the slots of the ring that are still inside the window
+    memset(buckets, 0, sizeof(buckets));
+    for(int s = 0; s < STATS_WINDOW; s++){
+        second = __atomic_load_n(&stats->window[s].second, __ATOMIC_ACQUIRE);
+        if(second <= now - STATS_WINDOW || second > now) continue;
+        for(int p = 0; p < NUM_STATS_PHASES; p++){
+            for(b = 0; b < LATENCY_BUCKETS; b++){
+                buckets[p][b] += __atomic_load_n(&stats->window[s].buckets[p][b], __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    for(int p = 0; p < NUM_STATS_PHASES; p++){
+        count = 0;
+        for(b = 0; b < LATENCY_BUCKETS; b++) count += buckets[p][b];
+        for(b = LATENCY_BUCKETS - 1; b > 0 && buckets[p][b] == 0; b--);
+
+        appendLine(buffer, bufferSize, &used, "latency_%s_count %llu\n", phaseNames[p], (unsigned long long)count);
+        appendLine(buffer, bufferSize, &used, "latency_%s_p50_us %llu\n", phaseNames[p],
+                   (unsigned long long)percentile(buckets[p], count, 50));
+        appendLine(buffer, bufferSize, &used, "latency_%s_p90_us %llu\n", phaseNames[p],
+                   (unsigned long long)percentile(buckets[p], count, 90));
+        appendLine(buffer, bufferSize, &used, "latency_%s_p99_us %llu\n", phaseNames[p],
+                   (unsigned long long)percentile(buckets[p], count, 99));
+        appendLine(buffer, bufferSize, &used, "latency_%s_max_us %llu\n", phaseNames[p], count > 0 ? 1ULL << b : 0ULL);
+    }
+    return used;
+}
+
+/*******************************************************************************
+ *                                  formatCacheStats                           *
+ * This function writes the cache's counters into buffer as text, in the same  *
+ * form as formatStats(), and returns its size.                                *
+ ******************************************************************************/
+size_t formatCacheStats(const struct cacheCounters* cache, char* buffer, size_t bufferSize){
+    size_t used = 0;                    // how much of buffer has been written
+
+    appendLine(buffer, bufferSize, &used, "cache_messages %llu\n", (unsigned long long)cache->messages);
+    appendLine(buffer, bufferSize, &used, "cache_bytes %llu\n", (unsigned long long)cache->bytes);
+    appendLine(buffer, bufferSize, &used, "cache_hits %llu\n", (unsigned long long)cache->hits);
+    appendLine(buffer, bufferSize, &used, "cache_misses %llu\n", (unsigned long long)cache->misses);
+    appendLine(buffer, bufferSize, &used, "cache_written_behind %llu\n", (unsigned long long)cache->writtenBehind);
+    appendLine(buffer, bufferSize, &used, "cache_evicted %llu\n", (unsigned long long)cache->evicted);
+    return used;
+}
+
+/*******************************************************************************
+ *                                  requestKind                                *
+ * This function returns the statsRequest counted for a mode, or -1 if otp_d  *
+ * doesn't know the mode.                                                      *
+ ******************************************************************************/
+static int requestKind(char mode){
+    switch(mode){
+        case MODE_POST: return STATS_POST;
+        case MODE_GET: return STATS_GET;
+        case MODE_STREAM_POST: return STATS_STREAM_POST;
+        case MODE_STREAM_GET: return STATS_STREAM_GET;
+        case MODE_STATS: return STATS_STATS;
+        case MODE_DRAIN: return STATS_DRAIN;
+        default: return -1;
+    }
+}
+
+/*******************************************************************************
+ *                                  latencyBucket                              *
+ * This function returns the bucket a latency is counted in, the smallest b    *
+ * for which it's under 2^b microseconds.                                      *
+ ******************************************************************************/
+static unsigned int latencyBucket(uint64_t micros){
+    unsigned int b = 0;
+
+    while(b < LATENCY_BUCKETS - 1 && micros >= (1ULL << b)) b++;
+    return b;
+}
+
+/*******************************************************************************
+ *                                  percentile                                 *
+ * This function returns the upper bound of the bucket that the given percent  *
+ * of count latencies fall at or under, or 0 if nothing was counted.           *
+ ******************************************************************************/
+static uint64_t percentile(const uint64_t buckets[LATENCY_BUCKETS], uint64_t count, unsigned int percent){
+    uint64_t wanted = (count * percent + 99) / 100;    // rounded up so p99 of a few requests is the slowest
+    uint64_t seen = 0;
+
+    if(count == 0) return 0;
+    for(unsigned int b = 0; b < LATENCY_BUCKETS; b++){
+        seen += buckets[b];
+        if(seen >= wanted) return 1ULL << b;
+    }
+    return 1ULL << (LATENCY_BUCKETS - 1);
+}
+
+/*******************************************************************************
+ *                                  appendLine                                 *
+ * This function adds a line of a snapshot to the end of buffer. A line that   *
+ * doesn't fit is left out rather than cut short.                              *
+ ******************************************************************************/
+static void appendLine(char* buffer, size_t bufferSize, size_t* used, const char* format, ...){
+    va_list args;
+    int size;
+
+    va_start(args, format);
+    size = vsnprintf(buffer + *used, bufferSize - *used, format, args);
+    va_end(args);
+    if(size >= 0 && (size_t)size < bufferSize - *used) *used += size;
+    else buffer[*used] = '\0';
+}
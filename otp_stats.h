@@ -0,0 +1,92 @@
+/*******************************************************************************
+** Program name: otp_stats.h
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  Declarations for the live counters otp_d keeps about itself,
+**               which a stats request (mode 'S', see otp_protocol.h) returns as
+**               text. Every counter is updated with an atomic add, so the forked
+**               children, the worker threads and the event loop can all count
+**               without a lock, and the counters live in shared memory so the
+**               forked children count into the same ones as the parent.
+**
+**               Latencies are counted in power of 2 buckets of microseconds, one
+**               set of buckets per phase of a request for each of the last
+**               STATS_WINDOW seconds, so the percentiles cover a rolling window
+**               and a snapshot never has to sort anything.
+**
+**               The store's cache keeps its own counters under the store's lock
+**               (see otp_store.h), which are added to a snapshot when it's on.
+*******************************************************************************/
+#ifndef OTP_STATS_H
+#define OTP_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define STATS_WINDOW 60                 // the seconds of latencies the percentiles cover
+#define LATENCY_BUCKETS 32              // bucket b counts latencies under 2^b microseconds
+#define STATS_TEXT_SIZE 4096            // big enough for every line of a snapshot
+
+struct cacheCounters;
+
+// the kinds of request that are counted
+enum statsRequest {
+    STATS_POST,                         // 'p'
+    STATS_GET,                          // 'g'
+    STATS_STREAM_POST,                  // 'P'
+    STATS_STREAM_GET,                   // 'G'
+    STATS_STATS,                        // 'S'
+    STATS_DRAIN,                        // 'D'
+    NUM_STATS_REQUESTS
+};
+
+// the phases of a request that are timed
+enum statsPhase {
+    PHASE_RECEIVE,                      // from the header to the end of the request
+    PHASE_STORE,                        // storing a posted ciphertext
+    PHASE_SYNC,                         // waiting for a stored post to be synced to disk
+    PHASE_LOOKUP,                       // finding and opening a user's oldest ciphertext
+    PHASE_SEND,                         // from the first byte of a response to the last
+    PHASE_TOTAL,                        // the whole request
+    NUM_STATS_PHASES
+};
+
+// the latencies counted during one second
+struct latencySecond {
+    int64_t second;                     // the second the buckets are for
+    uint64_t buckets[NUM_STATS_PHASES][LATENCY_BUCKETS];
+};
+
+// everything otp_d counts, shared by every process and thread of the server
+struct serverStats {
+    int64_t started;                    // the second otp_d started
+    const char* storeName;              // the backend the queued counts are for
+    uint64_t requests[NUM_STATS_REQUESTS]; // every request received, by kind
+    uint64_t failures;                  // requests that ended with an error
+    uint64_t bytesIn;                   // bytes read from clients
+    uint64_t bytesOut;                  // bytes sent to clients
+    uint64_t connectionsAccepted;       // every connection ever accepted
+    int64_t connectionsActive;          // connections that are being served now
+    int64_t connectionsWaiting;         // connections accepted but waiting for a slot
+    uint64_t connectionsRejected;       // connections turned away because otp_d was busy
+    int64_t queuedMessages;             // ciphertexts in the store waiting for a 'get'
+    int64_t queuedBytes;                // the size of those ciphertexts
+    struct latencySecond window[STATS_WINDOW]; // a ring of the last STATS_WINDOW seconds
+};
+
+// function prototypes:
+struct serverStats* openStats(const char* storeName, uint64_t queuedMessages, uint64_t queuedBytes);
+uint64_t statsClock(void);
+void countRequest(struct serverStats* stats, char mode, uint64_t started, bool success);
+void countLatency(struct serverStats* stats, enum statsPhase phase, uint64_t started);
+void countBytes(struct serverStats* stats, uint64_t bytesIn, uint64_t bytesOut);
+void countConnection(struct serverStats* stats, int change);
+void countWaiting(struct serverStats* stats, int change);
+void countRejected(struct serverStats* stats);
+void countQueued(struct serverStats* stats, int64_t messages, int64_t bytes);
+size_t formatStats(struct serverStats* stats, char* buffer, size_t bufferSize);
+size_t formatCacheStats(const struct cacheCounters* cache, char* buffer, size_t bufferSize);
+
+#endif
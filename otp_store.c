@@ -0,0 +1,1974 @@
+/*******************************************************************************
+** Program name: otp_store.c
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  This file stores and retrieves ciphertexts for otp_d. Each
+**               ciphertext is written followed by a newline to its own file,
+**               named "cipher" and a number, in a directory of its own for each
+**               user. The user directories are spread over 256 shard
+**               directories by a hash of the username:
+**                    <shard>/<user>/cipher<number>
+**               so listing a user's files costs the same no matter how many
+**               other users there are. A username of up to 128 ordinary
+**               characters is its own directory name, with any other byte
+**               escaped as %XX. A longer one gets a directory named with its
+**               hash, whose .user file holds the whole username to tell apart
+**               two users whose hashes match. When
+**               otp_d passes in an index, posts are given a sequence number
+**               and added to the back of the user's queue, and gets take the
+**               front of the queue, so a get costs the same no matter how many
+**               files are stored. The index is rebuilt once from the user
+**               directories when otp_d starts. Without an index, the user's
+**               directory is searched for their oldest file. Files left in
+**               the old flat layout, user@cipher<number>, are moved into place
+**               when the store is opened.
+**               The segment backend (otp_segment.c) shares the same index but
+**               keeps the ciphertexts in append-only segment files instead.
+**               With --durability=fsync each new file and the directory it went
+**               into are synced before a post is answered. With
+**               --durability=group a syncer thread syncs every post stored
+**               since its last sync with a single syncfs() (or fdatasync() of
+**               the active segment), so a burst of posts costs one trip to the
+**               disk instead of one each.
+**               With a cache (otp_d --cache-size), posts are queued in memory
+**               first and a writer thread writes each one to its file or
+**               segment once its write-behind delay is up, keeping the sequence
+**               number and (for a file) the time it was posted, so a restart
+**               queues it where it would have been.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "otp_cipher.h"
+#include "otp_store.h"
+
+#define NUM_SHARDS 256                  // the number of shard directories users are spread over
+#define USER_NAME_MAX 128               // the longest escaped username used as a directory name
+#define WRITE_RETRY_DELAY 1000000       // microseconds before a cached post that couldn't be written is retried
+
+// a ciphertext file found while rebuilding the index
+struct foundFile {
+    char* user;                         // the user the file belongs to
+    char* filename;                     // the name of the file
+    struct timespec modified;           // when the file was last modified
+    unsigned long long number;          // the number in the filename
+};
+
+// every ciphertext file found while rebuilding the index
+struct foundFiles {
+    struct foundFile* files;            // the files
+    size_t count;                       // the number of files
+    size_t capacity;                    // the number of files there's room for
+    unsigned long long nextSeq;         // one past the highest number in a filename
+};
+
+// the ciphertext files counted while measuring the store
+struct storeSize {
+    uint64_t messages;                  // the number of files
+    uint64_t bytes;                     // the size of the ciphertexts in them
+};
+
+// called with each ciphertext file found by scanCiphertextFiles(), returns false to stop
+typedef bool (*fileVisitor)(const char* user, const char* path, const struct stat* fileInfo,
+                            unsigned long long number, void* arg);
+
+// function prototypes:
+static bool rebuildFileIndex(struct messageIndex* index);
+static void freeIndex(struct messageIndex* index);
+static struct userQueue* findQueue(struct messageIndex* index, const char* user, bool create);
+static unsigned long hashUser(const char* user);
+static bool growIndex(struct messageIndex* index);
+static void removeQueue(struct messageIndex* index, struct userQueue* queue);
+static int compareFoundFiles(const void* a, const void* b);
+static bool collectFoundFile(const char* user, const char* path, const struct stat* fileInfo,
+                             unsigned long long number, void* arg);
+static bool countStoredFile(const char* user, const char* path, const struct stat* fileInfo,
+                            unsigned long long number, void* arg);
+static bool scanCiphertextFiles(fileVisitor visit, void* arg);
+static bool scanUserDirectory(const char* directory, const char* user, fileVisitor visit, void* arg);
+static FILE* createCiphertextFile(const char* user, const char* name, char* location, size_t locationSize);
+static bool moveCiphertextFile(const char* from, const char* user, const char* name,
+                               char* location, size_t locationSize);
+static bool ciphertextLocation(const char* user, bool create, const char* name, char* location, size_t locationSize);
+static bool userDirectory(const char* user, bool create, char* directory, size_t directorySize);
+static bool escapeUser(const char* user, char* name, size_t nameSize);
+static char* unescapeUser(const char* name);
+static bool makeUserDirectory(const char* directory);
+static char* readUserFile(const char* directory);
+static bool claimUserDirectory(const char* directory, const char* user);
+static bool parseCiphertextName(const char* name, unsigned long long* number);
+static bool parseFlatFilename(const char* filename, char** user, unsigned long long* number);
+static void migrateFlatFiles(void);
+static bool validCiphertext(const char* ciphertext, size_t ciphertextSize, enum ciphertextEncoding encoding);
+static bool validSpooled(struct ciphertextWriter* writer);
+static struct storedMessage* popMessage(struct messageIndex* index, const char* user);
+static bool findOldestFile(const char* user, char* oldestFile, size_t oldestFileSize);
+static bool openCiphertextFile(const char* filename, struct ciphertextReader* reader);
+static void removeSpoolFiles(void);
+static bool closeCiphertextFile(struct store* store, FILE* file, const char* location);
+static bool syncParent(const char* path);
+static bool syncActiveSegment(struct store* store);
+static unsigned long long addTicket(struct store* store);
+static void* runSyncer(void* arg);
+static bool cacheCiphertext(struct store* store, const char* user, const char* ciphertext, size_t ciphertextSize,
+                            char* location, size_t locationSize);
+static bool makeCacheRoom(struct store* store, size_t size);
+static bool writeCachedMessage(struct store* store, struct storedMessage* message);
+static void linkCached(struct store* store, struct storedMessage* message);
+static void unlinkCached(struct store* store, struct storedMessage* message);
+static void* runWriter(void* arg);
+
+static const char* infix = "@cipher";   // inserted into the middle of a filename in the old flat layout
+static const char* cipherPrefix = "cipher"; // starts the name of every ciphertext file
+static const char* userFileName = ".user"; // holds the username in a directory named with its hash
+static unsigned long numStored = 0;     // the number of ciphertexts this process has written
+static const char* spoolPrefix = ".spool-"; // starts the name of a streamed ciphertext's spool file
+static unsigned long numSpooled = 0;    // the number of spool files this process has created
+static bool syncDirectories = false;    // true if new directories are synced into their parent
+
+/*******************************************************************************
+ *                                  openStore                                  *
+ * This function gets a store ready to use. With an index, the index is built *
+ * from what is already on disk, after which every post and get keeps it up to *
+ * date. The segment backend needs the index, since a segment can't be         *
+ * searched for a user's oldest ciphertext the way the directory can. Group    *
+ * commit needs one process to hold every post, so without an index (each     *
+ * forked child storing on its own) it falls back to syncing each post.       *
+ ******************************************************************************/
+bool openStore(struct store* store, enum storeBackend backend, bool indexed, enum durability durability,
+               long groupWindow){
+    pthread_condattr_t attributes;      // makes the compactor's timed waits use CLOCK_MONOTONIC
+
+    memset(store, 0, sizeof(struct store));
+    store->backend = backend;
+    store->indexed = indexed;
+    store->durability = durability == DURABILITY_GROUP && !indexed ? DURABILITY_FSYNC : durability;
+    store->groupWindow = groupWindow;
+    store->dataFD = -1;
+    store->syncFD = -1;
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&store->compactorWake, &attributes);
+    pthread_condattr_destroy(&attributes);
+    pthread_cond_init(&store->syncerWake, NULL);
+    pthread_cond_init(&store->syncDone, NULL);
+    syncDirectories = store->durability == DURABILITY_FSYNC;
+
+    if(store->durability == DURABILITY_GROUP){
+        store->dataFD = open(".", O_RDONLY | O_DIRECTORY);
+        store->syncFD = eventfd(0, EFD_NONBLOCK);
+        if(store->dataFD < 0 || store->syncFD < 0) return false;
+        if(pthread_create(&store->syncer, NULL, runSyncer, store) != 0) return false;
+    }
+
+    if(backend == STORE_FILES) migrateFlatFiles();
+    if(!indexed){
+        return backend == STORE_FILES;
+    }
+
+    // a spool file left behind is a streamed ciphertext that never finished arriving
+    removeSpoolFiles();
+
+    if(backend == STORE_SEGMENTS){
+        if(!growIndex(&store->index)) return false;
+        return openSegments(store);
+    }
+    return rebuildFileIndex(&store->index);
+}
+
+/*******************************************************************************
+ *                                  closeStore                                 *
+ * This function stops the syncer and the compactor if there are any, and    *
+ * frees the index and the segments. The syncer syncs whatever is still       *
+ * waiting before it stops. Everything stored stays on disk for the next time. *
+ ******************************************************************************/
+void closeStore(struct store* store){
+    if(store->cacheBudget > 0){
+        pthread_mutex_lock(&store->lock);
+        store->stopping = true;
+        pthread_cond_signal(&store->writerWake);
+        pthread_mutex_unlock(&store->lock);
+        pthread_join(store->writer, NULL);
+        pthread_cond_destroy(&store->writerWake);
+        pthread_cond_destroy(&store->writtenWake);
+    }
+    if(store->durability == DURABILITY_GROUP){
+        pthread_mutex_lock(&store->lock);
+        store->stopping = true;
+        pthread_cond_signal(&store->syncerWake);
+        pthread_mutex_unlock(&store->lock);
+        pthread_join(store->syncer, NULL);
+        close(store->dataFD);
+        close(store->syncFD);
+    }
+    if(store->backend == STORE_SEGMENTS && store->indexed){
+        closeSegments(store);
+    }
+    freeIndex(&store->index);
+    pthread_cond_destroy(&store->compactorWake);
+    pthread_cond_destroy(&store->syncerWake);
+    pthread_cond_destroy(&store->syncDone);
+    pthread_mutex_destroy(&store->lock);
+}
+
+/*******************************************************************************
+ *                                  openCache                                  *
+ * This function starts caching posts in memory, up to budget bytes of         *
+ * ciphertext, each written to disk writeBehind milliseconds after it was      *
+ * posted unless a get takes it first. Only an indexed store with              *
+ * DURABILITY_NONE can cache, anything else fails with errno set to EINVAL.    *
+ * False is also returned if the writer thread couldn't be started.            *
+ ******************************************************************************/
+bool openCache(struct store* store, size_t budget, long writeBehind){
+    pthread_condattr_t attributes;      // makes the writer's timed waits use CLOCK_MONOTONIC
+
+    if(!store->indexed || store->durability != DURABILITY_NONE || budget == 0 || writeBehind < 0){
+        errno = EINVAL;
+        return false;
+    }
+
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&store->writerWake, &attributes);
+    pthread_condattr_destroy(&attributes);
+    pthread_cond_init(&store->writtenWake, NULL);
+    store->writeBehind = writeBehind;
+    if(pthread_create(&store->writer, NULL, runWriter, store) != 0){
+        pthread_cond_destroy(&store->writerWake);
+        pthread_cond_destroy(&store->writtenWake);
+        return false;
+    }
+    store->cacheBudget = budget;
+    return true;
+}
+
+/*******************************************************************************
+ *                              readCacheCounters                              *
+ * This function copies what the cache holds and has done so far.              *
+ ******************************************************************************/
+void readCacheCounters(struct store* store, struct cacheCounters* counters){
+    pthread_mutex_lock(&store->lock);
+    *counters = store->cache;
+    pthread_mutex_unlock(&store->lock);
+}
+
+/*******************************************************************************
+ *                                  measureStore                               *
+ * This function counts the ciphertexts waiting in the store and adds up their *
+ * sizes, which otp_d starts its counters from (see otp_stats.c). Segments are *
+ * measured from the index, and files from the user directories whether or   *
+ * not there is an index. It returns false if there's no memory.              *
+ ******************************************************************************/
+bool measureStore(struct store* store, uint64_t* messages, uint64_t* bytes){
+    struct storeSize size = {0, 0};     // what the ciphertext files add up to
+    struct storedMessage* message;
+
+    *messages = 0;
+    *bytes = 0;
+    if(store->indexed && store->backend == STORE_SEGMENTS){
+        pthread_mutex_lock(&store->lock);
+        for(struct segment* segment = store->segments; segment != NULL; segment = segment->next){
+            for(message = segment->live; message != NULL; message = message->segNext){
+                (*messages)++;
+                *bytes += message->size;
+            }
+        }
+        pthread_mutex_unlock(&store->lock);
+        return true;
+    }
+
+    if(!scanCiphertextFiles(countStoredFile, &size)) return false;
+    *messages = size.messages;
+    *bytes = size.bytes;
+    return true;
+}
+
+/*******************************************************************************
+ *                                  countStoredFile                            *
+ * This function is used with scanCiphertextFiles() to add a ciphertext file  *
+ * to the storeSize in arg.                                                    *
+ ******************************************************************************/
+static bool countStoredFile(const char* user, const char* path, const struct stat* fileInfo,
+                            unsigned long long number, void* arg){
+    struct storeSize* size = arg;
+
+    if(fileInfo->st_size < 1) return true;
+    size->messages++;
+    size->bytes += fileInfo->st_size - 1;   // the newline at the end isn't part of the ciphertext
+    return true;
+}
+
+/*******************************************************************************
+ *                                rebuildFileIndex                             *
+ * This function builds the index from the ciphertext files already in the     *
+ * user directories. Files are queued oldest first by modification time, using *
+ * the number in the filename to break ties. The next sequence number is set   *
+ * past every number already in use so no new file can overwrite one.          *
+ ******************************************************************************/
+static bool rebuildFileIndex(struct messageIndex* index){
+    struct foundFiles found = {NULL, 0, 0, 0}; // every ciphertext file in the store
+    struct storedMessage* message;      // a message added to a queue
+    bool success;
+
+    memset(index, 0, sizeof(struct messageIndex));
+    if(!growIndex(index)) return false;
+
+    success = scanCiphertextFiles(collectFoundFile, &found);
+
+    // queue the files oldest first
+    qsort(found.files, found.count, sizeof(struct foundFile), compareFoundFiles);
+    index->nextSeq = found.nextSeq > found.count ? found.nextSeq : found.count;
+    for(size_t i = 0; i < found.count; i++){
+        message = success ? pushMessage(index, found.files[i].user, i) : NULL;
+        if(message != NULL){
+            message->filename = found.files[i].filename;  // the message now owns the filename
+        }
+        else{
+            success = false;
+            free(found.files[i].filename);
+        }
+        free(found.files[i].user);
+    }
+    free(found.files);
+
+    return success;
+}
+
+/*******************************************************************************
+ *                                  collectFoundFile                           *
+ * This function is used with scanCiphertextFiles() to add a ciphertext file  *
+ * to the foundFiles in arg. It returns false if there's no memory.           *
+ ******************************************************************************/
+static bool collectFoundFile(const char* user, const char* path, const struct stat* fileInfo,
+                             unsigned long long number, void* arg){
+    struct foundFiles* found = arg;
+    struct foundFile* file;             // where the file goes in found
+    struct foundFile* grown;            // the files after being resized
+
+    if(found->count == found->capacity){
+        found->capacity = found->capacity ? found->capacity * 2 : 64;
+        grown = realloc(found->files, found->capacity * sizeof(struct foundFile));
+        if(grown == NULL) return false;
+        found->files = grown;
+    }
+    file = &found->files[found->count];
+    file->user = strdup(user);
+    file->filename = strdup(path);
+    file->modified = fileInfo->st_mtim;
+    file->number = number;
+    if(file->user == NULL || file->filename == NULL){
+        free(file->user);
+        free(file->filename);
+        return false;
+    }
+    found->count++;
+
+    // make sure a new file can never be given this file's number
+    if(number >= found->nextSeq) found->nextSeq = number + 1;
+    return true;
+}
+
+/*******************************************************************************
+ *                                  freeIndex                                  *
+ * This function frees every queue and message in the index. The ciphertext   *
+ * files themselves are left alone.                                            *
+ ******************************************************************************/
+static void freeIndex(struct messageIndex* index){
+    struct userQueue* queue;
+    struct storedMessage* message;
+
+    for(size_t i = 0; i < index->numBuckets; i++){
+        while((queue = index->buckets[i]) != NULL){
+            index->buckets[i] = queue->next;
+            while((message = queue->head) != NULL){
+                queue->head = message->next;
+                free(message->filename);
+                free(message->cached);
+                free(message->user);
+                free(message);
+            }
+            free(queue->user);
+            free(queue);
+        }
+    }
+    free(index->buckets);
+    memset(index, 0, sizeof(struct messageIndex));
+}
+
+/*******************************************************************************
+ *                                  findQueue                                  *
+ * This function returns the queue for the given user. If the user doesn't    *
+ * have one, a new empty queue is added if create is true, otherwise NULL is   *
+ * returned.                                                                   *
+ ******************************************************************************/
+static struct userQueue* findQueue(struct messageIndex* index, const char* user, bool create){
+    unsigned long bucket = hashUser(user) & (index->numBuckets - 1);
+    struct userQueue* queue;
+
+    for(queue = index->buckets[bucket]; queue != NULL; queue = queue->next){
+        if(strcmp(queue->user, user) == 0) return queue;
+    }
+    if(!create) return NULL;
+
+    // keep the table at most one queue per bucket on average
+    if(index->numUsers >= index->numBuckets){
+        if(!growIndex(index)) return NULL;
+        bucket = hashUser(user) & (index->numBuckets - 1);
+    }
+
+    queue = calloc(1, sizeof(struct userQueue));
+    if(queue == NULL) return NULL;
+    queue->user = strdup(user);
+    if(queue->user == NULL){
+        free(queue);
+        return NULL;
+    }
+    queue->next = index->buckets[bucket];
+    index->buckets[bucket] = queue;
+    index->numUsers++;
+    return queue;
+}
+
+/*******************************************************************************
+ *                                  storeCiphertext                            *
+ * This function stores a ciphertext. With the segment backend it's appended   *
+ * to the active segment. Otherwise it's written followed by a newline to a    *
+ * new file in the user's directory. With an index the file is named with the  *
+ * next sequence number, and is added to the back of the user's queue. Without *
+ * one, the pid and a counter are used so that neither concurrent child        *
+ * processes nor repeated posts in the same process overwrite each other. A    *
+ * description of where the ciphertext went is copied into location for the   *
+ * caller to print. With group commit, ticket is set to what the caller has   *
+ * to wait for with waitForSync() or checkSync() before answering the post,   *
+ * otherwise it's set to 0 and the post is as durable as it will get. The      *
+ * ciphertext is checked the way its encoding says, see validCiphertext().     *
+ ******************************************************************************/
+bool storeCiphertext(struct store* store, const char* user, const char* ciphertext,
+                     size_t ciphertextSize, enum ciphertextEncoding encoding, char* location, size_t locationSize,
+                     unsigned long long* ticket){
+    FILE* file;                         // declare FILE pointer for the ciphertext file
+    char name[64];                      // the name of the file in the user's directory
+    unsigned long long seq = 0;         // the sequence number of the new message
+    bool success;
+
+    *ticket = 0;
+
+    // check ciphertext for bad characters, this is the only time it's checked
+    if(!validCiphertext(ciphertext, ciphertextSize, encoding)){
+        fprintf(stderr, "otp_d ERROR: ciphertext for \"%s\" has bad characters\n", user);
+        errno = EINVAL;
+        return false;
+    }
+
+    if(!store->indexed){
+        // create filename with the prefix, pid & counter
+        snprintf(name, sizeof(name), "%s%d-%lu", cipherPrefix, (int)getpid(), numStored++);
+        file = createCiphertextFile(user, name, location, locationSize);
+        if(!file){
+            return false;
+        }
+        fwrite(ciphertext, sizeof(char), ciphertextSize, file); // write the ciphertext to the file
+        fputc('\n', file);              // followed by a newline
+        if(!closeCiphertextFile(store, file, location)){ // close the file
+            remove(location);
+            return false;
+        }
+        return true;
+    }
+
+    pthread_mutex_lock(&store->lock);
+    if(store->cacheBudget > 0 && ciphertextSize <= store->cacheBudget && makeCacheRoom(store, ciphertextSize)){
+        success = cacheCiphertext(store, user, ciphertext, ciphertextSize, location, locationSize);
+        pthread_mutex_unlock(&store->lock);
+        return success;
+    }
+    if(store->backend == STORE_SEGMENTS){
+        success = appendSegmentMessage(store, user, ciphertext, ciphertextSize, location, locationSize);
+        if(success && store->durability == DURABILITY_FSYNC) success = syncActiveSegment(store);
+        if(success) *ticket = addTicket(store);
+        pthread_mutex_unlock(&store->lock);
+        return success;
+    }
+
+    // take the next sequence number, then let go of the lock while the file is written,
+    // so the other --threads workers' posts and gets don't wait on this one's disk I/O
+    seq = store->index.nextSeq++;
+    pthread_mutex_unlock(&store->lock);
+
+    // create filename with the prefix & the sequence number
+    snprintf(name, sizeof(name), "%s%llu", cipherPrefix, seq);
+    file = createCiphertextFile(user, name, location, locationSize);
+    if(!file){
+        return false;
+    }
+    fwrite(ciphertext, sizeof(char), ciphertextSize, file); // write the ciphertext to the file
+    fputc('\n', file);                  // followed by a newline
+
+    // a get can only take the post once it's written, it goes in its queue by sequence number
+    if(!closeCiphertextFile(store, file, location) || !addCiphertextFile(store, user, seq, location, ticket)){
+        remove(location);
+        return false;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                              reserveCiphertextFile                          *
+ * This function is the first half of storing a ciphertext in its own file for *
+ * a caller that writes the file itself, the way otp_d --io-uring does. The    *
+ * ciphertext is checked the way its encoding says, and is given the next      *
+ * sequence number and the path that goes with it. The caller can't make the   *
+ * user's directory part way through writing, so it's made here unless the     *
+ * user already has files queued. Once the file is written, it's handed to     *
+ * addCiphertextFile(). It only works with an index and the file backend, and  *
+ * returns false with errno set otherwise or if the ciphertext is bad.         *
+ ******************************************************************************/
+bool reserveCiphertextFile(struct store* store, const char* user, const char* ciphertext,
+                           size_t ciphertextSize, enum ciphertextEncoding encoding, unsigned long long* seq,
+                           char* location, size_t locationSize){
+    char name[64];                      // the name of the file in the user's directory
+    bool queued;                        // true if the user has files queued, so their directory exists
+
+    if(!store->indexed || store->backend != STORE_FILES){
+        errno = ENOTSUP;
+        return false;
+    }
+
+    // check ciphertext for bad characters, this is the only time it's checked
+    if(!validCiphertext(ciphertext, ciphertextSize, encoding)){
+        fprintf(stderr, "otp_d ERROR: ciphertext for \"%s\" has bad characters\n", user);
+        errno = EINVAL;
+        return false;
+    }
+
+    // create filename with the prefix & the next sequence number, user directories are
+    // never removed, so one with files queued is sure to still be there
+    pthread_mutex_lock(&store->lock);
+    *seq = store->index.nextSeq++;
+    queued = findQueue(&store->index, user, false) != NULL;
+    pthread_mutex_unlock(&store->lock);
+    snprintf(name, sizeof(name), "%s%llu", cipherPrefix, *seq);
+    return ciphertextLocation(user, !queued, name, location, locationSize);
+}
+
+/*******************************************************************************
+ *                              addCiphertextFile                              *
+ * This function adds a ciphertext file written after reserveCiphertextFile() *
+ * to the user's queue. Files can finish being written in a different order   *
+ * than they were reserved in, so it goes wherever its sequence number puts   *
+ * it. False is returned if there's no memory, and the file is left to the    *
+ * caller. The ticket works the same as for storeCiphertext(), and the caller *
+ * must have synced the file itself unless the store uses group commit.       *
+ ******************************************************************************/
+bool addCiphertextFile(struct store* store, const char* user, unsigned long long seq, const char* location,
+                       unsigned long long* ticket){
+    struct storedMessage* message;      // the message added to the user's queue
+    char* filename;                     // the message's copy of the file's path
+
+    // the path is copied first, so a message is never queued without one
+    *ticket = 0;
+    filename = strdup(location);
+    if(filename == NULL) return false;
+
+    pthread_mutex_lock(&store->lock);
+    message = pushMessage(&store->index, user, seq);
+    if(message != NULL){
+        message->filename = filename;
+        *ticket = addTicket(store);
+    }
+    pthread_mutex_unlock(&store->lock);
+    if(message == NULL) free(filename);
+    return message != NULL;
+}
+
+/*******************************************************************************
+ *                              takeOldestCiphertextFile                       *
+ * This function takes the oldest ciphertext file for the user off the front  *
+ * of their queue and copies its path into location, for a caller that opens *
+ * and removes the file itself. The ciphertext is out of the store as soon as *
+ * this returns. It only works with an index, the file backend and no cache,  *
+ * and returns false if the user has nothing queued.                          *
+ ******************************************************************************/
+bool takeOldestCiphertextFile(struct store* store, const char* user, char* location, size_t locationSize){
+    struct storedMessage* message;      // the message at the front of the user's queue
+
+    if(!store->indexed || store->backend != STORE_FILES || store->cacheBudget > 0) return false;
+
+    pthread_mutex_lock(&store->lock);
+    message = popMessage(&store->index, user);
+    pthread_mutex_unlock(&store->lock);
+    if(message == NULL) return false;
+
+    snprintf(location, locationSize, "%s", message->filename);
+    free(message->filename);
+    free(message);
+    return true;
+}
+
+/*******************************************************************************
+ *                                  beginCiphertext                            *
+ * This function starts streaming a ciphertext into the store. The chunks are *
+ * written to a new spool file as they arrive, so no more than one chunk is    *
+ * ever held in memory, and the ciphertext only becomes visible to a 'get'     *
+ * once commitCiphertext() is called. The chunks of a binary ciphertext       *
+ * aren't checked for bad characters, and a packed one, whose groups can be    *
+ * cut anywhere by the chunks, is checked as a whole when it's committed.      *
+ ******************************************************************************/
+bool beginCiphertext(struct store* store, struct ciphertextWriter* writer, enum ciphertextEncoding encoding){
+    pthread_mutex_lock(&store->lock);
+    snprintf(writer->spoolName, sizeof(writer->spoolName), "%s%d-%lu", spoolPrefix, (int)getpid(), numSpooled++);
+    pthread_mutex_unlock(&store->lock);
+
+    writer->size = 0;
+    writer->encoding = encoding;
+    writer->fd = open(writer->spoolName, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    return writer->fd >= 0;
+}
+
+/*******************************************************************************
+ *                                  writeCiphertext                            *
+ * This function appends a chunk of a ciphertext to its spool file.            *
+ ******************************************************************************/
+bool writeCiphertext(struct ciphertextWriter* writer, const char* chunk, size_t chunkSize){
+    ssize_t i;
+
+    // check the chunk for bad characters, this is the only time it's checked
+    if(writer->encoding == ENCODING_TEXT && !validCiphertext(chunk, chunkSize, ENCODING_TEXT)){
+        fprintf(stderr, "otp_d ERROR: streamed ciphertext has bad characters\n");
+        errno = EINVAL;
+        return false;
+    }
+
+    while(chunkSize > 0){
+        i = write(writer->fd, chunk, chunkSize);
+        if(i < 0 && errno == EINTR) continue;
+        if(i < 1) return false;
+        chunk += i;
+        chunkSize -= i;
+        writer->size += i;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                                  commitCiphertext                           *
+ * This function finishes a streamed ciphertext and stores it for the user.    *
+ * With the file backend the spool file gets its newline and is renamed into   *
+ * the user's directory. With the segment backend it's copied into the active  *
+ * segment a chunk at a time with the lock let go, and synced there if posts   *
+ * are synced, so the ticket is always 0. Otherwise the ticket works the same  *
+ * as for storeCiphertext(). The spool file is gone either way. A packed       *
+ * ciphertext is checked first, and thrown away if it's bad.                   *
+ ******************************************************************************/
+bool commitCiphertext(struct store* store, struct ciphertextWriter* writer, const char* user,
+                      char* location, size_t locationSize, unsigned long long* ticket){
+    char name[64];                      // the name of the file in the user's directory
+    unsigned long long seq;             // the sequence number of the new message
+    bool success;
+
+    *ticket = 0;
+    if(writer->encoding == ENCODING_PACKED && !validSpooled(writer)){
+        fprintf(stderr, "otp_d ERROR: streamed ciphertext has bad characters\n");
+        abortCiphertext(writer);
+        errno = EINVAL;
+        return false;
+    }
+    if(store->indexed && store->backend == STORE_SEGMENTS){
+        // copied in with the lock let go, and already synced if posts are, so there's no ticket
+        success = appendSegmentFile(store, user, writer->fd, writer->size, location, locationSize);
+        abortCiphertext(writer);
+        return success;
+    }
+
+    // the file backend stores the ciphertext followed by a newline
+    if(write(writer->fd, "\n", sizeof(char)) != sizeof(char) ||
+       (store->durability == DURABILITY_FSYNC && fsync(writer->fd) != 0) || close(writer->fd) != 0){
+        writer->fd = -1;
+        abortCiphertext(writer);
+        return false;
+    }
+    writer->fd = -1;
+
+    if(!store->indexed){
+        // create filename with the prefix, pid & counter
+        snprintf(name, sizeof(name), "%s%d-%lu", cipherPrefix, (int)getpid(), numStored++);
+        if(!moveCiphertextFile(writer->spoolName, user, name, location, locationSize)){
+            abortCiphertext(writer);
+            return false;
+        }
+        if(store->durability == DURABILITY_FSYNC && !syncParent(location)){
+            remove(location);
+            return false;
+        }
+        return true;
+    }
+
+    // create filename with the prefix & the next sequence number, the file is moved
+    // into place with the lock let go and only queued once it's there
+    pthread_mutex_lock(&store->lock);
+    seq = store->index.nextSeq++;
+    pthread_mutex_unlock(&store->lock);
+    snprintf(name, sizeof(name), "%s%llu", cipherPrefix, seq);
+    if(!moveCiphertextFile(writer->spoolName, user, name, location, locationSize)){
+        abortCiphertext(writer);
+        return false;
+    }
+    if((store->durability == DURABILITY_FSYNC && !syncParent(location)) ||
+       !addCiphertextFile(store, user, seq, location, ticket)){
+        remove(location);
+        return false;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                                  abortCiphertext                            *
+ * This function throws away a streamed ciphertext that wasn't finished.      *
+ ******************************************************************************/
+void abortCiphertext(struct ciphertextWriter* writer){
+    if(writer->fd >= 0) close(writer->fd);
+    writer->fd = -1;
+    remove(writer->spoolName);
+}
+
+/*******************************************************************************
+ *                              openOldestCiphertext                           *
+ * This function takes the oldest ciphertext for the given user out of the     *
+ * store so it can be sent back a chunk at a time with sendCiphertext().      *
+ * The ciphertext is removed from the store straight away (it's only for       *
+ * one-time use), and is read through a descriptor that stays valid even after *
+ * its file is gone. False is returned if the user has no ciphertext.          *
+ ******************************************************************************/
+bool openOldestCiphertext(struct store* store, const char* user, struct ciphertextReader* reader){
+    char oldestFile[FILENAME_SIZE];     // the path of the oldest ciphertext file for a user
+    struct storedMessage* message;      // the message at the front of the user's queue
+    bool success = false;
+
+    if(!store->indexed){
+        return findOldestFile(user, oldestFile, sizeof(oldestFile)) && openCiphertextFile(oldestFile, reader);
+    }
+
+    pthread_mutex_lock(&store->lock);
+    while(!success && (message = popMessage(&store->index, user)) != NULL){
+        // a cached post being written is still in use, it's either on disk or cached again after
+        while(message->writing) pthread_cond_wait(&store->writtenWake, &store->lock);
+        if(message->cached != NULL){
+            // taken before it was written, so it never touches the disk
+            unlinkCached(store, message);
+            store->cache.hits++;
+            reader->fd = -1;
+            reader->buffer = message->cached;
+            reader->offset = 0;
+            reader->remaining = message->size;
+            free(message->user);
+            success = true;
+        }
+        else if(store->backend == STORE_SEGMENTS){
+            reader->fd = dup(message->segment->fd);
+            reader->buffer = NULL;
+            reader->offset = message->offset;
+            reader->remaining = message->size;
+            success = reader->fd >= 0;
+            dropSegmentMessage(store, message);
+        }
+        else{
+            // the message is already off the queue, so no one else can take the file
+            // while it's opened and removed with the lock let go
+            pthread_mutex_unlock(&store->lock);
+            success = openCiphertextFile(message->filename, reader);
+            free(message->filename);
+            pthread_mutex_lock(&store->lock);
+        }
+        if(success && message->cached == NULL && store->cacheBudget > 0) store->cache.misses++;
+        free(message);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return success;
+}
+
+/*******************************************************************************
+ *                                  sendCiphertext                             *
+ * This function sends up to size more characters of a ciphertext being       *
+ * streamed out of the store straight from its file to a socket with          *
+ * sendfile(), so the ciphertext is never copied into otp_d, or from memory    *
+ * if it was taken from the cache. It returns how much was sent, 0 once the    *
+ * whole ciphertext has been sent, or -1 with errno set on an error (EAGAIN if *
+ * a non-blocking socket is full).                                             *
+ ******************************************************************************/
+ssize_t sendCiphertext(struct ciphertextReader* reader, int socket, size_t size){
+    ssize_t i;
+
+    if(size > reader->remaining) size = reader->remaining;
+    if(size == 0) return 0;
+
+    // a cached ciphertext is already in memory, so it's sent from there
+    if(reader->buffer != NULL){
+        i = send(socket, reader->buffer + reader->offset, size, 0);
+        if(i > 0) reader->offset += i;
+    }
+    else{
+        i = sendfile(socket, reader->fd, &reader->offset, size);
+    }
+    if(i > 0) reader->remaining -= i;
+    return i;
+}
+
+/*******************************************************************************
+ *                                  closeCiphertext                            *
+ * This function closes a ciphertext that was being streamed out of the store.*
+ ******************************************************************************/
+void closeCiphertext(struct ciphertextReader* reader){
+    if(reader->fd >= 0) close(reader->fd);
+    reader->fd = -1;
+    free(reader->buffer);
+    reader->buffer = NULL;
+}
+
+/*******************************************************************************
+ *                                  beginDrain                                 *
+ * This function starts taking a user's ciphertexts oldest first, at most      *
+ * maxCount of them and stopping once maxBytes or more have been taken, where  *
+ * a limit of 0 means there isn't one. With an index each one is popped off    *
+ * the user's queue as it's taken. Without one the user's directory is scanned *
+ * once, here, instead of once for each ciphertext, so anything posted after   *
+ * this is left for the next drain. False is returned if there's no memory.    *
+ ******************************************************************************/
+bool beginDrain(struct store* store, const char* user, uint64_t maxCount, uint64_t maxBytes,
+                struct ciphertextDrain* drain){
+    struct foundFiles found = {NULL, 0, 0, 0}; // the user's ciphertext files
+    char directory[FILENAME_SIZE];      // the user's directory
+    bool success = true;
+
+    drain->user = user;
+    drain->filenames = NULL;
+    drain->numFiles = 0;
+    drain->nextFile = 0;
+    drain->countLeft = maxCount != 0 ? maxCount : UINT64_MAX;
+    drain->bytesLeft = maxBytes != 0 ? maxBytes : UINT64_MAX;
+    if(store->indexed || !userDirectory(user, false, directory, sizeof(directory))) return true;
+
+    // queue the files oldest first, the same order findOldestFile() takes them in
+    success = scanUserDirectory(directory, user, collectFoundFile, &found);
+    qsort(found.files, found.count, sizeof(struct foundFile), compareFoundFiles);
+    drain->filenames = success && found.count > 0 ? malloc(found.count * sizeof(char*)) : NULL;
+    if(drain->filenames == NULL && found.count > 0) success = false;
+    for(size_t i = 0; i < found.count; i++){
+        if(success){
+            drain->filenames[drain->numFiles++] = found.files[i].filename; // the drain now owns the filename
+        }
+        else{
+            free(found.files[i].filename);
+        }
+        free(found.files[i].user);
+    }
+    free(found.files);
+    if(!success) endDrain(drain);
+    return success;
+}
+
+/*******************************************************************************
+ *                                  openNextDrained                            *
+ * This function takes the next ciphertext of a drain out of the store and     *
+ * opens it the same way openOldestCiphertext() does. False is returned once   *
+ * the user has no more, or the drain's limits have been reached.              *
+ ******************************************************************************/
+bool openNextDrained(struct store* store, struct ciphertextDrain* drain, struct ciphertextReader* reader){
+    bool success = false;
+
+    if(drain->countLeft == 0 || drain->bytesLeft == 0) return false;
+
+    if(store->indexed){
+        success = openOldestCiphertext(store, drain->user, reader);
+    }
+    // a file another process took since the scan can't be opened, so it's skipped
+    while(!store->indexed && !success && drain->nextFile < drain->numFiles){
+        success = openCiphertextFile(drain->filenames[drain->nextFile++], reader);
+    }
+    if(!success) return false;
+
+    drain->countLeft--;
+    drain->bytesLeft -= reader->remaining < drain->bytesLeft ? reader->remaining : drain->bytesLeft;
+    return true;
+}
+
+/*******************************************************************************
+ *                                  endDrain                                   *
+ * This function frees what a drain holds. It can be called more than once.    *
+ ******************************************************************************/
+void endDrain(struct ciphertextDrain* drain){
+    for(size_t i = 0; i < drain->numFiles; i++) free(drain->filenames[i]);
+    free(drain->filenames);
+    drain->filenames = NULL;
+    drain->numFiles = 0;
+    drain->nextFile = 0;
+}
+
+/*******************************************************************************
+ *                                  waitForSync                                *
+ * This function blocks until the post with the given ticket has been synced   *
+ * by the syncer thread, for a caller that can afford to wait. A ticket of 0   *
+ * needs no waiting. It returns false if a sync failed before the post was on  *
+ * disk.                                                                       *
+ ******************************************************************************/
+bool waitForSync(struct store* store, unsigned long long ticket){
+    bool synced;
+
+    if(ticket == 0) return true;
+    pthread_mutex_lock(&store->lock);
+    while(store->synced < ticket && store->syncError == 0){
+        pthread_cond_wait(&store->syncDone, &store->lock);
+    }
+    synced = store->synced >= ticket;
+    pthread_mutex_unlock(&store->lock);
+    return synced;
+}
+
+/*******************************************************************************
+ *                                  checkSync                                  *
+ * This function is waitForSync() for an event loop, which can't block. It     *
+ * says whether the post with the given ticket is on disk yet, and is worth    *
+ * asking again each time the store's syncFD becomes readable.                 *
+ ******************************************************************************/
+enum syncState checkSync(struct store* store, unsigned long long ticket){
+    enum syncState state;
+
+    if(ticket == 0) return SYNC_DONE;
+    pthread_mutex_lock(&store->lock);
+    if(store->synced >= ticket) state = SYNC_DONE;
+    else state = store->syncError == 0 ? SYNC_WAITING : SYNC_FAILED;
+    pthread_mutex_unlock(&store->lock);
+    return state;
+}
+
+/*******************************************************************************
+ *                                  popMessage                                 *
+ * This function takes the message at the front of the user's queue off the   *
+ * queue and returns it, freeing the queue if it's now empty. NULL is returned *
+ * if the user has nothing queued.                                             *
+ ******************************************************************************/
+static struct storedMessage* popMessage(struct messageIndex* index, const char* user){
+    struct userQueue* queue = findQueue(index, user, false);
+    struct storedMessage* message;
+
+    if(queue == NULL) return NULL;
+
+    message = queue->head;
+    queue->head = message->next;
+    if(queue->head == NULL) queue->tail = NULL;
+    queue->count--;
+    if(queue->count == 0) removeQueue(index, queue);
+    return message;
+}
+
+/*******************************************************************************
+ *                                  findOldestFile                             *
+ * This function searches the user's directory for their ciphertext file that *
+ * was modified longest ago, copying its path into oldestFile. It returns      *
+ * false if the user has no ciphertext file.                                   *
+ ******************************************************************************/
+static bool findOldestFile(const char* user, char* oldestFile, size_t oldestFileSize){
+    DIR* dir;                           // declare DIR pointer
+    struct dirent* dirEnt;              // pointer for directory entry
+    struct stat dirInfo;                // contains info about a directory
+    char directory[FILENAME_SIZE];      // the user's directory
+    char path[FILENAME_SIZE];           // the path of a file in the user's directory
+    unsigned long long number;          // the number parsed from a filename
+    bool foundUserFile = false;         // true if we've found a ciphertext file for the given user
+    double timeDiff;                    // difference between the time a file was modified and the current runtime
+    double oldestTime = -1;             // the oldest time will be the greatest time difference
+    time_t time1970;                    // seconds elapsed since 1970
+
+    // a user who has never posted has no directory
+    if(!userDirectory(user, false, directory, sizeof(directory))) return false;
+
+    // open the user's directory and get pointer of type DIR
+    dir = opendir(directory);
+    if(dir == NULL){        // opendir returns NULL if we can't open directory
+        if(errno != ENOENT) perror("otp_d ERROR opening user directory");
+        return false;
+    }
+
+    // find the oldest ciphertext file for the user
+    time1970 = time(NULL);  // get seconds elapsed since 1970
+    while((dirEnt = readdir(dir)) != NULL){
+        // examine files that are named like a ciphertext
+        if(parseCiphertextName(dirEnt->d_name, &number)){
+            if(snprintf(path, sizeof(path), "%s/%s", directory, dirEnt->d_name) >= (int)sizeof(path) ||
+               stat(path, &dirInfo) != 0){ // put info on a file into dirInfo
+                continue;   // the file may have just been taken by another process
+            }
+
+            // find the greatest time difference between the current time (immediately
+            // before looping through the user's files) and time of the most recent
+            // modification to the file, this will give us the oldest file
+            timeDiff = difftime(time1970, dirInfo.st_mtime);
+            if(timeDiff > oldestTime){
+                oldestTime = timeDiff;
+                snprintf(oldestFile, oldestFileSize, "%s", path);
+            }
+
+            // we've found a ciphertext file for the given user
+            foundUserFile = true;
+        }
+    }
+    closedir(dir);
+
+    return foundUserFile;
+}
+
+/*******************************************************************************
+ *                              openCiphertextFile                             *
+ * This function opens a ciphertext file for streaming and removes it, the    *
+ * open descriptor can still be read after that. The newline at the end of    *
+ * the file isn't part of the ciphertext.                                      *
+ ******************************************************************************/
+static bool openCiphertextFile(const char* filename, struct ciphertextReader* reader){
+    struct stat fileInfo;
+
+    reader->buffer = NULL;
+    reader->fd = open(filename, O_RDONLY);
+    if(reader->fd < 0) return false;
+    if(fstat(reader->fd, &fileInfo) != 0 || fileInfo.st_size < 1){
+        closeCiphertext(reader);
+        return false;
+    }
+    reader->offset = 0;
+    reader->remaining = fileInfo.st_size - 1;
+
+    // remove the ciphertext file now that we have it open, it's only for one-time use
+    remove(filename);
+    return true;
+}
+
+/*******************************************************************************
+ *                                  removeSpoolFiles                           *
+ * This function removes every spool file in the data directory.              *
+ ******************************************************************************/
+static void removeSpoolFiles(void){
+    DIR* dir;                           // declare DIR pointer
+    struct dirent* dirEnt;              // pointer for directory entry
+
+    dir = opendir(".");
+    if(dir == NULL) return;
+    while((dirEnt = readdir(dir)) != NULL){
+        if(strncmp(dirEnt->d_name, spoolPrefix, strlen(spoolPrefix)) == 0){
+            remove(dirEnt->d_name);
+        }
+    }
+    closedir(dir);
+}
+
+/*******************************************************************************
+ *                                  hashUser                                   *
+ * This function returns the FNV-1a hash of a username.                        *
+ ******************************************************************************/
+static unsigned long hashUser(const char* user){
+    unsigned long hash = 2166136261UL;
+
+    while(*user != '\0'){
+        hash ^= (unsigned char)*user++;
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+/*******************************************************************************
+ *                                  growIndex                                  *
+ * This function doubles the number of buckets in the index (or creates the    *
+ * first 64) and moves every queue into its new bucket.                        *
+ ******************************************************************************/
+static bool growIndex(struct messageIndex* index){
+    size_t numBuckets = index->numBuckets ? index->numBuckets * 2 : 64;
+    struct userQueue** buckets = calloc(numBuckets, sizeof(struct userQueue*));
+    struct userQueue* queue;
+    unsigned long bucket;
+
+    if(buckets == NULL) return false;
+
+    for(size_t i = 0; i < index->numBuckets; i++){
+        while((queue = index->buckets[i]) != NULL){
+            index->buckets[i] = queue->next;
+            bucket = hashUser(queue->user) & (numBuckets - 1);
+            queue->next = buckets[bucket];
+            buckets[bucket] = queue;
+        }
+    }
+    free(index->buckets);
+    index->buckets = buckets;
+    index->numBuckets = numBuckets;
+    return true;
+}
+
+/*******************************************************************************
+ *                                  removeQueue                                *
+ * This function unlinks an empty queue from the index and frees it, so users  *
+ * that have nothing waiting don't take up memory.                             *
+ ******************************************************************************/
+static void removeQueue(struct messageIndex* index, struct userQueue* queue){
+    unsigned long bucket = hashUser(queue->user) & (index->numBuckets - 1);
+    struct userQueue** link = &index->buckets[bucket];
+
+    while(*link != NULL && *link != queue){
+        link = &(*link)->next;
+    }
+    if(*link == NULL) return;
+
+    *link = queue->next;
+    index->numUsers--;
+    free(queue->user);
+    free(queue);
+}
+
+/*******************************************************************************
+ *                                  pushMessage                                *
+ * This function adds a new message to the user's queue and returns it so the *
+ * caller can fill in where the ciphertext is stored. A message almost always  *
+ * has the highest sequence number yet and goes on the back, but one that was *
+ * written out of order is put in its place so gets stay first in, first out.  *
+ ******************************************************************************/
+struct storedMessage* pushMessage(struct messageIndex* index, const char* user, unsigned long long seq){
+    struct userQueue* queue = findQueue(index, user, true);
+    struct storedMessage* message;
+    struct storedMessage** link;        // the pointer the message is linked in at
+
+    if(queue == NULL) return NULL;
+
+    message = calloc(1, sizeof(struct storedMessage));
+    if(message == NULL) return NULL;
+    message->seq = seq;
+
+    if(queue->tail != NULL && queue->tail->seq > seq){
+        for(link = &queue->head; (*link)->seq < seq; link = &(*link)->next);
+        message->next = *link;
+        *link = message;
+        queue->count++;
+        return message;
+    }
+
+    if(queue->tail != NULL){
+        queue->tail->next = message;
+    }
+    else{
+        queue->head = message;
+    }
+    queue->tail = message;
+    queue->count++;
+    return message;
+}
+
+/*******************************************************************************
+ *                                  syncDirectory                              *
+ * This function syncs a directory, so the names of the files that were just  *
+ * made or renamed in it survive a crash along with what's in them.           *
+ ******************************************************************************/
+bool syncDirectory(const char* directory){
+    int fd = open(directory, O_RDONLY | O_DIRECTORY);
+    bool synced;
+
+    if(fd < 0) return false;
+    synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
+}
+
+/*******************************************************************************
+ *                              compareFoundFiles                              *
+ * This function is used with qsort() to order files found while rebuilding    *
+ * the index from the oldest modification time to the newest.                 *
+ ******************************************************************************/
+static int compareFoundFiles(const void* a, const void* b){
+    const struct foundFile* fileA = a;
+    const struct foundFile* fileB = b;
+
+    if(fileA->modified.tv_sec != fileB->modified.tv_sec){
+        return fileA->modified.tv_sec < fileB->modified.tv_sec ? -1 : 1;
+    }
+    if(fileA->modified.tv_nsec != fileB->modified.tv_nsec){
+        return fileA->modified.tv_nsec < fileB->modified.tv_nsec ? -1 : 1;
+    }
+    if(fileA->number != fileB->number){
+        return fileA->number < fileB->number ? -1 : 1;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ *                                parseFlatFilename                            *
+ * This function checks that a filename looks like user@cipher<number>, with   *
+ * an optional -<counter> after the number, the way ciphertext files were      *
+ * named before each user had a directory. If it does, the user is copied      *
+ * into a new heap string and the number is returned through number.           *
+ ******************************************************************************/
+static bool parseFlatFilename(const char* filename, char** user, unsigned long long* number){
+    const char* at = NULL;              // the last occurrence of the infix
+    const char* next = filename;
+    char* endPtr;
+
+    while((next = strstr(next, infix)) != NULL){
+        at = next;
+        next++;
+    }
+    if(at == NULL || at == filename) return false;
+
+    next = at + strlen(infix);
+    if(*next < '0' || *next > '9') return false;
+    errno = 0;
+    *number = strtoull(next, &endPtr, 10);
+    if(errno != 0) return false;
+    if(*endPtr == '-'){
+        next = endPtr + 1;
+        if(*next < '0' || *next > '9') return false;
+        strtoull(next, &endPtr, 10);
+    }
+    if(*endPtr != '\0') return false;
+
+    *user = strndup(filename, at - filename);
+    return *user != NULL;
+}
+
+/*******************************************************************************
+ *                              parseCiphertextName                            *
+ * This function checks that a name in a user's directory looks like           *
+ * cipher<number>, with an optional -<counter> after the number. If it does,   *
+ * the number is returned through number.                                      *
+ ******************************************************************************/
+static bool parseCiphertextName(const char* name, unsigned long long* number){
+    const char* next;
+    char* endPtr;
+
+    if(strncmp(name, cipherPrefix, strlen(cipherPrefix)) != 0) return false;
+    next = name + strlen(cipherPrefix);
+    if(*next < '0' || *next > '9') return false;
+    errno = 0;
+    *number = strtoull(next, &endPtr, 10);
+    if(errno != 0) return false;
+    if(*endPtr == '-'){
+        next = endPtr + 1;
+        if(*next < '0' || *next > '9') return false;
+        strtoull(next, &endPtr, 10);
+    }
+    return *endPtr == '\0';
+}
+
+/*******************************************************************************
+ *                              scanCiphertextFiles                            *
+ * This function calls visit with every ciphertext file in every user's        *
+ * directory, along with the user it belongs to. A directory whose user can't  *
+ * be worked out is skipped. It returns false as soon as visit does.           *
+ ******************************************************************************/
+static bool scanCiphertextFiles(fileVisitor visit, void* arg){
+    DIR* dir;                           // declare DIR pointer
+    struct dirent* dirEnt;              // pointer for directory entry
+    char shard[3];                      // the name of a shard directory
+    char directory[FILENAME_SIZE];      // the path of a user's directory
+    char* user;                         // the user a directory belongs to
+    bool success = true;
+
+    for(unsigned int i = 0; success && i < NUM_SHARDS; i++){
+        snprintf(shard, sizeof(shard), "%02x", i);
+        dir = opendir(shard);
+        if(dir == NULL) continue;       // no user has been hashed to this shard yet
+        while(success && (dirEnt = readdir(dir)) != NULL){
+            if(dirEnt->d_name[0] == '.') continue;
+            if(snprintf(directory, sizeof(directory), "%s/%s", shard, dirEnt->d_name) >= (int)sizeof(directory)){
+                continue;
+            }
+            user = dirEnt->d_name[0] == '#' ? readUserFile(directory) : unescapeUser(dirEnt->d_name);
+            if(user == NULL) continue;
+            success = scanUserDirectory(directory, user, visit, arg);
+            free(user);
+        }
+        closedir(dir);
+    }
+    return success;
+}
+
+/*******************************************************************************
+ *                              scanUserDirectory                              *
+ * This function calls visit with every ciphertext file in one user's          *
+ * directory. It returns false as soon as visit does.                          *
+ ******************************************************************************/
+static bool scanUserDirectory(const char* directory, const char* user, fileVisitor visit, void* arg){
+    DIR* dir;                           // declare DIR pointer
+    struct dirent* dirEnt;              // pointer for directory entry
+    struct stat fileInfo;               // contains info about a file
+    char path[FILENAME_SIZE];           // the path of a file in the directory
+    unsigned long long number;          // the number parsed from a filename
+    bool success = true;
+
+    dir = opendir(directory);
+    if(dir == NULL) return true;
+    while(success && (dirEnt = readdir(dir)) != NULL){
+        if(!parseCiphertextName(dirEnt->d_name, &number)) continue;
+        if(snprintf(path, sizeof(path), "%s/%s", directory, dirEnt->d_name) >= (int)sizeof(path)) continue;
+        if(stat(path, &fileInfo) != 0 || !S_ISREG(fileInfo.st_mode)) continue;
+        success = visit(user, path, &fileInfo, number, arg);
+    }
+    closedir(dir);
+    return success;
+}
+
+/*******************************************************************************
+ *                              createCiphertextFile                           *
+ * This function creates the named file in the user's directory and opens it  *
+ * for writing, copying its path into location. The directory is only made    *
+ * once creating the file has failed without it, so most posts don't pay for  *
+ * a mkdir(). NULL is returned with errno set if the file can't be created.   *
+ ******************************************************************************/
+static FILE* createCiphertextFile(const char* user, const char* name, char* location, size_t locationSize){
+    FILE* file;
+
+    if(ciphertextLocation(user, false, name, location, locationSize)){
+        file = fopen(location, "w");
+        if(file != NULL || errno != ENOENT) return file;
+    }
+    if(!ciphertextLocation(user, true, name, location, locationSize)) return NULL;
+    return fopen(location, "w");
+}
+
+/*******************************************************************************
+ *                              moveCiphertextFile                             *
+ * This function renames a finished spool file to the named file in the user's *
+ * directory, copying its path into location. Like createCiphertextFile(), the *
+ * directory is only made if the rename fails without it.                      *
+ ******************************************************************************/
+static bool moveCiphertextFile(const char* from, const char* user, const char* name,
+                               char* location, size_t locationSize){
+    if(ciphertextLocation(user, false, name, location, locationSize)){
+        if(rename(from, location) == 0) return true;
+        if(errno != ENOENT) return false;
+    }
+    return ciphertextLocation(user, true, name, location, locationSize) && rename(from, location) == 0;
+}
+
+/*******************************************************************************
+ *                              ciphertextLocation                             *
+ * This function copies the path of the named file in the user's directory    *
+ * into location, making the directory first if create is true. It returns     *
+ * false with errno set if the path doesn't fit, or if create is false and     *
+ * the user's directory can't be found without making it.                      *
+ ******************************************************************************/
+static bool ciphertextLocation(const char* user, bool create, const char* name, char* location, size_t locationSize){
+    char directory[FILENAME_SIZE];      // the user's directory
+
+    if(!userDirectory(user, create, directory, sizeof(directory))) return false;
+    if(snprintf(location, locationSize, "%s/%s", directory, name) >= (int)locationSize){
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                                  userDirectory                              *
+ * This function copies the path of the user's directory into directory,      *
+ * making it first if create is true. The shard is the low byte of the         *
+ * username's hash. A short username is escaped to make the directory's name.  *
+ * A long one is named with the whole hash and a number, counting up from 0    *
+ * past any directory whose .user file holds another username. Without create, *
+ * false is returned with errno set to ENOENT if a long username's directory   *
+ * doesn't exist yet.                                                          *
+ ******************************************************************************/
+static bool userDirectory(const char* user, bool create, char* directory, size_t directorySize){
+    unsigned long hash = hashUser(user);
+    char name[USER_NAME_MAX + 1];       // the escaped username
+    char* owner;                        // the username in a .user file
+
+    if(escapeUser(user, name, sizeof(name))){
+        if(snprintf(directory, directorySize, "%02lx/%s", hash % NUM_SHARDS, name) >= (int)directorySize){
+            errno = ENAMETOOLONG;
+            return false;
+        }
+        return !create || makeUserDirectory(directory);
+    }
+
+    for(unsigned int i = 0; ; i++){
+        if(snprintf(directory, directorySize, "%02lx/#%016lx-%u", hash % NUM_SHARDS, hash, i) >= (int)directorySize){
+            errno = ENAMETOOLONG;
+            return false;
+        }
+        if(create){
+            if(!makeUserDirectory(directory)) return false;
+            if(claimUserDirectory(directory, user)) return true;
+            if(errno != EEXIST) return false;
+            continue;
+        }
+        owner = readUserFile(directory);
+        if(owner == NULL) return false;
+        if(strcmp(owner, user) == 0){
+            free(owner);
+            return true;
+        }
+        free(owner);
+    }
+}
+
+/*******************************************************************************
+ *                                  escapeUser                                 *
+ * This function copies the username into name with every byte that isn't a   *
+ * letter, digit, '_', '-' or a '.' after the first character written as %XX,  *
+ * so that any username makes a safe directory name and no two make the same   *
+ * one. An empty username is written as %00. It returns false if the escaped   *
+ * username doesn't fit in name.                                               *
+ ******************************************************************************/
+static bool escapeUser(const char* user, char* name, size_t nameSize){
+    size_t length = 0;                  // how much of name has been used
+    unsigned char c;
+
+    if(*user == '\0'){
+        snprintf(name, nameSize, "%%00");
+        return nameSize > 3;
+    }
+    for(size_t i = 0; user[i] != '\0'; i++){
+        c = user[i];
+        if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '_' || c == '-' || (c == '.' && i > 0)){
+            if(length + 1 >= nameSize) return false;
+            name[length++] = c;
+        }
+        else{
+            if(length + 3 >= nameSize) return false;
+            snprintf(name + length, 4, "%%%02X", c);
+            length += 3;
+        }
+    }
+    name[length] = '\0';
+    return true;
+}
+
+/*******************************************************************************
+ *                                  unescapeUser                               *
+ * This function turns a directory name made by escapeUser() back into the     *
+ * username, in a new heap string. NULL is returned if the name couldn't have  *
+ * been made by escapeUser().                                                  *
+ ******************************************************************************/
+static char* unescapeUser(const char* name){
+    char* user = malloc(strlen(name) + 1);
+    size_t length = 0;                  // how much of user has been used
+    char hex[3] = {0};                  // the two digits of an escaped byte
+    char* endPtr;
+
+    if(user == NULL) return NULL;
+    while(*name != '\0'){
+        if(*name != '%'){
+            user[length++] = *name++;
+            continue;
+        }
+        hex[0] = name[1];
+        hex[1] = hex[0] != '\0' ? name[2] : '\0';
+        user[length++] = strtoul(hex, &endPtr, 16);
+        if(hex[0] == '\0' || hex[0] == '+' || hex[0] == '-' || endPtr != hex + 2){
+            free(user);
+            return NULL;
+        }
+        name += 3;
+    }
+    user[length] = '\0';
+    return user;
+}
+
+/*******************************************************************************
+ *                              makeUserDirectory                              *
+ * This function makes a user's directory and the shard directory it's in,   *
+ * if they don't exist yet. Directories are never removed, so once made they   *
+ * stay for the next post. With --durability=fsync a directory that's made is *
+ * synced into its parent, which only happens once for each.                  *
+ ******************************************************************************/
+static bool makeUserDirectory(const char* directory){
+    char shard[3];                      // the shard the directory is in
+
+    snprintf(shard, sizeof(shard), "%s", directory);
+    if(mkdir(shard, 0700) == 0){
+        if(syncDirectories && !syncDirectory(".")) return false;
+    }
+    else if(errno != EEXIST){
+        return false;
+    }
+    if(mkdir(directory, 0700) == 0){
+        return !syncDirectories || syncDirectory(shard);
+    }
+    return errno == EEXIST;
+}
+
+/*******************************************************************************
+ *                                  readUserFile                               *
+ * This function reads the username from the .user file in a directory named   *
+ * with a hash into a new heap string. NULL is returned with errno set if the  *
+ * file isn't there (ENOENT) or can't be read.                                 *
+ ******************************************************************************/
+static char* readUserFile(const char* directory){
+    char path[FILENAME_SIZE];           // the path of the .user file
+    struct stat fileInfo;               // contains info about the file
+    char* user;
+    ssize_t i;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", directory, userFileName);
+    fd = open(path, O_RDONLY);
+    if(fd < 0) return NULL;
+    user = fstat(fd, &fileInfo) == 0 ? malloc(fileInfo.st_size + 1) : NULL;
+    if(user == NULL){
+        close(fd);
+        return NULL;
+    }
+    do{
+        i = pread(fd, user, fileInfo.st_size, 0);
+    }while(i < 0 && errno == EINTR);
+    close(fd);
+    if(i != fileInfo.st_size){
+        free(user);
+        errno = EIO;
+        return NULL;
+    }
+    user[fileInfo.st_size] = '\0';
+    return user;
+}
+
+/*******************************************************************************
+ *                              claimUserDirectory                             *
+ * This function makes the directory named with a hash belong to the user, by *
+ * writing the username to a temporary file and linking it in as .user, which  *
+ * only one process can do. It returns true if the directory is the user's,   *
+ * either now or from before, and false with errno set to EEXIST if it belongs *
+ * to someone else.                                                            *
+ ******************************************************************************/
+static bool claimUserDirectory(const char* directory, const char* user){
+    char path[FILENAME_SIZE];           // the path of the .user file
+    char temp[FILENAME_SIZE];           // the path of the temporary file
+    size_t userSize = strlen(user);
+    char* owner;                        // the username already in the .user file
+    bool written;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", directory, userFileName);
+    snprintf(temp, sizeof(temp), "%s/%s-XXXXXX", directory, userFileName);
+    fd = mkstemp(temp);
+    if(fd < 0) return false;
+    written = write(fd, user, userSize) == (ssize_t)userSize;
+    if(syncDirectories && written) written = fsync(fd) == 0;
+    if(close(fd) != 0) written = false;
+    if(written && link(temp, path) == 0){
+        unlink(temp);
+        return !syncDirectories || syncDirectory(directory);
+    }
+    unlink(temp);
+    if(!written || errno != EEXIST) return false;
+
+    owner = readUserFile(directory);
+    if(owner == NULL) return false;
+    written = strcmp(owner, user) == 0;
+    free(owner);
+    errno = EEXIST;
+    return written;
+}
+
+/*******************************************************************************
+ *                                  migrateFlatFiles                           *
+ * This function moves ciphertext files left in the data directory by an older *
+ * otp_d, named user@cipher<number>, into the user's directory with the same   *
+ * number. A file whose new name is already taken is left where it is.         *
+ ******************************************************************************/
+static void migrateFlatFiles(void){
+    DIR* dir;                           // declare DIR pointer
+    struct dirent* dirEnt;              // pointer for directory entry
+    struct stat fileInfo;               // contains info about a file
+    char name[FILENAME_SIZE];           // the file's new name in the user's directory
+    char location[FILENAME_SIZE];       // the file's new path
+    char* user;                         // the user parsed from a filename
+    unsigned long long number;          // the number parsed from a filename
+
+    dir = opendir(".");
+    if(dir == NULL) return;
+    while((dirEnt = readdir(dir)) != NULL){
+        if(!parseFlatFilename(dirEnt->d_name, &user, &number)) continue;
+        if(stat(dirEnt->d_name, &fileInfo) == 0 && S_ISREG(fileInfo.st_mode)){
+            snprintf(name, sizeof(name), "%s%s", cipherPrefix, dirEnt->d_name + strlen(user) + strlen(infix));
+            if(ciphertextLocation(user, true, name, location, sizeof(location)) &&
+               link(dirEnt->d_name, location) == 0){
+                unlink(dirEnt->d_name);
+            }
+        }
+        free(user);
+    }
+    closedir(dir);
+}
+
+/*******************************************************************************
+ *                                  validCiphertext                            *
+ * This function returns true if a ciphertext only has the characters A-Z and  *
+ * space in it, or only their values if it's packed. Any binary ciphertext is  *
+ * good.                                                                       *
+ ******************************************************************************/
+static bool validCiphertext(const char* ciphertext, size_t ciphertextSize, enum ciphertextEncoding encoding){
+    if(encoding == ENCODING_BINARY) return true;
+    if(encoding == ENCODING_PACKED) return validPackedText(ciphertext, ciphertextSize);
+    for(size_t i = 0; i < ciphertextSize; i++){
+        if((ciphertext[i] < 65 || ciphertext[i] > 90) && ciphertext[i] != 32){
+            return false;
+        }
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                                  validSpooled                               *
+ * This function checks a packed ciphertext once it has all been spooled,      *
+ * mapping the spool file rather than reading it back.                         *
+ ******************************************************************************/
+static bool validSpooled(struct ciphertextWriter* writer){
+    void* spooled;                      // the spool file mapped into memory
+    bool valid;
+
+    if(writer->size == 0) return false;
+    spooled = mmap(NULL, writer->size, PROT_READ, MAP_SHARED, writer->fd, 0);
+    if(spooled == MAP_FAILED) return false;
+    valid = validPackedText(spooled, writer->size);
+    munmap(spooled, writer->size);
+    return valid;
+}
+
+/*******************************************************************************
+ *                              closeCiphertextFile                            *
+ * This function closes a newly written ciphertext file. With                  *
+ * --durability=fsync the file and then its directory are synced first, so    *
+ * the post can be answered as soon as this returns true. Posts call it with  *
+ * the store's lock let go, so one post's sync doesn't hold up every other     *
+ * request.                                                                    *
+ ******************************************************************************/
+static bool closeCiphertextFile(struct store* store, FILE* file, const char* location){
+    bool success = true;
+
+    if(store->durability == DURABILITY_FSYNC){
+        success = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    }
+    if(fclose(file) != 0) success = false;
+    if(success && store->durability == DURABILITY_FSYNC) success = syncParent(location);
+    return success;
+}
+
+/*******************************************************************************
+ *                                  syncParent                                 *
+ * This function syncs the directory a file's path is in.                      *
+ ******************************************************************************/
+static bool syncParent(const char* path){
+    char directory[FILENAME_SIZE];      // the path up to the last '/'
+    const char* slash = strrchr(path, '/');
+
+    if(slash == NULL) return syncDirectory(".");
+    snprintf(directory, sizeof(directory), "%.*s", (int)(slash - path), path);
+    return syncDirectory(directory);
+}
+
+/*******************************************************************************
+ *                              syncActiveSegment                              *
+ * This function syncs the active segment after a post was appended to it     *
+ * with --durability=fsync. The store's lock must be held. It's let go during  *
+ * the sync, the same way the syncer does it, so other posts and gets carry on *
+ * meanwhile, and taken back before returning. The segment is synced through   *
+ * its own descriptor, so it doesn't matter if the compactor or a full segment *
+ * swaps it out in the meantime.                                               *
+ ******************************************************************************/
+static bool syncActiveSegment(struct store* store){
+    int fd = dup(store->active->fd);
+    bool success;
+
+    if(fd < 0) return false;
+    pthread_mutex_unlock(&store->lock);
+    success = fdatasync(fd) == 0;
+    close(fd);
+    pthread_mutex_lock(&store->lock);
+    return success;
+}
+
+/*******************************************************************************
+ *                                  addTicket                                  *
+ * This function hands out the ticket for a post that has just been stored and *
+ * wakes the syncer to sync it. Without group commit the ticket is 0. The      *
+ * store's lock must be held.                                                  *
+ ******************************************************************************/
+static unsigned long long addTicket(struct store* store){
+    if(store->durability != DURABILITY_GROUP) return 0;
+    pthread_cond_signal(&store->syncerWake);
+    return ++store->stored;
+}
+
+/*******************************************************************************
+ *                                  runSyncer                                  *
+ * This function is run by the syncer thread with --durability=group. It waits *
+ * for a post to be stored, optionally lingers for the group window so more    *
+ * posts can join in, then syncs every post stored so far at once. The lock    *
+ * is let go during the sync itself, so posts stored meanwhile make up the     *
+ * next batch. Waiters are woken through syncDone and the store's eventfd. A   *
+ * failed sync is sticky: what was written may have been dropped from the page *
+ * cache, so no later post can be promised to be on disk until a restart.     *
+ ******************************************************************************/
+static void* runSyncer(void* arg){
+    struct store* store = arg;
+    unsigned long long batch;           // the newest ticket in this sync
+    int error;                          // the errno of a failed sync
+    int fd;
+
+    pthread_mutex_lock(&store->lock);
+    while(true){
+        while(store->synced == store->stored || store->syncError != 0){
+            if(store->stopping) break;
+            pthread_cond_wait(&store->syncerWake, &store->lock);
+        }
+        if(store->synced == store->stored || store->syncError != 0) break;
+
+        if(store->groupWindow > 0 && !store->stopping){
+            pthread_mutex_unlock(&store->lock);
+            usleep(store->groupWindow);
+            pthread_mutex_lock(&store->lock);
+        }
+        batch = store->stored;
+        error = 0;
+
+        // a full segment is synced before the next one takes over, so only the active one needs it
+        if(store->backend == STORE_SEGMENTS){
+            fd = dup(store->active->fd);
+            pthread_mutex_unlock(&store->lock);
+            if(fd < 0 || fdatasync(fd) != 0) error = errno;
+            if(fd >= 0) close(fd);
+        }
+        else{
+            pthread_mutex_unlock(&store->lock);
+            if(syncfs(store->dataFD) != 0) error = errno;
+        }
+
+        pthread_mutex_lock(&store->lock);
+        if(error == 0){
+            store->synced = batch;
+        }
+        else{
+            store->syncError = error;
+            errno = error;
+            perror("otp_d ERROR syncing the store");
+        }
+        pthread_cond_broadcast(&store->syncDone);
+        eventfd_write(store->syncFD, 1);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return NULL;
+}
+
+/*******************************************************************************
+ *                                  cacheCiphertext                            *
+ * This function queues a post for the user in memory only, with the next      *
+ * sequence number, and wakes the writer to write it once its delay is up.     *
+ * The caller has already made room for it. The store's lock must be held.     *
+ ******************************************************************************/
+static bool cacheCiphertext(struct store* store, const char* user, const char* ciphertext, size_t ciphertextSize,
+                            char* location, size_t locationSize){
+    struct storedMessage* message;      // the message added to the user's queue
+    char* copy;                         // the ciphertext with a null terminator, kept until it's taken or written
+    char* userCopy;                     // the username, which the writer needs to write it
+
+    copy = malloc((ciphertextSize + 1) * sizeof(char));
+    userCopy = strdup(user);
+    message = copy != NULL && userCopy != NULL ? pushMessage(&store->index, user, store->index.nextSeq) : NULL;
+    if(message == NULL){
+        free(copy);
+        free(userCopy);
+        return false;
+    }
+    store->index.nextSeq++;
+    memcpy(copy, ciphertext, ciphertextSize);
+    copy[ciphertextSize] = '\0';
+
+    message->cached = copy;
+    message->user = userCopy;
+    message->size = ciphertextSize;
+    clock_gettime(CLOCK_REALTIME, &message->posted);
+    message->writeBy = storeClock() + (uint64_t)store->writeBehind * 1000;
+    linkCached(store, message);
+    pthread_cond_signal(&store->writerWake);
+
+    snprintf(location, locationSize, "cache:%s%llu", cipherPrefix, message->seq);
+    return true;
+}
+
+/*******************************************************************************
+ *                                  makeCacheRoom                              *
+ * This function writes the oldest cached posts to disk early until size more  *
+ * bytes fit in the cache's budget. It returns false if one of them couldn't   *
+ * be written, in which case the new post isn't cached. The store's lock must  *
+ * be held, and is let go while each post is written.                          *
+ ******************************************************************************/
+static bool makeCacheRoom(struct store* store, size_t size){
+    while(store->cache.bytes + size > store->cacheBudget){
+        if(!writeCachedMessage(store, store->cacheOldest)) return false;
+        store->cache.evicted++;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *                              writeCachedMessage                             *
+ * This function writes a cached post to disk the way it would have been       *
+ * stored without the cache, then frees its copy in memory. A file is dated    *
+ * when the post arrived rather than when it was written, since that's the     *
+ * order the index is rebuilt in. The post is taken off the cache's list and   *
+ * written with the lock let go, staying in its user's queue. A get that takes *
+ * it meanwhile waits for the write to finish. It returns false if the post    *
+ * couldn't be written, and it's cached again at the back of the list to be    *
+ * tried again after WRITE_RETRY_DELAY. The store's lock must be held, and is  *
+ * held again on return.                                                       *
+ ******************************************************************************/
+static bool writeCachedMessage(struct store* store, struct storedMessage* message){
+    FILE* file;                         // the new ciphertext file
+    char name[64];                      // the name of the file in the user's directory
+    char location[FILENAME_SIZE];       // the path of the file
+    char* filename = NULL;              // a copy of the path for the message
+    struct timespec times[2];           // the access and modification times the file is given
+    bool success = false;
+
+    unlinkCached(store, message);
+    message->writing = true;
+
+    if(store->backend == STORE_SEGMENTS){
+        success = appendCachedMessage(store, message);
+    }
+    else{
+        pthread_mutex_unlock(&store->lock);
+        snprintf(name, sizeof(name), "%s%llu", cipherPrefix, message->seq);
+        file = createCiphertextFile(message->user, name, location, sizeof(location));
+        if(file){
+            fwrite(message->cached, sizeof(char), message->size, file); // write the ciphertext to the file
+            fputc('\n', file);          // followed by a newline
+            times[0] = times[1] = message->posted;
+            success = fflush(file) == 0 && futimens(fileno(file), times) == 0;
+            if(!closeCiphertextFile(store, file, location)) success = false;
+            if(success) success = (filename = strdup(location)) != NULL;
+            if(!success) remove(location);
+        }
+        pthread_mutex_lock(&store->lock);
+        message->filename = filename;
+    }
+
+    message->writing = false;
+    pthread_cond_broadcast(&store->writtenWake);
+    if(!success){
+        perror("otp_d ERROR writing a cached ciphertext");
+        message->writeBy = storeClock() + WRITE_RETRY_DELAY;
+        linkCached(store, message);
+        return false;
+    }
+
+    free(message->cached);
+    free(message->user);
+    message->cached = NULL;
+    message->user = NULL;
+    return true;
+}
+
+/*******************************************************************************
+ *                                  linkCached                                 *
+ * This function adds a message to the newest end of the cache's list and      *
+ * counts it. The store's lock must be held.                                   *
+ ******************************************************************************/
+static void linkCached(struct store* store, struct storedMessage* message){
+    message->cacheOlder = store->cacheNewest;
+    message->cacheNewer = NULL;
+    if(store->cacheNewest != NULL){
+        store->cacheNewest->cacheNewer = message;
+    }
+    else{
+        store->cacheOldest = message;
+    }
+    store->cacheNewest = message;
+    store->cache.messages++;
+    store->cache.bytes += message->size;
+}
+
+/*******************************************************************************
+ *                                  unlinkCached                               *
+ * This function takes a message off the cache's list, whether it's being     *
+ * taken by a get or has just been written, and stops counting it. The store's *
+ * lock must be held.                                                          *
+ ******************************************************************************/
+static void unlinkCached(struct store* store, struct storedMessage* message){
+    if(message->cacheOlder != NULL){
+        message->cacheOlder->cacheNewer = message->cacheNewer;
+    }
+    else{
+        store->cacheOldest = message->cacheNewer;
+    }
+    if(message->cacheNewer != NULL){
+        message->cacheNewer->cacheOlder = message->cacheOlder;
+    }
+    else{
+        store->cacheNewest = message->cacheOlder;
+    }
+    message->cacheOlder = NULL;
+    message->cacheNewer = NULL;
+    store->cache.messages--;
+    store->cache.bytes -= message->size;
+}
+
+/*******************************************************************************
+ *                                  runWriter                                  *
+ * This function is run by the writer thread while the store has a cache. It   *
+ * sleeps until the oldest cached post's delay is up, writes it to disk and    *
+ * moves on to the next. Posts are cached in the order they arrive with the    *
+ * same delay, so the oldest is always due first. A post that can't be written *
+ * goes to the back to be tried again later. Each post is written with the     *
+ * lock let go. When the store closes, every cached post is written straight   *
+ * away before the thread exits.                                               *
+ ******************************************************************************/
+static void* runWriter(void* arg){
+    struct store* store = arg;
+    struct storedMessage* message;      // the next cached post due to be written
+    struct timespec until;              // when it's due, on CLOCK_MONOTONIC
+    uint64_t now;
+
+    pthread_mutex_lock(&store->lock);
+    while((message = store->cacheOldest) != NULL || !store->stopping){
+        if(message == NULL){
+            pthread_cond_wait(&store->writerWake, &store->lock);
+            continue;
+        }
+        now = storeClock();
+        if(message->writeBy > now && !store->stopping){
+            until.tv_sec = message->writeBy / 1000000;
+            until.tv_nsec = (message->writeBy % 1000000) * 1000;
+            pthread_cond_timedwait(&store->writerWake, &store->lock, &until);
+            continue;
+        }
+
+        if(writeCachedMessage(store, message)){
+            store->cache.writtenBehind++;
+        }
+        else if(store->stopping){
+            break;                      // what's left is lost, there's nothing more to try
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+    return NULL;
+}
+
+/*******************************************************************************
+ *                                  storeClock                                 *
+ * This function returns the time in microseconds on a clock that never goes   *
+ * backwards, the same clock the writer's and the compactor's timed waits use. *
+ ******************************************************************************/
+uint64_t storeClock(void){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
@@ -0,0 +1,250 @@
+/*******************************************************************************
+** Program name: otp_store.h
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  Declarations for the ciphertext storage used by otp_d. By
+**               default every ciphertext is kept in its own file in a directory
+**               for each user, under otp_d's data directory. A single process
+**               server (otp_d --epoll, --io-uring or --threads) also keeps an
+**               index in memory which maps each user to a first in, first out
+**               queue of their stored ciphertexts, so that a 'get' never has to
+**               list the user's directory. The index is guarded by a lock, so
+**               the worker threads of --threads can share it. The forked
+**               children of the default mode can't share that index, so they
+**               search the user's directory instead.
+**               With an index, ciphertexts can instead be appended to a few
+**               large segment files (see otp_segment.c). Ciphertexts that are
+**               too big for memory can be streamed in and out a chunk at a
+**               time, and a drain takes all of a user's ciphertexts one after
+**               another for the price of a single lookup.
+**               Ciphertexts are checked for bad characters once, when they're
+**               stored, unless they were posted as binary, which can hold any
+**               byte. A packed ciphertext (see packText() in otp_cipher.h) is
+**               checked as packed and stored that way, taking about 5/8 of
+**               the space, and a 'get' sends it back packed. Ciphertexts are
+**               sent back out with sendfile() without being read into otp_d.
+**
+**               How sure a post is to survive a crash once it has been stored
+**               depends on the store's durability. By default it's left to the
+**               kernel to write back. With DURABILITY_FSYNC each post is synced
+**               on its own before the store returns. With DURABILITY_GROUP a
+**               syncer thread syncs the posts stored while the last sync was
+**               running all at once, and each post gets a ticket which the
+**               caller waits on, or checks when the store's eventfd says a sync
+**               has finished, before answering it.
+**
+**               An indexed store can also keep a cache of recent posts in
+**               memory (openCache()). A post that fits in the cache's budget is
+**               only queued in memory, and a writer thread writes it to disk
+**               once it has waited there for the write-behind delay. A get that
+**               takes a cached post is answered from memory, so a post taken
+**               before its deadline never touches the disk. When a new post
+**               would go over the budget, the oldest cached posts are written
+**               out early until it fits, and a post bigger than the whole
+**               budget is stored the usual way. A cached post only exists in
+**               otp_d's memory, so the cache can't be used with a durability
+**               that promises posts are on disk.
+*******************************************************************************/
+#ifndef OTP_STORE_H
+#define OTP_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define FILENAME_SIZE 256               // the size of a ciphertext path buffer
+
+// how sure a stored post is to be on disk before it's answered
+enum durability {
+    DURABILITY_NONE,                    // the kernel writes posts back whenever it likes
+    DURABILITY_FSYNC,                   // every post is synced on its own
+    DURABILITY_GROUP                    // posts are synced in batches by the syncer thread
+};
+
+// where a post's sync has got to, see checkSync()
+enum syncState {
+    SYNC_WAITING,                       // the post hasn't been synced yet
+    SYNC_DONE,                          // the post is on disk
+    SYNC_FAILED                         // a sync failed, so the post may not be on disk
+};
+
+// the ways a store can keep ciphertexts on disk
+enum storeBackend {
+    STORE_FILES,                        // one <shard>/<user>/cipher<number> file per ciphertext
+    STORE_SEGMENTS                      // records appended to segment-<number>.log files
+};
+
+struct segment;
+
+// a stored ciphertext waiting in a user's queue
+struct storedMessage {
+    unsigned long long seq;             // sequence number, a lower number was posted earlier
+    char* filename;                     // the path of the file that holds the ciphertext (STORE_FILES)
+    struct segment* segment;            // the segment that holds the ciphertext (STORE_SEGMENTS)
+    off_t offset;                       // where the ciphertext starts in the segment
+    size_t size;                        // the size of the ciphertext in the segment or the cache
+    size_t recordSize;                  // the size of the whole record in the segment
+    struct storedMessage* segPrev;      // the previous live message in the same segment
+    struct storedMessage* segNext;      // the next live message in the same segment
+    struct storedMessage* next;         // the next newer message for the same user
+    char* cached;                       // the ciphertext while it's only held in memory, or NULL
+    char* user;                         // the username while the message is cached
+    struct timespec posted;             // when a cached message was posted, its file is dated then
+    uint64_t writeBy;                   // when a cached message is written to disk, in microseconds
+    struct storedMessage* cacheOlder;   // the cached message posted before this one
+    struct storedMessage* cacheNewer;   // the cached message posted after this one
+    bool writing;                       // the cached message is being written with the lock let go
+};
+
+// the queue of stored ciphertexts for one user, oldest at the head
+struct userQueue {
+    char* user;                         // the username
+    struct storedMessage* head;         // the oldest message, the next one a 'get' returns
+    struct storedMessage* tail;         // the newest message, where a 'post' is added
+    size_t count;                       // the number of messages in the queue
+    struct userQueue* next;             // the next queue in the same hash bucket
+};
+
+// a hash table of user queues
+struct messageIndex {
+    struct userQueue** buckets;         // each bucket is a linked list of queues
+    size_t numBuckets;                  // the number of buckets, always a power of 2
+    size_t numUsers;                    // the number of queues in the table
+    unsigned long long nextSeq;         // the sequence number given to the next post
+};
+
+// an append-only file of ciphertext and tombstone records
+struct segment {
+    unsigned int id;                    // the number in the segment's filename
+    int fd;                             // the open segment file
+    off_t size;                         // the size of the file, where the next record goes
+    off_t deadBytes;                    // bytes taken up by consumed messages and tombstones
+    struct storedMessage* live;         // the messages in this segment not yet consumed
+    struct segment* next;               // the next newer segment
+    uint64_t retryAt;                   // when compacting it failed, the storeClock() time to try again
+    unsigned int copying;               // records being copied in with the lock let go, it isn't deleted till they're done
+};
+
+// what the cache holds and has done, see readCacheCounters()
+struct cacheCounters {
+    uint64_t messages;                  // the posts held in memory now
+    uint64_t bytes;                     // the size of their ciphertexts
+    uint64_t hits;                      // gets answered from memory
+    uint64_t misses;                    // gets answered from disk
+    uint64_t writtenBehind;             // posts written to disk once their delay was up
+    uint64_t evicted;                   // posts written to disk early to make room for newer ones
+};
+
+// where and how otp_d keeps ciphertexts
+struct store {
+    enum storeBackend backend;          // files or segments
+    bool indexed;                       // true if index is used instead of searching the directory
+    struct messageIndex index;          // each user's queue of stored ciphertexts
+    pthread_mutex_t lock;               // held while the index or the segments are used
+    struct segment* segments;           // every segment, oldest first (STORE_SEGMENTS)
+    struct segment* active;             // the newest segment, where new records are appended
+    pthread_t compactor;                // the thread which rewrites mostly dead segments
+    pthread_cond_t compactorWake;       // signaled when a segment may need compacting, waited on with CLOCK_MONOTONIC
+    bool stopping;                      // tells the compactor and the syncer to exit
+    enum durability durability;         // how posts are synced
+    long groupWindow;                   // microseconds the syncer waits for more posts to join a sync
+    int dataFD;                         // the data directory, syncfs() syncs its whole file system
+    unsigned long long stored;          // the ticket of the newest post (DURABILITY_GROUP)
+    unsigned long long synced;          // every post up to this ticket is on disk
+    int syncError;                      // the errno of a failed sync, nothing is synced after one
+    pthread_t syncer;                   // the thread which syncs batches of posts
+    pthread_cond_t syncerWake;          // signaled when a post is waiting to be synced
+    pthread_cond_t syncDone;            // broadcast when a sync has finished
+    int syncFD;                         // an eventfd bumped when a sync has finished, or -1
+    size_t cacheBudget;                 // the most bytes of ciphertext the cache holds, 0 for no cache
+    long writeBehind;                   // milliseconds a cached post waits before it's written to disk
+    struct cacheCounters cache;         // what the cache holds and has done
+    struct storedMessage* cacheOldest;  // the cached message posted first, the next to be written
+    struct storedMessage* cacheNewest;  // the cached message posted last
+    pthread_t writer;                   // the thread which writes cached posts to disk
+    pthread_cond_t writerWake;          // signaled when a post is cached, waited on with CLOCK_MONOTONIC
+    pthread_cond_t writtenWake;         // broadcast when a cached post has finished being written
+};
+
+// how a posted ciphertext is encoded, which decides how it's checked
+enum ciphertextEncoding {
+    ENCODING_TEXT,                      // A-Z and space, a character a byte
+    ENCODING_BINARY,                    // any byte, so it isn't checked
+    ENCODING_PACKED                     // A-Z and space packed 5 bits a character, see packText()
+};
+
+// a ciphertext being streamed into the store
+struct ciphertextWriter {
+    int fd;                             // the spool file the chunks are written to
+    char spoolName[FILENAME_SIZE];      // the name of the spool file
+    size_t size;                        // how much of the ciphertext has been written
+    enum ciphertextEncoding encoding;   // how the ciphertext is checked
+};
+
+// a ciphertext being streamed out of the store
+struct ciphertextReader {
+    int fd;                             // the file or segment the ciphertext is in
+    off_t offset;                       // where the next chunk is read from
+    size_t remaining;                   // how much of the ciphertext is left to read
+    char* buffer;                       // the ciphertext if it came from the cache, instead of fd
+};
+
+// a user's ciphertexts being taken oldest first by a drain
+struct ciphertextDrain {
+    const char* user;                   // the user being drained
+    char** filenames;                   // the user's files oldest first, found by one scan (no index only)
+    size_t numFiles;                    // the number of filenames
+    size_t nextFile;                    // the next of them to take
+    uint64_t countLeft;                 // how many more ciphertexts can be taken
+    uint64_t bytesLeft;                 // how many more bytes can be taken before the drain stops
+};
+
+// function prototypes:
+bool openStore(struct store* store, enum storeBackend backend, bool indexed, enum durability durability,
+               long groupWindow);
+void closeStore(struct store* store);
+bool openCache(struct store* store, size_t budget, long writeBehind);
+void readCacheCounters(struct store* store, struct cacheCounters* counters);
+bool measureStore(struct store* store, uint64_t* messages, uint64_t* bytes);
+bool storeCiphertext(struct store* store, const char* user, const char* ciphertext,
+                     size_t ciphertextSize, enum ciphertextEncoding encoding, char* location, size_t locationSize,
+                     unsigned long long* ticket);
+bool beginCiphertext(struct store* store, struct ciphertextWriter* writer, enum ciphertextEncoding encoding);
+bool writeCiphertext(struct ciphertextWriter* writer, const char* chunk, size_t chunkSize);
+bool commitCiphertext(struct store* store, struct ciphertextWriter* writer, const char* user,
+                      char* location, size_t locationSize, unsigned long long* ticket);
+void abortCiphertext(struct ciphertextWriter* writer);
+bool openOldestCiphertext(struct store* store, const char* user, struct ciphertextReader* reader);
+ssize_t sendCiphertext(struct ciphertextReader* reader, int socket, size_t size);
+void closeCiphertext(struct ciphertextReader* reader);
+bool beginDrain(struct store* store, const char* user, uint64_t maxCount, uint64_t maxBytes,
+                struct ciphertextDrain* drain);
+bool openNextDrained(struct store* store, struct ciphertextDrain* drain, struct ciphertextReader* reader);
+void endDrain(struct ciphertextDrain* drain);
+bool reserveCiphertextFile(struct store* store, const char* user, const char* ciphertext,
+                           size_t ciphertextSize, enum ciphertextEncoding encoding, unsigned long long* seq, char* location,
+                           size_t locationSize);
+bool addCiphertextFile(struct store* store, const char* user, unsigned long long seq, const char* location,
+                       unsigned long long* ticket);
+bool takeOldestCiphertextFile(struct store* store, const char* user, char* location, size_t locationSize);
+bool waitForSync(struct store* store, unsigned long long ticket);
+enum syncState checkSync(struct store* store, unsigned long long ticket);
+
+// used by otp_segment.c:
+struct storedMessage* pushMessage(struct messageIndex* index, const char* user, unsigned long long seq);
+bool syncDirectory(const char* directory);
+bool openSegments(struct store* store);
+void closeSegments(struct store* store);
+bool appendSegmentMessage(struct store* store, const char* user, const char* ciphertext,
+                          size_t ciphertextSize, char* location, size_t locationSize);
+bool appendSegmentFile(struct store* store, const char* user, int fd, size_t size,
+                       char* location, size_t locationSize);
+bool appendCachedMessage(struct store* store, struct storedMessage* message);
+void dropSegmentMessage(struct store* store, struct storedMessage* message);
+uint64_t storeClock(void);
+
+#endif
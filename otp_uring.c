@@ -0,0 +1,189 @@
+/*******************************************************************************
+** Program name: otp_uring.c
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  Functions for the io_uring wrapper used by otp_d --io-uring,
+**               see otp_uring.h. Only one thread ever uses a ring, so the only
+**               ordering that matters is with the kernel: entries are filled in
+**               behind a private tail, which is only stored for the kernel to see
+**               with release semantics when they're submitted, and the kernel's
+**               completion tail is loaded with acquire semantics before the
+**               completions behind it are read.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "otp_uring.h"
+
+/*******************************************************************************
+ *                                  openRing                                   *
+ * This function sets up a ring with room for entries submissions and maps its *
+ * queues. It returns false with errno set if the kernel has no io_uring, has  *
+ * it turned off, or is too old to map both queues at once.                    *
+ ******************************************************************************/
+bool openRing(struct ring* ring, unsigned int entries){
+    struct io_uring_params params;
+    char* rings;
+
+    memset(ring, 0, sizeof(struct ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(ring->fd < 0) return false;
+
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP)){
+        close(ring->fd);
+        errno = ENOSYS;
+        return false;
+    }
+    ring->features = params.features;
+    ring->entries = params.sq_entries;
+
+    // the submission and completion queues share one mapping, the entries have their own
+    ring->ringsSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    if(params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe) > ring->ringsSize){
+        ring->ringsSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    }
+    ring->rings = mmap(NULL, ring->ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQ_RING);
+    if(ring->rings == MAP_FAILED){
+        close(ring->fd);
+        return false;
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED){
+        munmap(ring->rings, ring->ringsSize);
+        close(ring->fd);
+        return false;
+    }
+
+    rings = ring->rings;
+    ring->sqHead = (unsigned int*)(rings + params.sq_off.head);
+    ring->sqTail = (unsigned int*)(rings + params.sq_off.tail);
+    ring->sqMask = (unsigned int*)(rings + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned int*)(rings + params.sq_off.array);
+    ring->cqHead = (unsigned int*)(rings + params.cq_off.head);
+    ring->cqTail = (unsigned int*)(rings + params.cq_off.tail);
+    ring->cqMask = (unsigned int*)(rings + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(rings + params.cq_off.cqes);
+    ring->tail = *ring->sqTail;
+    return true;
+}
+
+/*******************************************************************************
+ *                                  ringSupports                               *
+ * This function asks the kernel whether it knows every one of the given      *
+ * operations, since each kernel version has added some.                      *
+ ******************************************************************************/
+bool ringSupports(struct ring* ring, const unsigned char* ops, size_t numOps){
+    struct io_uring_probe* probe;
+    size_t probeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    bool supported = true;
+
+    probe = calloc(1, probeSize);
+    if(probe == NULL) return false;
+    if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) < 0){
+        free(probe);
+        return false;
+    }
+    for(size_t i = 0; i < numOps; i++){
+        if(ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)){
+            supported = false;
+        }
+    }
+    free(probe);
+    return supported;
+}
+
+/*******************************************************************************
+ *                                  registerRingFiles                          *
+ * This function registers count empty file slots with the ring. An operation  *
+ * can open a file straight into a slot, and later operations linked to it can *
+ * use the slot before the open has even happened.                            *
+ ******************************************************************************/
+bool registerRingFiles(struct ring* ring, unsigned int count){
+    int* fds = malloc(count * sizeof(int));
+    long result;
+
+    if(fds == NULL) return false;
+    for(unsigned int i = 0; i < count; i++) fds[i] = -1;
+    result = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, count);
+    free(fds);
+    return result == 0;
+}
+
+/*******************************************************************************
+ *                                  getRingEntries                             *
+ * This function hands out count cleared submission entries in a row, first   *
+ * submitting what's queued if there isn't room, so operations linked together *
+ * always go to the kernel in the same submit. It returns false if the queue   *
+ * can't be emptied.                                                           *
+ ******************************************************************************/
+bool getRingEntries(struct ring* ring, struct io_uring_sqe** sqes, unsigned int count){
+    unsigned int index;
+
+    if(count > ring->entries) return false;
+    if(ring->tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) + count > ring->entries){
+        if(submitRing(ring, 0) < 0) return false;
+        if(ring->tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) + count > ring->entries) return false;
+    }
+
+    for(unsigned int i = 0; i < count; i++){
+        index = (ring->tail + i) & *ring->sqMask;
+        ring->sqArray[index] = index;
+        sqes[i] = &ring->sqes[index];
+        memset(sqes[i], 0, sizeof(struct io_uring_sqe));
+    }
+    ring->tail += count;
+    return true;
+}
+
+/*******************************************************************************
+ *                                  submitRing                                 *
+ * This function hands every queued operation to the kernel and, if waitFor   *
+ * isn't 0, sleeps until at least that many completions are ready, all in one *
+ * system call. It returns how many operations were submitted, or -1 with     *
+ * errno set.                                                                  *
+ ******************************************************************************/
+int submitRing(struct ring* ring, unsigned int waitFor){
+    unsigned int queued;                // entries the kernel hasn't taken yet
+    long submitted;
+
+    __atomic_store_n(ring->sqTail, ring->tail, __ATOMIC_RELEASE);
+    queued = ring->tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    do{
+        submitted = syscall(__NR_io_uring_enter, ring->fd, queued, waitFor,
+                            waitFor > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    }while(submitted < 0 && errno == EINTR);
+    return submitted < 0 ? -1 : (int)submitted;
+}
+
+/*******************************************************************************
+ *                                  nextCompletion                             *
+ * This function copies the oldest completion into cqe and frees its slot. It  *
+ * returns false if there are none waiting.                                    *
+ ******************************************************************************/
+bool nextCompletion(struct ring* ring, struct io_uring_cqe* cqe){
+    unsigned int head = *ring->cqHead;
+
+    if(head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) return false;
+    *cqe = ring->cqes[head & *ring->cqMask];
+    __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*******************************************************************************
+ *                                  closeRing                                  *
+ * This function unmaps a ring's queues and closes it.                         *
+ ******************************************************************************/
+void closeRing(struct ring* ring){
+    munmap(ring->sqes, ring->sqesSize);
+    munmap(ring->rings, ring->ringsSize);
+    close(ring->fd);
+}
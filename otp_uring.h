@@ -0,0 +1,52 @@
+/*******************************************************************************
+** Program name: otp_uring.h
+** Author:       Louis Adams
+** Email:        adamslou@oregonstate.edu
+** Due date:     2020-06-05
+** Description:  Declarations for the small io_uring wrapper used by
+**               otp_d --io-uring. A ring is a submission queue and a completion
+**               queue shared with the kernel: operations are added to the
+**               submission queue without a system call, a single io_uring_enter()
+**               hands them all to the kernel and waits for some to finish, and
+**               their results are read off the completion queue, again without a
+**               system call. The ring is set up with the raw system calls, so
+**               otp_d doesn't need liburing.
+*******************************************************************************/
+#ifndef OTP_URING_H
+#define OTP_URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+// an io_uring instance and its queues mapped into otp_d
+struct ring {
+    int fd;                             // the ring's descriptor
+    unsigned int features;              // the IORING_FEAT_ flags the kernel reported
+    unsigned int entries;               // the size of the submission queue
+    unsigned int tail;                  // where the next entry goes, the kernel sees it once submitted
+    unsigned int* sqHead;               // the first entry the kernel hasn't taken yet
+    unsigned int* sqTail;               // the tail the kernel has been handed
+    unsigned int* sqMask;               // turns a head or tail into an index
+    unsigned int* sqArray;              // the order the kernel takes the entries in
+    struct io_uring_sqe* sqes;          // the submission queue entries
+    unsigned int* cqHead;               // the first completion not yet read
+    unsigned int* cqTail;               // where the kernel adds the next completion
+    unsigned int* cqMask;               // turns a head or tail into an index
+    struct io_uring_cqe* cqes;          // the completion queue entries
+    void* rings;                        // the mapping holding both queues' heads and tails
+    size_t ringsSize;                   // the size of that mapping
+    size_t sqesSize;                    // the size of the mapping of the entries
+};
+
+// function prototypes:
+bool openRing(struct ring* ring, unsigned int entries);
+bool ringSupports(struct ring* ring, const unsigned char* ops, size_t numOps);
+bool registerRingFiles(struct ring* ring, unsigned int count);
+bool getRingEntries(struct ring* ring, struct io_uring_sqe** sqes, unsigned int count);
+int submitRing(struct ring* ring, unsigned int waitFor);
+bool nextCompletion(struct ring* ring, struct io_uring_cqe* cqe);
+void closeRing(struct ring* ring);
+
+#endif